@@ -0,0 +1,390 @@
+#include "../common/dhparams.h"
+#include "../common/errors.h"
+#include "../common/frame.h"
+#include "../common/seq.h"
+#include "../common/session.h"
+#include "../common/types.h"
+#include "../common/utils.h"
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+/*
+ * Microbenchmarks of the primitives of common/ that every message or login
+ * goes through: the socket helpers, the framing, AES-GCM on a chunk, the key
+ * derivation and generation, and the signatures of the handshake.
+ *
+ * Each benchmark runs its operation for at least the given time, then writes
+ * a line of comma separated values: its name, the operations run, the
+ * nanoseconds per operation and, for those handling data, the MB/s.
+ */
+
+using namespace std;
+using namespace std::chrono;
+
+struct options {
+    // Time each benchmark runs for at least, in seconds
+    double min_time = 0.5;
+    // Only the benchmarks whose name starts with any of these run, all of
+    // them if none
+    vector<string> filters;
+};
+
+static options opts;
+
+/*
+ * Runs [op] as many times as it takes to last opts.min_time, printing the
+ * result as [name]. Each run handles [bytes] bytes, if any.
+ */
+static void run(const string &name, size_t bytes, const function<void()> &op) {
+    bool selected = opts.filters.empty();
+    for (const auto &filter : opts.filters)
+        selected |= name.compare(0, filter.length(), filter) == 0;
+    if (!selected)
+        return;
+
+    // Warm up, then double the batch until it lasts long enough
+    op();
+    unsigned long iterations = 0;
+    double elapsed = 0;
+    for (unsigned long batch = 1; elapsed < opts.min_time; batch *= 2) {
+        auto start = steady_clock::now();
+        for (unsigned long i = 0; i < batch; i++)
+            op();
+        elapsed += duration<double>(steady_clock::now() - start).count();
+        iterations += batch;
+    }
+
+    double ns = elapsed * 1e9 / iterations;
+    cout << name << "," << iterations << "," << ns << ",";
+    if (bytes > 0)
+        cout << bytes * iterations / elapsed / 1e6;
+    cout << endl;
+}
+
+/* Pair of connected sockets, one end for each session of a benchmark */
+static void make_socketpair(int fds[2]) {
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        handle_errors("Could not create the sockets");
+    }
+}
+
+static void bench_socket_helpers() {
+    int fds[2];
+    make_socketpair(fds);
+
+    run("header", 0, [&] {
+        auto send_res = send_header(fds[0], UploadReq);
+        if (send_res.is_error)
+            handle_errors(send_res.error);
+        auto mtype_res = get_mtype(fds[1]);
+        if (mtype_res.is_error)
+            handle_errors(mtype_res.error);
+    });
+
+    for (flen len : {16, 256, 4096, 16384}) {
+        vector<uchar> data(len, 'x');
+        run("field/" + to_string(len), len, [&] {
+            auto send_res = send_field(fds[0], len, data.data());
+            if (send_res.is_error)
+                handle_errors(send_res.error);
+            auto read_res = read_field(fds[1]);
+            if (read_res.is_error)
+                handle_errors(read_res.error);
+            delete[] get<1>(read_res.result);
+        });
+    }
+
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static void bench_framing() {
+    int fds[2];
+    make_socketpair(fds);
+    FrameWriter out;
+    FrameReader in;
+    uchar tag[TAG_LEN] = {0};
+    seqnum seq = 0;
+
+    run("frame_header", 0, [&] {
+        auto flush_res = out.header(ListReq, seq).flush(fds[0]);
+        if (flush_res.is_error)
+            handle_errors(flush_res.error);
+        auto mtype_res = in.get_mtype(fds[1]);
+        auto header_res = in.read_header(fds[1]);
+        if (mtype_res.is_error || header_res.is_error)
+            handle_errors("Could not read the header");
+        inc_seqnum(seq);
+    });
+
+    for (blen len : {16, 256, 4096, 16384}) {
+        vector<uchar> data(len, 'x');
+        vector<uchar> buf(len);
+        run("frame/" + to_string(len), len, [&] {
+            auto flush_res = out.header(UploadChunk, seq)
+                                 .field(len, data.data())
+                                 .tag(tag)
+                                 .flush(fds[0]);
+            if (flush_res.is_error)
+                handle_errors(flush_res.error);
+            if (in.get_mtype(fds[1]).is_error ||
+                in.read_header(fds[1]).is_error ||
+                in.read_field(fds[1], buf.data(), len).is_error ||
+                in.read_tag(fds[1], tag).is_error)
+                handle_errors("Could not read the message");
+            inc_seqnum(seq);
+        });
+    }
+
+    close(fds[0]);
+    close(fds[1]);
+}
+
+/* Copy of [key], for a session to take ownership of */
+static uchar *copy_key(const uchar *key) {
+    int key_len = get_symmetric_key_length();
+    auto *copy = new uchar[key_len];
+    memcpy(copy, key, key_len);
+    return copy;
+}
+
+/*
+ * Seals the [len] bytes of [pt] into [ct] as the message [seq] of [session],
+ * alike send_message. Returns the length of the ciphertext
+ */
+template <class Suite>
+static int seal(Session &session, seqnum seq, const uchar *pt, int len,
+                uchar *ct, uchar *tag) {
+    uchar iv[AEAD_IV_LEN];
+    int ct_len = 0;
+    session.send_nonce(seq, iv);
+    if (!aead_seal<Suite>(session.send_ctx, iv, mtype_to_uc(UploadChunk), seq,
+                          pt, len, ct, ct_len, tag)) {
+        handle_errors("Could not seal the chunk");
+    }
+    return ct_len;
+}
+
+/* Opens what seal sealed, as the receiving side of the session */
+template <class Suite>
+static void open(Session &session, seqnum seq, const uchar *ct, int len,
+                 uchar *pt, const uchar *tag) {
+    uchar iv[AEAD_IV_LEN];
+    int pt_len;
+    session.recv_nonce(seq, iv);
+    if (!aead_open<Suite>(session.recv_ctx, iv, mtype_to_uc(UploadChunk), seq,
+                          ct, len, pt, pt_len, tag)) {
+        handle_errors("Could not open the chunk");
+    }
+}
+
+/* Chunks and messages of every size, sealed and opened with [Suite] */
+template <class Suite> static void bench_suite() {
+    int fds[2];
+    make_socketpair(fds);
+    Session client(fds[0], RoleClient);
+    Session server(fds[1], RoleServer);
+    client.suite = server.suite = Suite::suite;
+    uchar key[AEAD_KEY_LEN];
+    if (RAND_bytes(key, sizeof(key)) != 1) {
+        handle_errors();
+    }
+    client.set_key(copy_key(key));
+    server.set_key(copy_key(key));
+    string name = cipher_suite_name(Suite::suite);
+
+    for (unsigned int len :
+         {MIN_CHUNK_SIZE, 256 * 1024, DEFAULT_CHUNK_SIZE, MAX_CHUNK_SIZE}) {
+        vector<uchar> pt(len, 'x');
+        vector<uchar> ct(len);
+        uchar tag[TAG_LEN];
+        seqnum seq = 0;
+
+        run("seal/" + name + "/" + to_string(len), len, [&] {
+            seal<Suite>(client, seq, pt.data(), len, ct.data(), tag);
+            inc_seqnum(seq);
+        });
+
+        // The same message, opened again and again
+        int ct_len = seal<Suite>(client, seq, pt.data(), len, ct.data(), tag);
+        run("open/" + name + "/" + to_string(len), len, [&] {
+            open<Suite>(server, seq, ct.data(), ct_len, pt.data(), tag);
+        });
+    }
+
+    // Whole messages, sealed, sent, received and opened
+    for (blen len : {16, 256, 4096, 16384}) {
+        vector<uchar> pt(len, 'x');
+        vector<uchar> res;
+        run("message/" + name + "/" + to_string(len), len, [&] {
+            send_message(client, RenameReq, pt.data(), len);
+            if (!receive_message(server, RenameReq, res, len))
+                handle_errors("Could not receive the message");
+        });
+    }
+}
+
+static void bench_cipher() {
+    bench_suite<AesGcm>();
+    bench_suite<ChaCha20Poly1305>();
+}
+
+/* The half key of [keypair] as PEM, as it is sent during the handshake */
+static string half_key_pem(EVP_PKEY *keypair) {
+    BIO *bio = BIO_new(BIO_s_mem());
+    if (bio == nullptr || PEM_write_bio_PUBKEY(bio, keypair) != 1) {
+        handle_errors("Could not write to memory bio");
+    }
+    char *data;
+    long len = BIO_get_mem_data(bio, &data);
+    string pem(data, len);
+    BIO_free(bio);
+    return pem;
+}
+
+/* A key of the kind of the certificates/ ones */
+static EVP_PKEY *gen_rsa_key() {
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, nullptr);
+    EVP_PKEY *key = nullptr;
+    if (ctx == nullptr || EVP_PKEY_keygen_init(ctx) != 1 ||
+        EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, 2048) != 1 ||
+        EVP_PKEY_keygen(ctx, &key) != 1) {
+        handle_errors("Could not generate the signing key");
+    }
+    EVP_PKEY_CTX_free(ctx);
+    return key;
+}
+
+static void bench_handshake() {
+    run("gen_iv", 0, [] {
+        auto iv_res = gen_iv();
+        if (iv_res.is_error)
+            handle_errors(iv_res.error);
+        delete[] iv_res.result;
+    });
+
+    uchar secret[32];
+    if (RAND_bytes(secret, sizeof(secret)) != 1) {
+        handle_errors();
+    }
+    run("kdf", 0, [&] {
+        // The shared secret is wiped and freed by kdf
+        auto *copy = new uchar[sizeof(secret)];
+        memcpy(copy, secret, sizeof(secret));
+        auto key_res = kdf(copy, sizeof(secret), get_symmetric_key_length());
+        if (key_res.is_error)
+            handle_errors(key_res.error);
+        delete[] key_res.result;
+    });
+
+    run("gen_keypair/x25519", 0,
+        [] { EVP_PKEY_free(gen_keypair(KexX25519)); });
+    run("gen_keypair/dh2048", 0,
+        [] { EVP_PKEY_free(gen_keypair(KexDH2048)); });
+
+    for (kex_group group : {KexX25519, KexDH2048}) {
+        EVP_PKEY *mine = gen_keypair(group);
+        EVP_PKEY *peer = gen_keypair(group);
+        run(string("derive/") + (group == KexX25519 ? "x25519" : "dh2048"), 0,
+            [&] {
+                EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new(mine, nullptr);
+                size_t len;
+                if (ctx == nullptr || EVP_PKEY_derive_init(ctx) != 1 ||
+                    EVP_PKEY_derive_set_peer(ctx, peer) != 1 ||
+                    EVP_PKEY_derive(ctx, nullptr, &len) != 1) {
+                    handle_errors("Could not derive the shared secret");
+                }
+                vector<uchar> shared(len);
+                if (EVP_PKEY_derive(ctx, shared.data(), &len) != 1) {
+                    handle_errors("Could not derive the shared secret");
+                }
+                EVP_PKEY_CTX_free(ctx);
+            });
+        EVP_PKEY_free(mine);
+        EVP_PKEY_free(peer);
+    }
+
+    // What each side signs: both half keys, then the name of the other
+    EVP_PKEY *client_half_key = gen_keypair(KexX25519);
+    EVP_PKEY *server_half_key = gen_keypair(KexX25519);
+    string signed_data = half_key_pem(client_half_key) +
+                         half_key_pem(server_half_key) + "alice";
+    EVP_PKEY_free(client_half_key);
+    EVP_PKEY_free(server_half_key);
+
+    EVP_PKEY *private_key = gen_rsa_key();
+    vector<uchar> signature(get_signature_max_length(private_key));
+    unsigned int signature_len;
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    if (ctx == nullptr) {
+        handle_errors("Could not allocate signing context");
+    }
+
+    run("sign", 0, [&] {
+        EVP_SignInit(ctx, get_hash_type());
+        if (EVP_SignUpdate(ctx, signed_data.data(), signed_data.length()) !=
+                1 ||
+            EVP_SignFinal(ctx, signature.data(), &signature_len,
+                          private_key) != 1) {
+            handle_errors("Could not sign correctly");
+        }
+    });
+
+    run("verify", 0, [&] {
+        EVP_VerifyInit(ctx, get_hash_type());
+        if (EVP_VerifyUpdate(ctx, signed_data.data(), signed_data.length()) !=
+                1 ||
+            EVP_VerifyFinal(ctx, signature.data(), signature_len,
+                            private_key) != 1) {
+            handle_errors("Signature verification failed");
+        }
+    });
+
+    EVP_MD_CTX_free(ctx);
+    EVP_PKEY_free(private_key);
+}
+
+void print_usage(const char *name) {
+    cerr << "Usage: " << name << " [-t seconds] [benchmark...]" << endl
+         << "    -t  time each benchmark runs for at least (default: 0.5)"
+         << endl
+         << "    Only the benchmarks whose name starts with any of those given"
+         << endl
+         << "    run, all of them if none is" << endl;
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "t:")) != -1) {
+        switch (opt) {
+        case 't':
+            if ((opts.min_time = atof(optarg)) <= 0) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        default:
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = optind; i < argc; i++)
+        opts.filters.push_back(argv[i]);
+
+    cout << "benchmark,iterations,ns_per_op,mb_per_s" << endl;
+    bench_socket_helpers();
+    bench_framing();
+    bench_cipher();
+    bench_handshake();
+    return 0;
+}
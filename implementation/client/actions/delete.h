@@ -1,7 +1,20 @@
-
+#include "../../common/session.h"
 #ifndef delete_h
 #define delete_h
 
-void delete_file(int sock, unsigned char *key);
+/*
+ * Deletes the file [name], once the user confirms it if [ask] is set (and
+ * right away otherwise). Returns whether it was confirmed; errors are thrown
+ * through handle_errors.
+ */
+bool delete_file(Session &session, const char *name, bool ask);
+
+void delete_file(Session &session);
+
+/*
+ * Deletes a batch of files, whose names are asked for one per line, in a
+ * single round trip
+ */
+void delete_files(Session &session);
 
 #endif
\ No newline at end of file
@@ -1,9 +1,19 @@
 #include "../../common/errors.h"
+#include "../../common/pipeline.h"
 #include "../../common/seq.h"
+#include "../../common/session.h"
 #include "../../common/types.h"
 #include "../../common/utils.h"
-#include <openssl/evp.h>
+#include "../cache.h"
+#include "../client.h"
+#include "download.h"
+#include "logout.h"
+#include <algorithm>
+#include <memory>
+#include <stdint.h>
 #include <string.h>
+#include <thread>
+#include <vector>
 
 #if __has_include(<filesystem>)
 #include <filesystem>
@@ -17,298 +27,382 @@ error "Missing the <filesystem> header."
 
 using namespace std;
 
-void download(int sock, unsigned char *key) {
+static unsigned int download_streams = 1;
+
+void set_download_streams(unsigned int streams) { download_streams = streams; }
+
+void send_download_request(Session &session, unsigned char *filename,
+                           uint64_t offset, uint64_t length,
+                           const unsigned char *cached) {
+    // The name of the file, followed by the range, then the hash of the copy
+    // cached if any
+    const size_t request_len = FNAME_MAX_LEN + sizeof(offset) + sizeof(length);
+    unsigned char request[request_len + FILE_HASH_LEN];
+    memcpy(request, filename, FNAME_MAX_LEN);
+    memcpy(request + FNAME_MAX_LEN, &offset, sizeof(offset));
+    memcpy(request + FNAME_MAX_LEN + sizeof(offset), &length, sizeof(length));
+    if (cached != nullptr) {
+        memcpy(request + request_len, cached, FILE_HASH_LEN);
+    }
+    send_message(session, DownloadReq, request,
+                 request_len + (cached != nullptr ? FILE_HASH_LEN : 0));
+}
 
-    cout << "What do you want to download? ";
-    unsigned char filename[FNAME_MAX_LEN] = {0};
-    if (fgets(reinterpret_cast<char *>(filename), FNAME_MAX_LEN, stdin) ==
-        nullptr) {
-        handle_errors();
+bool receive_download_answer(Session &session, uint64_t &file_size,
+                             bool &unchanged) {
+    auto mtype_res = session.in.get_mtype(session.sock);
+    if (mtype_res.is_error ||
+        (mtype_res.result != DownloadAns &&
+         mtype_res.result != DownloadUnchanged && mtype_res.result != Error)) {
+        handle_errors("Incorrect message type");
     }
-    filename[strcspn(reinterpret_cast<char *>(filename), "\n")] = '\0';
 
-    cout << "Where do you want to save the file? ";
-    char output_file[FNAME_MAX_LEN] = {0};
-    if (fgets(output_file, FNAME_MAX_LEN, stdin) == nullptr) {
-        handle_errors();
+    // An Error is no longer than a filename
+    vector<unsigned char> pt;
+    open_message(session, mtype_res.result, pt,
+                 mtype_res.result == Error ? FNAME_MAX_LEN
+                                           : sizeof(file_size));
+    if (mtype_res.result == Error) {
+        cout << message_string(pt) << endl;
+        return false;
     }
-    output_file[strcspn(output_file, "\n")] = '\0';
+    if (pt.size() != sizeof(file_size)) {
+        handle_errors("Malformed download answer");
+    }
+    memcpy(&file_size, pt.data(), sizeof(file_size));
+    unchanged = mtype_res.result == DownloadUnchanged;
+    return true;
+}
 
-    // Sanity check: never overwrite a file
-    if (fs::status(fs::path(output_file)).type() != fs::file_type::not_found) {
-        cout << "Error - Output file must not exist" << endl;
-        return;
+bool receive_download_answer(Session &session, uint64_t &file_size) {
+    bool unchanged;
+    if (!receive_download_answer(session, file_size, unchanged)) {
+        return false;
+    }
+    if (unchanged) {
+        handle_errors("Incorrect message type");
     }
+    return true;
+}
 
-    // Make sure that the file can be written before
-    FILE *output_file_fp;
-    if ((output_file_fp = fopen(output_file, "w")) == nullptr) {
-        cout << "Error - Could not open output file for writing" << endl;
-        return;
+/*
+ * Downloads the [length] bytes of [filename] at [offset] over [session],
+ * writing them at the same offset of [fp]. The size of the file must be
+ * [file_size], i.e. unchanged since the first range was asked for. Returns
+ * false if the server could not send the range.
+ */
+static Maybe<bool> download_range(Session &session, unsigned char *filename,
+                                  FILE *fp, uint64_t offset, uint64_t length,
+                                  uint64_t file_size) {
+    Maybe<bool> res;
+    send_download_request(session, filename, offset, length);
+
+    uint64_t answer_size;
+    if (!receive_download_answer(session, answer_size)) {
+        return res;
+    }
+    if (answer_size != file_size) {
+        res.set_error("The file changed during the download");
+        return res;
     }
 
-    // Generate iv for message
-    auto iv_res = gen_iv();
-    if (iv_res.is_error) {
-        handle_errors(iv_res.error);
+    return receive_file(session, fp, offset, length, DownloadChunk,
+                        DownloadEnd);
+}
+
+/*
+ * Downloads the file, of [file_size] bytes, in ranges of a few chunks each on
+ * as many sessions at once: one all the same does not fill a link with a
+ * large bandwidth-delay product. [session] takes the first range, and new
+ * sessions of the same user take the others, each writing through its own
+ * handle of [output_file].
+ */
+static Maybe<bool> download_parallel(Session &session, unsigned char *filename,
+                                     FILE *fp, const char *output_file,
+                                     uint64_t file_size) {
+    // Ranges end on chunk boundaries, so that only the last one of each is
+    // cut short
+    uint64_t part_len =
+        (file_size + download_streams - 1) / download_streams;
+    part_len = (part_len + session.chunk_size - 1) / session.chunk_size *
+               session.chunk_size;
+    unsigned int parts = (file_size + part_len - 1) / part_len;
+
+    vector<Maybe<bool>> results(parts);
+    vector<thread> streams;
+    for (unsigned int i = 1; i < parts; i++) {
+        streams.emplace_back([&, i] {
+            uint64_t offset = i * part_len;
+            uint64_t length = min<uint64_t>(part_len, file_size - offset);
+            try {
+                unique_ptr<Session> other(open_session(session));
+                FILE *part_fp = fopen(output_file, "r+");
+                if (part_fp == nullptr) {
+                    results[i].set_error(
+                        "Could not open output file for writing");
+                    logout(*other);
+                    return;
+                }
+                results[i] = download_range(*other, filename, part_fp, offset,
+                                            length, file_size);
+                fclose(part_fp);
+                if (!results[i].is_error) {
+                    logout(*other);
+                }
+            } catch (char const *ex) {
+                results[i].set_error(ex);
+            }
+        });
     }
-    auto iv = iv_res.result;
-
-    // Send download request
-    auto send_packet_header_res =
-        send_header(sock, DownloadReq, seq_num, iv, get_iv_len());
-    if (send_packet_header_res.is_error) {
-        delete[] iv;
-        handle_errors(send_packet_header_res.error);
+
+    // The streams are joined even if this one fails
+    try {
+        results[0] =
+            download_range(session, filename, fp, 0, part_len, file_size);
+    } catch (char const *ex) {
+        results[0].set_error(ex);
     }
+    for (auto &stream : streams)
+        stream.join();
 
-    // Initialize encryption context
-    EVP_CIPHER_CTX *ctx;
-    int len = 0;
-    int ct_len;
-    if ((ctx = EVP_CIPHER_CTX_new()) == nullptr) {
-        delete[] iv;
-        handle_errors("Could not encrypt message (alloc)");
+    if (results[0].is_error) {
+        return results[0];
     }
 
-    if (EVP_EncryptInit(ctx, get_symmetric_cipher(), key, iv) != 1) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+    // A stream failing does not take this session down
+    Maybe<bool> res = results[0];
+    for (unsigned int i = 1; i < parts; i++) {
+        if (results[i].is_error) {
+            cout << "Error - A stream of the download failed" << endl;
+#ifdef DEBUG
+            cerr << "Error: " << results[i].error << endl;
+#endif
+        }
+        if (results[i].is_error || !results[i].result) {
+            res.set_result(false);
+        }
     }
+    return res;
+}
 
-    // Authenticated data
-    int err = 0;
-    unsigned char header = mtype_to_uc(DownloadReq);
-    err |=
-        EVP_EncryptUpdate(ctx, nullptr, &len, &header, sizeof(unsigned char));
-    err |=
-        EVP_EncryptUpdate(ctx, nullptr, &len, seqnum_to_uc(), sizeof(seqnum));
-    if (err != 1) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+/*
+ * Opens the file the download of [name] into [output_file] is written into
+ * until it is complete: a new one, or one left there by a download that did
+ * not make it, to be taken up where it ends on the assumption that the file
+ * did not change on the server
+ */
+static bool open_partial(const char *name, const char *output_file,
+                         PendingDownload &download) {
+    memset(download.filename, 0, FNAME_MAX_LEN);
+    strncpy(reinterpret_cast<char *>(download.filename), name,
+            FNAME_MAX_LEN - 1);
+    download.output_file = output_file;
+
+    // Sanity check: never overwrite a file
+    if (fs::status(fs::path(output_file)).type() != fs::file_type::not_found) {
+        cout << "Error - Output file must not exist" << endl;
+        return false;
     }
 
-    // Encryption of the filename
-    unsigned char *ct = new unsigned char[FNAME_MAX_LEN + get_block_size()];
-    if (EVP_EncryptUpdate(ctx, ct, &len, filename, FNAME_MAX_LEN) != 1) {
-        delete[] iv;
-        delete[] ct;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+    download.partial_file = string(output_file) + ".partial";
+    download.offset = 0;
+    error_code ec;
+    if (fs::exists(download.partial_file, ec)) {
+        auto partial_size = fs::file_size(download.partial_file, ec);
+        if (ec || partial_size > FSIZE_MAX ||
+            (download.fp = fopen(download.partial_file.c_str(), "r+")) ==
+                nullptr) {
+            cout << "Error - Could not open output file for writing" << endl;
+            return false;
+        }
+        download.offset = partial_size;
+        cout << "Resuming the download from byte " << download.offset << endl;
+    } else if ((download.fp = fopen(download.partial_file.c_str(), "w")) ==
+               nullptr) {
+        cout << "Error - Could not open output file for writing" << endl;
+        return false;
     }
-    ct_len = len;
+    return true;
+}
 
-    if (EVP_EncryptFinal(ctx, ct + ct_len, &len) != 1) {
-        delete[] iv;
-        delete[] ct;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+/*
+ * Looks up the file of [download] in the cache, for the server to be asked
+ * whether it changed: only for a download from the start. Returns the hash of
+ * the copy cached, or nullptr if there is none.
+ */
+static const unsigned char *look_up_cache(Session &session,
+                                          PendingDownload &download) {
+    download.cache_entry.clear();
+    download.unchanged = false;
+    if (download.offset > 0 ||
+        !cache_lookup(session.username,
+                      reinterpret_cast<char *>(download.filename),
+                      download.cache_hash, download.cache_entry)) {
+        return nullptr;
     }
-    ct_len += len;
-
-    unsigned char *tag = new unsigned char[TAG_LEN];
-    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, TAG_LEN, tag) != 1) {
-        delete[] iv;
-        delete[] ct;
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+    return download.cache_hash;
+}
+
+/*
+ * Writes the copy of the file of [download] the cache has, the server having
+ * said that the file, of [file_size] bytes, did not change. Returns false if
+ * the copy cannot be taken.
+ */
+static Maybe<bool> copy_cached(PendingDownload &download, uint64_t file_size) {
+    Maybe<bool> res;
+    download.unchanged = true;
+    error_code ec;
+    uint64_t entry_size = fs::file_size(download.cache_entry, ec);
+    if (ec || entry_size != file_size) {
+        cache_drop(download.cache_entry);
+        cout << "Error - The cached copy of the file is damaged" << endl;
+        res.set_result(false);
+        return res;
     }
-    delete[] iv;
-    EVP_CIPHER_CTX_reset(ctx);
-
-    // Send ciphertext
-    auto ct_send_res = send_field(sock, (flen)ct_len, ct);
-    if (ct_send_res.is_error) {
-        delete[] ct;
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors(ct_send_res.error);
+    fs::copy_file(download.cache_entry, download.partial_file,
+                  fs::copy_options::overwrite_existing, ec);
+    if (ec) {
+        cout << "Error - Could not copy the file from the cache" << endl;
+        res.set_result(false);
+        return res;
     }
-    delete[] ct;
+    cout << "The file did not change, it is copied from the cache" << endl;
+    res.set_result(true);
+    return res;
+}
 
-    auto tag_send_res = send_tag(sock, tag);
-    if (tag_send_res.is_error) {
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors(tag_send_res.error);
+/*
+ * Ends the download once the file was received, as [receive_res] says, all
+ * of it on the session of the user if [sequential]. A file sent by the server
+ * is cached once saved.
+ */
+static bool save_download(Session &session, PendingDownload &download,
+                          Maybe<bool> receive_res, bool sequential) {
+    fclose(download.fp);
+
+    // The server could not send the file, or the ranges of a parallel
+    // download may have left holes: the partial file is removed. Otherwise,
+    // after an error, what was received so far is kept for the next attempt.
+    error_code ec;
+    if (receive_res.is_error || !receive_res.result) {
+        if (!receive_res.is_error || !sequential ||
+            strcmp(receive_res.error, WRITE_ERROR) == 0) {
+            fs::remove(download.partial_file, ec);
+        }
+        if (receive_res.is_error) {
+            handle_errors(receive_res.error);
+        }
+        return false;
     }
-    delete[] tag;
 
-    inc_seqnum();
+    // Sanity check: never overwrite a file, even one created meanwhile
+    if (fs::exists(download.output_file, ec)) {
+        cout << "Error - Output file must not exist, the file is kept as '"
+             << download.partial_file << "'" << endl;
+        return false;
+    }
+    fs::rename(download.partial_file, download.output_file, ec);
+    if (ec) {
+        cout << "Error - Could not rename the file, kept as '"
+             << download.partial_file << "'" << endl;
+        return false;
+    }
 
-    //------------------Server's response------------------
+    cout << "File saved locally as '" << download.output_file
+         << "' correctly!" << endl;
+    if (!download.unchanged) {
+        cache_store(session.username,
+                    reinterpret_cast<char *>(download.filename),
+                    download.output_file);
+    }
+    return true;
+}
 
-    unsigned char *pt = new unsigned char[CHUNK_SIZE + get_block_size()];
+bool request_download(Session &session, const char *name,
+                      const char *output_file, PendingDownload &download) {
+    if (!open_partial(name, output_file, download)) {
+        return false;
+    }
 
-    for (;;) {
-        auto server_response_header_res = get_mtype(sock);
-        if (server_response_header_res.is_error) {
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(output_file_fp);
-            delete[] pt;
-            handle_errors(server_response_header_res.error);
-        }
-        auto server_response_header = server_response_header_res.result;
-
-        // Read IV and sequence number
-        auto server_header_res = read_header(sock);
-        if (server_header_res.is_error) {
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(output_file_fp);
-            delete[] pt;
-            handle_errors(server_header_res.error);
-        }
-        auto [seq, in_iv] = server_header_res.result;
-        iv = in_iv;
-
-        // Check correctness of the sequence number
-        if (seq != seq_num) {
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(output_file_fp);
-            delete[] pt;
-            delete[] iv;
-            handle_errors("Incorrect sequence number");
-        }
+    // The whole file, or what is left of it, in one go
+    send_download_request(session, download.filename, download.offset,
+                          FSIZE_MAX, look_up_cache(session, download));
+    return true;
+}
 
-        // Read ciphertext
-        auto ct_res = read_field(sock);
-        if (ct_res.is_error) {
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(output_file_fp);
-            delete[] pt;
-            delete[] iv;
-            handle_errors(ct_res.error);
-        }
-        auto ct_tuple = ct_res.result;
-        ct_len = get<0>(ct_tuple);
-        ct = get<1>(ct_tuple);
-
-        if (ct_len > CHUNK_SIZE + get_block_size()) {
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(output_file_fp);
-            delete[] pt;
-            delete[] iv;
-            delete[] ct;
-            handle_errors("Ciphertext longer than expected");
-        }
+bool finish_download(Session &session, PendingDownload &download) {
+    Maybe<bool> receive_res;
+    uint64_t file_size;
+    bool unchanged;
+    if (receive_download_answer(session, file_size, unchanged)) {
+        // Receive the file a chunk at a time, decrypting and writing the
+        // previous chunks while the next ones arrive
+        receive_res = unchanged
+                          ? copy_cached(download, file_size)
+                          : receive_file(session, download.fp,
+                                         download.offset,
+                                         file_size - download.offset,
+                                         DownloadChunk, DownloadEnd);
+    }
+    return save_download(session, download, receive_res, true);
+}
 
-        // Read tag
-        auto tag_res = read_tag(sock);
-        if (tag_res.is_error) {
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(output_file_fp);
-            delete[] pt;
-            delete[] ct;
-            delete[] iv;
-            handle_errors(tag_res.error);
-        }
-        tag = tag_res.result;
-
-        // Initialize decryption
-        if (EVP_DecryptInit(ctx, get_symmetric_cipher(), key, iv) != 1) {
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(output_file_fp);
-            delete[] pt;
-            delete[] tag;
-            delete[] ct;
-            delete[] iv;
-            handle_errors();
-        }
-        delete[] iv;
-
-        header = mtype_to_uc(server_response_header);
-
-        // Authenticated data
-        err = 0;
-        err |= EVP_DecryptUpdate(ctx, nullptr, &len, &header, sizeof(mtype));
-        err |= EVP_DecryptUpdate(ctx, nullptr, &len, seqnum_to_uc(),
-                                 sizeof(seqnum));
-
-        if (err != 1) {
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(output_file_fp);
-            delete[] pt;
-            delete[] tag;
-            delete[] ct;
-            handle_errors();
-        }
+bool download_file(Session &session, const char *name,
+                   const char *output_file) {
+    PendingDownload download;
 
-        int pt_len;
-        if (EVP_DecryptUpdate(ctx, pt, &len, ct, ct_len) != 1) {
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(output_file_fp);
-            delete[] pt;
-            delete[] tag;
-            delete[] ct;
-            handle_errors();
-        }
-        pt_len = len;
-
-        // GCM tag check
-        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, TAG_LEN, tag);
-
-        if (EVP_DecryptFinal(ctx, pt + len, &len) != 1) {
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(output_file_fp);
-            delete[] pt;
-            delete[] tag;
-            delete[] ct;
-            handle_errors();
-        }
-        pt_len += len;
-
-        delete[] ct;
-        delete[] tag;
-
-        // Reset the context and increment the sequence number
-        EVP_CIPHER_CTX_reset(ctx);
-        inc_seqnum();
-
-        // Finally, handle the message
-        switch (server_response_header) {
-        case DownloadChunk:
-        case DownloadEnd:
-            if (fwrite(pt, sizeof(*pt), pt_len, output_file_fp) !=
-                (unsigned int)pt_len) {
-                EVP_CIPHER_CTX_free(ctx);
-                fclose(output_file_fp);
-                delete[] pt;
-                handle_errors("Error when writing downloaded chunk to file");
-            }
-            break;
-        case Error:
-        default:
-            // There was an error, either prior to the download or during it
-            // Handle it by:
-            //   - printing the error to the user
-            //   - freeing memory
-            //   - removing the (partial) downloaded file
-
-            cout << pt << endl;
-
-            fclose(output_file_fp);
-            EVP_CIPHER_CTX_free(ctx);
-            delete[] pt;
-
-            fs::path outfile_path = fs::path(output_file);
-            if (fs::exists(outfile_path)) {
-                fs::remove(outfile_path);
-            }
+    // What is left of a file goes over this session only
+    if (download_streams <= 1) {
+        return request_download(session, name, output_file, download) &&
+               finish_download(session, download);
+    }
+    if (!open_partial(name, output_file, download)) {
+        return false;
+    }
+    if (download.offset > 0) {
+        send_download_request(session, download.filename, download.offset,
+                              FSIZE_MAX, look_up_cache(session, download));
+        return finish_download(session, download);
+    }
 
-            return;
+    // An empty range first, for the size of the file (or for nothing more,
+    // if it is cached and did not change)
+    Maybe<bool> receive_res;
+    uint64_t file_size;
+    bool unchanged;
+    send_download_request(session, download.filename, 0, 0,
+                          look_up_cache(session, download));
+    if (!receive_download_answer(session, file_size, unchanged)) {
+        // Nothing received
+    } else if (unchanged) {
+        receive_res = copy_cached(download, file_size);
+    } else {
+        receive_res =
+            receive_file(session, download.fp, DownloadChunk, DownloadEnd);
+        if (!receive_res.is_error && receive_res.result && file_size > 0) {
+            receive_res = download_parallel(session, download.filename,
+                                            download.fp,
+                                            download.partial_file.c_str(),
+                                            file_size);
         }
+    }
+    return save_download(session, download, receive_res, false);
+}
 
-        if (server_response_header == DownloadEnd) {
-            break;
-        }
+void download(Session &session) {
+    cout << "What do you want to download? ";
+    char filename[FNAME_MAX_LEN] = {0};
+    if (fgets(filename, FNAME_MAX_LEN, stdin) == nullptr) {
+        handle_errors();
     }
+    filename[strcspn(filename, "\n")] = '\0';
 
-    EVP_CIPHER_CTX_free(ctx);
-    fclose(output_file_fp);
-    delete[] pt;
+    cout << "Where do you want to save the file? ";
+    char output_file[FNAME_MAX_LEN] = {0};
+    if (fgets(output_file, FNAME_MAX_LEN, stdin) == nullptr) {
+        handle_errors();
+    }
+    output_file[strcspn(output_file, "\n")] = '\0';
 
-    cout << "File saved locally as '" << output_file << "' correctly!" << endl;
+    download_file(session, filename, output_file);
 }
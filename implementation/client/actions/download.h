@@ -1,6 +1,77 @@
+#include "../../common/session.h"
+#include "../../common/types.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
 #ifndef download_h
 #define download_h
 
-void download(int sock, unsigned char *key);
+/*
+ * Number of sessions downloading a file at once, each a range of it (default
+ * 1: the whole file on the session of the user)
+ */
+void set_download_streams(unsigned int streams);
+
+/*
+ * Downloads the file [name] into [output_file], which must not exist.
+ * Returns whether the file was saved; errors are thrown through
+ * handle_errors.
+ */
+bool download_file(Session &session, const char *name,
+                   const char *output_file);
+
+/*
+ * Asks the server for the [length] bytes of [filename] starting at [offset],
+ * or for all of them past it if [length] is FSIZE_MAX. With the FILE_HASH_LEN
+ * bytes [cached], the hash of a copy of the file the client has, the server
+ * sends nothing of a file with that same hash.
+ */
+void send_download_request(Session &session, unsigned char *filename,
+                           uint64_t offset, uint64_t length,
+                           const unsigned char *cached = nullptr);
+
+/*
+ * Receives the answer to a download request. Returns true, with [file_size]
+ * set to the size of the whole file, if the server is sending the range:
+ * receive_file takes it from there. Otherwise, the Error of the server is
+ * written on the standard output.
+ */
+bool receive_download_answer(Session &session, uint64_t &file_size);
+
+/*
+ * As above, for a request sent with the hash of a cached copy: [unchanged]
+ * is set if the file still has that hash, in which case nothing follows.
+ */
+bool receive_download_answer(Session &session, uint64_t &file_size,
+                             bool &unchanged);
+
+/* A download whose request was sent, and whose file was not received yet */
+struct PendingDownload {
+    unsigned char filename[FNAME_MAX_LEN];
+    std::string output_file;
+    // Where the file is written until it is complete
+    std::string partial_file;
+    FILE *fp;
+    // Where the range asked for starts, past what an earlier attempt saved
+    uint64_t offset;
+    // The copy of the file in the cache, if any, and its hash
+    std::string cache_entry;
+    unsigned char cache_hash[FILE_HASH_LEN];
+    // Whether the server said the cached copy is still the file
+    bool unchanged;
+};
+
+/*
+ * The two halves of a download over the session of the user only, so that
+ * other requests can be sent in between: request_download asks for the file
+ * (returning false, with nothing sent, if it cannot be written), and
+ * finish_download receives it once every request sent before was answered.
+ * Return as download_file.
+ */
+bool request_download(Session &session, const char *name,
+                      const char *output_file, PendingDownload &download);
+bool finish_download(Session &session, PendingDownload &download);
+
+void download(Session &session);
 
 #endif
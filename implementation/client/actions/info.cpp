@@ -0,0 +1,77 @@
+#include "../../common/errors.h"
+#include "../../common/session.h"
+#include "../../common/types.h"
+#include "../../common/utils.h"
+#include "info.h"
+#include <iomanip>
+#include <iostream>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+using namespace std;
+
+// Size of the hash of a file in the answer (get_hash_type())
+#define INFO_HASH_LEN 32
+#define INFO_USAGE_LEN (2 * sizeof(uint64_t) + sizeof(uint32_t))
+#define INFO_FILE_LEN (sizeof(uint64_t) + sizeof(int64_t) + INFO_HASH_LEN)
+
+void file_info(Session &session) {
+    cout << "Which file do you want to know about (none for your usage "
+            "only)? ";
+    unsigned char filename[FNAME_MAX_LEN] = {0};
+    if (fgets(reinterpret_cast<char *>(filename), FNAME_MAX_LEN, stdin) ==
+        nullptr) {
+        handle_errors();
+    }
+    filename[strcspn(reinterpret_cast<char *>(filename), "\n")] = '\0';
+
+    send_message(session, InfoReq, filename, FNAME_MAX_LEN);
+
+    //------------------Wait server response------------------
+    vector<unsigned char> res;
+    if (!receive_message(session, InfoAns, res,
+                         INFO_USAGE_LEN + INFO_FILE_LEN)) {
+        return;
+    }
+    bool named = filename[0] != '\0';
+    if (res.size() != INFO_USAGE_LEN + (named ? INFO_FILE_LEN : 0)) {
+        handle_errors("Malformed info answer");
+    }
+
+    uint64_t bytes, quota;
+    uint32_t files;
+    memcpy(&bytes, res.data(), sizeof(bytes));
+    memcpy(&quota, res.data() + sizeof(bytes), sizeof(quota));
+    memcpy(&files, res.data() + 2 * sizeof(uint64_t), sizeof(files));
+    cout << endl << "You store " << bytes << " bytes in " << files << " files";
+    if (quota != 0) {
+        cout << ", out of " << quota << " allowed";
+    }
+    cout << endl;
+
+    if (named) {
+        const unsigned char *file = res.data() + INFO_USAGE_LEN;
+        uint64_t size;
+        int64_t mtime;
+        memcpy(&size, file, sizeof(size));
+        memcpy(&mtime, file + sizeof(size), sizeof(mtime));
+        time_t secs = mtime / 1000000000;
+        char when[64] = "?";
+        struct tm tm;
+        if (localtime_r(&secs, &tm) != nullptr) {
+            strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+        }
+
+        cout << filename << ": " << size << " bytes, modified " << when
+             << endl
+             << "SHA-256: " << hex << setfill('0');
+        for (int i = 0; i < INFO_HASH_LEN; i++) {
+            cout << setw(2) << (int)file[sizeof(size) + sizeof(mtime) + i];
+        }
+        cout << dec << setfill(' ') << endl;
+    }
+    cout << endl;
+}
@@ -0,0 +1,11 @@
+#include "../../common/session.h"
+#ifndef info_h
+#define info_h
+
+/*
+ * Shows how much the user stores, and the size, modification time and hash
+ * of one of the files if asked for
+ */
+void file_info(Session &session);
+
+#endif
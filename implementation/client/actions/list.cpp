@@ -1,214 +1,81 @@
 #include "../../common/errors.h"
-#include "../../common/seq.h"
+#include "../../common/session.h"
 #include "../../common/types.h"
 #include "../../common/utils.h"
-#include <openssl/evp.h>
-#include <sys/socket.h>
-
-void list_files(int sock, unsigned char *key) {
-
-    // Generate iv for message
-    auto iv_res = gen_iv();
-    if (iv_res.is_error) {
-        handle_errors(iv_res.error);
-    }
-    auto iv = iv_res.result;
-
-    // Send list request header
-    auto send_packet_header_res =
-        send_header(sock, ListReq, seq_num, iv, get_iv_len());
-    if (send_packet_header_res.is_error) {
-        delete[] iv;
-        handle_errors(send_packet_header_res.error);
-    }
-
-    // Initialize encryption context
-    EVP_CIPHER_CTX *ctx;
-    int len = 0;
-    int ct_len;
-    if ((ctx = EVP_CIPHER_CTX_new()) == nullptr) {
-        delete[] iv;
-        handle_errors("Could not encrypt message (alloc)");
-    }
-
-    if (EVP_EncryptInit(ctx, get_symmetric_cipher(), key, iv) != 1) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-
-    int err = 0;
-    unsigned char header = mtype_to_uc(ListReq);
-    err |=
-        EVP_EncryptUpdate(ctx, nullptr, &len, &header, sizeof(unsigned char));
-    err |=
-        EVP_EncryptUpdate(ctx, nullptr, &len, seqnum_to_uc(), sizeof(seqnum));
-    if (err != 1) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-
-    // Get dummy value to encrypt
-    auto dummy_res = get_dummy();
-    if (dummy_res.is_error) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-    auto dummy = dummy_res.result;
-
-    // actual encryption
-    unsigned char *ct = new unsigned char[DUMMY_LEN + get_block_size()];
-    if (EVP_EncryptUpdate(ctx, ct, &len, dummy, DUMMY_LEN) != 1) {
-        delete[] iv;
-        delete[] dummy;
-        delete[] ct;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-    ct_len = len;
-
-    if (EVP_EncryptFinal(ctx, ct + len, &len) != 1) {
-        delete[] iv;
-        delete[] dummy;
-        delete[] ct;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-    ct_len += len;
-
-    unsigned char *tag = new unsigned char[TAG_LEN];
-    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, TAG_LEN, tag) != 1) {
-        delete[] iv;
-        delete[] dummy;
-        delete[] ct;
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-    delete[] iv;
-    delete[] dummy;
-    EVP_CIPHER_CTX_reset(ctx);
-
-    // send ciphertext and tag
-    auto ct_send_res = send_field(sock, (flen)ct_len, ct);
-    if (ct_send_res.is_error) {
-        EVP_CIPHER_CTX_free(ctx);
-        delete[] ct;
-        delete[] tag;
-        handle_errors(ct_send_res.error);
-    }
-
-    auto tag_send_res = send_tag(sock, tag);
-    if (tag_send_res.is_error) {
-        EVP_CIPHER_CTX_free(ctx);
-        delete[] ct;
-        delete[] tag;
-        handle_errors(tag_send_res.error);
-    }
-    delete[] ct;
-    delete[] tag;
-    EVP_CIPHER_CTX_reset(ctx);
-
-    inc_seqnum();
+#include "list.h"
+#include <functional>
+#include <iostream>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+using namespace std;
+
+/*
+ * Lists the files whose name matches [filter], calling [on_name] on each one
+ * as soon as its page arrives. Returns false if the server sent an Error.
+ */
+static bool list_pages(Session &session, const char *filter,
+                       const function<void(const char *, size_t)> &on_name) {
+
+    // Send list request: the name to go on after, none as it starts from
+    // the first one, followed by the filter
+    unsigned char request[1 + FNAME_MAX_LEN] = {0};
+    strncpy(reinterpret_cast<char *>(request + 1), filter, FNAME_MAX_LEN - 1);
+    send_message(session, ListReq, request, 1 + strlen(filter) + 1);
 
     //------------------Wait server response------------------
+    // Pages of names, until one telling that none follows
+    vector<unsigned char> page;
+    uint32_t more;
+    do {
+        if (!receive_message(session, ListAns, page,
+                             sizeof(more) + LIST_PAGE_LEN)) {
+            return false;
+        }
+        if (page.size() < sizeof(more)) {
+            handle_errors("Malformed list answer");
+        }
+        memcpy(&more, page.data(), sizeof(more));
+
+        char *names = reinterpret_cast<char *>(page.data() + sizeof(more));
+        size_t len = page.size() - sizeof(more);
+        for (size_t i = 0; i < len;) {
+            size_t name_len = strnlen(names + i, len - i);
+            on_name(names + i, name_len);
+            i += name_len + 1;
+        }
+    } while (more != 0);
+    return true;
+}
 
-    auto mtype_res = get_mtype(sock);
-    if (mtype_res.is_error || mtype_res.result != ListAns) {
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors("Incorrect message type");
-    }
-
-    // read iv and sequence number
-    auto server_header_res = read_header(sock);
-    if (server_header_res.is_error) {
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-    auto [seq, in_iv] = server_header_res.result;
-    iv = in_iv;
-
-    // Check correctness of the sequence number
-    if (seq != seq_num) {
-        EVP_CIPHER_CTX_free(ctx);
-        delete[] iv;
-        handle_errors("Incorrect sequence number");
-    }
-
-    // read ciphertext
-    auto ct_res = read_field(sock);
-    if (ct_res.is_error) {
-        EVP_CIPHER_CTX_free(ctx);
-        delete[] iv;
-        handle_errors();
-    }
-    auto ct_tuple = ct_res.result;
-    ct_len = get<0>(ct_tuple);
-    ct = get<1>(ct_tuple);
-
-    // read tag
-    auto tag_res = read_tag(sock);
-    if (tag_res.is_error) {
-        EVP_CIPHER_CTX_free(ctx);
-        delete[] ct;
-        delete[] iv;
-        handle_errors();
-    }
-    tag = tag_res.result;
-
-    if (EVP_DecryptInit(ctx, get_symmetric_cipher(), key, iv) != 1) {
-        delete[] iv;
-        delete[] ct;
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+void list_matching(Session &session, const char *filter) {
+    cout << endl << "List of your files: " << endl;
+    if (list_pages(session, filter, [](const char *name, size_t len) {
+            cout.write(name, len) << endl;
+        })) {
+        cout << endl;
     }
-    delete[] iv;
+}
 
-    header = mtype_to_uc(mtype_res.result);
+bool list_names(Session &session, const char *filter,
+                vector<string> &names) {
+    return list_pages(session, filter, [&](const char *name, size_t len) {
+        names.emplace_back(name, len);
+    });
+}
 
-    // Specify authenticated data
-    err = 0;
-    err |= EVP_DecryptUpdate(ctx, nullptr, &len, &header, sizeof(mtype));
-    err |=
-        EVP_DecryptUpdate(ctx, nullptr, &len, seqnum_to_uc(), sizeof(seqnum));
+void list_files(Session &session) { list_matching(session, ""); }
 
-    if (err != 1) {
-        delete[] ct;
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
+void find_files(Session &session) {
+    cout << "Which files do you want to list (a prefix, or a pattern such as "
+            "*.txt)? ";
+    char filter[FNAME_MAX_LEN] = {0};
+    if (fgets(filter, FNAME_MAX_LEN, stdin) == nullptr) {
         handle_errors();
     }
+    filter[strcspn(filter, "\n")] = '\0';
 
-    // Allocate plaintext of the length == ciphertext length
-    auto *pt = new unsigned char[ct_len];
-    if (EVP_DecryptUpdate(ctx, pt, &len, ct, ct_len) != 1) {
-        delete[] ct;
-        delete[] tag;
-        delete[] pt;
-        EVP_CIPHER_CTX_free(ctx);
-    }
-
-    // GCM tag check
-    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, TAG_LEN, tag);
-
-    // Encrypt Final. Finalize the encryption and adds the padding
-    if (EVP_DecryptFinal(ctx, pt + len, &len) != 1) {
-        delete[] ct;
-        delete[] tag;
-        delete[] pt;
-        EVP_CIPHER_CTX_free(ctx);
-    }
-
-    cout << endl << "List of your files: " << endl << pt << endl;
-    delete[] pt;
-    delete[] ct;
-    delete[] tag;
-
-    // free context
-    EVP_CIPHER_CTX_free(ctx);
-
-    inc_seqnum();
+    list_matching(session, filter);
 }
@@ -1,7 +1,25 @@
-
+#include "../../common/session.h"
+#include <string>
+#include <vector>
 #ifndef list_h
 #define list_h
 
-void list_files(int sock, unsigned char *key);
+/*
+ * Lists the files whose name matches [filter], a prefix or a pattern,
+ * printing each page of them as soon as it arrives
+ */
+void list_matching(Session &session, const char *filter);
+
+/*
+ * Same as the above, with the names put into [names] instead. Returns false
+ * if the server sent an Error, written on the standard output.
+ */
+bool list_names(Session &session, const char *filter,
+                std::vector<std::string> &names);
+
+void list_files(Session &session);
+
+/* Lists the files whose name has a prefix, or matches a pattern */
+void find_files(Session &session);
 
-#endif
\ No newline at end of file
+#endif
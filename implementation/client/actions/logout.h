@@ -1,7 +1,7 @@
-
+#include "../../common/session.h"
 #ifndef logout_h
 #define logout_h
 
-void logout(int sock, unsigned char *key);
+void logout(Session &session);
 
 #endif
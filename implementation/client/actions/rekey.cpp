@@ -0,0 +1,38 @@
+#include "../../common/errors.h"
+#include "../../common/session.h"
+#include "../../common/types.h"
+#include "../../common/utils.h"
+#include "rekey.h"
+#include <vector>
+
+using namespace std;
+
+bool rekey(Session &session) {
+    auto nonce_res = gen_nonce();
+    if (nonce_res.is_error) {
+        handle_errors(nonce_res.error);
+    }
+    unsigned char *client_nonce = nonce_res.result;
+
+    send_message(session, RekeyReq, client_nonce, NONCE_LEN);
+
+    //------------------Wait server response------------------
+    vector<unsigned char> server_nonce;
+    if (!receive_message(session, RekeyAns, server_nonce, NONCE_LEN)) {
+        delete[] client_nonce;
+        return false;
+    }
+    if (server_nonce.size() != NONCE_LEN) {
+        delete[] client_nonce;
+        handle_errors("Malformed rekey answer");
+    }
+
+    auto key_res = derive_rekeyed_key(session.key, get_symmetric_key_length(),
+                                      client_nonce, server_nonce.data());
+    delete[] client_nonce;
+    if (key_res.is_error) {
+        handle_errors(key_res.error);
+    }
+    session.replace_key(key_res.result);
+    return true;
+}
@@ -0,0 +1,12 @@
+#include "../../common/session.h"
+#ifndef rekey_h
+#define rekey_h
+
+/*
+ * Replaces the key of the session with one derived from it, and starts the
+ * counters over, so that the session goes on instead of expiring. Nothing may
+ * be in flight. Returns false if the server refused it.
+ */
+bool rekey(Session &session);
+
+#endif
@@ -1,7 +1,19 @@
-
+#include "../../common/session.h"
 #ifndef rename_h
 #define rename_h
 
-void rename(int sock, unsigned char *key);
+/*
+ * Renames the file [from] to [to]. Returns whether the server renamed it;
+ * errors are thrown through handle_errors.
+ */
+bool rename_file(Session &session, const char *from, const char *to);
+
+void rename(Session &session);
+
+/*
+ * Renames a batch of files, whose old and new names are asked for on
+ * alternate lines, in a single round trip
+ */
+void rename_files(Session &session);
 
 #endif
\ No newline at end of file
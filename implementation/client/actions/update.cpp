@@ -0,0 +1,133 @@
+#include "../../common/delta.h"
+#include "../../common/errors.h"
+#include "../../common/pipeline.h"
+#include "../../common/session.h"
+#include "../../common/types.h"
+#include "../../common/utils.h"
+#include "update.h"
+#include <iostream>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vector>
+
+using namespace std;
+
+/*
+ * Writes into a new temporary file the delta from the file of the signature
+ * [sigs] to the [size] bytes of [fp]. Returns nullptr if the file could not
+ * be read.
+ */
+static FILE *compute_delta(FILE *fp, uint32_t size,
+                           const vector<unsigned char> &sigs) {
+    // The blocks of the stored file are looked for at every byte: the file
+    // is mapped rather than read through a window
+    const uchar *data = nullptr;
+    if (size > 0) {
+        void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+        if (map == MAP_FAILED)
+            return nullptr;
+        madvise(map, size, MADV_SEQUENTIAL);
+        data = static_cast<const uchar *>(map);
+    }
+
+    FILE *delta = tmpfile();
+    Maybe<bool> delta_res;
+    if (delta != nullptr) {
+        delta_res = make_delta(data, size, sigs.data(), sigs.size(), delta);
+    }
+    if (data != nullptr)
+        munmap(const_cast<uchar *>(data), size);
+    if (delta_res.is_error) {
+        if (delta != nullptr)
+            fclose(delta);
+        handle_errors(delta_res.error);
+    }
+    if (delta != nullptr && (!delta_res.result || fflush(delta) != 0)) {
+        fclose(delta);
+        delta = nullptr;
+    }
+    return delta;
+}
+
+void update(Session &session) {
+    cout << "What do you want to update? ";
+    unsigned char filename[FNAME_MAX_LEN] = {0};
+    if (fgets(reinterpret_cast<char *>(filename), FNAME_MAX_LEN, stdin) ==
+        nullptr) {
+        handle_errors();
+    }
+    filename[strcspn(reinterpret_cast<char *>(filename), "\n")] = '\0';
+
+    // Make sure that the file can be read before
+    FILE *input_file_fp;
+    if ((input_file_fp = fopen(reinterpret_cast<char *>(filename), "r")) ==
+        nullptr) {
+        cout << "Error - Could not open input file for reading" << endl;
+        return;
+    }
+    struct stat st;
+    if (fstat(fileno(input_file_fp), &st) != 0 || !S_ISREG(st.st_mode)) {
+        cout << "Error - Could not open input file for reading" << endl;
+        fclose(input_file_fp);
+        return;
+    }
+    if ((unsigned long)st.st_size > DELTA_FSIZE_MAX) {
+        cout << "Error - File too big to be updated (max 4Gb)" << endl;
+        fclose(input_file_fp);
+        return;
+    }
+    uint32_t file_size = st.st_size;
+
+    // Send update request: the name of the file, followed by its size
+    unsigned char request[FNAME_MAX_LEN + sizeof(file_size)];
+    memcpy(request, filename, FNAME_MAX_LEN);
+    memcpy(request + FNAME_MAX_LEN, &file_size, sizeof(file_size));
+    vector<unsigned char> sigs;
+    try {
+        send_message(session, UpdateReq, request, sizeof(request));
+
+        //------------------Wait server response------------------
+        // The signature of the stored file, or an Error
+        if (!receive_message(session, UpdateSigs, sigs, DELTA_SIGS_MAX_LEN)) {
+            fclose(input_file_fp);
+            return;
+        }
+    } catch (char const *) {
+        fclose(input_file_fp);
+        throw;
+    }
+
+    FILE *delta = compute_delta(input_file_fp, file_size, sigs);
+    fclose(input_file_fp);
+    if (delta == nullptr) {
+        send_error_response(session, "Error - Could not read file");
+        return;
+    }
+    cout << "Sending " << ftell(delta) << " bytes of changes, for a file of "
+         << file_size << " bytes" << endl;
+
+    rewind(delta);
+    auto send_res = send_file(session, delta, UpdateChunk, UpdateEnd);
+    fclose(delta);
+    if (send_res.is_error) {
+        handle_errors(send_res.error);
+    }
+
+    // Whatever was sent so far ends with the error
+    if (!send_res.result) {
+        send_error_response(session, "Error - Could not read file");
+        return;
+    }
+
+    //-------------Wait server response--------------
+    // An Error if the server could not rebuild or save the file in the end
+    vector<unsigned char> res;
+    if (receive_message(session, UpdateRes, res, FNAME_MAX_LEN)) {
+        char *msg = reinterpret_cast<char *>(res.data());
+        cout << endl;
+        cout.write(msg, strnlen(msg, res.size())) << endl;
+    }
+}
@@ -0,0 +1,11 @@
+#include "../../common/session.h"
+#ifndef update_h
+#define update_h
+
+/*
+ * Sends a new version of a file the server already has, as the changes from
+ * the stored one only
+ */
+void update(Session &session);
+
+#endif
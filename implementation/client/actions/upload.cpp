@@ -1,9 +1,16 @@
 #include "../../common/errors.h"
+#include "../../common/pipeline.h"
 #include "../../common/seq.h"
+#include "../../common/session.h"
 #include "../../common/types.h"
 #include "../../common/utils.h"
+#include "upload.h"
 #include <openssl/evp.h>
+#include <stdint.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
 
 #if __has_include(<filesystem>)
 #include <filesystem>
@@ -17,488 +24,299 @@ error "Missing the <filesystem> header."
 
 using namespace std;
 
-void upload(int sock, unsigned char *key) {
-    cout << "What do you want to upload? ";
-    unsigned char filename[FNAME_MAX_LEN] = {0};
-    if (fgets(reinterpret_cast<char *>(filename), FNAME_MAX_LEN, stdin) ==
-        nullptr) {
-        handle_errors();
-    }
-    filename[strcspn(reinterpret_cast<char *>(filename), "\n")] = '\0';
-
-    // Make sure that the file can be read before
-    FILE *input_file_fp;
-    if ((input_file_fp = fopen(reinterpret_cast<char *>(filename), "r")) ==
-        nullptr) {
-        cout << "Error - Could not open input file for reading" << endl;
-        return;
-    }
-    fs::path input_path = reinterpret_cast<char *>(filename);
-    if (fs::file_size(input_path) > FSIZE_MAX) {
-        cout << "Error - File too big for upload (max 4Gb)" << endl;
-        return;
-    }
+/*
+ * Writes into [id] the ID of the upload of [filename], of [size] bytes: the
+ * same for as long as the file is not modified, so that the server can tell
+ * another attempt at the upload from a new one
+ */
+static bool transfer_id(const unsigned char *filename, uint64_t size,
+                        time_t mtime, unsigned char *id) {
+    unsigned char data[FNAME_MAX_LEN + sizeof(size) + sizeof(mtime)];
+    memcpy(data, filename, FNAME_MAX_LEN);
+    memcpy(data + FNAME_MAX_LEN, &size, sizeof(size));
+    memcpy(data + FNAME_MAX_LEN + sizeof(size), &mtime, sizeof(mtime));
+
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    if (EVP_Digest(data, sizeof(data), digest, nullptr, EVP_sha256(),
+                   nullptr) != 1) {
+        return false;
+    }
+    memcpy(id, digest, TRANSFER_ID_LEN);
+    return true;
+}
 
-    // Generate iv for message
-    auto iv_res = gen_iv();
-    if (iv_res.is_error) {
-        fclose(input_file_fp);
-        handle_errors(iv_res.error);
+/*
+ * Upload of a file the server keeps as its chunks: the hashes of all of them
+ * go first, then only the chunks the server does not have yet. Returns false
+ * if the file could not be read.
+ */
+static Maybe<bool> send_chunks(Session &session, FILE *fp, uint64_t size) {
+    Maybe<bool> res;
+    size_t chunks = ((size_t)size + session.chunk_size - 1) /
+                    session.chunk_size;
+
+    vector<unsigned char> hashes(chunks * CHUNK_HASH_LEN);
+    vector<unsigned char> chunk(session.chunk_size);
+    for (size_t i = 0; i < chunks; i++) {
+        size_t len = min((size_t)session.chunk_size,
+                         (size_t)size - i * session.chunk_size);
+        unsigned char hash[EVP_MAX_MD_SIZE];
+        if (fread(chunk.data(), 1, len, fp) != len) {
+            return res;
+        }
+        if (EVP_Digest(chunk.data(), len, hash, nullptr, get_hash_type(),
+                       nullptr) != 1) {
+            handle_errors();
+        }
+        memcpy(hashes.data() + i * CHUNK_HASH_LEN, hash, CHUNK_HASH_LEN);
     }
-    auto iv = iv_res.result;
+    rewind(fp);
+    send_message(session, UploadHashes, hashes.data(), hashes.size());
 
-    // Send upload request
-    auto send_packet_header_res =
-        send_header(sock, UploadReq, seq_num, iv, get_iv_len());
-    if (send_packet_header_res.is_error) {
-        delete[] iv;
-        fclose(input_file_fp);
-        handle_errors(send_packet_header_res.error);
+    vector<unsigned char> bitmap;
+    if (!receive_message(session, UploadMissing, bitmap,
+                         (chunks + 7) / 8) ||
+        bitmap.size() != (chunks + 7) / 8) {
+        handle_errors("Malformed missing chunks");
     }
+    auto is_missing = [&](size_t i) { return bitmap[i / 8] >> (i % 8) & 1; };
 
-    // Initialize encryption context
-    EVP_CIPHER_CTX *ctx;
-    int len = 0;
-    int ct_len;
-    if ((ctx = EVP_CIPHER_CTX_new()) == nullptr) {
-        delete[] iv;
-        fclose(input_file_fp);
-        handle_errors("Could not encrypt message (alloc)");
+    size_t sent = 0;
+    for (size_t i = 0; i < chunks; i++)
+        sent += is_missing(i);
+    if (sent < chunks) {
+        cout << "The server has " << chunks - sent << " of the " << chunks
+             << " chunks of the file already" << endl;
     }
 
-    if (EVP_EncryptInit(ctx, get_symmetric_cipher(), key, iv) != 1) {
-        delete[] iv;
-        fclose(input_file_fp);
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+    // Runs of consecutive chunks, each one sent as a file of its own
+    for (size_t i = 0; i < chunks;) {
+        if (!is_missing(i)) {
+            i++;
+            continue;
+        }
+        size_t run_end = i;
+        while (run_end < chunks && is_missing(run_end))
+            run_end++;
+        off_t offset = (off_t)i * session.chunk_size;
+        off_t end = min((off_t)run_end * session.chunk_size, (off_t)size);
+
+        auto send_res = send_file(session, fp, offset, end - offset,
+                                  UploadChunk, UploadEnd);
+        if (send_res.is_error || !send_res.result) {
+            return send_res;
+        }
+        i = run_end;
     }
 
-    // Authenticated data
-    int err = 0;
-    unsigned char header = mtype_to_uc(UploadReq);
-    err |=
-        EVP_EncryptUpdate(ctx, nullptr, &len, &header, sizeof(unsigned char));
-    err |=
-        EVP_EncryptUpdate(ctx, nullptr, &len, seqnum_to_uc(), sizeof(seqnum));
-    if (err != 1) {
-        delete[] iv;
-        fclose(input_file_fp);
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
+    res.set_result(true);
+    return res;
+}
 
-    // Encryption of the filename
-    unsigned char *ct = new unsigned char[FNAME_MAX_LEN + get_block_size()];
-    if (EVP_EncryptUpdate(ctx, ct, &len, filename, FNAME_MAX_LEN) != 1) {
-        delete[] iv;
-        fclose(input_file_fp);
-        delete[] ct;
-        EVP_CIPHER_CTX_free(ctx);
+/* Whether the first [len] bytes of [fp] have the hash [hash] */
+static bool has_prefix(FILE *fp, uint64_t len, const unsigned char *hash) {
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    if (ctx == nullptr || EVP_DigestInit(ctx, get_hash_type()) != 1) {
+        EVP_MD_CTX_free(ctx);
         handle_errors();
     }
-    ct_len = len;
-
-    if (EVP_EncryptFinal(ctx, ct + ct_len, &len) != 1) {
-        delete[] iv;
-        fclose(input_file_fp);
-        delete[] ct;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+    vector<unsigned char> buf(DEFAULT_CHUNK_SIZE);
+    bool read = true;
+    for (uint64_t offset = 0; read && offset < len;) {
+        size_t n = min((uint64_t)buf.size(), len - offset);
+        read = pread(fileno(fp), buf.data(), n, offset) == (ssize_t)n;
+        if (read && EVP_DigestUpdate(ctx, buf.data(), n) != 1) {
+            EVP_MD_CTX_free(ctx);
+            handle_errors();
+        }
+        offset += n;
     }
-    ct_len += len;
-
-    unsigned char *tag = new unsigned char[TAG_LEN];
-    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, TAG_LEN, tag) != 1) {
-        delete[] iv;
-        fclose(input_file_fp);
-        delete[] ct;
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    if (read && EVP_DigestFinal(ctx, digest, nullptr) != 1) {
+        EVP_MD_CTX_free(ctx);
         handle_errors();
     }
-    delete[] iv;
-    EVP_CIPHER_CTX_reset(ctx);
-
-    // Send ciphertext
-    auto ct_send_res = send_field(sock, (flen)ct_len, ct);
-    if (ct_send_res.is_error) {
-        delete[] ct;
-        fclose(input_file_fp);
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors(ct_send_res.error);
-    }
-    delete[] ct;
-
-    auto tag_send_res = send_tag(sock, tag);
-    if (tag_send_res.is_error) {
-        delete[] tag;
-        fclose(input_file_fp);
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors(tag_send_res.error);
-    }
-    delete[] tag;
-
-    inc_seqnum();
+    EVP_MD_CTX_free(ctx);
+    return read && memcmp(digest, hash, FILE_HASH_LEN) == 0;
+}
 
-    //------------------Wait server response------------------
+/*
+ * Reads the answer [pt] of the server to the upload of [fp], of [size]
+ * bytes: where the server has the file up to, from an earlier attempt, and
+ * the hash of what it has, then a message for the user. Sets [offset] to
+ * where the upload goes on from. Returns false if what the server has is not
+ * the start of the file.
+ */
+static bool read_upload_answer(FILE *fp, const vector<unsigned char> &pt,
+                               uint64_t size, uint64_t &offset) {
+    if (pt.size() < sizeof(offset) + FILE_HASH_LEN + 1 ||
+        pt.back() != '\0') {
+        fclose(fp);
+        handle_errors("Malformed upload answer");
+    }
+    memcpy(&offset, pt.data(), sizeof(offset));
+    cout << endl << pt.data() + sizeof(offset) + FILE_HASH_LEN << endl;
+    if (offset > size) {
+        fclose(fp);
+        handle_errors("Malformed upload answer");
+    }
+    if (offset == 0) {
+        return true;
+    }
+    if (!has_prefix(fp, offset, pt.data() + sizeof(offset))) {
+        return false;
+    }
+    cout << "Resuming the upload from byte " << offset << endl;
+    return true;
+}
 
-    auto mtype_res = get_mtype(sock);
+/*
+ * Upload of a file the server keeps as it is, from [offset] on. Returns false
+ * if the file could not be read.
+ */
+static Maybe<bool> send_from_offset(Session &session, FILE *fp,
+                                    uint64_t offset) {
+    // Send the file a chunk at a time, reading and encrypting the next chunks
+    // while the previous ones are sent
+    return send_file(session, fp, offset, -1, UploadChunk, UploadEnd);
+}
 
-    if (mtype_res.is_error ||
-        (mtype_res.result != UploadAns && mtype_res.result != Error)) {
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors("Incorrect message type");
-    }
+bool request_upload(Session &session, const char *path, const char *name,
+                    PendingUpload &upload) {
+    unsigned char filename[FNAME_MAX_LEN] = {0};
+    strncpy(reinterpret_cast<char *>(filename), name, FNAME_MAX_LEN - 1);
 
-    // read iv and sequence number
-    auto server_header_res = read_header(sock);
-    if (server_header_res.is_error) {
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+    // Make sure that the file can be read before
+    FILE *input_file_fp;
+    if ((input_file_fp = fopen(path, "r")) == nullptr) {
+        cout << "Error - Could not open input file for reading" << endl;
+        return false;
     }
-    auto [seq, in_iv] = server_header_res.result;
-    iv = in_iv;
-
-    // Check correctness of the sequence number
-    if (seq != seq_num) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
+    struct stat st;
+    if (fstat(fileno(input_file_fp), &st) != 0) {
+        cout << "Error - Could not open input file for reading" << endl;
         fclose(input_file_fp);
-        handle_errors("Incorrect sequence number");
+        return false;
     }
-
-    // read ciphertext
-    auto ct_res = read_field(sock);
-    if (ct_res.is_error) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
+    if ((unsigned long)st.st_size > FSIZE_MAX) {
+        cout << "Error - File too big for upload (max 32Tb)" << endl;
         fclose(input_file_fp);
-        handle_errors();
+        return false;
     }
-    auto ct_tuple = ct_res.result;
-    ct_len = get<0>(ct_tuple);
-    ct = get<1>(ct_tuple);
-
-    // read tag
-    auto tag_res = read_tag(sock);
-    if (tag_res.is_error) {
-        delete[] ct;
+    // The server reserves room for the file before it is sent
+    uint64_t file_size = st.st_size;
+
+    unsigned char id[TRANSFER_ID_LEN] = {0};
+    if (!transfer_id(filename, file_size, st.st_mtime, id)) {
         fclose(input_file_fp);
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
         handle_errors();
     }
-    tag = tag_res.result;
 
-    if (EVP_DecryptInit(ctx, get_symmetric_cipher(), key, iv) != 1) {
-        delete[] iv;
+    // Send upload request: the name of the file, followed by its size and
+    // the ID of the upload
+    unsigned char request[FNAME_MAX_LEN + sizeof(file_size) + TRANSFER_ID_LEN];
+    memcpy(request, filename, FNAME_MAX_LEN);
+    memcpy(request + FNAME_MAX_LEN, &file_size, sizeof(file_size));
+    memcpy(request + FNAME_MAX_LEN + sizeof(file_size), id, TRANSFER_ID_LEN);
+    try {
+        send_message(session, UploadReq, request, sizeof(request));
+    } catch (char const *) {
         fclose(input_file_fp);
-        delete[] ct;
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+        throw;
     }
-    delete[] iv;
 
-    header = mtype_to_uc(mtype_res.result);
+    upload.fp = input_file_fp;
+    upload.file_size = file_size;
+    return true;
+}
 
-    /* Specify authenticated data */
-    err = 0;
-    err |= EVP_DecryptUpdate(ctx, nullptr, &len, &header, sizeof(mtype));
-    err |=
-        EVP_DecryptUpdate(ctx, nullptr, &len, seqnum_to_uc(), sizeof(seqnum));
+bool send_upload(Session &session, PendingUpload &upload) {
+    FILE *input_file_fp = upload.fp;
 
-    if (err != 1) {
-        delete[] ct;
-        fclose(input_file_fp);
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
+    //------------------Wait server response------------------
+
+    // Either where the server has the file up to, or a request for the
+    // hashes of its chunks
+    auto mtype_res = session.in.get_mtype(session.sock);
 
-    // Allocate plaintext of the length == ciphertext length
-    auto *pt = new unsigned char[ct_len];
-    if (EVP_DecryptUpdate(ctx, pt, &len, ct, ct_len) != 1) {
-        delete[] ct;
+    if (mtype_res.is_error ||
+        (mtype_res.result != UploadAns && mtype_res.result != UploadHashReq &&
+         mtype_res.result != Error)) {
         fclose(input_file_fp);
-        delete[] tag;
-        delete[] pt;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+        handle_errors("Incorrect message type");
     }
 
-    // GCM tag check
-    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, TAG_LEN, tag);
-
-    if (EVP_DecryptFinal(ctx, pt + len, &len) != 1) {
-        delete[] ct;
+    vector<unsigned char> pt;
+    try {
+        open_message(session, mtype_res.result, pt, FNAME_MAX_LEN);
+    } catch (char const *) {
         fclose(input_file_fp);
-        delete[] tag;
-        delete[] pt;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+        throw;
     }
 
-    delete[] ct;
-    delete[] tag;
-
-    EVP_CIPHER_CTX_reset(ctx);
-
-    inc_seqnum();
-
-    cout << endl << pt << endl;
-    delete[] pt;
-
     if (mtype_res.result == Error) {
-        EVP_CIPHER_CTX_free(ctx);
-        return;
-    }
-
-    // Send the file a chunk at a time
-    unsigned char buffer[CHUNK_SIZE] = {0};
-    ct = new unsigned char[sizeof(buffer) + get_block_size()];
-    tag = new unsigned char[TAG_LEN];
-    mtypes msg_type = UploadChunk;
-
-    for (;;) {
-        size_t read_len;
-        if ((read_len = fread(buffer, sizeof(*buffer), sizeof(buffer),
-                              input_file_fp)) != sizeof(buffer)) {
-            // When we read less than expected we could either have an error, or
-            // we could have reached eof
-            if (feof(input_file_fp) != 0) {
-                // Change message type, as this is the last chunk of data
-                msg_type = UploadEnd;
-            } else if (ferror(input_file_fp) != 0) {
-                cout << endl << ferror(input_file_fp) << endl;
-                delete[] ct;
-                delete[] tag;
-                fclose(input_file_fp);
-                EVP_CIPHER_CTX_free(ctx);
-                send_error_response(sock, key, "Error - Could not read file");
-                return;
-            } else {
-                delete[] ct;
-                delete[] tag;
-                fclose(input_file_fp);
-                EVP_CIPHER_CTX_free(ctx);
-                send_error_response(sock, key, "Error - Cosmic rays uh?");
-                return;
-            }
-        }
-        // Generate iv for message
-        iv_res = gen_iv();
-        if (iv_res.is_error) {
-            delete[] ct;
-            delete[] tag;
-            fclose(input_file_fp);
-            EVP_CIPHER_CTX_free(ctx);
-            handle_errors(iv_res.error);
-        }
-        iv = iv_res.result;
-
-        // Send chunk header
-        send_packet_header_res =
-            send_header(sock, msg_type, seq_num, iv, get_iv_len());
-        if (send_packet_header_res.is_error) {
-            delete[] iv;
-            delete[] ct;
-            delete[] tag;
-            fclose(input_file_fp);
-            EVP_CIPHER_CTX_free(ctx);
-            handle_errors(send_packet_header_res.error);
-        }
-
-        if (EVP_EncryptInit(ctx, get_symmetric_cipher(), key, iv) != 1) {
-            delete[] iv;
-            delete[] ct;
-            delete[] tag;
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(input_file_fp);
-            handle_errors();
-        }
-        delete[] iv;
-
-        // Authenticated data
-        err = 0;
-        header = mtype_to_uc(msg_type);
-        err |= EVP_EncryptUpdate(ctx, nullptr, &len, &header,
-                                 sizeof(unsigned char));
-        err |= EVP_EncryptUpdate(ctx, nullptr, &len, seqnum_to_uc(),
-                                 sizeof(seqnum));
-        if (err != 1) {
-            delete[] ct;
-            delete[] tag;
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(input_file_fp);
-            handle_errors();
-        }
-
-        // Encrypt the chunk
-        if (EVP_EncryptUpdate(ctx, ct, &len, buffer, read_len) != 1) {
-            delete[] ct;
-            delete[] tag;
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(input_file_fp);
-            handle_errors();
-        }
-        ct_len = len;
-
-        // Finalize encryption
-        if (EVP_EncryptFinal(ctx, ct + ct_len, &len) != 1) {
-            delete[] ct;
-            delete[] tag;
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(input_file_fp);
-            handle_errors();
-        }
-        ct_len += len;
-
-        if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, TAG_LEN, tag) !=
-            1) {
-            delete[] ct;
-            delete[] tag;
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(input_file_fp);
-            handle_errors();
-        }
-
-        // Send ciphertext
-        ct_send_res = send_field(sock, (flen)ct_len, ct);
-        if (ct_send_res.is_error) {
-            delete[] ct;
-            delete[] tag;
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(input_file_fp);
-            handle_errors(ct_send_res.error);
-        }
-
-        tag_send_res = send_tag(sock, tag);
-        if (tag_send_res.is_error) {
-            delete[] tag;
-            delete[] ct;
-            EVP_CIPHER_CTX_free(ctx);
+        cout << endl << message_string(pt) << endl;
+        fclose(input_file_fp);
+        return false;
+    }
+
+    Maybe<bool> send_res;
+    if (mtype_res.result == UploadHashReq) {
+        cout << endl << message_string(pt) << endl;
+        send_res = send_chunks(session, input_file_fp, upload.file_size);
+    } else {
+        uint64_t offset;
+        if (!read_upload_answer(input_file_fp, pt, upload.file_size,
+                                offset)) {
+            // The server drops what it has on the error: the next attempt
+            // starts over
+            cout << "The part of the file on the server is not the one here: "
+                    "upload it again to start over"
+                 << endl;
             fclose(input_file_fp);
-            handle_errors(tag_send_res.error);
-        }
-
-        // At the end, reset the context and increase the sequence number
-        EVP_CIPHER_CTX_reset(ctx);
-        inc_seqnum();
-
-        // We have reached EOF, thus the upload has ended
-        // Note that we already sent the full file to the client, correctly
-        // ending with a UploadEnd message
-        if (feof(input_file_fp) != 0) {
-            break;
+            send_error_response(session, "Error - The file does not match");
+            return false;
         }
+        send_res = send_from_offset(session, input_file_fp, offset);
     }
-
-    delete[] tag;
-    delete[] ct;
     fclose(input_file_fp);
-
-    //-------------Wait server response--------------
-
-    mtype_res = get_mtype(sock);
-
-    if (mtype_res.is_error || mtype_res.result != UploadRes) {
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors("Incorrect message type");
-    }
-
-    // read iv and sequence number
-    server_header_res = read_header(sock);
-    if (server_header_res.is_error) {
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-    seq = get<0>(server_header_res.result);
-    in_iv = get<1>(server_header_res.result);
-    iv = in_iv;
-
-    // Check correctness of the sequence number
-    if (seq != seq_num) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors("Incorrect sequence number");
-    }
-
-    // read ciphertext
-    ct_res = read_field(sock);
-    if (ct_res.is_error) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-    ct_tuple = ct_res.result;
-    ct_len = get<0>(ct_tuple);
-    ct = get<1>(ct_tuple);
-
-    // read tag
-    tag_res = read_tag(sock);
-    if (tag_res.is_error) {
-        delete[] ct;
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+    if (send_res.is_error) {
+        handle_errors(send_res.error);
     }
-    tag = tag_res.result;
 
-    if (EVP_DecryptInit(ctx, get_symmetric_cipher(), key, iv) != 1) {
-        delete[] iv;
-        delete[] ct;
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+    // Whatever was sent so far ends with the error
+    if (!send_res.result) {
+        send_error_response(session, "Error - Could not read file");
+        return false;
     }
-    delete[] iv;
-
-    header = mtype_to_uc(mtype_res.result);
-
-    /* Specify authenticated data */
-    err = 0;
-    err |= EVP_DecryptUpdate(ctx, nullptr, &len, &header, sizeof(mtype));
-    err |=
-        EVP_DecryptUpdate(ctx, nullptr, &len, seqnum_to_uc(), sizeof(seqnum));
+    return true;
+}
 
-    if (err != 1) {
-        delete[] ct;
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
+bool finish_upload(Session &session) {
+    //-------------Wait server response--------------
 
-    // Allocate plaintext of the length == ciphertext length
-    pt = new unsigned char[ct_len];
-    if (EVP_DecryptUpdate(ctx, pt, &len, ct, ct_len) != 1) {
-        delete[] ct;
-        delete[] tag;
-        delete[] pt;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+    // An Error if the server could not save the file in the end
+    vector<unsigned char> pt;
+    bool saved = receive_message(session, UploadRes, pt, FNAME_MAX_LEN);
+    if (saved) {
+        cout << endl << message_string(pt) << endl;
     }
+    return saved;
+}
 
-    // GCM tag check
-    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, TAG_LEN, tag);
+bool upload_file(Session &session, const char *path) {
+    PendingUpload upload;
+    return request_upload(session, path, path, upload) &&
+           send_upload(session, upload) && finish_upload(session);
+}
 
-    if (EVP_DecryptFinal(ctx, pt + len, &len) != 1) {
-        delete[] ct;
-        delete[] tag;
-        delete[] pt;
-        EVP_CIPHER_CTX_free(ctx);
+void upload(Session &session) {
+    cout << "What do you want to upload? ";
+    char filename[FNAME_MAX_LEN] = {0};
+    if (fgets(filename, FNAME_MAX_LEN, stdin) == nullptr) {
         handle_errors();
     }
+    filename[strcspn(filename, "\n")] = '\0';
 
-    delete[] ct;
-    delete[] tag;
-
-    // free context
-    EVP_CIPHER_CTX_free(ctx);
-
-    inc_seqnum();
-
-    cout << endl << pt << endl;
-    delete[] pt;
+    upload_file(session, filename);
 }
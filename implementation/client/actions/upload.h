@@ -1,6 +1,37 @@
+#include "../../common/session.h"
+#include <stdint.h>
+#include <stdio.h>
 #ifndef upload_h
 #define upload_h
 
-void upload(int sock, unsigned char *key);
+/*
+ * Uploads the file at [path], under its name. Returns whether the server
+ * saved it; errors are thrown through handle_errors.
+ */
+bool upload_file(Session &session, const char *path);
 
-#endif
\ No newline at end of file
+/* An upload whose request was sent, and whose answer was not read yet */
+struct PendingUpload {
+    FILE *fp;
+    uint64_t file_size;
+};
+
+/*
+ * The three parts of an upload, so that other requests can be sent in
+ * between:
+ *  - request_upload asks to upload the file at [path] as [name] (returning
+ *    false, with nothing sent, if it cannot be read);
+ *  - send_upload reads the answer and sends the file, once every request
+ *    sent before was answered, and with none sent after;
+ *  - finish_upload reads whether the server saved the file, once every
+ *    request sent before was answered.
+ * Each returns false if the upload ended there.
+ */
+bool request_upload(Session &session, const char *path, const char *name,
+                    PendingUpload &upload);
+bool send_upload(Session &session, PendingUpload &upload);
+bool finish_upload(Session &session);
+
+void upload(Session &session);
+
+#endif
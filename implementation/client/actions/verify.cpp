@@ -0,0 +1,156 @@
+#include "../../common/errors.h"
+#include "../../common/filesource.h"
+#include "../../common/merkle.h"
+#include "../../common/session.h"
+#include "../../common/types.h"
+#include "../../common/utils.h"
+#include "verify.h"
+#include <iostream>
+#include <memory>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+using namespace std;
+
+#define VERIFY_REQ_LEN (FNAME_MAX_LEN + 2 * sizeof(uint32_t))
+#define VERIFY_ANS_LEN (sizeof(uint64_t) + sizeof(uint32_t) + MERKLE_HASH_LEN)
+
+/* What the server says of the tree of a file */
+struct RemoteTree {
+    uint64_t size;
+    uint32_t levels;
+    unsigned char root[MERKLE_HASH_LEN];
+    // The nodes asked for, one after the other
+    vector<unsigned char> nodes;
+};
+
+/*
+ * Asks the server for the [nodes] at [level] of the tree of [filename].
+ * Returns false if it sent an Error instead, written on the standard output.
+ */
+static bool ask_nodes(Session &session, const unsigned char *filename,
+                      uint32_t level, const vector<uint32_t> &nodes,
+                      RemoteTree &remote) {
+    uint32_t count = nodes.size();
+    vector<unsigned char> request(VERIFY_REQ_LEN + count * sizeof(uint32_t));
+    memcpy(request.data(), filename, FNAME_MAX_LEN);
+    memcpy(request.data() + FNAME_MAX_LEN, &level, sizeof(level));
+    memcpy(request.data() + FNAME_MAX_LEN + sizeof(level), &count,
+           sizeof(count));
+    if (count > 0) {
+        memcpy(request.data() + VERIFY_REQ_LEN, nodes.data(),
+               count * sizeof(uint32_t));
+    }
+    send_message(session, VerifyReq, request.data(), request.size());
+
+    vector<unsigned char> res;
+    if (!receive_message(session, VerifyAns, res,
+                         VERIFY_ANS_LEN + count * MERKLE_HASH_LEN)) {
+        return false;
+    }
+    if (res.size() != VERIFY_ANS_LEN + count * MERKLE_HASH_LEN) {
+        handle_errors("Malformed verify answer");
+    }
+    memcpy(&remote.size, res.data(), sizeof(remote.size));
+    memcpy(&remote.levels, res.data() + sizeof(remote.size),
+           sizeof(remote.levels));
+    memcpy(remote.root, res.data() + sizeof(remote.size) + sizeof(uint32_t),
+           MERKLE_HASH_LEN);
+    remote.nodes.assign(res.begin() + VERIFY_ANS_LEN, res.end());
+    return true;
+}
+
+/* Builds the tree of the local file at [path] */
+static bool local_tree(const char *path, MerkleTree &tree) {
+    FILE *fp = fopen(path, "r");
+    if (fp == nullptr)
+        return false;
+    unique_ptr<FileSource> source(open_source(fp, SourceStdio));
+    bool ok = merkle_source(*source, tree);
+    source.reset();
+    fclose(fp);
+    return ok;
+}
+
+void verify(Session &session) {
+    cout << "Which file do you want to verify? ";
+    unsigned char filename[FNAME_MAX_LEN] = {0};
+    if (fgets(reinterpret_cast<char *>(filename), FNAME_MAX_LEN, stdin) ==
+        nullptr) {
+        handle_errors();
+    }
+    filename[strcspn(reinterpret_cast<char *>(filename), "\n")] = '\0';
+
+    cout << "Against which local copy? ";
+    string path;
+    if (!getline(cin, path)) {
+        handle_errors();
+    }
+
+    MerkleTree local;
+    if (!local_tree(path.c_str(), local)) {
+        cout << "Error - Could not read the local copy" << endl;
+        return;
+    }
+
+    // The root first, with nothing else
+    RemoteTree remote;
+    if (!ask_nodes(session, filename, 0, {}, remote)) {
+        return;
+    }
+    if (remote.size != local.size) {
+        cout << "The file differs: " << remote.size
+             << " bytes on the server, " << local.size << " here" << endl;
+        return;
+    }
+    if (remote.levels != local.levels.size()) {
+        handle_errors("Malformed verify answer");
+    }
+    if (memcmp(remote.root, local.root(), MERKLE_HASH_LEN) == 0) {
+        cout << "The file matches the local copy" << endl;
+        return;
+    }
+
+    // Down the tree, below the nodes that differ only: once they are too
+    // many to be asked for at once, the ranges are those of the last level
+    vector<uint32_t> differ = {0};
+    uint32_t level = remote.levels - 1;
+    while (level > 0) {
+        vector<uint32_t> children;
+        for (uint32_t node : differ) {
+            for (uint32_t child = 2 * node;
+                 child <= 2 * node + 1 && child < merkle_nodes(local.size,
+                                                               level - 1);
+                 child++)
+                children.push_back(child);
+        }
+        if (children.size() > VERIFY_MAX_NODES) {
+            break;
+        }
+        if (!ask_nodes(session, filename, level - 1, children, remote)) {
+            return;
+        }
+        level--;
+        differ.clear();
+        for (size_t i = 0; i < children.size(); i++) {
+            if (memcmp(remote.nodes.data() + i * MERKLE_HASH_LEN,
+                       local.node(level, children[i]), MERKLE_HASH_LEN) != 0)
+                differ.push_back(children[i]);
+        }
+    }
+
+    // A node covers 2^level leaves, the ranges of neighbours are merged
+    uint64_t span = (uint64_t)MERKLE_LEAF_LEN << level;
+    cout << "The file differs from the local copy in bytes:" << endl;
+    for (size_t i = 0; i < differ.size();) {
+        size_t j = i + 1;
+        while (j < differ.size() && differ[j] == differ[j - 1] + 1)
+            j++;
+        uint64_t start = differ[i] * span;
+        uint64_t end = min((uint64_t)(differ[j - 1] + 1) * span, local.size);
+        cout << "    " << start << " - " << end << endl;
+        i = j;
+    }
+}
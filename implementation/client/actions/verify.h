@@ -0,0 +1,13 @@
+#include "../../common/session.h"
+#ifndef verify_h
+#define verify_h
+
+/*
+ * Compares one of the files with a local copy of it through its Merkle tree
+ * (see merkle.h), without downloading it: the server sends the root, then
+ * only the nodes below those that differ, a level at a time, down to the
+ * leaves. Shows the ranges of bytes that differ, if any.
+ */
+void verify(Session &session);
+
+#endif
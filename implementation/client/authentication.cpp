@@ -1,17 +1,25 @@
 #include "authentication.h"
 #include "../common/dhparams.h"
 #include "../common/errors.h"
+#include "../common/frame.h"
+#include "../common/keypool.h"
 #include "../common/types.h"
 #include "../common/utils.h"
+#include <fcntl.h>
 #include <iostream>
 #include <new>
 #include <openssl/aes.h>
 #include <openssl/bio.h>
+#include <openssl/crypto.h>
 #include <openssl/evp.h>
 #include <openssl/pem.h>
+#include <stdint.h>
 #include <string.h>
 #include <string>
+#include <time.h>
 #include <tuple>
+#include <unistd.h>
+#include <vector>
 
 using namespace std;
 
@@ -85,38 +93,29 @@ Maybe<EVP_PKEY *> verify_certificate_and_get_key(X509 *cert) {
     return res;
 }
 
-unsigned char *authenticate(int socket, int key_len) {
-    cout << "Username: ";
-    string username;
-    getline(cin, username);
-
-    // Check that the length of the name doesn't exceed the maximum length of a
-    // packet field
-    if (username.length() + 1 > FLEN_MAX) {
-        handle_errors("Username is too long");
-    }
-
+/*
+ * Runs the full authentication protocol with the server as [username],
+ * proposing chunks of [chunk_size] bytes, compressed with [compression] and
+ * sealed with [suite]. Returns the agreed key.
+ */
+static unsigned char *authenticate(int socket, const string &username,
+                                   int key_len, kex_group kex,
+                                   uint32_t chunk_size, uint32_t compression,
+                                   uint32_t suite) {
     // ---------------------------------------------------------------------- //
     // ----------------- Client's opening message to Server ----------------- //
     // ---------------------------------------------------------------------- //
 
-    // Authentication start
-    auto send_auth_start_header_res = send_header(socket, AuthStart);
-    if (send_auth_start_header_res.is_error) {
-        handle_errors("Incorrect header during authentication (AuthStart)");
-    }
+    // Authentication start, written along with the half key
+    FrameWriter out;
+    out.header(AuthStart);
 
     // Send the username
-    auto send_username_res =
-        send_field(socket, username.length() + 1,
-                   reinterpret_cast<unsigned char *>(
-                       const_cast<char *>(username.c_str())));
-    if (send_username_res.is_error) {
-        handle_errors(send_username_res.error);
-    }
+    out.field(username.length() + 1, reinterpret_cast<unsigned char *>(
+                                         const_cast<char *>(username.c_str())));
 
-    // Send the client's half key
-    auto keypair = gen_keypair();
+    // Send the client's half key, which also tells the server the group to use
+    auto keypair = get_keypair(kex);
 
 #ifdef DEBUG
     cout << "Client half key:" << endl;
@@ -163,7 +162,8 @@ unsigned char *authenticate(int socket, int key_len) {
 
     // Finally send the half key
     auto send_client_half_key_result =
-        send_field(socket, (flen)client_half_key_len, client_half_key_ptr);
+        out.field((flen)client_half_key_len, client_half_key_ptr)
+            .flush(socket);
 
     if (send_client_half_key_result.is_error) {
         EVP_PKEY_free(keypair);
@@ -249,6 +249,18 @@ unsigned char *authenticate(int socket, int key_len) {
     cout << endl;
 #endif
 
+    // The server must have answered in the group we asked for
+    auto kex_res = get_kex_group(server_half_key);
+    if (kex_res.is_error || kex_res.result != kex) {
+        EVP_PKEY_free(keypair);
+        BIO_free(tmp_bio);
+        delete[] client_half_key_pem;
+        delete[] server_name;
+        delete[] server_half_key_pem;
+        EVP_PKEY_free(server_half_key);
+        handle_errors("Server answered in a different key exchange group");
+    }
+
     // Receive server's certificate and verify it
     auto server_certificate_res = read_field(socket);
     if (server_certificate_res.is_error) {
@@ -434,15 +446,7 @@ unsigned char *authenticate(int socket, int key_len) {
     // ---------------------------------------------------------------------- //
 
     // Send packet header
-    auto send_last_header_res = send_header(socket, AuthClientAns);
-    if (send_last_header_res.is_error) {
-        EVP_PKEY_free(keypair);
-        BIO_free(tmp_bio);
-        delete[] client_half_key_pem;
-        delete[] server_name;
-        delete[] server_half_key_pem;
-        handle_errors("Could not send header");
-    }
+    out.header(AuthClientAns);
 
     // Compute the signature
 
@@ -528,9 +532,16 @@ unsigned char *authenticate(int socket, int key_len) {
             "Client signature is bigger than the max packet field length");
     }
 
-    // Send the signature to the server
+    // Send the signature to the server, followed by the proposed chunk size,
+    // compression and cipher suite
     auto send_client_signature_res =
-        send_field(socket, (flen)client_signature_len, client_signature);
+        out.field((flen)client_signature_len, client_signature)
+            .field(sizeof(chunk_size),
+                   reinterpret_cast<unsigned char *>(&chunk_size))
+            .field(sizeof(compression),
+                   reinterpret_cast<unsigned char *>(&compression))
+            .field(sizeof(suite), reinterpret_cast<unsigned char *>(&suite))
+            .flush(socket);
     if (send_client_signature_res.is_error) {
         EVP_PKEY_free(keypair);
         BIO_free(tmp_bio);
@@ -544,3 +555,284 @@ unsigned char *authenticate(int socket, int key_len) {
 
     return key;
 }
+
+/* Path of the file holding the ticket of the user */
+static string ticket_path(const string &username) {
+    return "certificates/" + username + ".ticket";
+}
+
+/*
+ * Tries to resume a previous session of the user, if a ticket of it was kept,
+ * proposing chunks of [chunk_size] bytes, compressed with [compression] and
+ * sealed with [suite]. Returns the agreed key, or nullptr if there is no
+ * valid ticket (or the server refused it) and the full protocol has to run.
+ */
+static unsigned char *resume(int socket, const string &username, int key_len,
+                             uint32_t chunk_size, uint32_t compression,
+                             uint32_t suite) {
+    // Ticket file: expiration time || ticket length || ticket || secret.
+    // Corrupted or partial files are simply ignored.
+    FILE *fp;
+    if ((fp = fopen(ticket_path(username).c_str(), "r")) == nullptr) {
+        return nullptr;
+    }
+
+    int64_t expires_at;
+    flen ticket_len;
+    if (fread(&expires_at, sizeof(expires_at), 1, fp) != 1 ||
+        fread(&ticket_len, sizeof(ticket_len), 1, fp) != 1 ||
+        expires_at < time(nullptr)) {
+        fclose(fp);
+        return nullptr;
+    }
+
+    unsigned char *ticket = new unsigned char[ticket_len];
+    unsigned char *resumption_secret = new unsigned char[key_len];
+    bool read_ok = fread(ticket, 1, ticket_len, fp) == ticket_len &&
+                   fread(resumption_secret, 1, key_len, fp) == (size_t)key_len;
+    fclose(fp);
+    if (!read_ok) {
+        delete[] ticket;
+        explicit_bzero(resumption_secret, key_len);
+        delete[] resumption_secret;
+        return nullptr;
+    }
+
+    auto client_nonce_res = gen_nonce();
+    if (client_nonce_res.is_error) {
+        delete[] ticket;
+        explicit_bzero(resumption_secret, key_len);
+        delete[] resumption_secret;
+        handle_errors(client_nonce_res.error);
+    }
+    auto client_nonce = client_nonce_res.result;
+
+    FrameWriter out;
+    auto send_res = out.header(AuthResume)
+                        .field(username.length() + 1,
+                               reinterpret_cast<unsigned char *>(
+                                   const_cast<char *>(username.c_str())))
+                        .field(ticket_len, ticket)
+                        .field(NONCE_LEN, client_nonce)
+                        .field(sizeof(chunk_size),
+                               reinterpret_cast<unsigned char *>(&chunk_size))
+                        .field(sizeof(compression),
+                               reinterpret_cast<unsigned char *>(&compression))
+                        .field(sizeof(suite),
+                               reinterpret_cast<unsigned char *>(&suite))
+                        .flush(socket);
+    delete[] ticket;
+    if (send_res.is_error) {
+        explicit_bzero(resumption_secret, key_len);
+        delete[] resumption_secret;
+        delete[] client_nonce;
+        handle_errors("Could not send the ticket");
+    }
+
+    auto header_res = get_mtype(socket);
+    if (header_res.is_error || header_res.result != AuthResumeAns) {
+        explicit_bzero(resumption_secret, key_len);
+        delete[] resumption_secret;
+        delete[] client_nonce;
+        handle_errors("Incorrect message type");
+    }
+
+    auto server_nonce_res = read_field(socket);
+    if (server_nonce_res.is_error) {
+        explicit_bzero(resumption_secret, key_len);
+        delete[] resumption_secret;
+        delete[] client_nonce;
+        handle_errors(server_nonce_res.error);
+    }
+    auto [server_nonce_len, server_nonce] = server_nonce_res.result;
+
+    // An empty nonce means that the ticket was refused
+    if (server_nonce_len != NONCE_LEN) {
+        explicit_bzero(resumption_secret, key_len);
+        delete[] resumption_secret;
+        delete[] client_nonce;
+        delete[] server_nonce;
+        return nullptr;
+    }
+
+    auto key_res = derive_resumed_key(resumption_secret, key_len, client_nonce,
+                                      server_nonce);
+    explicit_bzero(resumption_secret, key_len);
+    delete[] resumption_secret;
+    delete[] client_nonce;
+    delete[] server_nonce;
+    if (key_res.is_error) {
+        handle_errors(key_res.error);
+    }
+
+    return key_res.result;
+}
+
+/*
+ * Receives the ticket issued at the end of the login and, if [keep], stores it.
+ * [chunk_size], [compression] and [suite] hold the proposed chunk size,
+ * compression and cipher suite, and are set to the agreed ones. The tag of
+ * the answer is checked against them first (login_tag): a login whose
+ * proposals or answer were changed on the way fails.
+ */
+static void receive_ticket(int socket, const string &username,
+                           unsigned char *key, int key_len, bool keep,
+                           unsigned int &chunk_size,
+                           compression_algo &compression,
+                           cipher_suite &suite) {
+    auto header_res = get_mtype(socket);
+    if (header_res.is_error || header_res.result != AuthTicket) {
+        handle_errors("Incorrect message type");
+    }
+
+    auto ticket_res = read_field(socket);
+    if (ticket_res.is_error) {
+        handle_errors(ticket_res.error);
+    }
+    auto [ticket_len, ticket] = ticket_res.result;
+
+    auto lifetime_res = read_uint_field(socket);
+    auto chunk_size_res = lifetime_res.is_error ? lifetime_res
+                                                : read_uint_field(socket);
+    auto compression_res = chunk_size_res.is_error ? chunk_size_res
+                                                   : read_uint_field(socket);
+    auto suite_res = compression_res.is_error ? compression_res
+                                              : read_uint_field(socket);
+    if (suite_res.is_error) {
+        delete[] ticket;
+        handle_errors(suite_res.error);
+    }
+    auto tag_res = read_field(socket);
+    if (tag_res.is_error) {
+        delete[] ticket;
+        handle_errors(tag_res.error);
+    }
+    auto [tag_len, tag] = tag_res.result;
+
+    // The tag covers what we proposed, then the answer as it was received
+    uint32_t answer[] = {chunk_size,
+                         (uint32_t)compression,
+                         (uint32_t)suite,
+                         lifetime_res.result,
+                         chunk_size_res.result,
+                         compression_res.result,
+                         suite_res.result};
+    vector<unsigned char> tagged(sizeof(answer) + ticket_len);
+    memcpy(tagged.data(), answer, sizeof(answer));
+    memcpy(tagged.data() + sizeof(answer), ticket, ticket_len);
+    unsigned char expected[LOGIN_TAG_LEN];
+    auto expected_res =
+        login_tag(key, key_len, tagged.data(), tagged.size(), expected);
+    bool tagged_ok = !expected_res.is_error && tag_len == LOGIN_TAG_LEN &&
+                     CRYPTO_memcmp(tag, expected, LOGIN_TAG_LEN) == 0;
+    delete[] tag;
+    if (!tagged_ok) {
+        delete[] ticket;
+        handle_errors("Invalid tag of the login");
+    }
+    int64_t expires_at = time(nullptr) + lifetime_res.result;
+
+    // The server may only shrink the chunks we proposed
+    if (chunk_size_res.result < MIN_CHUNK_SIZE ||
+        chunk_size_res.result > chunk_size) {
+        delete[] ticket;
+        handle_errors("Invalid chunk size");
+    }
+    chunk_size = chunk_size_res.result;
+
+    // The server may only turn the compression we proposed down
+    if (compression_res.result != (uint32_t)compression &&
+        compression_res.result != CompressNone) {
+        delete[] ticket;
+        handle_errors("Invalid compression");
+    }
+    compression = (compression_algo)compression_res.result;
+
+    // The server may only fall back to AES-256-GCM from the suite we
+    // proposed
+    if (suite_res.result != (uint32_t)suite &&
+        suite_res.result != SuiteAesGcm) {
+        delete[] ticket;
+        handle_errors("Invalid cipher suite");
+    }
+    suite = (cipher_suite)suite_res.result;
+
+    if (!keep) {
+        delete[] ticket;
+        return;
+    }
+
+    auto secret_res = derive_resumption_secret(key, key_len);
+    if (secret_res.is_error) {
+        delete[] ticket;
+        handle_errors(secret_res.error);
+    }
+    auto resumption_secret = secret_res.result;
+
+    // The file holds a secret: only the user may read it. Failing to store
+    // the ticket only means that the next login will run the full protocol.
+    int fd = open(ticket_path(username).c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                  0600);
+    FILE *fp = fd >= 0 ? fdopen(fd, "w") : nullptr;
+    if (fp != nullptr) {
+        fwrite(&expires_at, sizeof(expires_at), 1, fp);
+        fwrite(&ticket_len, sizeof(ticket_len), 1, fp);
+        fwrite(ticket, 1, ticket_len, fp);
+        fwrite(resumption_secret, 1, key_len, fp);
+        fclose(fp);
+    } else if (fd >= 0) {
+        close(fd);
+    }
+
+    delete[] ticket;
+    explicit_bzero(resumption_secret, key_len);
+    delete[] resumption_secret;
+}
+
+unsigned char *login(int socket, int key_len, kex_group kex,
+                     unsigned int &chunk_size, compression_algo &compression,
+                     cipher_suite &suite, string &username) {
+    cout << "Username: ";
+    getline(cin, username);
+    return login_as(socket, username, key_len, kex, chunk_size, compression,
+                    suite, true);
+}
+
+unsigned char *login_as(int socket, const string &username, int key_len,
+                        kex_group kex, unsigned int &chunk_size,
+                        compression_algo &compression, cipher_suite &suite,
+                        bool keep_ticket) {
+    // Check that the length of the name doesn't exceed the maximum length of a
+    // packet field
+    if (username.length() + 1 > FLEN_MAX) {
+        handle_errors("Username is too long");
+    }
+
+    // The username names the ticket file
+    bool can_resume = !username.empty() && username.find('/') == string::npos;
+
+    unsigned char *key = nullptr;
+    if (can_resume) {
+        key = resume(socket, username, key_len, chunk_size, compression,
+                     suite);
+#ifdef DEBUG
+        cout << (key != nullptr ? "Session resumed" : "Full authentication")
+             << endl;
+#endif
+    }
+    if (key == nullptr) {
+        key = authenticate(socket, username, key_len, kex, chunk_size,
+                           compression, suite);
+    }
+
+    try {
+        receive_ticket(socket, username, key, key_len,
+                       can_resume && keep_ticket, chunk_size, compression,
+                       suite);
+    } catch (char const *) {
+        explicit_bzero(key, key_len);
+        delete[] key;
+        throw;
+    }
+    return key;
+}
@@ -1,14 +1,41 @@
+#include "../common/cipher.h"
+#include "../common/compress.h"
+#include "../common/dhparams.h"
 #include <openssl/bio.h>
 #include <openssl/evp.h>
+#include <string>
 
 #ifndef authentication_h
 #define authentication_h
 /*
- * Runs the authentication protocol with the entity on the other side of the
- * passed socket.
+ * Asks for the username, which is set into [username], and runs the
+ * authentication protocol with the entity on the other side of the passed
+ * socket.
+ *
+ * A session of the same user is resumed from the ticket kept by an earlier
+ * login, if any. Otherwise, the full protocol runs, with the ephemeral key
+ * exchange in the [kex] group. Either way, the ticket issued by the server is
+ * kept for the next login.
+ *
+ * [chunk_size], [compression] and [suite] hold the chunk size, the
+ * compression and the cipher suite proposed to the server, and are set to the
+ * ones agreed with it.
  *
  * Returns the key shared with the other party of len [key_len], if the run was
  * successful. If the run failed, it aborts the program execution.
  */
-unsigned char *authenticate(int socket, int key_len);
+unsigned char *login(int socket, int key_len, kex_group kex,
+                     unsigned int &chunk_size, compression_algo &compression,
+                     cipher_suite &suite, std::string &username);
+
+/*
+ * Same as the above, as [username] without asking for it, e.g. for another
+ * connection of a user already logged in. The ticket issued by the server is
+ * only kept if [keep_ticket]: connections logging in at once must not all
+ * write it.
+ */
+unsigned char *login_as(int socket, const std::string &username, int key_len,
+                        kex_group kex, unsigned int &chunk_size,
+                        compression_algo &compression, cipher_suite &suite,
+                        bool keep_ticket);
 #endif
@@ -0,0 +1,325 @@
+#include "../common/errors.h"
+#include "../common/session.h"
+#include "../common/types.h"
+#include "../common/utils.h"
+#include "actions/download.h"
+#include "actions/list.h"
+#include "actions/rekey.h"
+#include "actions/upload.h"
+#include "batch.h"
+#include "transfer.h"
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <sstream>
+#include <stdint.h>
+#include <string.h>
+
+using namespace std;
+
+class UploadOperation : public Operation {
+  public:
+    explicit UploadOperation(const string &path) : path(path) {}
+
+    bool send(Session &session) override {
+        return request_upload(session, path.c_str(), path.c_str(), upload);
+    }
+    // The file goes once the server said what it needs of it
+    bool exchanges() const override { return true; }
+    bool exchange(Session &session) override {
+        return send_upload(session, upload);
+    }
+    bool finish(Session &session) override { return finish_upload(session); }
+    string describe() const override { return "upload of '" + path + "'"; }
+
+  private:
+    string path;
+    PendingUpload upload;
+};
+
+class DownloadOperation : public Operation {
+  public:
+    explicit DownloadOperation(const string &name) : name(name) {}
+
+    bool send(Session &session) override {
+        return request_download(session, name.c_str(), name.c_str(),
+                                download);
+    }
+    bool finish(Session &session) override {
+        return finish_download(session, download);
+    }
+    string describe() const override { return "download of '" + name + "'"; }
+
+  private:
+    string name;
+    PendingDownload download;
+};
+
+/*
+ * A batch request of the server, answered with a result for each of its
+ * items: the deletions, or the renames, in a single round trip
+ */
+class BatchOperation : public Operation {
+  public:
+    /*
+     * The batch of [type], answered by [answer], of [names] taken
+     * [per_item] at a time
+     */
+    BatchOperation(mtypes type, mtypes answer, const vector<string> &names,
+                   size_t per_item)
+        : type(type), answer(answer), names(names), per_item(per_item) {}
+
+    bool send(Session &session) override {
+        // The number of items, followed by their names
+        uint32_t count = names.size() / per_item;
+        vector<unsigned char> request(sizeof(count) +
+                                      names.size() * FNAME_MAX_LEN);
+        memcpy(request.data(), &count, sizeof(count));
+        for (size_t i = 0; i < names.size(); i++) {
+            memcpy(request.data() + sizeof(count) + i * FNAME_MAX_LEN,
+                   names[i].c_str(), names[i].size());
+        }
+        send_message(session, type, request.data(), request.size());
+        return true;
+    }
+
+    bool finish(Session &session) override {
+        size_t count = names.size() / per_item;
+        vector<unsigned char> pt;
+        if (!receive_message(session, answer, pt, count * FNAME_MAX_LEN)) {
+            return false;
+        }
+        vector<string> results;
+        if (!split_results(pt, count, results)) {
+            handle_errors("Malformed batch answer");
+        }
+        for (size_t i = 0; i < count; i++) {
+            cout << names[i * per_item];
+            for (size_t j = 1; j < per_item; j++)
+                cout << " -> " << names[i * per_item + j];
+            cout << ": " << results[i] << endl;
+        }
+        return true;
+    }
+
+    string describe() const override {
+        return (type == DeleteBatchReq ? "deletion of " : "rename of ") +
+               to_string(names.size() / per_item) + " files";
+    }
+
+  private:
+    mtypes type;
+    mtypes answer;
+    vector<string> names;
+    size_t per_item;
+};
+
+/* The pages of a list come one after the other, with nothing in between */
+class ListOperation : public Operation {
+  public:
+    explicit ListOperation(const string &filter) : filter(filter) {}
+
+    bool send(Session &session) override {
+        (void)session;
+        return true;
+    }
+    bool exchanges() const override { return true; }
+    bool exchange(Session &session) override {
+        list_matching(session, filter.c_str());
+        return true;
+    }
+    bool finish(Session &session) override {
+        (void)session;
+        return true;
+    }
+    string describe() const override { return "list"; }
+
+  private:
+    string filter;
+};
+
+/* A directory tree, on sessions of its own besides this one */
+class DirectoryOperation : public Operation {
+  public:
+    DirectoryOperation(bool upload, const string &dir) : upload(upload), dir(dir) {}
+
+    bool send(Session &session) override {
+        (void)session;
+        return true;
+    }
+    bool exchanges() const override { return true; }
+    bool exchange(Session &session) override {
+        return upload ? upload_tree(session, dir.c_str())
+                      : download_tree(session, dir.c_str());
+    }
+    bool finish(Session &session) override {
+        (void)session;
+        return true;
+    }
+    string describe() const override {
+        return (upload ? "upload of '" : "download of '") + dir + "'";
+    }
+
+  private:
+    bool upload;
+    string dir;
+};
+
+bool read_manifest(const char *path, vector<string> &commands) {
+    ifstream manifest(path);
+    if (!manifest) {
+        return false;
+    }
+    string line;
+    while (getline(manifest, line)) {
+        size_t start = line.find_first_not_of(" \t\r");
+        if (start == string::npos || line[start] == '#')
+            continue;
+        commands.push_back(line);
+    }
+    return !manifest.bad();
+}
+
+void group_commands(char **words, int count, vector<string> &commands) {
+    static const set<string> actions = {"upload", "download", "updir",
+                                        "downdir", "delete", "rename",
+                                        "list"};
+    bool first = true;
+    for (int i = 0; i < count; i++) {
+        istringstream split(words[i]);
+        for (string word; split >> word; first = false) {
+            if (first || actions.count(word) > 0) {
+                commands.push_back(word);
+            } else {
+                commands.back() += " " + word;
+            }
+        }
+    }
+}
+
+/*
+ * Adds to [script] the batches of [type] over [names], each of at most
+ * BATCH_MAX_ITEMS items of [per_item] names
+ */
+static void add_batches(Script &script, mtypes type, mtypes answer,
+                        const vector<string> &names, size_t per_item) {
+    size_t batch_len = (size_t)BATCH_MAX_ITEMS * per_item;
+    for (size_t i = 0; i < names.size(); i += batch_len) {
+        vector<string> batch(names.begin() + i,
+                             names.begin() + min(i + batch_len, names.size()));
+        script.emplace_back(
+            new BatchOperation(type, answer, batch, per_item));
+    }
+}
+
+bool parse_commands(const vector<string> &commands, Script &script) {
+    // Downloads saved at once under the same name would write the same file
+    set<string> downloads;
+
+    for (auto &command : commands) {
+        istringstream words(command);
+        string action;
+        words >> action;
+        vector<string> args;
+        for (string arg; words >> arg;) {
+            if (arg.size() >= FNAME_MAX_LEN) {
+                cerr << "Name too long: " << arg << endl;
+                return false;
+            }
+            args.push_back(arg);
+        }
+
+        if (action == "upload" && !args.empty()) {
+            for (auto &path : args)
+                script.emplace_back(new UploadOperation(path));
+        } else if (action == "download" && !args.empty()) {
+            for (auto &name : args) {
+                if (!downloads.insert(name).second) {
+                    cerr << "Downloaded twice: " << name << endl;
+                    return false;
+                }
+                script.emplace_back(new DownloadOperation(name));
+            }
+        } else if ((action == "updir" || action == "downdir") &&
+                   !args.empty()) {
+            for (auto &dir : args)
+                script.emplace_back(
+                    new DirectoryOperation(action == "updir", dir));
+        } else if (action == "delete" && !args.empty()) {
+            add_batches(script, DeleteBatchReq, DeleteBatchRes, args, 1);
+        } else if (action == "rename" && !args.empty() &&
+                   args.size() % 2 == 0) {
+            add_batches(script, RenameBatchReq, RenameBatchRes, args, 2);
+        } else if (action == "list" && args.size() <= 1) {
+            script.emplace_back(
+                new ListOperation(args.empty() ? "" : args[0]));
+        } else {
+            cerr << "Invalid command: " << command << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+size_t run_script(Session &session, Script &script) {
+    // Operations whose request was sent, in order, and whether each one is
+    // past its exchange
+    deque<pair<Operation *, bool>> in_flight;
+    size_t next = 0;
+    size_t failed = 0;
+
+    auto fail = [&](Operation *op) {
+        cout << "Error - The " << op->describe() << " failed" << endl;
+        failed++;
+    };
+
+    while (next < script.size() || !in_flight.empty()) {
+        // Requests go out until the window is full, or the last one sent
+        // waits for its exchange
+        while (next < script.size() && in_flight.size() < REQUESTS_IN_FLIGHT &&
+               (in_flight.empty() || in_flight.back().second)) {
+            // The key is replaced with nothing in flight, once every
+            // answer to the requests sent with the old one was read
+            if (session.is_rekey_due()) {
+                if (!in_flight.empty()) {
+                    break;
+                }
+                rekey(session);
+            }
+            // None is sent once the sequence numbers are about to wrap
+            // around: the rest fail, for a new session to run them
+            if (session.is_exhausted()) {
+                cout << "Session expired, please log in again" << endl;
+                for (; next < script.size(); next++)
+                    fail(script[next].get());
+                break;
+            }
+            Operation *op = script[next++].get();
+            if (op->send(session)) {
+                in_flight.emplace_back(op, !op->exchanges());
+            } else {
+                fail(op);
+            }
+        }
+        if (in_flight.empty()) {
+            continue;
+        }
+
+        // The first one in flight has every answer before its own read
+        auto &[op, exchanged] = in_flight.front();
+        if (!exchanged) {
+            exchanged = true;
+            if (!op->exchange(session)) {
+                fail(op);
+                in_flight.pop_front();
+            }
+            continue;
+        }
+        if (!op->finish(session)) {
+            fail(op);
+        }
+        in_flight.pop_front();
+    }
+    return failed;
+}
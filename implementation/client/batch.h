@@ -0,0 +1,98 @@
+#include "../common/session.h"
+#include <memory>
+#include <string>
+#include <vector>
+#ifndef batch_h
+#define batch_h
+
+/*
+ * Scripted use of the client, with no prompt: commands come from the
+ * arguments, or one per line of a manifest, each on as many files as it is
+ * given:
+ *     upload PATH...            uploads each file under its name
+ *     download NAME...          saves each file under its name, in the
+ *                               working directory
+ *     updir DIR...              uploads each directory tree (transfer.h)
+ *     downdir DIR...            downloads each directory tree
+ *     delete NAME...            deletes the files, with no confirmation
+ *     rename OLD NEW [OLD NEW]...
+ *     list [FILTER]             lists the files, or the ones matching FILTER
+ * Names are separated by blanks, so they cannot hold any.
+ *
+ * The requests are pipelined: up to REQUESTS_IN_FLIGHT of them are sent before
+ * the answer to the first one is read, so that running many of them costs
+ * about a round trip in all instead of one each. The server answers them in
+ * order, and so they are taken in order.
+ */
+
+// Requests sent at most before the answer to the first one is read
+#define REQUESTS_IN_FLIGHT 32
+
+/*
+ * One request of a script, in up to three steps: the request, an exchange
+ * once the server answered it, and the rest of the answer
+ */
+class Operation {
+  public:
+    virtual ~Operation() {}
+
+    /*
+     * Sends the request, unless it cannot be made: then nothing is sent and
+     * the operation failed
+     */
+    virtual bool send(Session &session) = 0;
+
+    /*
+     * Whether the operation goes on with an exchange, sending more once the
+     * server answered: no other request may be sent after it until then
+     */
+    virtual bool exchanges() const { return false; }
+
+    /*
+     * The exchange, once every operation sent before was finished. Returns
+     * false if the operation ended there, having failed
+     */
+    virtual bool exchange(Session &session) {
+        (void)session;
+        return true;
+    }
+
+    /*
+     * Reads the rest of the answer, once every operation sent before was
+     * finished. Returns whether the operation succeeded
+     */
+    virtual bool finish(Session &session) = 0;
+
+    /* What the operation is about, for its errors */
+    virtual std::string describe() const = 0;
+};
+
+typedef std::vector<std::unique_ptr<Operation>> Script;
+
+/*
+ * Reads the commands of the manifest at [path], one per line, into
+ * [commands]. Empty lines and the ones starting with # are skipped. Returns
+ * false if the manifest cannot be read.
+ */
+bool read_manifest(const char *path, std::vector<std::string> &commands);
+
+/*
+ * Groups [words], e.g. the arguments of the client, into commands, each one
+ * starting at the name of one. A word may hold a whole command.
+ */
+void group_commands(char **words, int count,
+                    std::vector<std::string> &commands);
+
+/*
+ * Turns [commands] into the operations of [script], in order. Returns false,
+ * writing why on the standard error, if any of them is malformed.
+ */
+bool parse_commands(const std::vector<std::string> &commands, Script &script);
+
+/*
+ * Runs the operations of [script], pipelined. Returns how many of them
+ * failed; errors of the session are thrown through handle_errors.
+ */
+size_t run_script(Session &session, Script &script);
+
+#endif
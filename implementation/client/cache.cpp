@@ -0,0 +1,145 @@
+#include "../common/types.h"
+#include "../common/utils.h"
+#include "cache.h"
+#include <openssl/evp.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+#if __has_include(<filesystem>)
+#include <filesystem>
+namespace fs = std::filesystem;
+#elif __has_include(<experimental/filesystem>)
+#include <experimental/filesystem>
+namespace fs = std::experimental::filesystem;
+#else
+error "Missing the <filesystem> header."
+#endif
+
+using namespace std;
+
+static fs::path cache_dir;
+
+void set_cache_dir(const char *dir) { cache_dir = dir ? dir : ""; }
+
+static string to_hex(const unsigned char *data, size_t len) {
+    static const char digits[] = "0123456789abcdef";
+    string hex;
+    for (size_t i = 0; i < len; i++) {
+        hex += digits[data[i] >> 4];
+        hex += digits[data[i] & 0xf];
+    }
+    return hex;
+}
+
+/* Parses the [len] bytes written as [hex], returning false if it is not */
+static bool from_hex(const string &hex, unsigned char *data, size_t len) {
+    if (hex.size() != 2 * len)
+        return false;
+    for (size_t i = 0; i < len; i++) {
+        int value = 0;
+        for (char c : hex.substr(2 * i, 2)) {
+            if (c >= '0' && c <= '9')
+                value = value * 16 + c - '0';
+            else if (c >= 'a' && c <= 'f')
+                value = value * 16 + c - 'a' + 10;
+            else
+                return false;
+        }
+        data[i] = value;
+    }
+    return true;
+}
+
+/* Directory of the entry of the file [name] of [username] */
+static fs::path entry_dir(const char *username, const char *name) {
+    unsigned char hash[EVP_MAX_MD_SIZE];
+    if (EVP_Digest(name, strlen(name), hash, nullptr, get_hash_type(),
+                   nullptr) != 1) {
+        return fs::path();
+    }
+    return cache_dir / username / to_hex(hash, FILE_HASH_LEN);
+}
+
+/* Computes the hash of the content of the file at [path] */
+static bool hash_file(const fs::path &path, unsigned char *hash) {
+    FILE *fp = fopen(path.native().c_str(), "r");
+    if (fp == nullptr)
+        return false;
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    bool ok = ctx != nullptr && EVP_DigestInit(ctx, get_hash_type()) == 1;
+    vector<unsigned char> buf(DEFAULT_CHUNK_SIZE);
+    size_t len;
+    while (ok && (len = fread(buf.data(), 1, buf.size(), fp)) > 0) {
+        ok = EVP_DigestUpdate(ctx, buf.data(), len) == 1;
+    }
+    ok = ok && !ferror(fp) && EVP_DigestFinal(ctx, hash, nullptr) == 1;
+    EVP_MD_CTX_free(ctx);
+    fclose(fp);
+    return ok;
+}
+
+bool cache_lookup(const char *username, const char *name, unsigned char *hash,
+                  string &entry) {
+    if (cache_dir.empty())
+        return false;
+    fs::path dir = entry_dir(username, name);
+    if (dir.empty())
+        return false;
+
+    // Whatever is not named after a hash is an entry being written
+    error_code ec;
+    for (fs::directory_iterator it(dir, ec), end; !ec && it != end;
+         it.increment(ec)) {
+        if (it->is_regular_file(ec) &&
+            from_hex(it->path().filename().native(), hash, FILE_HASH_LEN)) {
+            entry = it->path().native();
+            return true;
+        }
+    }
+    return false;
+}
+
+void cache_store(const char *username, const char *name, const string &path) {
+    if (cache_dir.empty())
+        return;
+    fs::path dir = entry_dir(username, name);
+    unsigned char hash[EVP_MAX_MD_SIZE];
+    if (dir.empty() || !hash_file(path, hash)) {
+        return;
+    }
+
+    error_code ec;
+    fs::create_directories(dir, ec);
+    fs::path temp = dir / (".partial-" + to_string(getpid()));
+    fs::path entry = dir / to_hex(hash, FILE_HASH_LEN);
+    if (ec || !fs::copy_file(path, temp, fs::copy_options::overwrite_existing,
+                             ec)) {
+        fs::remove(temp, ec);
+        return;
+    }
+    fs::rename(temp, entry, ec);
+    if (ec) {
+        fs::remove(temp, ec);
+        return;
+    }
+
+    // The entry of the content the file had before goes
+    vector<fs::path> stale;
+    for (fs::directory_iterator it(dir, ec), end; !ec && it != end;
+         it.increment(ec)) {
+        unsigned char other[FILE_HASH_LEN];
+        if (it->path() != entry &&
+            from_hex(it->path().filename().native(), other, FILE_HASH_LEN)) {
+            stale.push_back(it->path());
+        }
+    }
+    for (auto &old : stale)
+        fs::remove(old, ec);
+}
+
+void cache_drop(const string &entry) {
+    error_code ec;
+    fs::remove(entry, ec);
+}
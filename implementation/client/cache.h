@@ -0,0 +1,40 @@
+#include <string>
+#ifndef cache_h
+#define cache_h
+
+/*
+ * Local cache of the files downloaded, so that downloading one again costs a
+ * single round trip as long as it did not change on the server.
+ *
+ * An entry is a copy of a whole file of a user, keyed by the name of the file
+ * on the server and by the hash of its content: it is kept at
+ * <cache>/<user>/<hash of the name>/<hash of the content>, in hex, with one
+ * entry at most for each name. The hash of the entry goes with the request to
+ * download the file, and the server answers DownloadUnchanged instead of
+ * sending it if its own copy has the same. Entries are written under another
+ * name first, and only then given theirs: an entry is always whole.
+ */
+
+/* Directory of the cache, or nullptr for none (the default) */
+void set_cache_dir(const char *dir);
+
+/*
+ * Looks up the entry of the file [name] of [username], setting [hash] to the
+ * hash of its content (FILE_HASH_LEN bytes) and [entry] to its path. Returns
+ * false if there is none.
+ */
+bool cache_lookup(const char *username, const char *name, unsigned char *hash,
+                  std::string &entry);
+
+/*
+ * Replaces the entry of the file [name] of [username] with a copy of [path],
+ * just downloaded as a whole. A cache that cannot be written fails no
+ * download: the file is just not cached.
+ */
+void cache_store(const char *username, const char *name,
+                 const std::string &path);
+
+/* Removes the entry at [entry], whose content is not what its name says */
+void cache_drop(const std::string &entry);
+
+#endif
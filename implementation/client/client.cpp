@@ -1,14 +1,25 @@
 #include "../common/errors.h"
+#include "../common/keypool.h"
+#include "../common/session.h"
+#include "../common/trace.h"
 #include "../common/types.h"
 #include "../common/utils.h"
 #include "actions/delete.h"
 #include "actions/download.h"
+#include "actions/info.h"
 #include "actions/list.h"
 #include "actions/logout.h"
+#include "actions/rekey.h"
 #include "actions/rename.h"
+#include "actions/update.h"
 #include "actions/upload.h"
+#include "actions/verify.h"
 #include "authentication.h"
-#include <arpa/inet.h>
+#include "batch.h"
+#include "cache.h"
+#include "client.h"
+#include "transfer.h"
+#include <errno.h>
 #include <iostream>
 #include <openssl/bio.h>
 #include <signal.h>
@@ -18,22 +29,27 @@
 #include <sys/socket.h>
 #include <unistd.h>
 
-#define PORT 8080
-#define ADDRESS "127.0.0.1"
-
 using namespace std;
 
-int sock;
-unsigned char *shared_key;
+Session *session = nullptr;
 
-void signal_handler(int signum) {
-    logout(sock, shared_key);
-    explicit_bzero(shared_key, get_symmetric_key_length());
-    delete[] shared_key;
-    close(sock);
+/* Logs out from the server and terminates the client */
+void terminate_session() {
+    logout(*session);
+    delete session;
     exit(EXIT_SUCCESS);
 }
 
+void signal_handler(int signum) {
+    (void)signum;
+    // Nothing to log out from if the authentication is still running
+    if (session->key == nullptr) {
+        delete session;
+        exit(EXIT_SUCCESS);
+    }
+    terminate_session();
+}
+
 void greet_user() {
     // Thanks to https://fsymbols.com/generators/carty/
     cout << "\
@@ -50,31 +66,60 @@ void greet_user() {
 void print_menu() {
     cout << "Actions:" << endl;
     cout << "    list     - List your files" << endl;
+    cout << "    find     - List your files matching a prefix or pattern"
+         << endl;
+    cout << "    info     - Show how much you store, or about a file" << endl;
+    cout << "    verify   - Check a file against a local copy of it" << endl;
     cout << "    upload   - Upload a new file" << endl;
+    cout << "    update   - Upload a new version of a file" << endl;
     cout << "    download - Download a file" << endl;
+    cout << "    updir    - Upload a directory, over many connections"
+         << endl;
+    cout << "    downdir  - Download a directory, over many connections"
+         << endl;
     cout << "    rename   - Rename a file" << endl;
+    cout << "    mrename  - Rename many files at once" << endl;
     cout << "    delete   - Delete a file" << endl;
+    cout << "    mdelete  - Delete many files at once" << endl;
     cout << "    exit     - Terminate current session" << endl;
     cout << "> ";
 }
 
-/* Loop for the user to interact with the server. */
-void interact() {
-    string action;
-    int key_len;
+/*
+ * Runs the authentication protocol as [username], or as the user asked for if
+ * it is empty
+ */
+void log_in(const string &username) {
+    int key_len = get_symmetric_key_length();
+    string user = username;
+    if (user.empty()) {
+        session->set_key(login(session->sock, key_len, kex,
+                               session->chunk_size, session->compression,
+                               session->suite, user));
+    } else {
+        session->set_key(login_as(session->sock, user, key_len, kex,
+                                  session->chunk_size, session->compression,
+                                  session->suite, true));
+    }
+    session->username = new char[user.length() + 1];
+    strcpy(session->username, user.c_str());
+#ifdef DEBUG
+    cout << "Shared key: ";
+    print_debug(session->key, key_len);
+    cout << endl;
+#endif
+}
 
-    key_len = get_symmetric_key_length();
+/* Loop for the user to interact with the server, as [username] if not empty */
+void interact(const string &username) {
+    string action;
 
     // First of all, the user must run the authentication protocol with the
     // other party (hopefully the server). The exchange also provides a shared
-    // ephemeral key to use for further communications.
+    // ephemeral key to use for further communications, and the size of the
+    // chunks of the files.
     try {
-        shared_key = authenticate(sock, key_len);
-#ifdef DEBUG
-        cout << "Shared key: ";
-        print_debug(shared_key, key_len);
-        cout << endl;
-#endif
+        log_in(username);
 
         // Interaction loop. The user can perform a set of actions, until he
         // decides to terminate the session.
@@ -84,18 +129,45 @@ void interact() {
                 cout << "Error reading input!" << endl;
             }
 
+            // The key is replaced long before any of the sequence numbers
+            // can wrap around. Should the server refuse it, the session is
+            // terminated before they do, for the user to start a new one.
+            if (session->is_rekey_due()) {
+                rekey(*session);
+            }
+            if (session->is_exhausted()) {
+                cout << "Session expired, please log in again" << endl;
+                terminate_session();
+            }
+
             if (action == "list") {
-                list_files(sock, shared_key);
+                list_files(*session);
+            } else if (action == "find") {
+                find_files(*session);
+            } else if (action == "info") {
+                file_info(*session);
+            } else if (action == "verify") {
+                verify(*session);
             } else if (action == "upload") {
-                upload(sock, shared_key);
+                upload(*session);
+            } else if (action == "update") {
+                update(*session);
             } else if (action == "download") {
-                download(sock, shared_key);
+                download(*session);
+            } else if (action == "updir") {
+                upload_tree(*session);
+            } else if (action == "downdir") {
+                download_tree(*session);
             } else if (action == "rename") {
-                rename(sock, shared_key);
+                rename(*session);
+            } else if (action == "mrename") {
+                rename_files(*session);
             } else if (action == "delete") {
-                delete_file(sock, shared_key);
+                delete_file(*session);
+            } else if (action == "mdelete") {
+                delete_files(*session);
             } else if (action == "exit") {
-                kill(getpid(), SIGUSR1);
+                terminate_session();
             } else {
                 cout << "Invalid action!" << endl;
             }
@@ -106,49 +178,248 @@ void interact() {
         cerr << "Error: " << ex << endl;
 #endif
         cerr << "Exiting..." << endl;
-        close(sock);
+        delete session;
         exit(EXIT_FAILURE);
     }
 }
 
-int main() {
-    struct sockaddr_in serv_addr;
-
-    // Register signal handler to gracefully close on SIGINT
-    signal(SIGINT, signal_handler);
-
-    // Register signal handler to gracefully close on SIGUSR1 (before sequence
-    // number wraps)
-    signal(SIGUSR1, signal_handler);
+/*
+ * Runs the operations of [script] with no prompt, logged in as [username]
+ * unless it is empty, then terminates the client: with a failure if any of
+ * them failed.
+ */
+void run_batch(Script &script, const string &username) {
+    try {
+        log_in(username);
 
-    // Create the socket
-    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("Socket creation failed");
+        size_t failed = run_script(*session, script);
+        if (failed > 0) {
+            cout << failed << " of the " << script.size()
+                 << " operations failed" << endl;
+        }
+        logout(*session);
+        delete session;
+        exit(failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+    } catch (char const *ex) {
+        cerr << "Something went wrong! :(" << endl;
+#ifdef DEBUG
+        cerr << "Error: " << ex << endl;
+#endif
+        cerr << "Exiting..." << endl;
+        delete session;
         exit(EXIT_FAILURE);
     }
+}
+
+void print_usage(const char *name) {
+    cerr << "Usage: " << name
+         << " [-k x25519|dh] [-c bytes] [-j threads] [-r stdio|mmap|direct]"
+            " [-d depth] [-n streams] [-z none|zlib] [-a aes-gcm|chacha20]"
+            " [-u username] [-b manifest] [-p sessions] [-x] [-C dir]"
+            " [command]..."
+         << endl
+         << "    -k  group of the ephemeral key exchange: X25519 (default) or"
+         << endl
+         << "        2048-bit finite field Diffie-Hellman" << endl
+         << "    -c  chunk size proposed to the server, between "
+         << MIN_CHUNK_SIZE << " and" << endl
+         << "        " << MAX_CHUNK_SIZE
+         << " bytes (default: " << DEFAULT_CHUNK_SIZE << ")" << endl
+         << "    -j  threads encrypting (decrypting) the chunks of a transfer"
+         << endl
+         << "        in parallel (default: 1)" << endl
+         << "    -r  how the files uploaded are read: buffered (stdio,"
+         << endl
+         << "        default), mapped in memory (mmap) or bypassing the page"
+         << endl
+         << "        cache (direct)" << endl
+         << "    -d  disk reads (writes) of a transfer queued at once on"
+         << endl
+         << "        io_uring, or on threads without it, 0 runs them one at a"
+         << endl
+         << "        time (default: 0)" << endl
+         << "    -n  connections downloading a file at once, each a range of it"
+         << endl
+         << "        (default: 1). A server running a pool of workers must have"
+         << endl
+         << "        one for each of them" << endl
+         << "    -z  compression of the chunks asked to the server: none"
+         << endl
+         << "        (default), or deflate (zlib)" << endl
+         << "    -a  cipher suite proposed to the server: aes-gcm or chacha20"
+         << endl
+         << "        (default: the faster on this machine)" << endl
+         << "    -u  user to log in as, instead of asking for it" << endl
+         << "    -b  file of commands to run, one per line, as the commands"
+         << endl
+         << "        given after the options" << endl
+         << "    -p  connections transferring a directory at once (default: 4)."
+         << endl
+         << "        A server running a pool of workers must have one for each"
+         << endl
+         << "        of them" << endl
+         << "    -x  directories are transferred on streams of the connection,"
+         << endl
+         << "        multiplexed, instead of connections of their own" << endl
+         << "    -C  directory caching the files downloaded, for those that"
+         << endl
+         << "        did not change on the server not to be sent again" << endl
+         << "Commands, run with no prompt and pipelined to the server, each"
+         << endl
+         << "on as many files as it is given:" << endl
+         << "    upload PATH...  download NAME...  delete NAME..." << endl
+         << "    updir DIR...  downdir DIR..." << endl
+         << "    rename OLD NEW [OLD NEW]...  list [FILTER]" << endl;
+}
 
-    // Set socket address and port
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(PORT);
+int main(int argc, char **argv) {
+    int sock;
+    unsigned int chunk_size = DEFAULT_CHUNK_SIZE;
+    int cipher_threads = 1;
+    source_backend read_backend = SourceStdio;
+    int disk_depth = 0;
+    compression_algo compression = CompressNone;
+    cipher_suite suite = preferred_cipher_suite();
+    string username;
+    const char *manifest = nullptr;
 
-    // Convert IPv4 and IPv6 addresses from text to binary
-    // form
-    if (inet_pton(AF_INET, "127.0.0.1", &serv_addr.sin_addr) <= 0) {
-        perror("Cannot convert address");
+    int opt;
+    while ((opt = getopt(argc, argv, "k:c:j:r:d:n:z:a:u:b:p:xC:")) != -1) {
+        switch (opt) {
+        case 'k':
+            if (strcmp(optarg, "x25519") == 0) {
+                kex = KexX25519;
+            } else if (strcmp(optarg, "dh") == 0) {
+                kex = KexDH2048;
+            } else {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'c':
+            chunk_size = strtoul(optarg, nullptr, 10);
+            if (chunk_size < MIN_CHUNK_SIZE || chunk_size > MAX_CHUNK_SIZE) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'j':
+            if ((cipher_threads = atoi(optarg)) <= 0) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'r': {
+            auto backend_res = parse_source_backend(optarg);
+            if (backend_res.is_error) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            read_backend = backend_res.result;
+            break;
+        }
+        case 'd':
+            if ((disk_depth = atoi(optarg)) < 0) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'n': {
+            int streams = atoi(optarg);
+            if (streams <= 0) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            set_download_streams(streams);
+            break;
+        }
+        case 'z': {
+            auto compression_res = parse_compression(optarg);
+            if (compression_res.is_error) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            compression = compression_res.result;
+            break;
+        }
+        case 'a': {
+            auto suite_res = parse_cipher_suite(optarg);
+            if (suite_res.is_error) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            suite = suite_res.result;
+            break;
+        }
+        case 'u':
+            username = optarg;
+            break;
+        case 'b':
+            manifest = optarg;
+            break;
+        case 'p': {
+            int sessions = atoi(optarg);
+            if (sessions <= 0) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            set_transfer_sessions(sessions);
+            break;
+        }
+        case 'x':
+            set_transfer_streams(true);
+            break;
+        case 'C':
+            set_cache_dir(optarg);
+            break;
+        default:
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // A script is checked as a whole before anything runs
+    vector<string> commands;
+    if (manifest != nullptr && !read_manifest(manifest, commands)) {
+        perror("Cannot read the manifest");
+        exit(EXIT_FAILURE);
+    }
+    group_commands(argv + optind, argc - optind, commands);
+    Script script;
+    if (!parse_commands(commands, script)) {
+        print_usage(argv[0]);
         exit(EXIT_FAILURE);
     }
 
     // Connect to the server
-    if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
+    if ((sock = connect_to_server()) < 0) {
         perror("Cannot connect to server");
         exit(EXIT_FAILURE);
     }
+    session = new Session(sock, RoleClient);
+    session->chunk_size = chunk_size;
+    session->cipher_threads = cipher_threads;
+    session->read_backend = read_backend;
+    session->disk_depth = disk_depth;
+    session->compression = compression;
+    session->suite = suite;
+
+    // Generate the ephemeral key pair while the user types the username
+    start_key_pool(1, {kex});
+
+    // Register signal handler to gracefully close on SIGINT
+    signal(SIGINT, signal_handler);
+    install_trace_dump_handler();
+
+    if (!commands.empty()) {
+        run_batch(script, username);
+    }
 
     greet_user();
 
     // Start interacting with the server
-    interact();
+    interact(username);
 
     // Close socket when we are done
-    close(sock);
+    delete session;
 }
@@ -0,0 +1,20 @@
+#include "../common/dhparams.h"
+#include "../common/session.h"
+#ifndef client_h
+#define client_h
+
+// Group of the ephemeral key exchanges of the full logins
+extern kex_group kex;
+
+/* Connects a socket to the server, returns -1 (with errno set) on failure */
+int connect_to_server();
+
+/*
+ * Connects another session to the server, logged in as the user of [current]
+ * and with the same settings, e.g. for a stream of a parallel download. The
+ * ticket of the user is resumed if there is one, and left as it is. Errors
+ * are thrown through handle_errors.
+ */
+Session *open_session(const Session &current);
+
+#endif
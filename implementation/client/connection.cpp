@@ -0,0 +1,83 @@
+#include "../common/errors.h"
+#include "../common/session.h"
+#include "../common/utils.h"
+#include "authentication.h"
+#include "client.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define PORT 8080
+#define ADDRESS "127.0.0.1"
+
+using namespace std;
+
+kex_group kex = KexX25519;
+
+int connect_to_server() {
+    int sock;
+    struct sockaddr_in serv_addr;
+
+    // Create the socket
+    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        return -1;
+    }
+
+    // Set socket address and port
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons(PORT);
+
+    // Convert IPv4 and IPv6 addresses from text to binary
+    // form
+    if (inet_pton(AF_INET, ADDRESS, &serv_addr.sin_addr) <= 0) {
+        close(sock);
+        return -1;
+    }
+
+    // Connect to the server
+    if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
+        int err = errno;
+        close(sock);
+        errno = err;
+        return -1;
+    }
+
+    // Every message is written at once already. A small one must not wait
+    // for the acknowledgment of the data before it, e.g. a request sent
+    // right behind a file when requests are pipelined
+    int nodelay = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    return sock;
+}
+
+Session *open_session(const Session &current) {
+    int sock = connect_to_server();
+    if (sock < 0) {
+        handle_errors("Cannot connect to server");
+    }
+
+    auto *other = new Session(sock, RoleClient);
+    other->chunk_size = current.chunk_size;
+    other->cipher_threads = current.cipher_threads;
+    other->read_backend = current.read_backend;
+    other->disk_depth = current.disk_depth;
+    other->compression = current.compression;
+    other->suite = current.suite;
+
+    try {
+        other->set_key(login_as(sock, current.username,
+                                get_symmetric_key_length(), kex,
+                                other->chunk_size, other->compression,
+                                other->suite, false));
+    } catch (char const *) {
+        delete other;
+        throw;
+    }
+    other->username = new char[strlen(current.username) + 1];
+    strcpy(other->username, current.username);
+    return other;
+}
@@ -0,0 +1,517 @@
+#include "../common/compress.h"
+#include "../common/keypool.h"
+#include "../common/session.h"
+#include "../common/types.h"
+#include "../common/utils.h"
+#include "actions/delete.h"
+#include "actions/download.h"
+#include "actions/list.h"
+#include "actions/logout.h"
+#include "actions/rekey.h"
+#include "actions/rename.h"
+#include "actions/upload.h"
+#include "authentication.h"
+#include "client.h"
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+/*
+ * Load generator: runs many sessions against the server at once, each
+ * logging in as one of the users and running a random mix of operations on
+ * files of its own, through the same actions as the interactive client. It
+ * reports the rate of the logins, the throughput of the transfers and the
+ * latency of every kind of operation.
+ */
+
+using namespace std;
+using namespace std::chrono;
+
+enum operation { OpLogin, OpUpload, OpDownload, OpList, OpRename, OpDelete };
+#define OPERATIONS 6
+
+static const char *operation_names[OPERATIONS] = {
+    "login", "upload", "download", "list", "rename", "delete"};
+
+struct config {
+    int sessions = 4;
+    int operations = 100;
+    // Operations between two logins of a session, 0 to log in once
+    int relogin = 0;
+    vector<string> users = {"alice"};
+    // Weight of each operation but logins in the mix
+    int weights[OPERATIONS] = {0, 2, 4, 2, 1, 1};
+    vector<uint64_t> sizes = {65536, 1048576};
+    unsigned int chunk_size = DEFAULT_CHUNK_SIZE;
+    int cipher_threads = 1;
+    compression_algo compression = CompressNone;
+    cipher_suite suite = preferred_cipher_suite();
+    // Local files of each size, uploaded under names of their own
+    string dir;
+};
+
+/* What a session measured */
+struct stats {
+    vector<double> latencies[OPERATIONS];
+    unsigned long errors[OPERATIONS] = {0};
+    uint64_t bytes = 0;
+};
+
+/* File of the user uploaded by a session, still on the server */
+struct remote_file {
+    string name;
+    uint64_t size;
+};
+
+static Session *log_in(const config &conf, const string &username) {
+    int sock = connect_to_server();
+    if (sock < 0) {
+        throw "Cannot connect to server";
+    }
+    auto *session = new Session(sock, RoleClient);
+    session->chunk_size = conf.chunk_size;
+    session->cipher_threads = conf.cipher_threads;
+    session->compression = conf.compression;
+    session->suite = conf.suite;
+    try {
+        session->set_key(login_as(sock, username, get_symmetric_key_length(),
+                                  kex, session->chunk_size,
+                                  session->compression, session->suite,
+                                  false));
+    } catch (char const *) {
+        delete session;
+        throw;
+    }
+    session->username = new char[username.length() + 1];
+    strcpy(session->username, username.c_str());
+    return session;
+}
+
+static operation pick_operation(const config &conf, mt19937 &rng) {
+    int total = 0;
+    for (int op = 0; op < OPERATIONS; op++)
+        total += conf.weights[op];
+    int r = uniform_int_distribution<int>(0, total - 1)(rng);
+    for (int op = 0; op < OPERATIONS; op++) {
+        if (r < conf.weights[op])
+            return (operation)op;
+        r -= conf.weights[op];
+    }
+    return OpList;
+}
+
+/*
+ * Runs [op] for the session [id] on one of its [files], which it keeps up to
+ * date. Returns whether the server did it.
+ */
+static bool run_operation(const config &conf, int id, Session &session,
+                          operation op, vector<remote_file> &files,
+                          unsigned &names, mt19937 &rng, stats &st) {
+    string name = "lg-" + to_string(getpid()) + "-" + to_string(id) + "-" +
+                  to_string(names++);
+    size_t i = files.empty()
+                   ? 0
+                   : uniform_int_distribution<size_t>(0, files.size() - 1)(rng);
+
+    switch (op) {
+    case OpUpload: {
+        // Uploaded under its own name, as a link to the file of its size
+        uint64_t size = conf.sizes[uniform_int_distribution<size_t>(
+            0, conf.sizes.size() - 1)(rng)];
+        string path = conf.dir + "/" + name;
+        string source = conf.dir + "/size-" + to_string(size);
+        if (link(source.c_str(), path.c_str()) != 0)
+            return false;
+        bool ok = upload_file(session, path.c_str());
+        unlink(path.c_str());
+        if (ok) {
+            files.push_back({name, size});
+            st.bytes += size;
+        }
+        return ok;
+    }
+    case OpDownload: {
+        string path = conf.dir + "/" + name;
+        bool ok = download_file(session, files[i].name.c_str(), path.c_str());
+        unlink(path.c_str());
+        if (ok)
+            st.bytes += files[i].size;
+        return ok;
+    }
+    case OpList:
+        list_files(session);
+        return true;
+    case OpRename:
+        if (!rename_file(session, files[i].name.c_str(), name.c_str()))
+            return false;
+        files[i].name = name;
+        return true;
+    case OpDelete:
+        if (!delete_file(session, files[i].name.c_str(), false))
+            return false;
+        files.erase(files.begin() + i);
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void run_session(const config &conf, int id, stats &st) {
+    mt19937 rng(id * 7919 + getpid());
+    const string &username = conf.users[id % conf.users.size()];
+    vector<remote_file> files;
+    unsigned names = 0;
+    Session *session = nullptr;
+
+    for (int done = 0; done < conf.operations; done++) {
+        // A session about to run out of sequence numbers, its key not
+        // replaced, makes way for a new one
+        if (session != nullptr &&
+            ((conf.relogin > 0 && done % conf.relogin == 0) ||
+             session->is_exhausted())) {
+            try {
+                logout(*session);
+            } catch (char const *) {
+            }
+            delete session;
+            session = nullptr;
+        }
+        if (session == nullptr) {
+            auto start = steady_clock::now();
+            try {
+                session = log_in(conf, username);
+            } catch (char const *) {
+                st.errors[OpLogin]++;
+                continue;
+            }
+            st.latencies[OpLogin].push_back(
+                duration<double, milli>(steady_clock::now() - start).count());
+        }
+
+        // The key is replaced between two operations, long before any of
+        // the sequence numbers can wrap around, as by the interactive client
+        if (session->is_rekey_due()) {
+            try {
+                rekey(*session);
+            } catch (char const *) {
+                delete session;
+                session = nullptr;
+                st.errors[OpLogin]++;
+                continue;
+            }
+        }
+
+        // Operations on a file start with one
+        operation op = pick_operation(conf, rng);
+        if (files.empty() && op != OpList)
+            op = OpUpload;
+
+        auto start = steady_clock::now();
+        bool ok;
+        try {
+            ok = run_operation(conf, id, *session, op, files, names, rng, st);
+        } catch (char const *) {
+            delete session;
+            session = nullptr;
+            ok = false;
+        }
+        if (ok) {
+            st.latencies[op].push_back(
+                duration<double, milli>(steady_clock::now() - start).count());
+        } else {
+            st.errors[op]++;
+        }
+    }
+
+    // What is left of the files is removed, unmeasured
+    try {
+        if (session == nullptr && !files.empty())
+            session = log_in(conf, username);
+        for (const auto &file : files)
+            delete_file(*session, file.name.c_str(), false);
+        if (session != nullptr)
+            logout(*session);
+    } catch (char const *) {
+    }
+    delete session;
+}
+
+static double percentile(const vector<double> &sorted, double p) {
+    if (sorted.empty())
+        return 0;
+    size_t i = min(sorted.size() - 1, (size_t)(p * sorted.size()));
+    return sorted[i];
+}
+
+static void print_report(const stats &total, double seconds) {
+    cout << fixed << setprecision(3);
+    cout << "Elapsed: " << seconds << " s" << endl;
+    cout << "Logins/s: " << total.latencies[OpLogin].size() / seconds << endl;
+    cout << "MB/s: " << total.bytes / seconds / 1e6 << endl;
+    cout << endl
+         << left << setw(10) << "op" << right << setw(8) << "count"
+         << setw(8) << "errors" << setw(12) << "p50 ms" << setw(12)
+         << "p99 ms" << setw(12) << "p999 ms" << endl;
+    for (int op = 0; op < OPERATIONS; op++) {
+        vector<double> sorted = total.latencies[op];
+        sort(sorted.begin(), sorted.end());
+        cout << left << setw(10) << operation_names[op] << right << setw(8)
+             << sorted.size() << setw(8) << total.errors[op] << setw(12)
+             << percentile(sorted, 0.5) << setw(12)
+             << percentile(sorted, 0.99) << setw(12)
+             << percentile(sorted, 0.999) << endl;
+    }
+}
+
+/* Splits [list] at every comma */
+static vector<string> split(const char *list) {
+    vector<string> items;
+    string item;
+    for (const char *c = list;; c++) {
+        if (*c == ',' || *c == '\0') {
+            if (!item.empty())
+                items.push_back(item);
+            item.clear();
+            if (*c == '\0')
+                break;
+        } else {
+            item += *c;
+        }
+    }
+    return items;
+}
+
+/* Parses a mix such as "upload:2,download:4", into [weights] */
+static bool parse_mix(const char *mix, int *weights) {
+    int parsed[OPERATIONS] = {0};
+    int total = 0;
+    for (const auto &item : split(mix)) {
+        size_t colon = item.find(':');
+        int op = 1;
+        while (op < OPERATIONS && item.compare(0, colon, operation_names[op]))
+            op++;
+        if (colon == string::npos || op == OPERATIONS)
+            return false;
+        parsed[op] = atoi(item.c_str() + colon + 1);
+        if (parsed[op] < 0)
+            return false;
+        total += parsed[op];
+    }
+    if (total == 0)
+        return false;
+    memcpy(weights, parsed, sizeof(parsed));
+    return true;
+}
+
+/* Writes a local file of random content for each size to be uploaded */
+static bool make_files(const config &conf) {
+    // Content that does not compress, whatever the session asks for
+    mt19937 rng(getpid());
+    vector<uchar> buf(1 << 20);
+    for (uint64_t size : conf.sizes) {
+        string path = conf.dir + "/size-" + to_string(size);
+        FILE *fp = fopen(path.c_str(), "w");
+        if (fp == nullptr)
+            return false;
+        for (uint64_t left = size; left > 0;) {
+            size_t len = min<uint64_t>(left, buf.size());
+            for (size_t i = 0; i < len; i++)
+                buf[i] = rng();
+            if (fwrite(buf.data(), 1, len, fp) != len) {
+                fclose(fp);
+                return false;
+            }
+            left -= len;
+        }
+        if (fclose(fp) != 0)
+            return false;
+    }
+    return true;
+}
+
+static void remove_files(const config &conf) {
+    for (uint64_t size : conf.sizes)
+        unlink((conf.dir + "/size-" + to_string(size)).c_str());
+    rmdir(conf.dir.c_str());
+}
+
+void print_usage(const char *name) {
+    cerr << "Usage: " << name
+         << " [-s sessions] [-o operations] [-l operations] [-U users]"
+            " [-m mix] [-f sizes] [-k x25519|dh] [-c bytes] [-j threads]"
+            " [-z none|zlib] [-a aes-gcm|chacha20]"
+         << endl
+         << "    -s  sessions running at once (default: 4)" << endl
+         << "    -o  operations run by each session (default: 100)" << endl
+         << "    -l  operations between two logins of a session, 0 logs in"
+         << endl
+         << "        once (default: 0)" << endl
+         << "    -U  users logging in, one after the other, separated by"
+         << endl
+         << "        commas (default: alice)" << endl
+         << "    -m  weight of each operation, e.g. the default"
+         << endl
+         << "        upload:2,download:4,list:2,rename:1,delete:1" << endl
+         << "    -f  sizes of the files uploaded, separated by commas"
+         << endl
+         << "        (default: 65536,1048576)" << endl
+         << "    -k, -c, -j, -z, -a  as for the client" << endl;
+}
+
+int main(int argc, char **argv) {
+    config conf;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:o:l:U:m:f:k:c:j:z:a:")) != -1) {
+        switch (opt) {
+        case 's':
+            if ((conf.sessions = atoi(optarg)) <= 0) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'o':
+            if ((conf.operations = atoi(optarg)) <= 0) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'l':
+            if ((conf.relogin = atoi(optarg)) < 0) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'U':
+            conf.users = split(optarg);
+            if (conf.users.empty()) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'm':
+            if (!parse_mix(optarg, conf.weights)) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'f':
+            conf.sizes.clear();
+            for (const auto &size : split(optarg)) {
+                unsigned long value = strtoul(size.c_str(), nullptr, 10);
+                if (value > FSIZE_MAX) {
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                conf.sizes.push_back(value);
+            }
+            if (conf.sizes.empty()) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'k':
+            if (strcmp(optarg, "x25519") == 0) {
+                kex = KexX25519;
+            } else if (strcmp(optarg, "dh") == 0) {
+                kex = KexDH2048;
+            } else {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'c':
+            conf.chunk_size = strtoul(optarg, nullptr, 10);
+            if (conf.chunk_size < MIN_CHUNK_SIZE ||
+                conf.chunk_size > MAX_CHUNK_SIZE) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'j':
+            if ((conf.cipher_threads = atoi(optarg)) <= 0) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'z': {
+            auto compression_res = parse_compression(optarg);
+            if (compression_res.is_error) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            conf.compression = compression_res.result;
+            break;
+        }
+        case 'a': {
+            auto suite_res = parse_cipher_suite(optarg);
+            if (suite_res.is_error) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            conf.suite = suite_res.result;
+            break;
+        }
+        default:
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    char dir[] = "/tmp/loadgen-XXXXXX";
+    if (mkdtemp(dir) == nullptr) {
+        perror("Could not create the directory of the files");
+        exit(EXIT_FAILURE);
+    }
+    conf.dir = dir;
+    if (!make_files(conf)) {
+        perror("Could not write the files to upload");
+        remove_files(conf);
+        exit(EXIT_FAILURE);
+    }
+
+    // A session whose server went away fails on its own, not the process
+    signal(SIGPIPE, SIG_IGN);
+    start_key_pool(conf.sessions, {kex});
+
+    // The actions report to the user as they go, which the load generator
+    // has no use for
+    cout.setstate(ios::badbit);
+
+    vector<stats> session_stats(conf.sessions);
+    vector<thread> threads;
+    auto start = steady_clock::now();
+    for (int i = 0; i < conf.sessions; i++)
+        threads.emplace_back(run_session, cref(conf), i,
+                             ref(session_stats[i]));
+    for (auto &t : threads)
+        t.join();
+    double seconds = duration<double>(steady_clock::now() - start).count();
+    cout.clear();
+
+    stats total;
+    for (const auto &st : session_stats) {
+        for (int op = 0; op < OPERATIONS; op++) {
+            total.latencies[op].insert(total.latencies[op].end(),
+                                       st.latencies[op].begin(),
+                                       st.latencies[op].end());
+            total.errors[op] += st.errors[op];
+        }
+        total.bytes += st.bytes;
+    }
+    print_report(total, seconds);
+
+    remove_files(conf);
+    return 0;
+}
@@ -0,0 +1,588 @@
+#include "../common/errors.h"
+#include "../common/mux.h"
+#include "../common/pipeline.h"
+#include "../common/session.h"
+#include "../common/types.h"
+#include "../common/utils.h"
+#include "actions/download.h"
+#include "actions/list.h"
+#include "actions/logout.h"
+#include "actions/rekey.h"
+#include "actions/upload.h"
+#include "batch.h"
+#include "client.h"
+#include "transfer.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <stdint.h>
+#include <string.h>
+#include <thread>
+
+#if __has_include(<filesystem>)
+#include <filesystem>
+namespace fs = std::filesystem;
+#elif __has_include(<experimental/filesystem>)
+#include <experimental/filesystem>
+namespace fs = std::experimental::filesystem;
+#else
+error "Missing the <filesystem> header."
+#endif
+
+using namespace std;
+
+static unsigned int transfer_sessions = 4;
+static bool transfer_streams = false;
+
+void set_transfer_sessions(unsigned int sessions) {
+    transfer_sessions = sessions;
+}
+
+void set_transfer_streams(bool streams) { transfer_streams = streams; }
+
+/*
+ * Writes [path] as a relative path with no . in it into [relative]. Returns
+ * false if it is not one under the working directory.
+ */
+static bool relative_path(const fs::path &path, string &relative) {
+    relative.clear();
+    if (path.has_root_path()) {
+        return false;
+    }
+    for (auto &part : path) {
+        if (part == "..") {
+            return false;
+        }
+        if (part.empty() || part == ".") {
+            continue;
+        }
+        if (!relative.empty()) {
+            relative += '/';
+        }
+        relative += part.string();
+    }
+    return true;
+}
+
+/* The name the file at the relative [path] is stored under */
+static string path_to_name(const string &path) {
+    string name;
+    for (char c : path) {
+        if (c == '/') {
+            name += "%2F";
+        } else if (c == '%') {
+            name += "%25";
+        } else {
+            name += c;
+        }
+    }
+    return name;
+}
+
+/*
+ * The other way around. Returns false if [name] is not the one of a path
+ * under the working directory.
+ */
+static bool name_to_path(const string &name, string &path) {
+    string decoded;
+    for (size_t i = 0; i < name.size(); i++) {
+        if (name[i] != '%') {
+            decoded += name[i];
+        } else if (name.compare(i, 3, "%2F") == 0) {
+            decoded += '/';
+            i += 2;
+        } else if (name.compare(i, 3, "%25") == 0) {
+            decoded += '%';
+            i += 2;
+        } else {
+            return false;
+        }
+    }
+    return relative_path(decoded, path) && !path.empty();
+}
+
+/* A file, or a range of one, for any session of the transfer to take */
+class TreeOperation : public Operation {
+  public:
+    // Whether it succeeded, for a session failing with it in flight
+    bool done = false;
+};
+
+/*
+ * Queues of the operations of a transfer, one per session. Each session
+ * takes from the front of its own, then from the back of the others.
+ */
+class WorkQueues {
+  public:
+    explicit WorkQueues(size_t count) : queues(count) {}
+
+    size_t size() const { return queues.size(); }
+
+    void push(size_t queue, unique_ptr<TreeOperation> op) {
+        {
+            lock_guard<mutex> guard(queues[queue].lock);
+            queues[queue].ops.push_back(move(op));
+        }
+        lock_guard<mutex> guard(idle_lock);
+        pending++;
+        idle.notify_all();
+    }
+
+    /* Same as the above, dealing them to the sessions in turn */
+    void push(unique_ptr<TreeOperation> op) {
+        push(next_queue++ % queues.size(), move(op));
+    }
+
+    /*
+     * Takes up to [max] operations for session [queue] into [script]: from
+     * its own queue, or half of another one at most. Waits while there are
+     * none, but some running may queue more. Returns false once all of them
+     * are over.
+     */
+    bool take(size_t queue, size_t max, Script &script) {
+        for (;;) {
+            for (size_t i = 0; i < queues.size(); i++) {
+                auto &victim = queues[(queue + i) % queues.size()];
+                lock_guard<mutex> guard(victim.lock);
+                if (i == 0) {
+                    while (!victim.ops.empty() && script.size() < max) {
+                        script.push_back(move(victim.ops.front()));
+                        victim.ops.pop_front();
+                    }
+                } else {
+                    size_t steal = min(max, (victim.ops.size() + 1) / 2);
+                    for (; steal > 0; steal--) {
+                        script.push_back(move(victim.ops.back()));
+                        victim.ops.pop_back();
+                    }
+                }
+                if (!script.empty()) {
+                    return true;
+                }
+            }
+
+            // A push may come in between: the wait is a short one
+            unique_lock<mutex> guard(idle_lock);
+            if (pending == 0) {
+                return false;
+            }
+            idle.wait_for(guard, chrono::milliseconds(10));
+        }
+    }
+
+    /* [count] of the operations taken are over, and queued no more since */
+    void finished(size_t count) {
+        lock_guard<mutex> guard(idle_lock);
+        pending -= count;
+        if (pending == 0) {
+            idle.notify_all();
+        }
+    }
+
+  private:
+    struct Queue {
+        mutex lock;
+        deque<unique_ptr<TreeOperation>> ops;
+    };
+    vector<Queue> queues;
+    atomic<size_t> next_queue{0};
+
+    // Operations queued or running, which may queue more
+    size_t pending = 0;
+    mutex idle_lock;
+    condition_variable idle;
+};
+
+class TreeUpload : public TreeOperation {
+  public:
+    TreeUpload(const string &path, const string &name)
+        : path(path), name(name) {}
+
+    bool send(Session &session) override {
+        return request_upload(session, path.c_str(), name.c_str(), upload);
+    }
+    bool exchanges() const override { return true; }
+    bool exchange(Session &session) override {
+        return send_upload(session, upload);
+    }
+    bool finish(Session &session) override {
+        done = finish_upload(session);
+        return done;
+    }
+    string describe() const override { return "upload of '" + path + "'"; }
+
+  private:
+    string path;
+    string name;
+    PendingUpload upload;
+};
+
+/* A file downloaded in one range or more, by any of the sessions */
+struct TreeFile {
+    unsigned char name[FNAME_MAX_LEN] = {0};
+    string output_file;
+    string partial_file;
+    // Set by the first range, checked by the others
+    uint64_t size = 0;
+    // Whether the first range created the partial file
+    bool created = false;
+    // Ranges not over yet, whether one of them failed, and whether the file
+    // was saved in the end
+    atomic<unsigned int> ranges_left{1};
+    atomic<bool> failed{false};
+    bool saved = false;
+};
+
+class TreeDownload : public TreeOperation {
+  public:
+    TreeDownload(shared_ptr<TreeFile> file, WorkQueues &queues,
+                 uint64_t offset = 0, uint64_t length = 0)
+        : file(file), queues(queues), offset(offset), length(length) {}
+
+    bool send(Session &session) override {
+        // The first range is the one creating the file
+        if (offset == 0) {
+            length = TRANSFER_RANGE_CHUNKS * session.chunk_size;
+            fs::path output(file->output_file);
+            error_code ec;
+            if (fs::status(output, ec).type() != fs::file_type::not_found ||
+                fs::status(file->partial_file, ec).type() !=
+                    fs::file_type::not_found) {
+                cout << "Error - Output file must not exist: "
+                     << file->output_file << endl;
+                return range_over(false);
+            }
+            if (output.has_parent_path()) {
+                fs::create_directories(output.parent_path(), ec);
+            }
+            fp = fopen(file->partial_file.c_str(), "w");
+            file->created = fp != nullptr;
+        } else {
+            fp = fopen(file->partial_file.c_str(), "r+");
+        }
+        if (fp == nullptr) {
+            cout << "Error - Could not open output file for writing: "
+                 << file->output_file << endl;
+            return range_over(false);
+        }
+
+        send_download_request(session, file->name, offset, length);
+        return true;
+    }
+
+    bool finish(Session &session) override {
+        uint64_t size;
+        if (!receive_download_answer(session, size)) {
+            fclose(fp);
+            return range_over(false);
+        }
+
+        if (offset == 0) {
+            // The rest of the file is queued as ranges of as much, the count
+            // of them up before this one is over
+            file->size = size;
+            for (uint64_t next = length; next < size; next += length) {
+                file->ranges_left++;
+                queues.push(unique_ptr<TreeOperation>(new TreeDownload(
+                    file, queues, next,
+                    min<uint64_t>(length, size - next))));
+            }
+        }
+        // The range is sent all the same, with nothing to tell the file
+        // changed in the middle
+        bool same_file = size == file->size;
+
+        auto receive_res =
+            receive_file(session, fp, offset,
+                         min<uint64_t>(length, size - min(offset, size)),
+                         DownloadChunk, DownloadEnd);
+        fclose(fp);
+        if (receive_res.is_error) {
+            range_over(false);
+            handle_errors(receive_res.error);
+        }
+        if (!same_file) {
+            cout << "Error - The file changed during the download: "
+                 << file->output_file << endl;
+        }
+        done = range_over(receive_res.result && same_file);
+        return done;
+    }
+
+    string describe() const override {
+        return "download of '" + file->output_file + "'";
+    }
+
+  private:
+    shared_ptr<TreeFile> file;
+    WorkQueues &queues;
+    uint64_t offset;
+    uint64_t length;
+    FILE *fp = nullptr;
+
+    /*
+     * The range is over, as [ok] says: the last one of the file saves it, or
+     * removes it if any failed. Returns [ok].
+     */
+    bool range_over(bool ok) {
+        if (!ok) {
+            file->failed = true;
+        }
+        if (--file->ranges_left > 0) {
+            return ok;
+        }
+
+        error_code ec;
+        if (file->failed) {
+            if (file->created) {
+                fs::remove(file->partial_file, ec);
+            }
+        } else if (fs::exists(file->output_file, ec)) {
+            // Sanity check: never overwrite a file, even one created
+            // meanwhile
+            cout << "Error - Output file must not exist, the file is kept as '"
+                 << file->partial_file << "'" << endl;
+            return false;
+        } else {
+            fs::rename(file->partial_file, file->output_file, ec);
+            if (ec) {
+                cout << "Error - Could not rename the file, kept as '"
+                     << file->partial_file << "'" << endl;
+                return false;
+            }
+            cout << "File saved locally as '" << file->output_file
+                 << "' correctly!" << endl;
+            file->saved = true;
+        }
+        return ok;
+    }
+};
+
+/*
+ * Runs the operations of session [index] over [session], adding the ones
+ * failing to [failed], until there are none left. Errors of the session are
+ * thrown through handle_errors, once the operations it had are over.
+ */
+static void run_worker(Session &session, WorkQueues &queues, size_t index,
+                       atomic<size_t> &failed) {
+    Script script;
+    for (;;) {
+        // Between two scripts nothing is in flight: the key is replaced
+        // there if it is due, before the next files are taken
+        if (session.is_rekey_due()) {
+            rekey(session);
+        }
+        if (!queues.take(index, REQUESTS_IN_FLIGHT, script)) {
+            break;
+        }
+        try {
+            failed += run_script(session, script);
+        } catch (char const *) {
+            // Whatever was in flight on the session is lost with it: the
+            // other sessions carry on with the rest
+            for (auto &op : script) {
+                failed += !static_cast<TreeOperation &>(*op).done;
+            }
+            queues.finished(script.size());
+            throw;
+        }
+        queues.finished(script.size());
+        script.clear();
+    }
+}
+
+/*
+ * Runs the operations of [queues], over [session] and as many new sessions of
+ * the same user as there are other queues, or over as many streams of
+ * [session] as there are queues. Returns how many of them failed.
+ */
+static size_t run_transfer(Session &session, WorkQueues &queues) {
+    atomic<size_t> failed{0};
+
+    auto start = chrono::steady_clock::now();
+    Mux mux(session, RoleClient);
+    bool streams = transfer_streams && mux.start();
+    if (transfer_streams && !streams) {
+        cout << "Transferring on sessions of their own instead" << endl;
+    }
+
+    vector<thread> workers;
+    for (size_t i = streams ? 0 : 1; i < queues.size(); i++) {
+        workers.emplace_back([&, i] {
+            try {
+                unique_ptr<Session> other(streams ? mux.open_stream()
+                                                  : open_session(session));
+                run_worker(*other, queues, i, failed);
+                if (!streams) {
+                    logout(*other);
+                }
+            } catch (char const *ex) {
+                // Its queue is left to the other sessions
+                cout << "Error - A session of the transfer failed" << endl;
+#ifdef DEBUG
+                cerr << "Error: " << ex << endl;
+#endif
+            }
+        });
+    }
+
+    // The other sessions are joined even if this one fails
+    const char *error = nullptr;
+    try {
+        if (!streams) {
+            run_worker(session, queues, 0, failed);
+        }
+    } catch (char const *ex) {
+        error = ex;
+    }
+    for (auto &worker : workers)
+        worker.join();
+    if (streams) {
+        try {
+            mux.end();
+        } catch (char const *ex) {
+            error = ex;
+        }
+    }
+    if (error != nullptr) {
+        handle_errors(error);
+    }
+
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    cout << "Transfer over in " << elapsed.count() << " s, on "
+         << queues.size() << (streams ? " streams" : " sessions") << endl;
+    return failed;
+}
+
+bool upload_tree(Session &session, const char *dir) {
+    string root;
+    if (!relative_path(dir, root)) {
+        cout << "Error - The directory must be under the working one" << endl;
+        return false;
+    }
+
+    // The files, largest first, dealt in turn: the sessions end at about the
+    // same time, stealing the smallest ones from each other
+    vector<pair<uintmax_t, string>> files;
+    error_code ec;
+    for (fs::recursive_directory_iterator it(root.empty() ? "." : root, ec),
+         end;
+         !ec && it != end; it.increment(ec)) {
+        if (!fs::is_regular_file(it->path(), ec)) {
+            continue;
+        }
+        string path;
+        relative_path(it->path(), path);
+        files.emplace_back(fs::file_size(it->path(), ec), path);
+    }
+    if (ec) {
+        cout << "Error - Could not read the directory" << endl;
+        return false;
+    }
+    sort(files.rbegin(), files.rend());
+
+    size_t failed = 0;
+    WorkQueues queues(transfer_sessions);
+    for (auto &file : files) {
+        string name = path_to_name(file.second);
+        if (name.size() >= FNAME_MAX_LEN) {
+            cout << "Error - Name too long: " << file.second << endl;
+            failed++;
+            continue;
+        }
+        queues.push(unique_ptr<TreeOperation>(
+            new TreeUpload(file.second, name)));
+    }
+
+    failed += run_transfer(session, queues);
+    cout << files.size() - failed << " of the " << files.size()
+         << " files uploaded" << endl;
+    return failed == 0;
+}
+
+bool download_tree(Session &session, const char *dir) {
+    string root;
+    if (!relative_path(dir, root) || strpbrk(dir, "*?[") != nullptr) {
+        cout << "Error - The directory must be under the working one, and "
+                "have no wildcard"
+             << endl;
+        return false;
+    }
+
+    // Everything if the tree is the working directory
+    string prefix = root.empty() ? "" : path_to_name(root) + "%2F";
+    vector<string> names;
+    if (!list_names(session, prefix.c_str(), names)) {
+        return false;
+    }
+
+    size_t failed = 0;
+    WorkQueues queues(transfer_sessions);
+    vector<shared_ptr<TreeFile>> files;
+    for (auto &name : names) {
+        string path;
+        if (!name_to_path(name, path)) {
+            cout << "Error - Not the name of a path: " << name << endl;
+            failed++;
+            continue;
+        }
+        auto file = make_shared<TreeFile>();
+        strncpy(reinterpret_cast<char *>(file->name), name.c_str(),
+                FNAME_MAX_LEN - 1);
+        file->output_file = path;
+        file->partial_file = path + ".partial";
+        files.push_back(file);
+        queues.push(unique_ptr<TreeOperation>(new TreeDownload(file, queues)));
+    }
+
+    // The ranges lost with a session that failed leave holes
+    auto remove_incomplete = [&] {
+        for (auto &file : files) {
+            if (file->ranges_left > 0 && file->created) {
+                error_code ec;
+                fs::remove(file->partial_file, ec);
+            }
+        }
+    };
+    try {
+        run_transfer(session, queues);
+    } catch (char const *) {
+        remove_incomplete();
+        throw;
+    }
+    remove_incomplete();
+
+    // A file may fail in more ranges than one
+    for (auto &file : files) {
+        failed += !file->saved;
+    }
+    cout << names.size() - failed << " of the " << names.size()
+         << " files downloaded" << endl;
+    return failed == 0;
+}
+
+void upload_tree(Session &session) {
+    cout << "Which directory do you want to upload? ";
+    char dir[FNAME_MAX_LEN] = {0};
+    if (fgets(dir, FNAME_MAX_LEN, stdin) == nullptr) {
+        handle_errors();
+    }
+    dir[strcspn(dir, "\n")] = '\0';
+
+    upload_tree(session, dir);
+}
+
+void download_tree(Session &session) {
+    cout << "Which directory do you want to download? ";
+    char dir[FNAME_MAX_LEN] = {0};
+    if (fgets(dir, FNAME_MAX_LEN, stdin) == nullptr) {
+        handle_errors();
+    }
+    dir[strcspn(dir, "\n")] = '\0';
+
+    download_tree(session, dir);
+}
@@ -0,0 +1,58 @@
+#include "../common/session.h"
+#ifndef transfer_h
+#define transfer_h
+
+/*
+ * Transfers of whole directory trees, over a pool of sessions of the user at
+ * once.
+ *
+ * The storage of a user is flat: a file of a tree is stored under its path
+ * from the working directory, with every / in it written as %2F (and every %
+ * as %25), so that the tree downloaded comes back as it was.
+ *
+ * The files are dealt to the sessions, the largest first, and each session
+ * takes them from its own queue, then steals from the back of the others
+ * once it is empty. A session takes up to REQUESTS_IN_FLIGHT files at a time,
+ * their requests pipelined, so that small files cost a fraction of a round
+ * trip each. Files are downloaded TRANSFER_RANGE_CHUNKS chunks at a time: the
+ * rest of a larger one is queued as ranges of as much, for any session to
+ * take. Uploads go whole, the server taking none in ranges.
+ *
+ * The sessions may instead be streams of the session of the user, multiplexed
+ * over its connection (see mux.h): the transfer then costs no authentication,
+ * and any number of them run on a server running a pool of workers.
+ */
+
+// Chunks of the ranges large files are downloaded in
+#define TRANSFER_RANGE_CHUNKS 8
+
+/*
+ * Number of sessions of a transfer, the one of the user included (default
+ * 4). A server running a pool of workers must have one for each of them.
+ */
+void set_transfer_sessions(unsigned int sessions);
+
+/*
+ * Whether the sessions of a transfer are streams of the session of the user
+ * (default: false). Without the server allowing it, they are connections of
+ * their own after all.
+ */
+void set_transfer_streams(bool streams);
+
+/*
+ * Uploads every file under the directory [dir], which must be under the
+ * working one. Returns whether all of them were saved; errors of the session
+ * of the user are thrown through handle_errors.
+ */
+bool upload_tree(Session &session, const char *dir);
+
+/*
+ * Downloads every file stored under [dir] into the working directory, as it
+ * was uploaded, never overwriting a file. Returns as upload_tree.
+ */
+bool download_tree(Session &session, const char *dir);
+
+void upload_tree(Session &session);
+void download_tree(Session &session);
+
+#endif
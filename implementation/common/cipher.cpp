@@ -0,0 +1,37 @@
+#include "cipher.h"
+#include <string.h>
+#if defined(__aarch64__) && defined(__linux__)
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+
+Maybe<cipher_suite> parse_cipher_suite(const char *name) {
+    Maybe<cipher_suite> res;
+    if (strcmp(name, "aes-gcm") == 0) {
+        res.set_result(SuiteAesGcm);
+    } else if (strcmp(name, "chacha20") == 0) {
+        res.set_result(SuiteChaCha20);
+    } else {
+        res.set_error("Unknown cipher suite");
+    }
+    return res;
+}
+
+const char *cipher_suite_name(cipher_suite suite) {
+    return suite == SuiteChaCha20 ? "chacha20" : "aes-gcm";
+}
+
+cipher_suite preferred_cipher_suite() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_cpu_supports("aes") ? SuiteAesGcm : SuiteChaCha20;
+#elif defined(__aarch64__) && defined(__linux__)
+    return getauxval(AT_HWCAP) & HWCAP_AES ? SuiteAesGcm : SuiteChaCha20;
+#else
+    // No telling: AES without instructions of its own is the slower one
+    return SuiteChaCha20;
+#endif
+}
+
+const EVP_CIPHER *get_suite_cipher(cipher_suite suite) {
+    return with_suite(suite, [](auto policy) { return policy.cipher(); });
+}
@@ -0,0 +1,135 @@
+#include "maybe.h"
+#include "types.h"
+#include <openssl/evp.h>
+#include <stdint.h>
+
+#ifndef cipher_h
+#define cipher_h
+
+/*
+ * The AEAD sealing the messages of a session, as agreed at login: the client
+ * proposes one, and the server takes it as long as it knows it.
+ *     - SuiteAesGcm:   AES-256-GCM (default), the fastest wherever the CPU
+ *                      has AES instructions
+ *     - SuiteChaCha20: ChaCha20-Poly1305, several times faster than AES on
+ *                      those without, e.g. most small ARM boards
+ * Both take keys of AEAD_KEY_LEN bytes, nonces of AEAD_IV_LEN bytes and give
+ * tags of TAG_LEN bytes, with ciphertexts as long as their plaintexts: the
+ * derivation of the keys and of the nonces, and the framing of the messages,
+ * do not depend on the suite.
+ */
+enum cipher_suite { SuiteAesGcm, SuiteChaCha20 };
+
+#define AEAD_KEY_LEN 32
+#define AEAD_IV_LEN 12
+
+/* Parses the name of a suite: "aes-gcm" or "chacha20" */
+Maybe<cipher_suite> parse_cipher_suite(const char *name);
+
+const char *cipher_suite_name(cipher_suite suite);
+
+/*
+ * The suite running the fastest on this machine: AES-256-GCM if the CPU has
+ * AES instructions, ChaCha20-Poly1305 otherwise
+ */
+cipher_suite preferred_cipher_suite();
+
+const EVP_CIPHER *get_suite_cipher(cipher_suite suite);
+
+/*
+ * Policies of the suites, for the code sealing and opening messages to be
+ * instantiated once for each: the lengths are constants there, and the
+ * cipher is never looked up.
+ */
+struct AesGcm {
+    static constexpr cipher_suite suite = SuiteAesGcm;
+    static constexpr int key_len = 32;
+    static constexpr int iv_len = 12;
+    static constexpr int tag_len = 16;
+    static const EVP_CIPHER *cipher() { return EVP_aes_256_gcm(); }
+};
+
+struct ChaCha20Poly1305 {
+    static constexpr cipher_suite suite = SuiteChaCha20;
+    static constexpr int key_len = 32;
+    static constexpr int iv_len = 12;
+    static constexpr int tag_len = 16;
+    static const EVP_CIPHER *cipher() { return EVP_chacha20_poly1305(); }
+};
+
+/*
+ * Calls [f] with the policy of [suite], e.g. to pick the instance of a
+ * template once for a whole transfer rather than once for every message
+ */
+template <class F> auto with_suite(cipher_suite suite, F &&f) {
+    if (suite == SuiteChaCha20) {
+        return f(ChaCha20Poly1305());
+    }
+    return f(AesGcm());
+}
+
+/*
+ * Seals the [len] bytes at [in] into [out], which may be [in] itself, with
+ * [ctx] keyed for [Suite] and the nonce [iv]. The type byte [header] and the
+ * sequence number [seq] of the message are authenticated first. [out_len] is
+ * set to the length of the ciphertext, and [tag] to its tag; an empty message
+ * needs no buffers at all. Returns false on failure.
+ */
+template <class Suite>
+bool aead_seal(EVP_CIPHER_CTX *ctx, const uchar *iv, uchar header, seqnum seq,
+               const uchar *in, int len, uchar *out, int &out_len,
+               uchar *tag) {
+    static_assert(Suite::key_len == AEAD_KEY_LEN &&
+                      Suite::iv_len == AEAD_IV_LEN &&
+                      Suite::tag_len == TAG_LEN,
+                  "The suites share the framing of the messages");
+    int n;
+    if (EVP_EncryptInit_ex(ctx, nullptr, nullptr, nullptr, iv) != 1 ||
+        EVP_EncryptUpdate(ctx, nullptr, &n, &header, sizeof(header)) != 1 ||
+        EVP_EncryptUpdate(ctx, nullptr, &n, reinterpret_cast<uchar *>(&seq),
+                          sizeof(seq)) != 1 ||
+        (len > 0 && EVP_EncryptUpdate(ctx, out, &n, in, len) != 1)) {
+        return false;
+    }
+    out_len = len > 0 ? n : 0;
+    if (EVP_EncryptFinal_ex(ctx, out + out_len, &n) != 1 ||
+        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, Suite::tag_len,
+                            tag) != 1) {
+        return false;
+    }
+    out_len += n;
+    return true;
+}
+
+/*
+ * Opens what aead_seal sealed, with [ctx] keyed for [Suite]: the [len] bytes
+ * at [in] into [out], which may be [in] itself. [out_len] is set to the
+ * length of the plaintext. Returns false if the message is not authentic.
+ */
+template <class Suite>
+bool aead_open(EVP_CIPHER_CTX *ctx, const uchar *iv, uchar header, seqnum seq,
+               const uchar *in, int len, uchar *out, int &out_len,
+               const uchar *tag) {
+    static_assert(Suite::key_len == AEAD_KEY_LEN &&
+                      Suite::iv_len == AEAD_IV_LEN &&
+                      Suite::tag_len == TAG_LEN,
+                  "The suites share the framing of the messages");
+    int n;
+    if (EVP_DecryptInit_ex(ctx, nullptr, nullptr, nullptr, iv) != 1 ||
+        EVP_DecryptUpdate(ctx, nullptr, &n, &header, sizeof(header)) != 1 ||
+        EVP_DecryptUpdate(ctx, nullptr, &n, reinterpret_cast<uchar *>(&seq),
+                          sizeof(seq)) != 1 ||
+        (len > 0 && EVP_DecryptUpdate(ctx, out, &n, in, len) != 1)) {
+        return false;
+    }
+    out_len = len > 0 ? n : 0;
+    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, Suite::tag_len,
+                            const_cast<uchar *>(tag)) != 1 ||
+        EVP_DecryptFinal_ex(ctx, out + out_len, &n) != 1) {
+        return false;
+    }
+    out_len += n;
+    return true;
+}
+
+#endif
@@ -0,0 +1,76 @@
+#include "compress.h"
+#include <string.h>
+
+Maybe<compression_algo> parse_compression(const char *name) {
+    Maybe<compression_algo> res;
+    if (strcmp(name, "none") == 0) {
+        res.set_result(CompressNone);
+    } else if (strcmp(name, "zlib") == 0) {
+        res.set_result(CompressZlib);
+    } else {
+        res.set_error("Unknown compression");
+    }
+    return res;
+}
+
+Codec::~Codec() {
+    if (deflater_ready)
+        deflateEnd(&deflater);
+    if (inflater_ready)
+        inflateEnd(&inflater);
+}
+
+blen Codec::compress(const uchar *in, blen len, uchar *out) {
+    if (len < 2)
+        return 0;
+
+    // Raw deflate: the tag of the chunk already covers its integrity
+    if (!deflater_ready) {
+        memset(&deflater, 0, sizeof(deflater));
+        if (deflateInit2(&deflater, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                         -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return 0;
+        }
+        deflater_ready = true;
+    } else if (deflateReset(&deflater) != Z_OK) {
+        return 0;
+    }
+
+    // Anything that does not end up shorter is not worth it
+    deflater.next_in = const_cast<uchar *>(in);
+    deflater.avail_in = len;
+    deflater.next_out = out;
+    deflater.avail_out = len - 1;
+    if (deflate(&deflater, Z_FINISH) != Z_STREAM_END)
+        return 0;
+    return len - 1 - deflater.avail_out;
+}
+
+Maybe<blen> Codec::decompress(const uchar *in, blen len, uchar *out,
+                              blen max_len) {
+    Maybe<blen> res;
+    if (!inflater_ready) {
+        memset(&inflater, 0, sizeof(inflater));
+        if (inflateInit2(&inflater, -MAX_WBITS) != Z_OK) {
+            res.set_error("Could not decompress a chunk");
+            return res;
+        }
+        inflater_ready = true;
+    } else if (inflateReset(&inflater) != Z_OK) {
+        res.set_error("Could not decompress a chunk");
+        return res;
+    }
+
+    // A chunk inflating past the chunk size is as malformed as any other
+    inflater.next_in = const_cast<uchar *>(in);
+    inflater.avail_in = len;
+    inflater.next_out = out;
+    inflater.avail_out = max_len;
+    if (inflate(&inflater, Z_FINISH) != Z_STREAM_END ||
+        inflater.avail_in != 0) {
+        res.set_error("Malformed compressed chunk");
+        return res;
+    }
+    res.set_result(max_len - inflater.avail_out);
+    return res;
+}
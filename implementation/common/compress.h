@@ -0,0 +1,53 @@
+#include "maybe.h"
+#include "types.h"
+#include <zlib.h>
+
+#ifndef compress_h
+#define compress_h
+
+/*
+ * How the chunks of a transfer are compressed, as agreed at login:
+ *     - CompressNone: they are not (default)
+ *     - CompressZlib: with deflate, each one on its own before it is
+ *                     encrypted, so that chunks are still independent of each
+ *                     other. A chunk that does not shrink is sent as it is.
+ * A compressed chunk has MTYPE_COMPRESSED set in its type.
+ */
+enum compression_algo { CompressNone, CompressZlib };
+
+/* Parses the name of an algorithm: "none" or "zlib" */
+Maybe<compression_algo> parse_compression(const char *name);
+
+/*
+ * Compression streams of a chunk, kept from one chunk to the next: only
+ * their state is reset. Each stream is set up on its first use.
+ */
+class Codec {
+  public:
+    Codec() = default;
+    ~Codec();
+
+    Codec(const Codec &) = delete;
+    Codec &operator=(const Codec &) = delete;
+
+    /*
+     * Compresses the [len] bytes at [in] into [out]. Returns their compressed
+     * length, or 0 if they do not shrink (or could not be compressed).
+     */
+    blen compress(const uchar *in, blen len, uchar *out);
+
+    /*
+     * Decompresses the [len] bytes at [in] into [out], which they must not
+     * take more than [max_len] bytes of. Returns their length.
+     */
+    Maybe<blen> decompress(const uchar *in, blen len, uchar *out,
+                           blen max_len);
+
+  private:
+    z_stream deflater;
+    z_stream inflater;
+    bool deflater_ready = false;
+    bool inflater_ready = false;
+};
+
+#endif
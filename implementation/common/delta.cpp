@@ -0,0 +1,285 @@
+#include "delta.h"
+#include "utils.h"
+#include <algorithm>
+#include <openssl/evp.h>
+#include <string.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+uint32_t delta_block_size(uint32_t size) {
+    uint32_t block_size = DELTA_MIN_BLOCK;
+    while ((uint64_t)block_size * block_size < size)
+        block_size *= 2;
+    return block_size;
+}
+
+uint64_t delta_max_len(uint32_t size, uint32_t basis_size) {
+    // A copy is at least a block long, and the bytes between two copies are
+    // split only as needed
+    uint64_t copies = size / delta_block_size(basis_size);
+    uint64_t data = copies + 1 + size / DELTA_DATA_MAX;
+    return size + copies * (1 + 2 * sizeof(uint32_t)) +
+           data * (1 + sizeof(uint32_t)) + 1 + EVP_MAX_MD_SIZE;
+}
+
+void RollingChecksum::reset(const uchar *data, uint32_t len) {
+    a = 0;
+    b = 0;
+    this->len = len;
+    for (uint32_t i = 0; i < len; i++) {
+        a += data[i];
+        b += (len - i) * data[i];
+    }
+}
+
+/* Computes the strong hash of the [len] bytes at [data] */
+static bool strong_hash(const uchar *data, size_t len, uchar *hash) {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    if (EVP_Digest(data, len, digest, nullptr, get_hash_type(), nullptr) !=
+        1) {
+        return false;
+    }
+    memcpy(hash, digest, DELTA_STRONG_LEN);
+    return true;
+}
+
+bool make_signature(int fd, uint32_t size, vector<uchar> &sigs) {
+    uint32_t block_size = delta_block_size(size);
+    size_t blocks = size / block_size;
+    sigs.resize(sizeof(uint32_t) + blocks * DELTA_SIG_LEN);
+    memcpy(sigs.data(), &block_size, sizeof(block_size));
+
+    vector<uchar> block(block_size);
+    RollingChecksum sum;
+    for (size_t i = 0; i < blocks; i++) {
+        if (pread(fd, block.data(), block_size, (off_t)i * block_size) !=
+            (ssize_t)block_size) {
+            return false;
+        }
+        uchar *sig = sigs.data() + sizeof(uint32_t) + i * DELTA_SIG_LEN;
+        sum.reset(block.data(), block_size);
+        uint32_t weak = sum.value();
+        memcpy(sig, &weak, sizeof(weak));
+        if (!strong_hash(block.data(), block_size, sig + sizeof(weak))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Writes a DELTA_COPY of the [count] blocks from [first], if any */
+static bool write_copy(FILE *out, uint32_t first, uint32_t count) {
+    if (count == 0)
+        return true;
+    uchar type = DELTA_COPY;
+    return fwrite(&type, 1, 1, out) == 1 &&
+           fwrite(&first, sizeof(first), 1, out) == 1 &&
+           fwrite(&count, sizeof(count), 1, out) == 1;
+}
+
+/* Writes the [len] bytes at [data] as DELTA_DATA instructions */
+static bool write_data(FILE *out, const uchar *data, size_t len) {
+    uchar type = DELTA_DATA;
+    while (len > 0) {
+        uint32_t data_len = min(len, (size_t)DELTA_DATA_MAX);
+        if (fwrite(&type, 1, 1, out) != 1 ||
+            fwrite(&data_len, sizeof(data_len), 1, out) != 1 ||
+            fwrite(data, 1, data_len, out) != data_len) {
+            return false;
+        }
+        data += data_len;
+        len -= data_len;
+    }
+    return true;
+}
+
+Maybe<bool> make_delta(const uchar *data, uint32_t size, const uchar *sigs,
+                       size_t sigs_len, FILE *out) {
+    Maybe<bool> res;
+    uint32_t block_size;
+    if (sigs_len < sizeof(block_size) ||
+        (sigs_len - sizeof(block_size)) % DELTA_SIG_LEN != 0) {
+        res.set_error("Malformed signature");
+        return res;
+    }
+    memcpy(&block_size, sigs, sizeof(block_size));
+    sigs += sizeof(block_size);
+    size_t blocks = (sigs_len - sizeof(block_size)) / DELTA_SIG_LEN;
+    if (block_size < DELTA_MIN_BLOCK || block_size > DELTA_FSIZE_MAX / 2 ||
+        blocks > DELTA_MAX_BLOCKS) {
+        res.set_error("Malformed signature");
+        return res;
+    }
+
+    // Blocks of the old version by rolling checksum, which may be shared
+    unordered_map<uint32_t, vector<uint32_t>> index;
+    for (uint32_t i = 0; i < blocks; i++) {
+        uint32_t weak;
+        memcpy(&weak, sigs + i * DELTA_SIG_LEN, sizeof(weak));
+        index[weak].push_back(i);
+    }
+
+    // Consecutive blocks found one after the other make a single copy
+    uint32_t copy_first = 0;
+    uint32_t copy_count = 0;
+    size_t data_start = 0;
+    size_t pos = 0;
+    RollingChecksum sum;
+    bool summed = false;
+    while (blocks > 0 && pos + block_size <= size) {
+        if (!summed) {
+            sum.reset(data + pos, block_size);
+            summed = true;
+        }
+
+        long match = -1;
+        auto it = index.find(sum.value());
+        if (it != index.end()) {
+            uchar hash[DELTA_STRONG_LEN];
+            if (!strong_hash(data + pos, block_size, hash)) {
+                res.set_error("Could not hash a block");
+                return res;
+            }
+            for (uint32_t i : it->second) {
+                if (memcmp(hash, sigs + i * DELTA_SIG_LEN + sizeof(uint32_t),
+                           DELTA_STRONG_LEN) != 0)
+                    continue;
+                match = i;
+                // The block following the last one found is best
+                if (copy_count > 0 && i == copy_first + copy_count)
+                    break;
+            }
+        }
+
+        if (match < 0) {
+            if (pos + block_size < size)
+                sum.roll(data[pos], data[pos + block_size]);
+            pos++;
+            continue;
+        }
+
+        if (data_start < pos || match != copy_first + copy_count) {
+            if (!write_copy(out, copy_first, copy_count) ||
+                !write_data(out, data + data_start, pos - data_start)) {
+                return res;
+            }
+            copy_first = match;
+            copy_count = 0;
+        }
+        copy_count++;
+        pos += block_size;
+        data_start = pos;
+        summed = false;
+    }
+    if (!write_copy(out, copy_first, copy_count) ||
+        !write_data(out, data + data_start, size - data_start)) {
+        return res;
+    }
+
+    uchar type = DELTA_END;
+    unsigned char hash[EVP_MAX_MD_SIZE];
+    if (EVP_Digest(data, size, hash, nullptr, get_hash_type(), nullptr) != 1) {
+        res.set_error("Could not hash the file");
+        return res;
+    }
+    if (fwrite(&type, 1, 1, out) != 1 ||
+        fwrite(hash, 1, get_hash_type_length(), out) !=
+            (size_t)get_hash_type_length()) {
+        return res;
+    }
+    res.set_result(true);
+    return res;
+}
+
+Maybe<bool> apply_delta(FILE *delta, int basis_fd, uint32_t basis_size,
+                        uint32_t size, FILE *out) {
+    Maybe<bool> res;
+    uint32_t block_size = delta_block_size(basis_size);
+    uint32_t blocks = basis_size / block_size;
+
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    if (ctx == nullptr || EVP_DigestInit(ctx, get_hash_type()) != 1) {
+        EVP_MD_CTX_free(ctx);
+        res.set_error("Error - Could not update the file");
+        return res;
+    }
+
+    // Written bytes are counted against the size announced, so that a delta
+    // cannot grow the file past it
+    vector<uchar> buf(max(block_size, (uint32_t)DELTA_DATA_MAX));
+    uint64_t written = 0;
+    const char *error = nullptr;
+    uchar type;
+    while (error == nullptr) {
+        if (fread(&type, 1, 1, delta) != 1) {
+            error = "Error - The changes are incomplete";
+            break;
+        }
+        if (type == DELTA_END)
+            break;
+
+        uint32_t first, count;
+        if (type == DELTA_COPY) {
+            if (fread(&first, sizeof(first), 1, delta) != 1 ||
+                fread(&count, sizeof(count), 1, delta) != 1 ||
+                first > blocks || count > blocks - first ||
+                written + (uint64_t)count * block_size > size) {
+                error = "Error - The changes do not apply to the file";
+                break;
+            }
+            for (uint32_t i = first; i < first + count; i++) {
+                if (pread(basis_fd, buf.data(), block_size,
+                          (off_t)i * block_size) != (ssize_t)block_size) {
+                    error = "Error - Could not read the file";
+                    break;
+                }
+                if (fwrite(buf.data(), 1, block_size, out) != block_size ||
+                    EVP_DigestUpdate(ctx, buf.data(), block_size) != 1) {
+                    error = "Error - Could not update the file";
+                    break;
+                }
+                written += block_size;
+            }
+        } else if (type == DELTA_DATA) {
+            if (fread(&count, sizeof(count), 1, delta) != 1 ||
+                count > DELTA_DATA_MAX || written + count > size ||
+                fread(buf.data(), 1, count, delta) != count) {
+                error = "Error - The changes do not apply to the file";
+                break;
+            }
+            if (fwrite(buf.data(), 1, count, out) != count ||
+                EVP_DigestUpdate(ctx, buf.data(), count) != 1) {
+                error = "Error - Could not update the file";
+                break;
+            }
+            written += count;
+        } else {
+            error = "Error - The changes do not apply to the file";
+        }
+    }
+
+    unsigned char expected[EVP_MAX_MD_SIZE];
+    unsigned char hash[EVP_MAX_MD_SIZE];
+    size_t hash_len = get_hash_type_length();
+    if (error == nullptr &&
+        (fread(expected, 1, hash_len, delta) != hash_len ||
+         fgetc(delta) != EOF)) {
+        error = "Error - The changes are incomplete";
+    }
+    if (error == nullptr &&
+        (written != size || EVP_DigestFinal(ctx, hash, nullptr) != 1 ||
+         memcmp(hash, expected, hash_len) != 0)) {
+        error = "Error - The changes do not apply to the file";
+    }
+    EVP_MD_CTX_free(ctx);
+
+    if (error != nullptr) {
+        res.set_error(error);
+        return res;
+    }
+    res.set_result(true);
+    return res;
+}
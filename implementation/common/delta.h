@@ -0,0 +1,107 @@
+#include "maybe.h"
+#include "types.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+#ifndef delta_h
+#define delta_h
+
+/*
+ * Update of a file the other party already has an older version of, as
+ * rsync does it:
+ *     - the party with the old version cuts it into blocks, and sends the
+ *       signature of each: a rolling checksum and a strong hash
+ *     - the party with the new version looks for those blocks at every byte
+ *       of it, the rolling checksum being cheap to slide one byte further,
+ *       and sends a delta: the blocks it found, by index, and the bytes in
+ *       between as they are
+ *     - the old version and the delta make up the new version, checked
+ *       against the hash of the whole file the delta ends with
+ *
+ * A signature is a uint32 block size, followed by DELTA_SIG_LEN bytes for
+ * each full block of the file: its rolling checksum, then its strong hash.
+ * A delta is a sequence of instructions, each a type byte followed by:
+ *     - DELTA_COPY: uint32 first block, uint32 count of consecutive blocks
+ *     - DELTA_DATA: uint32 length, then as many bytes (at most
+ *                   DELTA_DATA_MAX)
+ *     - DELTA_END:  the hash of the whole new version (get_hash_type())
+ * Integers are in host byte order, like the sizes of the other messages.
+ */
+
+// Files updated with a delta at most. Neither version is held in memory
+// whole (the new one is mapped, the delta goes through a file on either
+// side), but the signature is a single message of at most DELTA_MAX_BLOCKS
+// blocks of about the square root of the size: past 4 GiB the blocks, each
+// buffered whole as the delta is applied, would keep growing. The format
+// takes its sizes and blocks in 32 bits to match, as does the update
+// request. Larger files are uploaded again.
+#define DELTA_FSIZE_MAX ((1UL << 32) - 1)
+// Blocks are never smaller than this, so that small files need few of them
+#define DELTA_MIN_BLOCK 2048
+// Blocks of a file of up to DELTA_FSIZE_MAX bytes, given delta_block_size()
+#define DELTA_MAX_BLOCKS 65536
+#define DELTA_STRONG_LEN 16
+#define DELTA_SIG_LEN (sizeof(uint32_t) + DELTA_STRONG_LEN)
+#define DELTA_SIGS_MAX_LEN (sizeof(uint32_t) + DELTA_MAX_BLOCKS * DELTA_SIG_LEN)
+#define DELTA_DATA_MAX 65536
+
+#define DELTA_COPY 'C'
+#define DELTA_DATA 'D'
+#define DELTA_END 'E'
+
+/*
+ * Size of the blocks of a file of [size] bytes: about its square root, which
+ * balances the length of the signature against the bytes sent for a change
+ */
+uint32_t delta_block_size(uint32_t size);
+
+/*
+ * Longest delta make_delta() writes for a new version of [size] bytes of a
+ * file of [basis_size] bytes
+ */
+uint64_t delta_max_len(uint32_t size, uint32_t basis_size);
+
+/* Checksum of a block that can slide one byte at a time, as in rsync */
+class RollingChecksum {
+  public:
+    /* Starts over on the [len] bytes at [data] */
+    void reset(const uchar *data, uint32_t len);
+
+    /* Slides the block one byte further: [out] leaves it, [in] enters it */
+    void roll(uchar out, uchar in) {
+        a += in - out;
+        b += a - len * out;
+    }
+
+    uint32_t value() const { return (a & 0xffff) | (b << 16); }
+
+  private:
+    // Both sums are only ever taken modulo 2^16
+    uint32_t a, b, len;
+};
+
+/*
+ * Computes the signature of the first [size] bytes of [fd] into [sigs].
+ * Returns false if the file could not be read.
+ */
+bool make_signature(int fd, uint32_t size, std::vector<uchar> &sigs);
+
+/*
+ * Writes into [out] the delta turning the file of the signature [sigs], of
+ * [sigs_len] bytes, into the [size] bytes at [data]. Returns false if the
+ * delta could not be written, and an error if the signature is malformed.
+ */
+Maybe<bool> make_delta(const uchar *data, uint32_t size, const uchar *sigs,
+                       size_t sigs_len, FILE *out);
+
+/*
+ * Writes into [out] the new version of [size] bytes that [delta], from its
+ * current position, makes out of the file of [basis_size] bytes at
+ * [basis_fd], whose signature the delta was made from. Fails if the result
+ * is anything but exactly that many bytes, with the hash the delta ends with.
+ */
+Maybe<bool> apply_delta(FILE *delta, int basis_fd, uint32_t basis_size,
+                        uint32_t size, FILE *out);
+
+#endif
@@ -1,3 +1,4 @@
+#include "dhparams.h"
 #include "errors.h"
 #include <openssl/dh.h>
 #include <openssl/evp.h>
@@ -43,46 +44,73 @@ DH *get_dh2048(void) {
     return dh;
 }
 
-EVP_PKEY *gen_keypair() {
-    // generate dh params p and g
-    DH *tmp;
-    if ((tmp = get_dh2048()) == nullptr) {
-        handle_errors();
-    }
+/*
+ * Returns the DH parameters (p and g) as a key, built on the first call only.
+ * The parameters are shared by every key pair and never freed.
+ */
+static EVP_PKEY *get_dh_params() {
+    static EVP_PKEY *dh_params = [] {
+        // generate dh params p and g
+        DH *tmp;
+        if ((tmp = get_dh2048()) == nullptr) {
+            handle_errors();
+        }
 
-    EVP_PKEY *dh_params;
-    if ((dh_params = EVP_PKEY_new()) == nullptr) {
-        DH_free(tmp);
-        handle_errors();
-    }
+        EVP_PKEY *params;
+        if ((params = EVP_PKEY_new()) == nullptr) {
+            DH_free(tmp);
+            handle_errors();
+        }
 
-    if (EVP_PKEY_set1_DH(dh_params, tmp) != 1) {
+        if (EVP_PKEY_set1_DH(params, tmp) != 1) {
+            DH_free(tmp);
+            EVP_PKEY_free(params);
+            handle_errors();
+        }
         DH_free(tmp);
-        EVP_PKEY_free(dh_params);
-        handle_errors();
+        return params;
+    }();
+    return dh_params;
+}
+
+Maybe<kex_group> get_kex_group(EVP_PKEY *half_key) {
+    Maybe<kex_group> res;
+    switch (EVP_PKEY_base_id(half_key)) {
+    case EVP_PKEY_DH:
+        res.set_result(KexDH2048);
+        break;
+    case EVP_PKEY_X25519:
+        res.set_result(KexX25519);
+        break;
+    default:
+        res.set_error("Unsupported key exchange group");
     }
-    DH_free(tmp);
+    return res;
+}
 
-    // generate private and public key
-    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new(dh_params, nullptr);
+EVP_PKEY *gen_keypair(kex_group group) {
+    // generate private and public key, either from the DH params or for the
+    // curve
+    EVP_PKEY_CTX *ctx;
+    if (group == KexX25519) {
+        ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_X25519, nullptr);
+    } else {
+        ctx = EVP_PKEY_CTX_new(get_dh_params(), nullptr);
+    }
     if (ctx == nullptr) {
-        EVP_PKEY_free(dh_params);
         handle_errors();
     }
 
     EVP_PKEY *keypair = nullptr;
     if (EVP_PKEY_keygen_init(ctx) != 1) {
-        EVP_PKEY_free(dh_params);
         EVP_PKEY_CTX_free(ctx);
         handle_errors();
     }
     if (EVP_PKEY_keygen(ctx, &keypair) != 1) {
-        EVP_PKEY_free(dh_params);
         EVP_PKEY_CTX_free(ctx);
         handle_errors();
     }
 
-    EVP_PKEY_free(dh_params);
     EVP_PKEY_CTX_free(ctx);
 
     return keypair;
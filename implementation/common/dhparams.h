@@ -1,8 +1,23 @@
+#include "maybe.h"
 #include <openssl/dh.h>
+#include <openssl/evp.h>
+#include <vector>
 
 #ifndef dhparams_h
 #define dhparams_h
 
+// Groups available for the ephemeral key exchange
+enum kex_group { KexDH2048, KexX25519 };
+const std::vector<kex_group> kex_groups = {KexX25519, KexDH2048};
+
 DH *get_dh2048();
-EVP_PKEY *gen_keypair();
-#endif
\ No newline at end of file
+
+/*
+ * Returns the group of a received half key. The group travels with the half
+ * key itself (its PEM encoding), which is covered by both signatures.
+ */
+Maybe<kex_group> get_kex_group(EVP_PKEY *half_key);
+
+/* Generates an ephemeral key pair in the given group */
+EVP_PKEY *gen_keypair(kex_group group);
+#endif
@@ -0,0 +1,381 @@
+#include "diskqueue.h"
+#include <algorithm>
+#include <deque>
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+void DiskQueue::drain() {
+    unique_lock<mutex> lock(pending_mutex);
+    pending_cv.wait(lock, [&] { return pending == 0; });
+}
+
+void DiskQueue::reserve() {
+    unique_lock<mutex> lock(pending_mutex);
+    pending_cv.wait(lock, [&] { return pending < depth; });
+    pending++;
+}
+
+void DiskQueue::complete(void *cookie, ssize_t res) {
+    // The callback runs first: once drained, every one of them has returned
+    callback(cookie, res);
+    {
+        lock_guard<mutex> lock(pending_mutex);
+        pending--;
+    }
+    pending_cv.notify_all();
+}
+
+void DiskQueue::cancel() {
+    {
+        lock_guard<mutex> lock(pending_mutex);
+        pending--;
+    }
+    pending_cv.notify_all();
+}
+
+/*
+ * Queue on an io_uring instance, driven through the raw system calls: the
+ * submitting threads fill the submission ring, a thread of the queue reaps
+ * the completion ring. An operation that completes short is submitted again
+ * for the rest, by the reaper, so that it stops short only at the end of the
+ * file as with ThreadQueue.
+ */
+class UringQueue : public DiskQueue {
+  public:
+    /* Returns nullptr if the kernel does not allow io_uring */
+    static UringQueue *open(int fd, unsigned int depth,
+                            disk_callback callback);
+    ~UringQueue() override;
+
+    Maybe<bool> read(uchar *buf, size_t len, off_t offset,
+                     void *cookie) override {
+        return queue(new Operation{IORING_OP_READ, buf, len, offset, cookie});
+    }
+
+    Maybe<bool> write(const uchar *buf, size_t len, off_t offset,
+                      void *cookie) override {
+        return queue(new Operation{IORING_OP_WRITE, const_cast<uchar *>(buf),
+                                   len, offset, cookie});
+    }
+
+  private:
+    /* An operation in flight, and how much of it is done */
+    struct Operation {
+        uint8_t opcode;
+        uchar *buf;
+        size_t len;
+        off_t offset;
+        void *cookie;
+        size_t done = 0;
+    };
+
+    UringQueue(int fd, unsigned int depth, disk_callback callback)
+        : DiskQueue(depth, callback), fd(fd) {}
+
+    int fd;
+    int ring_fd = -1;
+
+    void *sq_ring = MAP_FAILED;
+    size_t sq_ring_size = 0;
+    void *cq_ring = MAP_FAILED;
+    size_t cq_ring_size = 0;
+    void *sqes = MAP_FAILED;
+    size_t sqes_size = 0;
+
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    io_uring_cqe *cqes;
+
+    mutex submit_mutex;
+    thread reaper;
+    // The operation stopping the reaper
+    Operation stop = {IORING_OP_NOP, nullptr, 0, 0, nullptr};
+
+    bool setup();
+    Maybe<bool> queue(Operation *op);
+    /* Submits what is left to do of [op] */
+    Maybe<bool> submit(Operation *op);
+    void reap();
+};
+
+UringQueue *UringQueue::open(int fd, unsigned int depth,
+                             disk_callback callback) {
+    auto *queue = new UringQueue(fd, depth, callback);
+    if (!queue->setup()) {
+        delete queue;
+        return nullptr;
+    }
+
+    queue->reaper = thread(&UringQueue::reap, queue);
+    return queue;
+}
+
+UringQueue::~UringQueue() {
+    if (reaper.joinable()) {
+        drain();
+
+        // Wake the reaper up with an operation of its own
+        if (submit(&stop).is_error) {
+            // It may never return: leave the rings to it
+            reaper.detach();
+            return;
+        }
+        reaper.join();
+    }
+
+    if (sqes != MAP_FAILED)
+        munmap(sqes, sqes_size);
+    if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+        munmap(cq_ring, cq_ring_size);
+    if (sq_ring != MAP_FAILED)
+        munmap(sq_ring, sq_ring_size);
+    if (ring_fd >= 0)
+        close(ring_fd);
+}
+
+bool UringQueue::setup() {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    // One more entry for the operation stopping the reaper
+    ring_fd = syscall(__NR_io_uring_setup, depth + 1, &params);
+    if (ring_fd < 0) {
+        return false;
+    }
+
+    // Plain reads and writes came along with this feature (Linux 5.6)
+    if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+        return false;
+    }
+
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap) {
+        sq_ring_size = cq_ring_size = max(sq_ring_size, cq_ring_size);
+    }
+
+    sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+        return false;
+    }
+    cq_ring = single_mmap
+                  ? sq_ring
+                  : mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring_fd,
+                         IORING_OFF_CQ_RING);
+    if (cq_ring == MAP_FAILED) {
+        return false;
+    }
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        return false;
+    }
+
+    auto *sq = reinterpret_cast<uchar *>(sq_ring);
+    auto *cq = reinterpret_cast<uchar *>(cq_ring);
+    sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+    return true;
+}
+
+Maybe<bool> UringQueue::queue(Operation *op) {
+    reserve();
+    auto res = submit(op);
+    if (res.is_error) {
+        cancel();
+        delete op;
+    }
+    return res;
+}
+
+Maybe<bool> UringQueue::submit(Operation *op) {
+    Maybe<bool> res;
+    lock_guard<mutex> lock(submit_mutex);
+
+    unsigned tail = *sq_tail;
+    unsigned index = tail & *sq_mask;
+    io_uring_sqe *sqe = reinterpret_cast<io_uring_sqe *>(sqes) + index;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op->opcode;
+    sqe->fd = fd;
+    sqe->off = op->offset + op->done;
+    sqe->addr = reinterpret_cast<uint64_t>(op->buf + op->done);
+    sqe->len = op->len - op->done;
+    sqe->user_data = reinterpret_cast<uint64_t>(op);
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    // The kernel takes the entry right away: the ring never fills up, as the
+    // spot of an operation submitted again is still taken
+    int ret;
+    do {
+        ret = syscall(__NR_io_uring_enter, ring_fd, 1, 0, 0, nullptr, 0);
+    } while (ret < 0 && errno == EINTR);
+    if (ret != 1) {
+        res.set_error("Could not queue a disk operation");
+    }
+    return res;
+}
+
+void UringQueue::reap() {
+    for (;;) {
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            if (syscall(__NR_io_uring_enter, ring_fd, 0, 1,
+                        IORING_ENTER_GETEVENTS, nullptr, 0) < 0 &&
+                errno != EINTR) {
+                return;
+            }
+            continue;
+        }
+
+        io_uring_cqe *cqe = &cqes[head & *cq_mask];
+        auto *op = reinterpret_cast<Operation *>(cqe->user_data);
+        ssize_t res = cqe->res;
+        __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+
+        if (op == &stop) {
+            return;
+        }
+
+        // Short of the end of the file, or interrupted: the rest goes again
+        if (res > 0) {
+            op->done += res;
+        }
+        bool more = (res > 0 && op->done < op->len) || res == -EINTR ||
+                    res == -EAGAIN;
+        if (more && !submit(op).is_error) {
+            continue;
+        }
+        complete(op->cookie, more ? -EIO : res < 0 ? res : op->done);
+        delete op;
+    }
+}
+
+/* Queue run by a few threads of its own, with plain preads and pwrites */
+class ThreadQueue : public DiskQueue {
+  public:
+    ThreadQueue(int fd, unsigned int depth, disk_callback callback);
+    ~ThreadQueue() override;
+
+    Maybe<bool> read(uchar *buf, size_t len, off_t offset,
+                     void *cookie) override {
+        return push({false, buf, len, offset, cookie});
+    }
+
+    Maybe<bool> write(const uchar *buf, size_t len, off_t offset,
+                      void *cookie) override {
+        return push({true, const_cast<uchar *>(buf), len, offset, cookie});
+    }
+
+  private:
+    struct Operation {
+        bool write;
+        uchar *buf;
+        size_t len;
+        off_t offset;
+        void *cookie;
+    };
+
+    int fd;
+    deque<Operation> queued;
+    mutex queued_mutex;
+    condition_variable queued_cv;
+    bool closing = false;
+    vector<thread> workers;
+
+    Maybe<bool> push(Operation op);
+    void work();
+};
+
+ThreadQueue::ThreadQueue(int fd, unsigned int depth, disk_callback callback)
+    : DiskQueue(depth, callback), fd(fd) {
+    for (unsigned int i = 0; i < min(depth, (unsigned int)DISK_THREADS); i++)
+        workers.emplace_back(&ThreadQueue::work, this);
+}
+
+ThreadQueue::~ThreadQueue() {
+    drain();
+    {
+        lock_guard<mutex> lock(queued_mutex);
+        closing = true;
+    }
+    queued_cv.notify_all();
+    for (auto &worker : workers)
+        worker.join();
+}
+
+Maybe<bool> ThreadQueue::push(Operation op) {
+    reserve();
+    {
+        lock_guard<mutex> lock(queued_mutex);
+        queued.push_back(op);
+    }
+    queued_cv.notify_one();
+    return Maybe<bool>();
+}
+
+void ThreadQueue::work() {
+    for (;;) {
+        Operation op;
+        {
+            unique_lock<mutex> lock(queued_mutex);
+            queued_cv.wait(lock, [&] { return !queued.empty() || closing; });
+            if (queued.empty())
+                return;
+            op = queued.front();
+            queued.pop_front();
+        }
+
+        // Stops short only at the end of the file
+        ssize_t done = 0;
+        while ((size_t)done < op.len) {
+            ssize_t len = op.write ? pwrite(fd, op.buf + done, op.len - done,
+                                            op.offset + done)
+                                   : pread(fd, op.buf + done, op.len - done,
+                                           op.offset + done);
+            if (len < 0 && errno == EINTR)
+                continue;
+            if (len < 0) {
+                done = -errno;
+                break;
+            }
+            if (len == 0)
+                break;
+            done += len;
+        }
+        complete(op.cookie, done);
+    }
+}
+
+DiskQueue *open_disk_queue(int fd, unsigned int depth, disk_callback callback) {
+    DiskQueue *queue = UringQueue::open(fd, depth, callback);
+    if (queue == nullptr) {
+        queue = new ThreadQueue(fd, depth, callback);
+    }
+    return queue;
+}
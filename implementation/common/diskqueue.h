@@ -0,0 +1,66 @@
+#include "maybe.h"
+#include "types.h"
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifndef diskqueue_h
+#define diskqueue_h
+
+// Threads running the operations of a queue when io_uring is not available
+#define DISK_THREADS 4
+
+/*
+ * Called once an operation completed, with its cookie and its result: the
+ * number of bytes read (written), or -errno. Runs on a thread of the queue.
+ */
+typedef std::function<void(void *cookie, ssize_t res)> disk_callback;
+
+/*
+ * Reads and writes of a file running in the background, at most [depth] of
+ * them at once, so that a transfer keeps the socket busy while the disk
+ * catches up. They run on io_uring when the kernel has it, on a few threads
+ * otherwise; either way they may complete in any order.
+ */
+class DiskQueue {
+  public:
+    virtual ~DiskQueue() {}
+
+    /*
+     * Queues a read (write) of [len] bytes at [offset] in the file, waiting
+     * first for a free spot if [depth] operations are already in flight. The
+     * buffer must stay untouched until the operation completes.
+     */
+    virtual Maybe<bool> read(uchar *buf, size_t len, off_t offset,
+                             void *cookie) = 0;
+    virtual Maybe<bool> write(const uchar *buf, size_t len, off_t offset,
+                              void *cookie) = 0;
+
+    /* Waits for every operation in flight to complete */
+    void drain();
+
+  protected:
+    DiskQueue(unsigned int depth, disk_callback callback)
+        : depth(depth), callback(callback) {}
+
+    unsigned int depth;
+    disk_callback callback;
+
+    std::mutex pending_mutex;
+    std::condition_variable pending_cv;
+    unsigned int pending = 0;
+
+    /* Takes a spot in the queue, waiting for one to be free */
+    void reserve();
+    /* Reports an operation as completed, freeing its spot */
+    void complete(void *cookie, ssize_t res);
+    /* Gives back a spot that could not be used after all */
+    void cancel();
+};
+
+/* Opens a queue for [fd], on io_uring if the kernel allows it */
+DiskQueue *open_disk_queue(int fd, unsigned int depth, disk_callback callback);
+
+#endif
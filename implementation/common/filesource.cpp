@@ -0,0 +1,191 @@
+#include "filesource.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+class StdioSource : public FileSource {
+  public:
+    // Reads at most [length] bytes, or up to the end if negative
+    StdioSource(FILE *fp, off_t length) : fp(fp), remaining(length) {}
+
+    Maybe<const uchar *> next(uchar *buf, blen max_len, blen &len) override {
+        Maybe<const uchar *> res;
+
+        if (remaining >= 0 && remaining < (off_t)max_len) {
+            max_len = remaining;
+        }
+
+        // When we read less than expected we could either have an error, or
+        // we could have reached eof
+        len = fread(buf, sizeof(*buf), max_len, fp);
+        if (len != max_len && feof(fp) == 0) {
+            res.set_error("Error - Could not read file");
+            return res;
+        }
+        if (remaining >= 0) {
+            remaining -= len;
+        }
+        res.set_result(buf);
+        return res;
+    }
+
+    bool at_end() override { return remaining == 0 || feof(fp) != 0; }
+
+  private:
+    FILE *fp;
+    off_t remaining;
+};
+
+class MmapSource : public FileSource {
+  public:
+    // Reads the map from [offset] to its end
+    MmapSource(uchar *map, size_t size, size_t offset)
+        : map(map), size(size), offset(offset) {}
+    ~MmapSource() override { munmap(map, size); }
+
+    Maybe<const uchar *> next(uchar *buf, blen max_len, blen &len) override {
+        (void)buf;
+        Maybe<const uchar *> res;
+
+        len = size - offset < max_len ? size - offset : max_len;
+        res.set_result(map + offset);
+        offset += len;
+        return res;
+    }
+
+    bool at_end() override { return offset == size; }
+
+  private:
+    uchar *map;
+    size_t size;
+    size_t offset;
+};
+
+class DirectSource : public FileSource {
+  public:
+    // Reads the file from [offset] up to [size], its end
+    DirectSource(int fd, off_t offset, off_t size)
+        : fd(fd), size(size), offset(offset) {
+        flags = fcntl(fd, F_GETFL);
+        // O_DIRECT wants aligned offsets
+        direct = offset % BUFFER_ALIGN == 0 && flags >= 0 &&
+                 fcntl(fd, F_SETFL, flags | O_DIRECT) == 0;
+        if (!direct) {
+            posix_fadvise(fd, offset, size - offset, POSIX_FADV_SEQUENTIAL);
+        }
+    }
+    ~DirectSource() override {
+        if (direct) {
+            fcntl(fd, F_SETFL, flags);
+        }
+    }
+
+    Maybe<const uchar *> next(uchar *buf, blen max_len, blen &len) override {
+        Maybe<const uchar *> res;
+
+        // O_DIRECT wants aligned lengths and offsets: all chunks but the
+        // last one are then a multiple of the alignment
+        blen aligned_len = max_len - max_len % BUFFER_ALIGN;
+        // The range may end before the file does: its last chunk is read in
+        // whole blocks all the same, and cut short
+        if (size - offset < (off_t)aligned_len) {
+            aligned_len = size - offset + BUFFER_ALIGN - 1;
+            aligned_len -= aligned_len % BUFFER_ALIGN;
+        }
+        ssize_t read_len = pread(fd, buf, aligned_len, offset);
+        if (read_len < 0 && errno == EINVAL && direct) {
+            // The file system took the flag, but not the read
+            fcntl(fd, F_SETFL, flags);
+            direct = false;
+            read_len = pread(fd, buf, aligned_len, offset);
+        }
+        if (read_len < 0) {
+            res.set_error("Error - Could not read file");
+            return res;
+        }
+        if (read_len > size - offset) {
+            read_len = size - offset;
+        }
+
+        // Without O_DIRECT, the pages just read are dropped right away
+        if (!direct) {
+            posix_fadvise(fd, offset, read_len, POSIX_FADV_DONTNEED);
+        }
+
+        offset += read_len;
+        // The file shrank in the meantime
+        if (read_len == 0) {
+            size = offset;
+        }
+
+        len = read_len;
+        res.set_result(buf);
+        return res;
+    }
+
+    bool at_end() override { return offset >= size; }
+
+  private:
+    int fd;
+    int flags;
+    bool direct;
+    off_t size;
+    off_t offset;
+};
+
+Maybe<source_backend> parse_source_backend(const char *name) {
+    Maybe<source_backend> res;
+    if (strcmp(name, "stdio") == 0) {
+        res.set_result(SourceStdio);
+    } else if (strcmp(name, "mmap") == 0) {
+        res.set_result(SourceMmap);
+    } else if (strcmp(name, "direct") == 0) {
+        res.set_result(SourceDirect);
+    } else {
+        res.set_error("Unknown file source");
+    }
+    return res;
+}
+
+FileSource *open_source(FILE *fp, source_backend backend) {
+    return open_source(fp, backend, 0, -1);
+}
+
+FileSource *open_source(FILE *fp, source_backend backend, off_t offset,
+                        off_t length) {
+    int fd = fileno(fp);
+    struct stat st;
+    bool regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+
+    // Only a regular file can start anywhere but at its beginning
+    off_t end = length;
+    if (regular) {
+        offset = offset < st.st_size ? offset : st.st_size;
+        end = length < 0 || length > st.st_size - offset ? st.st_size
+                                                         : offset + length;
+        if (offset > 0) {
+            fseeko(fp, offset, SEEK_SET);
+        }
+    }
+
+    if (backend == SourceStdio || !regular || end == offset) {
+        return new StdioSource(fp, regular ? end - offset : length);
+    }
+
+    if (backend == SourceDirect) {
+        return new DirectSource(fd, offset, end);
+    }
+
+    // The map starts at the beginning of the file: offsets of a map have to
+    // be aligned on pages
+    void *map = mmap(nullptr, end, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        return new StdioSource(fp, end - offset);
+    }
+    madvise(reinterpret_cast<uchar *>(map) + offset - offset % BUFFER_ALIGN,
+            end - offset + offset % BUFFER_ALIGN, MADV_SEQUENTIAL);
+    return new MmapSource(reinterpret_cast<uchar *>(map), end, offset);
+}
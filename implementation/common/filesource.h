@@ -0,0 +1,60 @@
+#include "maybe.h"
+#include "types.h"
+#include <stdio.h>
+#include <sys/types.h>
+
+#ifndef filesource_h
+#define filesource_h
+
+// Alignment of the chunk buffers of a session, enough for O_DIRECT reads
+#define BUFFER_ALIGN 4096
+
+/*
+ * How the content of a file is read when sending it:
+ *     - SourceStdio:  buffered reads through stdio (default)
+ *     - SourceMmap:   the file is mapped, and chunks are encrypted straight
+ *                     from the page cache, without copying them first
+ *     - SourceDirect: reads bypass the page cache, with O_DIRECT if the file
+ *                     system supports it or by dropping the pages once read,
+ *                     so that sending cold files does not evict hot ones
+ */
+enum source_backend { SourceStdio, SourceMmap, SourceDirect };
+
+/* Parses the name of a backend: "stdio", "mmap" or "direct" */
+Maybe<source_backend> parse_source_backend(const char *name);
+
+/* Content of a file being sent, a chunk at a time */
+class FileSource {
+  public:
+    virtual ~FileSource() {}
+
+    /*
+     * Reads the next chunk, of at most [max_len] bytes, into [buf] (aligned
+     * on BUFFER_ALIGN) unless it already lies in memory. Returns where the
+     * chunk is, and sets [len] to its length.
+     */
+    virtual Maybe<const uchar *> next(uchar *buf, blen max_len, blen &len) = 0;
+
+    /* Whether the whole file has been read */
+    virtual bool at_end() = 0;
+};
+
+/*
+ * Opens a source reading [fp] from its start with the given backend, or with
+ * stdio if the backend cannot be used for the file (e.g. it is empty, or not
+ * a regular file). The file is still owned by the caller, and must outlive
+ * the source.
+ *
+ * A mapped file must not be truncated while it is being sent.
+ */
+FileSource *open_source(FILE *fp, source_backend backend);
+
+/*
+ * Same as the above, for the [length] bytes of [fp] starting at [offset]
+ * only, or for all of them past it if [length] is negative. A range past the
+ * end of the file is cut short there.
+ */
+FileSource *open_source(FILE *fp, source_backend backend, off_t offset,
+                        off_t length);
+
+#endif
@@ -0,0 +1,229 @@
+#include "frame.h"
+#include "trace.h"
+#include "utils.h"
+#include <algorithm>
+#include <string.h>
+
+using namespace std;
+
+void FrameWriter::append(const void *data, size_t len) {
+    size_t offset = buf.size();
+    buf.resize(offset + len);
+    memcpy(buf.data() + offset, data, len);
+}
+
+FrameWriter &FrameWriter::header(mtypes type) {
+    buf.clear();
+    seq = 0;
+    error = nullptr;
+    bulk = is_bulk(type);
+    mtype m = type;
+    append(&m, sizeof(mtype));
+    return *this;
+}
+
+FrameWriter &FrameWriter::header(mtypes type, seqnum seq, bool compressed) {
+    header(type);
+    if (compressed)
+        buf[0] |= MTYPE_COMPRESSED;
+    append(&seq, sizeof(seqnum));
+    this->seq = seq;
+    return *this;
+}
+
+FrameWriter &FrameWriter::field(blen len, const uchar *data) {
+    auto dst = field_space(len);
+    if (!dst.is_error && len > 0)
+        memcpy(dst.result, data, len);
+    return *this;
+}
+
+Maybe<uchar *> FrameWriter::field_space(blen len) {
+    Maybe<uchar *> res;
+
+    if (bulk) {
+        append(&len, sizeof(blen));
+    } else if (len > FLEN_MAX) {
+        error = "Field too long for the message";
+        res.set_error(error);
+        return res;
+    } else {
+        flen short_len = len;
+        append(&short_len, sizeof(flen));
+    }
+    size_t offset = buf.size();
+    buf.resize(offset + len);
+    res.set_result(buf.data() + offset);
+    return res;
+}
+
+FrameWriter &FrameWriter::tag(const uchar *tag) {
+    append(tag, TAG_LEN);
+    return *this;
+}
+
+Maybe<bool> FrameWriter::flush(int socket) {
+    Maybe<bool> res;
+
+    if (error != nullptr) {
+        res.set_error(error);
+    } else if (!write_exact(socket, buf.data(), buf.size())) {
+        res.set_error("Error when writing frame");
+    } else {
+        TRACE_MESSAGE(socket, TraceSend, buf[0], seq, buf.size());
+    }
+    buf.clear();
+    return res;
+}
+
+bool FrameReader::read(int socket, void *data, size_t len) {
+    uchar *dst = reinterpret_cast<uchar *>(data);
+
+    while (len > 0) {
+        if (start == end) {
+            if (buf.empty())
+                buf.resize(RECV_BUFFER_SIZE);
+
+            // Whatever does not fit in the buffer skips it altogether
+            if (len >= buf.size()) {
+                size_t read_len = read_some(socket, dst, len);
+                if (read_len == 0)
+                    return false;
+                dst += read_len;
+                len -= read_len;
+                continue;
+            }
+
+            start = 0;
+            end = read_some(socket, buf.data(), buf.size());
+            if (end == 0)
+                return false;
+        }
+
+        size_t copy_len = min(len, end - start);
+        memcpy(dst, buf.data() + start, copy_len);
+        start += copy_len;
+        dst += copy_len;
+        len -= copy_len;
+    }
+    return true;
+}
+
+bool FrameReader::read_length(int socket, blen &len) {
+    if (bulk)
+        return read(socket, &len, sizeof(blen));
+
+    flen short_len;
+    if (!read(socket, &short_len, sizeof(flen)))
+        return false;
+    len = short_len;
+    return true;
+}
+
+Maybe<mtypes> FrameReader::get_mtype(int socket) {
+    Maybe<mtypes> res;
+
+    mtype m;
+    if (!read(socket, &m, sizeof(mtype))) {
+        res.set_error("Error when reading mtype");
+        return res;
+    }
+    type = m;
+    compressed = (uchar)m & MTYPE_COMPRESSED;
+    res.set_result((mtypes)((uchar)m & ~MTYPE_COMPRESSED));
+    bulk = is_bulk(res.result);
+    if (compressed && !bulk) {
+        res.set_error("Compressed message of a type that cannot be");
+        return res;
+    }
+
+    TRACE_MESSAGE(socket, TraceRecvType, type, 0, sizeof(mtype));
+    return res;
+}
+
+Maybe<seqnum> FrameReader::read_header(int socket) {
+    Maybe<seqnum> res;
+
+    seqnum seq;
+    if (!read(socket, &seq, sizeof(seqnum))) {
+        res.set_error("Error when reading sequence number");
+        return res;
+    }
+
+    TRACE_MESSAGE(socket, TraceRecvHeader, type, seq, sizeof(seqnum));
+
+    res.set_result(seq);
+    return res;
+}
+
+Maybe<blen> FrameReader::read_field(int socket, uchar *data, blen max_len) {
+    Maybe<blen> res;
+
+    blen len;
+    if (!read_length(socket, len)) {
+        res.set_error("Error when reading field length");
+        return res;
+    }
+    if (len > max_len) {
+        res.set_error("Field longer than expected");
+        return res;
+    }
+    if (!read(socket, data, len)) {
+        res.set_error("Error when reading field");
+        return res;
+    }
+
+    TRACE_MESSAGE(socket, TraceRecvField, type, 0, len);
+
+    res.set_result(len);
+    return res;
+}
+
+Maybe<tuple<flen, uchar *>> FrameReader::read_field(int socket) {
+    Maybe<tuple<flen, uchar *>> res;
+
+    blen len;
+    if (!read_length(socket, len)) {
+        res.set_error("Error when reading field length");
+        return res;
+    }
+    if (len > FLEN_MAX) {
+        res.set_error("Field longer than expected");
+        return res;
+    }
+
+    uchar *r = new uchar[len];
+    if (!read(socket, r, len)) {
+        delete[] r;
+        res.set_error("Error when reading field");
+        return res;
+    }
+
+    TRACE_MESSAGE(socket, TraceRecvField, type, 0, len);
+
+    res.set_result({(flen)len, r});
+    return res;
+}
+
+Maybe<bool> FrameReader::read_tag(int socket, uchar *tag) {
+    Maybe<bool> res;
+
+    if (!read(socket, tag, TAG_LEN)) {
+        res.set_error("Error when reading tag");
+    }
+    return res;
+}
+
+Maybe<uchar *> FrameReader::read_tag(int socket) {
+    Maybe<uchar *> res;
+
+    uchar *tag = new uchar[TAG_LEN];
+    if (read_tag(socket, tag).is_error) {
+        delete[] tag;
+        res.set_error("Error when reading tag");
+        return res;
+    }
+
+    res.set_result(tag);
+    return res;
+}
@@ -0,0 +1,93 @@
+#include "maybe.h"
+#include "types.h"
+#include <stddef.h>
+#include <tuple>
+#include <vector>
+
+#ifndef frame_h
+#define frame_h
+
+// Size of the receive buffer. The rest of a chunk bigger than it is read
+// straight to its destination
+#define RECV_BUFFER_SIZE (2 * MIN_CHUNK_SIZE)
+
+/*
+ * Outgoing message assembled in memory, so that it reaches the socket with a
+ * single write instead of one per part. Parts are appended in the same order
+ * (and with the same layout) as the send_* helpers of utils.h write them.
+ *
+ * The buffer is kept between messages: a writer owned by a session does not
+ * allocate once it has grown to the size of a chunk.
+ *
+ * The field of bulk messages (see is_bulk) is sized by a blen, any other one by
+ * a flen. Only bulk messages may be flagged as compressed.
+ */
+class FrameWriter {
+  public:
+    /* Starts a new message, dropping anything that was not flushed */
+    FrameWriter &header(mtypes type);
+    FrameWriter &header(mtypes type, seqnum seq, bool compressed = false);
+
+    FrameWriter &field(blen len, const uchar *data);
+    /*
+     * Appends a field of [len] bytes, returning where they go for the caller
+     * to write them, up to the next part appended. Fails if [len] is more
+     * than the length of a field of the message can tell (FLEN_MAX unless it
+     * is a bulk one), which then makes flush fail as well.
+     */
+    Maybe<uchar *> field_space(blen len);
+    FrameWriter &tag(const uchar *tag);
+
+    /* Writes the whole message to the socket, if it was assembled whole */
+    Maybe<bool> flush(int socket);
+
+  private:
+    std::vector<uchar> buf;
+    bool bulk = false;
+    // Sequence number of the message, if it has one
+    seqnum seq = 0;
+    // Why the message cannot be sent, if a part did not fit
+    const char *error = nullptr;
+
+    void append(const void *data, size_t len);
+};
+
+/*
+ * Incoming messages of a connection, taken from a buffer that is refilled with
+ * as much as the socket has to give. Parts are returned as the read_* helpers
+ * of utils.h return them, so most messages cost a single read.
+ *
+ * Only one reader may be used for a given socket: whatever it buffered is not
+ * seen by the unbuffered helpers anymore.
+ */
+class FrameReader {
+  public:
+    Maybe<mtypes> get_mtype(int socket);
+    // Whether the content of the message read last is compressed
+    bool is_compressed() const { return compressed; }
+    Maybe<seqnum> read_header(int socket);
+    Maybe<std::tuple<flen, uchar *>> read_field(int socket);
+    Maybe<uchar *> read_tag(int socket);
+
+    // Same as the above, but filling buffers of the caller. A field longer
+    // than max_len is an error
+    Maybe<blen> read_field(int socket, uchar *data, blen max_len);
+    Maybe<bool> read_tag(int socket, uchar *tag);
+
+  private:
+    // Allocated on the first read, so that idle sessions do not pay for it
+    std::vector<uchar> buf;
+    size_t start = 0;
+    size_t end = 0;
+
+    // Whether the message being read is a bulk one, and a compressed one
+    bool bulk = false;
+    bool compressed = false;
+    // Type of the message being read, as read
+    uchar type = 0;
+
+    bool read(int socket, void *data, size_t len);
+    bool read_length(int socket, blen &len);
+};
+
+#endif
@@ -0,0 +1,178 @@
+#include "keypool.h"
+#include <deque>
+#include <map>
+#include <pthread.h>
+#include <sys/mman.h>
+
+using namespace std;
+
+// Counters live in a shared mapping, so that forked children update the
+// counters of the parent
+struct shared_counters {
+    unsigned long hits;
+    unsigned long misses;
+};
+
+static map<kex_group, deque<EVP_PKEY *>> pool;
+static size_t pool_size = 0;
+static bool generator_running = false;
+static shared_counters *counters = nullptr;
+
+// Protects the pool
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+// Held by the generator while it generates: fork waits for it, so that the
+// child never inherits a generation in progress
+static pthread_mutex_t gen_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Returns a group whose pool is not full. Called with pool_mutex held */
+static bool needs_refill(kex_group &group) {
+    for (auto &entry : pool) {
+        if (entry.second.size() < pool_size) {
+            group = entry.first;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void *generator_main(void *arg) {
+    (void)arg;
+    for (;;) {
+        kex_group group;
+        pthread_mutex_lock(&pool_mutex);
+        while (!needs_refill(group))
+            pthread_cond_wait(&pool_cond, &pool_mutex);
+        pthread_mutex_unlock(&pool_mutex);
+
+        pthread_mutex_lock(&gen_mutex);
+        EVP_PKEY *keypair;
+        try {
+            keypair = gen_keypair(group);
+        } catch (char const *) {
+            // Leave it to the handshakes, which will generate them on the
+            // spot, and let the pool be started again
+            pthread_mutex_unlock(&gen_mutex);
+            pthread_mutex_lock(&pool_mutex);
+            generator_running = false;
+            pthread_cond_broadcast(&pool_cond);
+            pthread_mutex_unlock(&pool_mutex);
+            return nullptr;
+        }
+        pthread_mutex_unlock(&gen_mutex);
+
+        pthread_mutex_lock(&pool_mutex);
+        pool[group].push_back(keypair);
+        pthread_mutex_unlock(&pool_mutex);
+    }
+}
+
+static void fork_prepare() {
+    pthread_mutex_lock(&gen_mutex);
+    pthread_mutex_lock(&pool_mutex);
+}
+
+/* The first key pair of every group now belongs to the child */
+static void fork_parent() {
+    for (auto &entry : pool) {
+        if (!entry.second.empty()) {
+            EVP_PKEY_free(entry.second.front());
+            entry.second.pop_front();
+        }
+    }
+    pthread_cond_signal(&pool_cond);
+    pthread_mutex_unlock(&pool_mutex);
+    pthread_mutex_unlock(&gen_mutex);
+}
+
+/* Keeps the first key pair of every group only, the rest is the parent's */
+static void fork_child() {
+    for (auto &entry : pool) {
+        while (entry.second.size() > 1) {
+            EVP_PKEY_free(entry.second.back());
+            entry.second.pop_back();
+        }
+    }
+    // Threads do not survive a fork
+    generator_running = false;
+    pool_size = 0;
+    pthread_mutex_unlock(&pool_mutex);
+    pthread_mutex_unlock(&gen_mutex);
+}
+
+void start_key_pool(size_t size, const vector<kex_group> &groups) {
+    if (size == 0)
+        return;
+
+    if (counters == nullptr) {
+        void *mem = mmap(nullptr, sizeof(shared_counters),
+                         PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                         -1, 0);
+        if (mem != MAP_FAILED)
+            counters = static_cast<shared_counters *>(mem);
+    }
+
+    pthread_mutex_lock(&pool_mutex);
+    if (generator_running) {
+        pthread_mutex_unlock(&pool_mutex);
+        return;
+    }
+    // Set before the generator runs, which clears it if it gives up
+    generator_running = true;
+    pool_size = size;
+    for (auto group : groups)
+        pool[group];
+    pthread_mutex_unlock(&pool_mutex);
+
+    static bool atfork_registered = false;
+    if (!atfork_registered) {
+        pthread_atfork(fork_prepare, fork_parent, fork_child);
+        atfork_registered = true;
+    }
+
+    pthread_t generator;
+    if (pthread_create(&generator, nullptr, generator_main, nullptr) != 0) {
+        pthread_mutex_lock(&pool_mutex);
+        generator_running = false;
+        pthread_mutex_unlock(&pool_mutex);
+        return;
+    }
+    pthread_detach(generator);
+}
+
+EVP_PKEY *get_keypair(kex_group group) {
+    EVP_PKEY *keypair = nullptr;
+
+    pthread_mutex_lock(&pool_mutex);
+    auto entry = pool.find(group);
+    if (entry != pool.end() && !entry->second.empty()) {
+        keypair = entry->second.front();
+        entry->second.pop_front();
+        pthread_cond_signal(&pool_cond);
+    }
+    pthread_mutex_unlock(&pool_mutex);
+
+    if (counters != nullptr) {
+        __atomic_add_fetch(keypair != nullptr ? &counters->hits
+                                              : &counters->misses,
+                           1, __ATOMIC_RELAXED);
+    }
+
+    if (keypair == nullptr)
+        keypair = gen_keypair(group);
+    return keypair;
+}
+
+key_pool_stats get_key_pool_stats() {
+    key_pool_stats stats = {0, 0, 0};
+    if (counters != nullptr) {
+        stats.hits = __atomic_load_n(&counters->hits, __ATOMIC_RELAXED);
+        stats.misses = __atomic_load_n(&counters->misses, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_lock(&pool_mutex);
+    for (auto &entry : pool)
+        stats.available += entry.second.size();
+    pthread_mutex_unlock(&pool_mutex);
+    return stats;
+}
@@ -0,0 +1,36 @@
+#include "dhparams.h"
+#include <openssl/evp.h>
+#include <vector>
+
+#ifndef keypool_h
+#define keypool_h
+
+struct key_pool_stats {
+    // Key pairs handed out straight from the pool
+    unsigned long hits;
+    // Key pairs that had to be generated on the spot
+    unsigned long misses;
+    // Key pairs ready in the pool right now
+    unsigned long available;
+};
+
+/*
+ * Starts a background thread keeping up to [size] ephemeral key pairs ready
+ * for each of the given groups. Should a generation fail, the thread stops,
+ * and the pool may be started again.
+ *
+ * A forked child keeps a single key pair per group, which the parent drops,
+ * so that no key pair is ever used twice. The child has no generator. The
+ * counters are shared with every child forked afterwards.
+ */
+void start_key_pool(size_t size, const std::vector<kex_group> &groups);
+
+/*
+ * Returns a fresh key pair in the given group: from the pool when possible,
+ * generated on the spot otherwise (or if the pool was never started).
+ */
+EVP_PKEY *get_keypair(kex_group group);
+
+key_pool_stats get_key_pool_stats();
+
+#endif
@@ -0,0 +1,187 @@
+#include "merkle.h"
+#include "utils.h"
+#include <algorithm>
+#include <string.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Prefixes of the hashes of the leaves and of the nodes above them, so that
+// no leaf can pass for a node
+#define LEAF_PREFIX 0x00
+#define NODE_PREFIX 0x01
+
+uint32_t merkle_levels(uint64_t size) {
+    uint64_t nodes = merkle_nodes(size, 0);
+    uint32_t levels = 1;
+    for (; nodes > 1; nodes = (nodes + 1) / 2)
+        levels++;
+    return levels;
+}
+
+uint64_t merkle_nodes(uint64_t size, uint32_t level) {
+    uint64_t nodes = size == 0 ? 1 : (size - 1) / MERKLE_LEAF_LEN + 1;
+    for (uint32_t i = 0; i < level; i++)
+        nodes = (nodes + 1) / 2;
+    return nodes;
+}
+
+/* Writes (reads) the [len] bytes of [data] at [offset] of [fd] */
+static bool write_at(int fd, const uchar *data, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, data, len, offset);
+        if (n <= 0)
+            return false;
+        data += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+static bool read_at(int fd, uchar *data, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t n = pread(fd, data, len, offset);
+        if (n <= 0)
+            return false;
+        data += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+/*
+ * Sets the (nodes + 1) / 2 nodes of [above] to those over the [nodes] nodes
+ * of [below]
+ */
+static bool combine(const uchar *below, uint64_t nodes, uchar *above) {
+    uchar pair[1 + 2 * MERKLE_HASH_LEN];
+    pair[0] = NODE_PREFIX;
+    for (uint64_t i = 0; i < nodes; i += 2) {
+        uchar *node = above + (i / 2) * MERKLE_HASH_LEN;
+        const uchar *left = below + i * MERKLE_HASH_LEN;
+        if (i + 1 == nodes) {
+            memcpy(node, left, MERKLE_HASH_LEN);
+            continue;
+        }
+        memcpy(pair + 1, left, 2 * MERKLE_HASH_LEN);
+        if (EVP_Digest(pair, sizeof(pair), node, nullptr, get_hash_type(),
+                       nullptr) != 1)
+            return false;
+    }
+    return true;
+}
+
+MerkleBuilder::MerkleBuilder() : ctx(EVP_MD_CTX_new()) {}
+
+MerkleBuilder::MerkleBuilder(int fd, off_t offset)
+    : ctx(EVP_MD_CTX_new()), fd(fd), offset(offset) {}
+
+MerkleBuilder::~MerkleBuilder() { EVP_MD_CTX_free(ctx); }
+
+bool MerkleBuilder::start_leaf() {
+    const uchar prefix = LEAF_PREFIX;
+    in_leaf = true;
+    leaf_len = 0;
+    return ctx != nullptr &&
+           EVP_DigestInit_ex(ctx, get_hash_type(), nullptr) == 1 &&
+           EVP_DigestUpdate(ctx, &prefix, sizeof(prefix)) == 1;
+}
+
+bool MerkleBuilder::end_leaf() {
+    in_leaf = false;
+    size_t end = leaves.size();
+    leaves.resize(end + MERKLE_HASH_LEN);
+    if (EVP_DigestFinal_ex(ctx, leaves.data() + end, nullptr) != 1)
+        return false;
+    return fd < 0 || leaves.size() < MERKLE_BLOCK_NODES * MERKLE_HASH_LEN ||
+           flush_leaves();
+}
+
+bool MerkleBuilder::flush_leaves() {
+    if (!write_at(fd, leaves.data(), leaves.size(),
+                  offset + written * MERKLE_HASH_LEN))
+        return false;
+    written += leaves.size() / MERKLE_HASH_LEN;
+    leaves.clear();
+    return true;
+}
+
+bool MerkleBuilder::update(const uchar *data, size_t len) {
+    while (len > 0) {
+        // A full leaf is only ended once the file goes on past it
+        if (in_leaf && leaf_len == MERKLE_LEAF_LEN && !end_leaf())
+            return false;
+        if (!in_leaf && !start_leaf())
+            return false;
+        size_t n = min(len, (size_t)MERKLE_LEAF_LEN - leaf_len);
+        if (EVP_DigestUpdate(ctx, data, n) != 1)
+            return false;
+        leaf_len += n;
+        size += n;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool MerkleBuilder::finish(MerkleTree &tree) {
+    if ((!in_leaf && !start_leaf()) || !end_leaf())
+        return false;
+
+    tree.size = size;
+    tree.levels.clear();
+    tree.levels.push_back(move(leaves));
+    leaves.clear();
+    while (tree.levels.back().size() > MERKLE_HASH_LEN) {
+        const vector<uchar> &below = tree.levels.back();
+        uint64_t nodes = below.size() / MERKLE_HASH_LEN;
+        vector<uchar> level(((nodes + 1) / 2) * MERKLE_HASH_LEN);
+        if (!combine(below.data(), nodes, level.data()))
+            return false;
+        tree.levels.push_back(move(level));
+    }
+    return true;
+}
+
+bool MerkleBuilder::finish() {
+    if ((!in_leaf && !start_leaf()) || !end_leaf() || !flush_leaves())
+        return false;
+
+    // Each level is read back a block at a time, an even number of its
+    // nodes, for those of the next one to be written after it
+    vector<uchar> below(2 * MERKLE_BLOCK_NODES * MERKLE_HASH_LEN);
+    vector<uchar> above(MERKLE_BLOCK_NODES * MERKLE_HASH_LEN);
+    off_t from = offset;
+    for (uint64_t nodes = written; nodes > 1; nodes = (nodes + 1) / 2) {
+        off_t to = from + nodes * MERKLE_HASH_LEN;
+        for (uint64_t i = 0; i < nodes; i += 2 * MERKLE_BLOCK_NODES) {
+            uint64_t n = min(nodes - i, (uint64_t)2 * MERKLE_BLOCK_NODES);
+            if (!read_at(fd, below.data(), n * MERKLE_HASH_LEN,
+                         from + i * MERKLE_HASH_LEN) ||
+                !combine(below.data(), n, above.data()) ||
+                !write_at(fd, above.data(), (n + 1) / 2 * MERKLE_HASH_LEN,
+                          to + i / 2 * MERKLE_HASH_LEN))
+                return false;
+        }
+        from = to;
+    }
+    return true;
+}
+
+bool merkle_source(FileSource &source, MerkleBuilder &builder) {
+    vector<uchar> buf(DEFAULT_CHUNK_SIZE);
+    while (!source.at_end()) {
+        blen len;
+        auto next_res = source.next(buf.data(), buf.size(), len);
+        if (next_res.is_error || !builder.update(next_res.result, len))
+            return false;
+    }
+    return true;
+}
+
+bool merkle_source(FileSource &source, MerkleTree &tree) {
+    MerkleBuilder builder;
+    return merkle_source(source, builder) && builder.finish(tree);
+}
@@ -0,0 +1,121 @@
+#include "filesource.h"
+#include "types.h"
+#include <openssl/evp.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <vector>
+
+#ifndef merkle_h
+#define merkle_h
+
+/*
+ * Merkle tree of the content of a file, for two copies of it to be compared
+ * a few hashes at a time instead of byte by byte:
+ *     - the leaves are the hashes of the blocks of MERKLE_LEAF_LEN bytes of
+ *       the file, the last one possibly shorter, each prefixed with a 0 byte.
+ *       An empty file has a single leaf, of no bytes.
+ *     - every level above has a node for each two of the level below: the
+ *       hash of both, prefixed with a 1 byte. The last node of a level of an
+ *       odd number of them is taken up as it is.
+ *     - the last level holds the root alone
+ * Levels are numbered from the leaves, 0, up: the shape of the tree only
+ * depends on the size of the file. Two copies of the same size whose nodes
+ * differ differ within the bytes below those nodes, and nowhere else.
+ *
+ * The blocks do not depend on the size of the chunks of the transfers, so
+ * that the tree can be built as the chunks of the file go by, whatever their
+ * size.
+ */
+
+#define MERKLE_LEAF_LEN (64 * 1024)
+// Size of the hash of a node (get_hash_type())
+#define MERKLE_HASH_LEN FILE_HASH_LEN
+// Nodes a builder into a file holds at most before writing them, or reads
+// at once from the level below as it builds the next one: twice as many
+#define MERKLE_BLOCK_NODES 4096
+
+/* Levels of the tree of a file of [size] bytes, the leaves included */
+uint32_t merkle_levels(uint64_t size);
+
+/* Nodes at [level] of the tree of a file of [size] bytes */
+uint64_t merkle_nodes(uint64_t size, uint32_t level);
+
+/*
+ * The tree of a file of [size] bytes, as the MERKLE_HASH_LEN bytes of each
+ * node of each of its levels, from the leaves up
+ */
+struct MerkleTree {
+    uint64_t size = 0;
+    std::vector<std::vector<uchar>> levels;
+
+    const uchar *node(uint32_t level, uint64_t i) const {
+        return levels[level].data() + i * MERKLE_HASH_LEN;
+    }
+    const uchar *root() const { return levels.back().data(); }
+};
+
+/*
+ * Builds the tree of a file from its bytes, given in order: in memory, or
+ * into a file, so that only MERKLE_BLOCK_NODES nodes at a time are ever held
+ * in memory, however large the file
+ */
+class MerkleBuilder {
+  public:
+    MerkleBuilder();
+    /*
+     * Writes the nodes into [fd] from [offset] on, as a MerkleTree holds
+     * them: level after level, from the leaves up
+     */
+    MerkleBuilder(int fd, off_t offset);
+    ~MerkleBuilder();
+
+    MerkleBuilder(const MerkleBuilder &) = delete;
+    MerkleBuilder &operator=(const MerkleBuilder &) = delete;
+
+    /* Adds the next [len] bytes of the file. Returns false on failure. */
+    bool update(const uchar *data, size_t len);
+
+    /*
+     * Ends the file, setting [tree] to its tree, of a builder in memory.
+     * Returns false on failure.
+     */
+    bool finish(MerkleTree &tree);
+
+    /*
+     * Ends the file, writing the levels above the leaves, of a builder into
+     * a file. Returns false on failure.
+     */
+    bool finish();
+
+    /* Bytes of the file added so far */
+    uint64_t length() const { return size; }
+
+  private:
+    // Hash of the leaf being built, if one is
+    EVP_MD_CTX *ctx;
+    bool in_leaf = false;
+    size_t leaf_len = 0;
+    uint64_t size = 0;
+    // Leaves not written yet, all of them if kept in memory
+    std::vector<uchar> leaves;
+    // File the nodes are written to, if any, and the leaves written so far
+    int fd = -1;
+    off_t offset = 0;
+    uint64_t written = 0;
+
+    bool start_leaf();
+    bool end_leaf();
+    bool flush_leaves();
+};
+
+/*
+ * Adds whatever [source] holds to [builder]. Returns false if it could not
+ * be read.
+ */
+bool merkle_source(FileSource &source, MerkleBuilder &builder);
+
+/* Builds into [tree] the tree of whatever [source] holds, in memory */
+bool merkle_source(FileSource &source, MerkleTree &tree);
+
+#endif
@@ -0,0 +1,448 @@
+#include "mux.h"
+#include "errors.h"
+#include "utils.h"
+#include <algorithm>
+#include <csignal>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace std;
+
+typedef vector<pair<mtypes, vector<uchar>>> Messages;
+
+/* Content of a message about stream [id], followed by [len] bytes at [data] */
+static vector<uchar> stream_message(uint32_t id, const void *data = nullptr,
+                                    size_t len = 0) {
+    vector<uchar> content(sizeof(id) + len);
+    memcpy(content.data(), &id, sizeof(id));
+    if (len > 0)
+        memcpy(content.data() + sizeof(id), data, len);
+    return content;
+}
+
+Mux::Mux(Session &session, session_role role) : session(session), role(role) {
+    if (pipe(wake_pipe) != 0) {
+        handle_errors("Could not create the pipe of the multiplexing");
+    }
+    if (fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK) != 0 ||
+        fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK) != 0) {
+        close(wake_pipe[0]);
+        close(wake_pipe[1]);
+        handle_errors("Could not create the pipe of the multiplexing");
+    }
+}
+
+Mux::~Mux() {
+    if (writer.joinable() || reader.joinable() || !handlers.empty()) {
+        fail("The multiplexing was abandoned");
+        join();
+    }
+    for (auto &[id, stream] : streams)
+        close(stream.fd);
+    close(wake_pipe[0]);
+    close(wake_pipe[1]);
+}
+
+bool Mux::start() {
+    epoch = session.send_seq;
+    send_message(session, MuxStart, nullptr, 0);
+    vector<uchar> pt;
+    if (!receive_message(session, MuxStartAns, pt, 0)) {
+        return false;
+    }
+
+    // A stream closed by the other party must fail the writes of its
+    // session, not end the process
+    signal(SIGPIPE, SIG_IGN);
+    writer = thread(&Mux::write_loop, this);
+    reader = thread(&Mux::read_loop, this);
+    return true;
+}
+
+Session *Mux::open_stream() {
+    lock_guard<std::mutex> lock(mutex);
+    if (error != nullptr) {
+        handle_errors(error);
+    }
+    if (streams.size() >= MUX_MAX_STREAMS) {
+        handle_errors("Too many streams open");
+    }
+
+    uint32_t id = next_id++;
+    Session *stream = add_stream(id);
+    control.emplace_back(MuxOpen, stream_message(id));
+    wake();
+    return stream;
+}
+
+void Mux::end() {
+    {
+        unique_lock<std::mutex> lock(mutex);
+        streams_cv.wait(lock,
+                        [&] { return streams.empty() || error != nullptr; });
+        ending = true;
+        wake();
+    }
+    join();
+    if (error != nullptr) {
+        handle_errors(error);
+    }
+}
+
+void Mux::serve(seqnum epoch, stream_handler handler) {
+    this->epoch = epoch;
+    this->handler = handler;
+    send_message(session, MuxStartAns, nullptr, 0);
+
+    signal(SIGPIPE, SIG_IGN);
+    writer = thread(&Mux::write_loop, this);
+    read_loop();
+    join();
+    if (error != nullptr) {
+        handle_errors(error);
+    }
+}
+
+Session *Mux::add_stream(uint32_t id) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        handle_errors("Could not create a stream");
+    }
+    Session *stream = new Session(fds[1], role);
+    stream->chunk_size = session.chunk_size;
+    stream->cipher_threads = session.cipher_threads;
+    stream->read_backend = session.read_backend;
+    stream->disk_depth = session.disk_depth;
+    stream->compression = session.compression;
+    stream->suite = session.suite;
+    stream->username = new char[strlen(session.username) + 1];
+    strcpy(stream->username, session.username);
+
+    auto key_res =
+        derive_stream_key(session.key, get_symmetric_key_length(), epoch, id);
+    if (key_res.is_error) {
+        close(fds[0]);
+        delete stream;
+        handle_errors(key_res.error);
+    }
+    stream->set_key(key_res.result);
+
+    streams[id].fd = fds[0];
+    return stream;
+}
+
+void Mux::wake() {
+    // A full pipe already wakes the writer
+    char c = 0;
+    if (write(wake_pipe[1], &c, 1) < 0) {
+    }
+}
+
+void Mux::fail(const char *ex) {
+    lock_guard<std::mutex> lock(mutex);
+    if (error == nullptr)
+        error = ex;
+    // The streams see the end of their sockets, and the threads of the
+    // session are woken from whatever they wait for
+    for (auto &[id, stream] : streams)
+        shutdown(stream.fd, SHUT_RDWR);
+    shutdown(session.sock, SHUT_RDWR);
+    wake();
+    streams_cv.notify_all();
+}
+
+void Mux::join() {
+    if (writer.joinable())
+        writer.join();
+    if (reader.joinable())
+        reader.join();
+    for (auto &handler : handlers)
+        handler.join();
+    handlers.clear();
+}
+
+void Mux::deliver(uint32_t id, Stream &stream, Messages &out) {
+    while (stream.pending_start < stream.pending.size()) {
+        ssize_t len = send(stream.fd, stream.pending.data() + stream.pending_start,
+                           stream.pending.size() - stream.pending_start,
+                           MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (len > 0) {
+            stream.pending_start += len;
+            stream.delivered += len;
+        } else if (len < 0 && errno == EINTR) {
+            continue;
+        } else if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            // The stream is gone, and so is whatever it did not take
+            stream.pending_start = stream.pending.size();
+        }
+    }
+    if (stream.pending_start == stream.pending.size()) {
+        stream.pending.clear();
+        stream.pending_start = 0;
+    }
+
+    // Nothing more is sent once the other side closed the stream
+    if (stream.delivered >= MUX_WINDOW / 2 && !stream.remote_closed) {
+        out.emplace_back(MuxWindow,
+                         stream_message(id, &stream.delivered,
+                                        sizeof(stream.delivered)));
+        stream.delivered = 0;
+    }
+}
+
+void Mux::write_loop() {
+    try {
+        // Stream of the poll set the round starts from, for every stream
+        // ready to be first in turn
+        size_t turn = 0;
+        for (;;) {
+            vector<pollfd> fds{{wake_pipe[0], POLLIN, 0}};
+            vector<uint32_t> ids;
+            bool idle;
+            {
+                lock_guard<std::mutex> lock(mutex);
+                if (error != nullptr) {
+                    return;
+                }
+                for (auto &[id, stream] : streams) {
+                    short events = 0;
+                    if (!stream.local_closed && stream.credit > 0)
+                        events |= POLLIN;
+                    if (stream.pending_start < stream.pending.size())
+                        events |= POLLOUT;
+                    if (events != 0) {
+                        fds.push_back({stream.fd, events, 0});
+                        ids.push_back(id);
+                    }
+                }
+                idle = control.empty() && !(ending && streams.empty());
+            }
+
+            if (poll(fds.data(), fds.size(), idle ? -1 : 0) < 0 &&
+                errno != EINTR) {
+                handle_errors("Could not poll the streams");
+            }
+            if (fds[0].revents != 0) {
+                char buf[64];
+                while (read(wake_pipe[0], buf, sizeof(buf)) > 0)
+                    ;
+            }
+
+            Messages out;
+            bool last = false;
+            {
+                lock_guard<std::mutex> lock(mutex);
+                out.swap(control);
+
+                // A frame of each stream that has one, so that none waits
+                // for more than a frame of every other one
+                for (size_t k = 0; k < ids.size(); k++) {
+                    size_t i = (turn + k) % ids.size();
+                    auto it = streams.find(ids[i]);
+                    if (fds[i + 1].revents == 0 || it == streams.end())
+                        continue;
+                    auto &stream = it->second;
+
+                    deliver(ids[i], stream, out);
+                    if (stream.local_closed || stream.credit == 0)
+                        continue;
+                    size_t len = min((size_t)MUX_FRAME_LEN,
+                                     (size_t)stream.credit);
+                    vector<uchar> frame(sizeof(uint32_t) + len);
+                    ssize_t read_len = recv(stream.fd,
+                                            frame.data() + sizeof(uint32_t),
+                                            len, MSG_DONTWAIT);
+                    if (read_len > 0) {
+                        memcpy(frame.data(), &ids[i], sizeof(uint32_t));
+                        frame.resize(sizeof(uint32_t) + read_len);
+                        stream.credit -= read_len;
+                        out.emplace_back(MuxData, move(frame));
+                    } else if (read_len == 0 ||
+                               (errno != EAGAIN && errno != EWOULDBLOCK &&
+                                errno != EINTR)) {
+                        stream.local_closed = true;
+                        out.emplace_back(MuxClose, stream_message(ids[i]));
+                    }
+                }
+                turn++;
+
+                for (auto it = streams.begin(); it != streams.end();) {
+                    auto &stream = it->second;
+                    bool drained = stream.pending.empty();
+                    if (stream.remote_closed && drained && !stream.shut) {
+                        shutdown(stream.fd, SHUT_WR);
+                        stream.shut = true;
+                    }
+                    if (stream.local_closed && stream.remote_closed &&
+                        drained) {
+                        close(stream.fd);
+                        it = streams.erase(it);
+                        streams_cv.notify_all();
+                    } else {
+                        ++it;
+                    }
+                }
+
+                if (ending && streams.empty()) {
+                    out.emplace_back(MuxEnd, vector<uchar>());
+                    last = true;
+                }
+            }
+
+            for (auto &[type, content] : out) {
+                if (type == MuxData) {
+                    auto send_res = session.out.header(MuxData)
+                                        .field(content.size(), content.data())
+                                        .flush(session.sock);
+                    if (send_res.is_error) {
+                        handle_errors(send_res.error);
+                    }
+                    continue;
+                }
+                if (session.is_exhausted()) {
+                    handle_errors("Sequence number is about to wrap around");
+                }
+                send_message(session, type, content.data(), content.size());
+            }
+            if (last) {
+                return;
+            }
+        }
+    } catch (char const *ex) {
+        fail(ex);
+    }
+}
+
+void Mux::read_loop() {
+    try {
+        for (;;) {
+            auto mtype_res = session.in.get_mtype(session.sock);
+            if (mtype_res.is_error) {
+                handle_errors("Connection lost during the multiplexing");
+            }
+            mtypes type = mtype_res.result;
+
+            vector<uchar> pt;
+            switch (type) {
+            case MuxOpen:
+            case MuxClose:
+                open_message(session, type, pt, sizeof(uint32_t));
+                break;
+            case MuxData: {
+                pt.resize(sizeof(uint32_t) + MUX_FRAME_LEN);
+                auto field_res =
+                    session.in.read_field(session.sock, pt.data(), pt.size());
+                if (field_res.is_error) {
+                    handle_errors(field_res.error);
+                }
+                pt.resize(field_res.result);
+                break;
+            }
+            case MuxWindow:
+                open_message(session, type, pt, 2 * sizeof(uint32_t));
+                break;
+            case MuxEnd:
+                open_message(session, type, pt, 0);
+                break;
+            default:
+                handle_errors("Unexpected message during the multiplexing");
+            }
+
+            unique_lock<std::mutex> lock(mutex);
+            if (type == MuxEnd) {
+                // The client ends it once every stream is closed, and the
+                // server answers once it closed them too
+                for (auto &[id, stream] : streams) {
+                    if (!stream.local_closed || !stream.remote_closed) {
+                        handle_errors("Multiplexing ended with streams open");
+                    }
+                }
+                if (role == RoleClient && !ending) {
+                    handle_errors("Multiplexing ended by the server");
+                }
+                ending = true;
+                wake();
+                return;
+            }
+
+            if (pt.size() < sizeof(uint32_t)) {
+                handle_errors("Malformed multiplexing message");
+            }
+            uint32_t id;
+            memcpy(&id, pt.data(), sizeof(id));
+
+            if (type == MuxOpen) {
+                if (role != RoleServer || streams.count(id) > 0 ||
+                    streams.size() >= MUX_MAX_STREAMS) {
+                    handle_errors("Invalid stream opened");
+                }
+                handlers.emplace_back(handler, add_stream(id));
+                // For the writer to poll it too
+                wake();
+                continue;
+            }
+
+            auto it = streams.find(id);
+            if (it == streams.end()) {
+                // What was granted may come after the stream was done with
+                if (type == MuxWindow)
+                    continue;
+                handle_errors("Message of an unknown stream");
+            }
+            auto &stream = it->second;
+
+            if (type == MuxData) {
+                size_t len = pt.size() - sizeof(uint32_t);
+                if (stream.remote_closed ||
+                    stream.pending.size() - stream.pending_start + len >
+                        MUX_WINDOW) {
+                    handle_errors("Stream data beyond its window");
+                }
+                // What was handed over is dropped once it is most of the
+                // buffer
+                if (stream.pending_start > stream.pending.size() / 2) {
+                    stream.pending.erase(stream.pending.begin(),
+                                         stream.pending.begin() +
+                                             stream.pending_start);
+                    stream.pending_start = 0;
+                }
+                stream.pending.insert(stream.pending.end(),
+                                      pt.begin() + sizeof(uint32_t), pt.end());
+
+                // Straight to the stream, if it takes it: the writer only
+                // hears of what is left, and of the grants
+                size_t grants = control.size();
+                deliver(id, stream, control);
+                if (!stream.pending.empty() || control.size() > grants)
+                    wake();
+            } else if (type == MuxWindow) {
+                uint32_t grant;
+                if (pt.size() != 2 * sizeof(uint32_t)) {
+                    handle_errors("Malformed multiplexing message");
+                }
+                memcpy(&grant, pt.data() + sizeof(uint32_t), sizeof(grant));
+                if (grant > MUX_WINDOW - stream.credit) {
+                    handle_errors("Stream granted beyond its window");
+                }
+                bool stalled = stream.credit == 0;
+                stream.credit += grant;
+                if (stalled)
+                    wake();
+            } else {
+                if (stream.remote_closed) {
+                    handle_errors("Stream closed twice");
+                }
+                stream.remote_closed = true;
+                wake();
+            }
+        }
+    } catch (char const *ex) {
+        fail(ex);
+    }
+}
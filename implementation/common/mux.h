@@ -0,0 +1,151 @@
+#include "session.h"
+#include "types.h"
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+#ifndef mux_h
+#define mux_h
+
+/*
+ * Multiplexing: streams of requests run at once over a single authenticated
+ * session, instead of one request after the other.
+ *
+ * The client starts it with a MuxStart, answered by a MuxStartAns, then opens
+ * each stream with a MuxOpen. A stream is an ordinary session, with a key of
+ * its own (see derive_stream_key) and no authentication: any request but the
+ * logout runs on it as it would on a connection. Its bytes are carried by
+ * MuxData messages of the session, [stream id][bytes], at most MUX_FRAME_LEN
+ * bytes of a single stream each, so that the streams take turns on the
+ * connection a frame at a time: a listing gets through while a download is
+ * running, behind a frame of every other stream at most. The bytes of a
+ * stream being sealed with its key already, a MuxData is not sealed again,
+ * nor numbered: a frame that was changed, cut or moved to another stream
+ * fails the stream it reaches. Every other message of the multiplexing is.
+ *
+ * A party sends no more than MUX_WINDOW bytes of a stream the other one has
+ * not consumed yet. The other one grants more with a MuxWindow, [stream
+ * id][bytes], once it handed half a window over to the stream: a stream whose
+ * reader lags behind stops its writer, and no other stream.
+ *
+ * Either party ends its side of a stream with a MuxClose, [stream id], once
+ * the stream has nothing more to send. Once every stream is closed on both
+ * sides, the client sends a MuxEnd, answered by a MuxEnd, and the session
+ * goes back to serving requests one after the other.
+ */
+
+// Bytes of a stream carried by a MuxData at most
+#define MUX_FRAME_LEN 65536
+// Bytes of a stream sent at most, and not consumed yet by the other party
+#define MUX_WINDOW (512 * 1024)
+// Streams of a session open at once at most
+#define MUX_MAX_STREAMS 64
+
+/* Serves a stream, taking ownership of its session */
+typedef std::function<void(Session *stream)> stream_handler;
+
+/*
+ * The streams of a session, moved to and from the connection by two threads:
+ * one reading every message of the session, one writing them. Nothing else
+ * may use the session until the multiplexing is over.
+ */
+class Mux {
+  public:
+    Mux(Session &session, session_role role);
+    ~Mux();
+
+    Mux(const Mux &) = delete;
+    Mux &operator=(const Mux &) = delete;
+
+    /*
+     * Client side: starts the multiplexing. Returns false if the server
+     * refused it, with an Error whose content is written on the standard
+     * output. Errors are thrown through handle_errors.
+     */
+    bool start();
+
+    /*
+     * Client side: opens a new stream, whose session belongs to the caller
+     * and closes the stream once destroyed. Any thread may open streams and
+     * run them.
+     */
+    Session *open_stream();
+
+    /*
+     * Client side: waits for every stream to be closed, then ends the
+     * multiplexing. Errors of the session, and of the streams it cut short,
+     * are thrown through handle_errors.
+     */
+    void end();
+
+    /*
+     * Server side: answers the MuxStart numbered [epoch], whose content was
+     * read, and serves the streams until the client ends the multiplexing,
+     * running [handler] on a thread of its own for each one. Returns once
+     * every handler did; errors are thrown through handle_errors.
+     */
+    void serve(seqnum epoch, stream_handler handler);
+
+  private:
+    struct Stream {
+        // End of the stream the multiplexing reads and writes
+        int fd;
+        // Bytes received, not handed over to the stream yet
+        std::vector<uchar> pending;
+        size_t pending_start = 0;
+        // Bytes that may still be sent
+        uint32_t credit = MUX_WINDOW;
+        // Bytes handed over to the stream, not granted back yet
+        uint32_t delivered = 0;
+        // Whether the MuxClose of this (the other) side was sent
+        bool local_closed = false;
+        bool remote_closed = false;
+        // Whether the stream was told that nothing more is coming
+        bool shut = false;
+    };
+
+    Session &session;
+    session_role role;
+    // Sequence number of the MuxStart, for the keys of the streams
+    seqnum epoch = 0;
+
+    std::mutex mutex;
+    // Signalled whenever a stream is done with
+    std::condition_variable streams_cv;
+    std::map<uint32_t, Stream> streams;
+    uint32_t next_id = 0;
+    // Messages of the writer other than the data, e.g. the opening of a
+    // stream, sent before any data of the round
+    std::vector<std::pair<mtypes, std::vector<uchar>>> control;
+    // Whether the writer sends the MuxEnd once no stream is left
+    bool ending = false;
+    // First error of either thread, which ends the multiplexing
+    const char *error = nullptr;
+
+    // Written to by whoever has something for the writer
+    int wake_pipe[2];
+    std::thread writer;
+    std::thread reader;
+    // Threads of the stream handlers of the server
+    std::vector<std::thread> handlers;
+    stream_handler handler;
+
+    /* Opens a stream numbered [id], returning the session of its other end */
+    Session *add_stream(uint32_t id);
+    void wake();
+    /* Cuts every stream and the session short, on the first error */
+    void fail(const char *ex);
+    void join();
+
+    void write_loop();
+    void read_loop();
+    /* Hands over to [stream] as much of what it received as it takes */
+    void deliver(uint32_t id, Stream &stream,
+                 std::vector<std::pair<mtypes, std::vector<uchar>>> &out);
+};
+
+#endif
@@ -0,0 +1,704 @@
+#include "pipeline.h"
+#include "cipher.h"
+#include "diskqueue.h"
+#include "filesource.h"
+#include "seq.h"
+#include "utils.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <openssl/evp.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+#define STAGES 3
+
+/* A chunk of the file on its way through the stages, along with its buffers */
+struct Slot {
+    mtypes type;
+    seqnum seq;
+
+    unsigned char *pt;
+    blen pt_len;
+    // Plaintext of a chunk being sent: either in pt, or wherever the file
+    // source keeps it
+    const unsigned char *data;
+    unsigned char *ct;
+    blen ct_len;
+    unsigned char tag[TAG_LEN];
+
+    // Compression streams of the chunk and the buffer holding it compressed,
+    // when the session compresses chunks
+    Codec *codec;
+    unsigned char *zbuf;
+    // The chunk is sent compressed
+    bool compressed;
+
+    // No chunk follows this one
+    bool last;
+    // The file could not be read: there is nothing to send in this one, nor
+    // in any of the ones following it
+    bool failed;
+
+    // Position of the chunk in the file, counting chunks
+    size_t index;
+    // Stage that has to process the chunk next, the first one once it is free
+    int stage;
+};
+
+// Work of a stage on a chunk. The cipher stage gets the context of its thread.
+// Returns true if the stage holds on to the chunk until it calls release
+typedef function<Maybe<bool>(Slot &, EVP_CIPHER_CTX *)> stage_fn;
+
+/*
+ * Ring of slots shared by the stages. Every stage takes the chunks in order,
+ * waiting for the previous one to be done with the next of them: the first
+ * stage waits for the last one to free its slot. A stage run by many threads
+ * hands out the chunks in turn.
+ */
+class Pipeline {
+  public:
+    /*
+     * Takes the buffers of every slot from the session, along with a copy of
+     * its send (receive) context for each cipher thread, as [sending]
+     */
+    Pipeline(Session &session, bool sending);
+    ~Pipeline();
+
+    Pipeline(const Pipeline &) = delete;
+    Pipeline &operator=(const Pipeline &) = delete;
+
+    /*
+     * Runs the stages, each in its own threads but the last one, which runs
+     * in the one of the caller, unless it is a connection of an event loop
+     * (io_wait_hook). Returns once the last chunk went through all of them,
+     * or any of them failed, and no chunk is held anymore.
+     */
+    Maybe<bool> run(const stage_fn &first, const stage_fn &cipher,
+                    const stage_fn &third);
+
+    /* Passes a chunk held by its stage on to the next one, from any thread */
+    void release(Slot &slot);
+    /* Ends the transfer with [err], from any thread */
+    void fail(const char *err) { abort(err); }
+
+  private:
+    Session &session;
+    bool sending;
+    vector<Slot> slots;
+    vector<EVP_CIPHER_CTX *> ctxs;
+
+    mutex slots_mutex;
+    condition_variable slots_cv;
+    bool aborted = false;
+    const char *error = nullptr;
+    // Position of the last chunk, once the first stage has read it
+    size_t last_index = SIZE_MAX;
+    // Chunks held by their stage. Goes below zero when a chunk is released
+    // before its stage got to count it
+    int held = 0;
+
+    // Runs the stages, the last one in the thread of the caller
+    Maybe<bool> run_stages(const stage_fn &first, const stage_fn &cipher,
+                           const stage_fn &third);
+    void run_stage(int stage, const stage_fn &work, size_t first_index,
+                   size_t step, EVP_CIPHER_CTX *ctx);
+    // Adds the time of the work of [stage] on a chunk to the session. Only
+    // the queueing of the chunks counts for a disk stage holding on to them
+    void add_time(int stage, chrono::steady_clock::duration time);
+    // Hands the slot to the next stage, with slots_mutex locked
+    void pass(Slot &slot);
+    void abort(const char *err);
+};
+
+Pipeline::Pipeline(Session &session, bool sending)
+    : session(session), sending(sending),
+      slots(PIPELINE_DEPTH + session.cipher_threads - 1) {
+    for (size_t i = 0; i < slots.size(); i++) {
+        slots[i].pt = session.take_buffer();
+        slots[i].ct = session.take_buffer();
+        slots[i].codec = nullptr;
+        slots[i].zbuf = nullptr;
+        if (session.compression != CompressNone) {
+            slots[i].codec = session.take_codec();
+            slots[i].zbuf = session.take_buffer();
+        }
+        slots[i].compressed = false;
+        slots[i].last = false;
+        slots[i].failed = false;
+        slots[i].index = i;
+        slots[i].stage = 0;
+    }
+
+    EVP_CIPHER_CTX *src = sending ? session.send_ctx : session.recv_ctx;
+    for (unsigned int i = 0; i < session.cipher_threads; i++) {
+        EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+        if (ctx != nullptr && EVP_CIPHER_CTX_copy(ctx, src) != 1) {
+            EVP_CIPHER_CTX_free(ctx);
+            ctx = nullptr;
+        }
+        if (ctx == nullptr) {
+            // Failing to copy a context fails the transfer right away
+            abort("Could not copy the cipher context");
+            break;
+        }
+        ctxs.push_back(ctx);
+    }
+}
+
+Pipeline::~Pipeline() {
+    for (auto &slot : slots) {
+        session.give_back(slot.pt);
+        session.give_back(slot.ct);
+        if (slot.codec != nullptr) {
+            session.give_back(slot.codec);
+            session.give_back(slot.zbuf);
+        }
+    }
+    for (auto ctx : ctxs)
+        EVP_CIPHER_CTX_free(ctx);
+}
+
+Maybe<bool> Pipeline::run(const stage_fn &first, const stage_fn &cipher,
+                          const stage_fn &third) {
+    if (io_wait_hook == nullptr) {
+        return run_stages(first, cipher, third);
+    }
+
+    // The caller is a connection of an event loop, whose thread no stage may
+    // block: every other connection of the loop would wait on it, e.g. on a
+    // client stalled halfway through an upload. The stages all run in
+    // threads of their own then, and the connection is parked until they
+    // tell that they are done.
+    int done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (done_fd < 0) {
+        abort("Could not wait for the transfer");
+        return run_stages(first, cipher, third);
+    }
+    Maybe<bool> res;
+    thread runner([&] {
+        res = run_stages(first, cipher, third);
+        // Written once, to a counter at 0: cannot fail
+        uint64_t one = 1;
+        ssize_t written = write(done_fd, &one, sizeof(one));
+        (void)written;
+    });
+    uint64_t count;
+    while (read(done_fd, &count, sizeof(count)) != sizeof(count)) {
+        try {
+            io_wait_hook(done_fd, false);
+        } catch (char const *ex) {
+            // Not to be waited for, it is ended: the stages soon are
+            abort(ex);
+            break;
+        }
+    }
+    runner.join();
+    close(done_fd);
+    return res;
+}
+
+Maybe<bool> Pipeline::run_stages(const stage_fn &first, const stage_fn &cipher,
+                                 const stage_fn &third) {
+    vector<thread> threads;
+    if (!aborted) {
+        threads.emplace_back(&Pipeline::run_stage, this, 0, cref(first), 0, 1,
+                             nullptr);
+        for (size_t i = 0; i < ctxs.size(); i++) {
+            threads.emplace_back(&Pipeline::run_stage, this, 1, cref(cipher),
+                                 i, ctxs.size(), ctxs[i]);
+        }
+        run_stage(2, third, 0, 1, nullptr);
+    }
+
+    for (auto &t : threads)
+        t.join();
+
+    // Chunks still held are in the hands of the disk, which always answers
+    {
+        unique_lock<mutex> lock(slots_mutex);
+        slots_cv.wait(lock, [&] { return held == 0; });
+    }
+
+    Maybe<bool> res;
+    if (aborted) {
+        res.set_error(error);
+    }
+    return res;
+}
+
+void Pipeline::run_stage(int stage, const stage_fn &work, size_t first_index,
+                         size_t step, EVP_CIPHER_CTX *ctx) {
+    for (size_t index = first_index;; index += step) {
+        Slot &slot = slots[index % slots.size()];
+        {
+            unique_lock<mutex> lock(slots_mutex);
+            slots_cv.wait(lock, [&] {
+                return (slot.stage == stage && slot.index == index) ||
+                       index > last_index || aborted;
+            });
+            if (aborted || index > last_index)
+                return;
+        }
+
+        // Once passed on, the slot may be filled again by the first stage:
+        // a held one could be passed on before the work even returns
+        bool last = stage > 0 && (slot.last || slot.failed);
+
+        Maybe<bool> res;
+        auto start = chrono::steady_clock::now();
+        try {
+            res = work(slot, ctx);
+        } catch (char const *ex) {
+            res.set_error(ex);
+        }
+        add_time(stage, chrono::steady_clock::now() - start);
+        if (res.is_error) {
+            abort(res.error);
+            return;
+        }
+
+        // Only the first stage writes last
+        if (stage == 0)
+            last = slot.last;
+        {
+            lock_guard<mutex> lock(slots_mutex);
+            if (res.result)
+                held++;
+            else
+                pass(slot);
+        }
+        slots_cv.notify_all();
+
+        if (last)
+            return;
+    }
+}
+
+void Pipeline::add_time(int stage, chrono::steady_clock::duration time) {
+    uint64_t ns = chrono::duration_cast<chrono::nanoseconds>(time).count();
+    // The file is on the first stage of a send, on the last one of a receive
+    if (stage == 1) {
+        session.times.cipher += ns;
+        session.times.chunks++;
+    } else if ((stage == 0) == sending) {
+        session.times.disk += ns;
+    } else {
+        session.times.socket += ns;
+    }
+}
+
+void Pipeline::release(Slot &slot) {
+    {
+        lock_guard<mutex> lock(slots_mutex);
+        held--;
+        pass(slot);
+    }
+    slots_cv.notify_all();
+}
+
+void Pipeline::pass(Slot &slot) {
+    if (slot.last || slot.failed)
+        last_index = min(last_index, slot.index);
+    slot.stage = (slot.stage + 1) % STAGES;
+    if (slot.stage == 0)
+        slot.index += slots.size();
+}
+
+void Pipeline::abort(const char *err) {
+    {
+        lock_guard<mutex> lock(slots_mutex);
+        if (aborted)
+            return;
+        aborted = true;
+        error = err;
+    }
+
+    // Stages blocked on the socket would never notice otherwise
+    shutdown(session.sock, SHUT_RDWR);
+    slots_cv.notify_all();
+}
+
+/*
+ * Seals [slot] on [ctx], the copy of the send context of [session] of the
+ * thread, compressed first unless that does not make it any shorter. There is
+ * an instance for every suite, picked once for the whole transfer.
+ */
+template <class Suite>
+static Maybe<bool> seal_chunk(const Session &session, Slot &slot,
+                              EVP_CIPHER_CTX *ctx) {
+    Maybe<bool> res;
+    if (slot.failed) {
+        return res;
+    }
+
+    const unsigned char *data = slot.data;
+    blen data_len = slot.pt_len;
+    slot.compressed = false;
+    if (slot.codec != nullptr) {
+        blen z_len = slot.codec->compress(slot.data, slot.pt_len, slot.zbuf);
+        if (z_len > 0) {
+            data = slot.zbuf;
+            data_len = z_len;
+            slot.compressed = true;
+        }
+    }
+
+    unsigned char header = mtype_to_uc(slot.type);
+    if (slot.compressed)
+        header |= MTYPE_COMPRESSED;
+    unsigned char iv[Suite::iv_len];
+    session.send_nonce(slot.seq, iv);
+    int ct_len;
+    if (!aead_seal<Suite>(ctx, iv, header, slot.seq, data, data_len, slot.ct,
+                          ct_len, slot.tag)) {
+        res.set_error("Could not encrypt a chunk");
+        return res;
+    }
+    slot.ct_len = ct_len;
+    return res;
+}
+
+/*
+ * Opens [slot] on [ctx], the copy of the receive context of [session] of the
+ * thread, then decompresses it if it was sent compressed. There is an
+ * instance for every suite, as above.
+ */
+template <class Suite>
+static Maybe<bool> open_chunk(const Session &session, Slot &slot,
+                              EVP_CIPHER_CTX *ctx) {
+    Maybe<bool> res;
+
+    unsigned char header = mtype_to_uc(slot.type);
+    if (slot.compressed)
+        header |= MTYPE_COMPRESSED;
+    unsigned char iv[Suite::iv_len];
+    session.recv_nonce(slot.seq, iv);
+    int pt_len;
+    if (!aead_open<Suite>(ctx, iv, header, slot.seq, slot.ct, slot.ct_len,
+                          slot.pt, pt_len, slot.tag)) {
+        res.set_error("Could not decrypt a chunk");
+        return res;
+    }
+    slot.pt_len = pt_len;
+
+    // The chunk ends up in pt either way, the buffers are swapped
+    if (slot.compressed) {
+        auto z_res = slot.codec->decompress(slot.pt, slot.pt_len, slot.zbuf,
+                                            session.chunk_size);
+        if (z_res.is_error) {
+            res.set_error(z_res.error);
+            return res;
+        }
+        swap(slot.pt, slot.zbuf);
+        slot.pt_len = z_res.result;
+    }
+    return res;
+}
+
+/*
+ * Runs the stages of a send on [pipeline], after the first one: the chunks it
+ * fills in are encrypted, then written to the socket in order
+ */
+static Maybe<bool> run_send(Session &session, Pipeline &pipeline,
+                            const stage_fn &first) {
+    stage_fn encrypt_chunk =
+        with_suite(session.suite, [&](auto policy) -> stage_fn {
+            using Suite = decltype(policy);
+            return [&](Slot &slot, EVP_CIPHER_CTX *ctx) {
+                return seal_chunk<Suite>(session, slot, ctx);
+            };
+        });
+
+    auto send_chunk = [&](Slot &slot, EVP_CIPHER_CTX *) {
+        Maybe<bool> res;
+        if (slot.failed) {
+            return res;
+        }
+
+        auto send_res = session.out.header(slot.type, slot.seq,
+                                           slot.compressed)
+                            .field(slot.ct_len, slot.ct)
+                            .tag(slot.tag)
+                            .flush(session.sock);
+        if (send_res.is_error) {
+            res.set_error(send_res.error);
+            return res;
+        }
+
+        // Chunks numbered past a failed read are never sent: the next message
+        // takes the number of the first of them
+        session.send_seq = slot.seq;
+        inc_seqnum(session.send_seq);
+        return res;
+    };
+
+    return pipeline.run(first, encrypt_chunk, send_chunk);
+}
+
+Maybe<bool> send_file(Session &session, FILE *fp, mtypes chunk_type,
+                      mtypes end_type) {
+    return send_file(session, fp, 0, -1, chunk_type, end_type);
+}
+
+Maybe<bool> send_file(Session &session, FileSource &source, mtypes chunk_type,
+                      mtypes end_type) {
+    Pipeline pipeline(session, true);
+    // Chunks are numbered as they are read, ahead of the encryption
+    seqnum next_seq = session.send_seq;
+    atomic<bool> read_failed(false);
+
+    auto read_chunk = [&](Slot &slot, EVP_CIPHER_CTX *) {
+        Maybe<bool> res;
+
+        auto next_res = source.next(slot.pt, session.chunk_size, slot.pt_len);
+        slot.type = chunk_type;
+        slot.last = false;
+        slot.failed = false;
+
+        if (next_res.is_error) {
+            slot.last = true;
+            slot.failed = true;
+            read_failed = true;
+            return res;
+        }
+        slot.data = next_res.result;
+
+        if (source.at_end()) {
+            // Change message type, as this is the last chunk of data
+            slot.type = end_type;
+            slot.last = true;
+        }
+
+        slot.seq = next_seq;
+        inc_seqnum(next_seq);
+        return res;
+    };
+
+    auto res = run_send(session, pipeline, read_chunk);
+    res.set_result(!read_failed);
+    return res;
+}
+
+Maybe<bool> send_file(Session &session, FILE *fp, off_t offset, off_t length,
+                      mtypes chunk_type, mtypes end_type) {
+    // Regular files can be read at any offset, ahead of the stage
+    struct stat st;
+    bool queued = session.disk_depth > 0 && fstat(fileno(fp), &st) == 0 &&
+                  S_ISREG(st.st_mode) && offset < st.st_size && length != 0;
+    if (!queued) {
+        unique_ptr<FileSource> source(
+            open_source(fp, session.read_backend, offset, length));
+        return send_file(session, *source, chunk_type, end_type);
+    }
+
+    Pipeline pipeline(session, true);
+    seqnum next_seq = session.send_seq;
+    atomic<bool> read_failed(false);
+
+    // End of the range, in the file
+    off_t end = length < 0 || length > st.st_size - offset ? st.st_size
+                                                           : offset + length;
+    unique_ptr<DiskQueue> disk(open_disk_queue(
+        fileno(fp), session.disk_depth, [&](void *cookie, ssize_t len) {
+            Slot &slot = *static_cast<Slot *>(cookie);
+            if (len != (ssize_t)slot.pt_len) {
+                slot.failed = true;
+                read_failed = true;
+            }
+            pipeline.release(slot);
+        }));
+
+    auto queue_chunk = [&](Slot &slot, EVP_CIPHER_CTX *) {
+        Maybe<bool> res;
+
+        off_t chunk_offset = offset + (off_t)slot.index * session.chunk_size;
+        slot.pt_len = min((off_t)session.chunk_size, end - chunk_offset);
+        slot.data = slot.pt;
+        slot.type = chunk_type;
+        slot.last = false;
+        slot.failed = false;
+
+        // Chunks read past a failed one are never sent
+        if (read_failed) {
+            slot.last = true;
+            slot.failed = true;
+            return res;
+        }
+
+        if (chunk_offset + slot.pt_len == end) {
+            slot.type = end_type;
+            slot.last = true;
+        }
+
+        slot.seq = next_seq;
+        inc_seqnum(next_seq);
+
+        auto read_res =
+            disk->read(slot.pt, slot.pt_len, chunk_offset, &slot);
+        if (read_res.is_error) {
+            res.set_error(read_res.error);
+            return res;
+        }
+        res.set_result(true);
+        return res;
+    };
+
+    auto res = run_send(session, pipeline, queue_chunk);
+    res.set_result(!read_failed);
+    return res;
+}
+
+Maybe<bool> receive_file(Session &session, FILE *fp, mtypes chunk_type,
+                         mtypes end_type) {
+    return receive_file(session, fp, 0, FSIZE_MAX, chunk_type, end_type);
+}
+
+Maybe<bool> receive_file(Session &session, FILE *fp, off_t offset,
+                         unsigned long max_len, mtypes chunk_type,
+                         mtypes end_type, const chunk_observer &observe) {
+    Pipeline pipeline(session, false);
+    // The first stage checks the sequence numbers ahead of the decryption
+    seqnum expected_seq = session.recv_seq;
+    unsigned long received_size = 0;
+    bool complete = true;
+
+    // Writes to a regular file are queued on the disk, at their offset
+    struct stat st;
+    unique_ptr<DiskQueue> disk;
+    off_t write_offset = offset;
+    if (session.disk_depth > 0 && fstat(fileno(fp), &st) == 0 &&
+        S_ISREG(st.st_mode)) {
+        disk.reset(open_disk_queue(
+            fileno(fp), session.disk_depth, [&](void *cookie, ssize_t len) {
+                Slot &slot = *static_cast<Slot *>(cookie);
+                if (len != (ssize_t)slot.pt_len) {
+                    pipeline.fail(WRITE_ERROR);
+                }
+                pipeline.release(slot);
+            }));
+    }
+
+    auto receive_chunk = [&](Slot &slot, EVP_CIPHER_CTX *) {
+        Maybe<bool> res;
+
+        auto type_res = session.in.get_mtype(session.sock);
+        if (type_res.is_error) {
+            res.set_error(type_res.error);
+            return res;
+        }
+        slot.type = type_res.result;
+        slot.last = slot.type != chunk_type;
+        slot.failed = false;
+        slot.compressed = session.in.is_compressed();
+        if (slot.compressed && slot.codec == nullptr) {
+            res.set_error("Compressed chunk without compression agreed");
+            return res;
+        }
+
+        // Read sequence number
+        auto seq_res = session.in.read_header(session.sock);
+        if (seq_res.is_error) {
+            res.set_error(seq_res.error);
+            return res;
+        }
+
+        // Check correctness of the sequence number
+        if (seq_res.result != expected_seq) {
+            res.set_error("Incorrect sequence number");
+            return res;
+        }
+        slot.seq = expected_seq;
+        inc_seqnum(expected_seq);
+
+        // Read ciphertext and tag
+        auto ct_res = session.in.read_field(
+            session.sock, slot.ct, session.chunk_size + get_block_size());
+        if (ct_res.is_error) {
+            res.set_error(ct_res.error);
+            return res;
+        }
+        slot.ct_len = ct_res.result;
+
+        auto tag_res = session.in.read_tag(session.sock, slot.tag);
+        if (tag_res.is_error) {
+            res.set_error(tag_res.error);
+        }
+        return res;
+    };
+
+    stage_fn decrypt_chunk =
+        with_suite(session.suite, [&](auto policy) -> stage_fn {
+            using Suite = decltype(policy);
+            return [&](Slot &slot, EVP_CIPHER_CTX *ctx) {
+                return open_chunk<Suite>(session, slot, ctx);
+            };
+        });
+
+    auto write_chunk = [&](Slot &slot, EVP_CIPHER_CTX *) {
+        Maybe<bool> res;
+
+        if (slot.type != chunk_type && slot.type != end_type) {
+            // There was an error, either prior to the transfer or during it
+            char *msg = reinterpret_cast<char *>(slot.pt);
+            cout.write(msg, strnlen(msg, slot.pt_len)) << endl;
+            complete = false;
+            return res;
+        }
+
+        received_size += slot.pt_len;
+        if (received_size > max_len) {
+            res.set_error("Error - File too big");
+            return res;
+        }
+        if (observe && slot.pt_len > 0 && !observe(slot.pt, slot.pt_len)) {
+            res.set_error("Error when hashing a chunk");
+            return res;
+        }
+
+        if (disk != nullptr) {
+            if (slot.pt_len == 0) {
+                return res;
+            }
+            auto write_res =
+                disk->write(slot.pt, slot.pt_len, write_offset, &slot);
+            if (write_res.is_error) {
+                res.set_error(write_res.error);
+                return res;
+            }
+            write_offset += slot.pt_len;
+            res.set_result(true);
+            return res;
+        }
+
+        if (fwrite(slot.pt, sizeof(*slot.pt), slot.pt_len, fp) !=
+            slot.pt_len) {
+            res.set_error(WRITE_ERROR);
+        }
+        return res;
+    };
+
+    if (disk == nullptr && offset > 0 && fseeko(fp, offset, SEEK_SET) != 0) {
+        Maybe<bool> res;
+        res.set_error(WRITE_ERROR);
+        return res;
+    }
+
+    auto res = pipeline.run(receive_chunk, decrypt_chunk, write_chunk);
+    session.recv_seq = expected_seq;
+    res.set_result(complete);
+    return res;
+}
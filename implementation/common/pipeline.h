@@ -0,0 +1,98 @@
+#include "filesource.h"
+#include "maybe.h"
+#include "session.h"
+#include "types.h"
+#include <functional>
+#include <stdio.h>
+#include <sys/types.h>
+
+#ifndef pipeline_h
+#define pipeline_h
+
+// Chunks of a transfer in flight at once, between all of its stages, on top
+// of one for each cipher thread past the first
+#define PIPELINE_DEPTH 4
+
+// Error of receive_file when the file could not be written: what it holds
+// may then have holes, unlike after any other error
+#define WRITE_ERROR "Error when writing a chunk to file"
+
+/*
+ * Transfers of a file over a session, run as three stages, each in its own
+ * thread, so that the disk, the cipher and the socket work at the same time:
+ *     - sending:   read from the file -> encrypt -> write to the socket
+ *     - receiving: read from the socket -> decrypt -> write to the file
+ * The cipher stage runs on session.cipher_threads threads, each sealing
+ * (opening) every n-th chunk with its own copy of the cipher context: chunks
+ * are independent of each other, as each one has its own nonce and tag. The
+ * socket and the file still see the chunks in order of sequence number.
+ * With session.compression set, the cipher stage compresses (decompresses)
+ * each chunk on its own as well, on streams the session keeps from one
+ * transfer to the next.
+ * With session.disk_depth set, the disk stage only queues the reads (writes)
+ * of a regular file on a DiskQueue, and the chunks move on as they complete:
+ * a slow disk no longer holds the socket up for a whole chunk at a time.
+ * No other use of the session is allowed while a transfer runs.
+ *
+ * Run by a connection of the event-driven server, the transfer never blocks
+ * the thread of its event loop: every stage runs in a thread of its own, and
+ * the connection is parked (io_wait_hook) until the stages are done, for the
+ * other connections of the loop to go on meanwhile.
+ *
+ * A failure of any stage ends the transfer, and with it the session: the
+ * socket is shut down, so that no stage is left blocked on it. The error is
+ * returned to the caller, which is in charge of the file.
+ */
+
+/*
+ * Sends the content of [fp] as messages of type [chunk_type], the last one
+ * (possibly empty) of type [end_type].
+ *
+ * Returns false if the file could not be read: whatever was read before has
+ * been sent, and the caller is to tell the other party with an Error.
+ */
+Maybe<bool> send_file(Session &session, FILE *fp, mtypes chunk_type,
+                      mtypes end_type);
+
+/*
+ * Same as the above, for the [length] bytes of [fp] starting at [offset]
+ * only, or for all of them past it if [length] is negative
+ */
+Maybe<bool> send_file(Session &session, FILE *fp, off_t offset, off_t length,
+                      mtypes chunk_type, mtypes end_type);
+
+/*
+ * Same as the above, for whatever [source] holds, e.g. a file kept in pieces.
+ * Nothing is queued on a DiskQueue then.
+ */
+Maybe<bool> send_file(Session &session, FileSource &source, mtypes chunk_type,
+                      mtypes end_type);
+
+/*
+ * Receives the messages sent by send_file into [fp], up to the one of type
+ * [end_type]. Any other message ends the transfer as well: that is the Error
+ * of the other party, whose content is written on the standard output.
+ *
+ * Returns false if the other party sent an Error instead of the whole file.
+ */
+Maybe<bool> receive_file(Session &session, FILE *fp, mtypes chunk_type,
+                         mtypes end_type);
+
+/*
+ * Takes the [len] bytes at [data] of every chunk received, in order, before
+ * it is written. Returning false fails the transfer.
+ */
+typedef std::function<bool(const uchar *data, blen len)> chunk_observer;
+
+/*
+ * Same as the above, writing what is received at [offset] in [fp] onwards,
+ * for at most [max_len] bytes, and handing it over to [observe] if set.
+ * Whatever the error, but WRITE_ERROR, the chunks received before it are all
+ * in the file, in order, and those after it none at all.
+ */
+Maybe<bool> receive_file(Session &session, FILE *fp, off_t offset,
+                         unsigned long max_len, mtypes chunk_type,
+                         mtypes end_type,
+                         const chunk_observer &observe = nullptr);
+
+#endif
@@ -3,10 +3,21 @@
 #ifndef seq_h
 #define seq_h
 
-extern seqnum seq_num;
+/*
+ * Whether the counter is close enough to wrapping around that the session
+ * has to be terminated (leaving room for the logout exchange).
+ */
+bool is_wraparound(seqnum seq);
 
-bool is_wraparound();
-seqnum inc_seqnum();
-unsigned char *seqnum_to_uc();
+/* Whether the key of the session is due to be replaced, with a RekeyReq */
+bool is_rekey_due(seqnum seq);
+
+/*
+ * Increases the counter after a message has been sent or received. A counter
+ * never wraps around: the session is aborted instead.
+ */
+seqnum inc_seqnum(seqnum &seq);
+
+unsigned char *seqnum_to_uc(seqnum &seq);
 
 #endif
@@ -0,0 +1,135 @@
+#include "session.h"
+#include "errors.h"
+#include "seq.h"
+#include "trace.h"
+#include "utils.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+Session::Session(int sock, session_role role)
+    : sock(sock), key(nullptr), username(nullptr), send_seq(0), recv_seq(0),
+      chunk_size(MIN_CHUNK_SIZE), cipher_threads(1),
+      read_backend(SourceStdio), disk_depth(0),
+      compression(CompressNone), suite(SuiteAesGcm), errors_sent(0),
+      role(role) {
+    if ((send_ctx = EVP_CIPHER_CTX_new()) == nullptr) {
+        close(sock);
+        handle_errors("Could not allocate cipher context");
+    }
+    if ((recv_ctx = EVP_CIPHER_CTX_new()) == nullptr) {
+        EVP_CIPHER_CTX_free(send_ctx);
+        close(sock);
+        handle_errors("Could not allocate cipher context");
+    }
+}
+
+Session::~Session() {
+    EVP_CIPHER_CTX_free(send_ctx);
+    EVP_CIPHER_CTX_free(recv_ctx);
+
+    if (key != nullptr) {
+        explicit_bzero(key, AEAD_KEY_LEN);
+        delete[] key;
+    }
+    delete[] username;
+
+    for (auto buf : buffers)
+        free(buf);
+    for (auto codec : codecs)
+        delete codec;
+
+    trace_close(sock);
+    close(sock);
+}
+
+void Session::set_key(unsigned char *key) {
+    this->key = key;
+
+    int key_len = AEAD_KEY_LEN;
+    int salt_len = sizeof(send_salt);
+    session_role peer = role == RoleClient ? RoleServer : RoleClient;
+
+    auto send_salt_res = derive_nonce_salt(key, key_len, role, salt_len);
+    if (send_salt_res.is_error) {
+        handle_errors(send_salt_res.error);
+    }
+    memcpy(send_salt, send_salt_res.result, salt_len);
+    delete[] send_salt_res.result;
+
+    auto recv_salt_res = derive_nonce_salt(key, key_len, peer, salt_len);
+    if (recv_salt_res.is_error) {
+        handle_errors(recv_salt_res.error);
+    }
+    memcpy(recv_salt, recv_salt_res.result, salt_len);
+    delete[] recv_salt_res.result;
+
+    const EVP_CIPHER *cipher = get_suite_cipher(suite);
+    if (EVP_EncryptInit_ex(send_ctx, cipher, nullptr, key, nullptr) != 1 ||
+        EVP_DecryptInit_ex(recv_ctx, cipher, nullptr, key, nullptr) != 1) {
+        handle_errors("Could not key the cipher contexts");
+    }
+}
+
+/* Writes into [iv] the nonce of the message numbered [seq] */
+static void make_nonce(const unsigned char *salt, seqnum seq,
+                       unsigned char *iv) {
+    const size_t salt_len = AEAD_IV_LEN - sizeof(seqnum);
+    memcpy(iv, salt, salt_len);
+    memcpy(iv + salt_len, &seq, sizeof(seqnum));
+}
+
+void Session::send_nonce(seqnum seq, unsigned char *iv) const {
+    make_nonce(send_salt, seq, iv);
+}
+
+void Session::recv_nonce(seqnum seq, unsigned char *iv) const {
+    make_nonce(recv_salt, seq, iv);
+}
+
+void Session::replace_key(unsigned char *key) {
+    explicit_bzero(this->key, AEAD_KEY_LEN);
+    delete[] this->key;
+    set_key(key);
+    send_seq = 0;
+    recv_seq = 0;
+}
+
+bool Session::is_exhausted() {
+    return is_wraparound(send_seq) || is_wraparound(recv_seq);
+}
+
+bool Session::is_rekey_due() {
+    return ::is_rekey_due(send_seq) || ::is_rekey_due(recv_seq);
+}
+
+unsigned char *Session::take_buffer() {
+    if (free_buffers.empty()) {
+        void *buf;
+        if (posix_memalign(&buf, BUFFER_ALIGN,
+                           chunk_size + EVP_MAX_BLOCK_LENGTH) != 0) {
+            handle_errors("Could not allocate a chunk buffer");
+        }
+        buffers.push_back(reinterpret_cast<unsigned char *>(buf));
+        return buffers.back();
+    }
+
+    auto buf = free_buffers.back();
+    free_buffers.pop_back();
+    return buf;
+}
+
+void Session::give_back(unsigned char *buf) { free_buffers.push_back(buf); }
+
+Codec *Session::take_codec() {
+    if (free_codecs.empty()) {
+        codecs.push_back(new Codec());
+        return codecs.back();
+    }
+
+    auto codec = free_codecs.back();
+    free_codecs.pop_back();
+    return codec;
+}
+
+void Session::give_back(Codec *codec) { free_codecs.push_back(codec); }
@@ -0,0 +1,142 @@
+#include "cipher.h"
+#include "compress.h"
+#include "filesource.h"
+#include "frame.h"
+#include "types.h"
+#include <atomic>
+#include <openssl/evp.h>
+#include <stdint.h>
+#include <vector>
+
+#ifndef session_h
+#define session_h
+
+// Side of the connection a session runs on: each sends with its own nonces
+enum session_role { RoleClient, RoleServer };
+
+/*
+ * Time spent by the stages of the transfers of a session, in nanoseconds, and
+ * the chunks they went through. Every thread of a transfer adds to them.
+ */
+struct TransferTimes {
+    std::atomic<uint64_t> disk{0};
+    std::atomic<uint64_t> cipher{0};
+    std::atomic<uint64_t> socket{0};
+    std::atomic<uint64_t> chunks{0};
+};
+
+/*
+ * Protocol state of a single connection: the socket, the key agreed during
+ * the authentication, one sequence counter and one cipher context per
+ * direction. Nothing is shared between sessions, so that any number of them
+ * can be served by the same process.
+ */
+class Session {
+  public:
+    int sock;
+    unsigned char *key;
+    char *username;
+
+    seqnum send_seq;
+    seqnum recv_seq;
+
+    // Size of the chunks of a transfer, as agreed at login
+    unsigned int chunk_size;
+    // Threads encrypting (decrypting) the chunks of a transfer in parallel
+    unsigned int cipher_threads;
+    // How the files sent are read
+    source_backend read_backend;
+    // Disk operations of a transfer in flight at once, 0 to run them in the
+    // pipeline stage itself
+    unsigned int disk_depth;
+    // How the chunks of a transfer are compressed, as agreed at login
+    compression_algo compression;
+    // How every message is sealed, as agreed at login: to be set before the
+    // key
+    cipher_suite suite;
+
+    EVP_CIPHER_CTX *send_ctx;
+    EVP_CIPHER_CTX *recv_ctx;
+
+    // Since whoever reads them last took them back to zero
+    TransferTimes times;
+    // Errors sent to the other party
+    unsigned long errors_sent;
+
+    // Outgoing messages are assembled here, then flushed at once
+    FrameWriter out;
+    // Incoming messages are parsed from here, once authenticated
+    FrameReader in;
+
+    /*
+     * Takes ownership of the socket, which is closed when the session is
+     * destroyed together with the key and the username.
+     */
+    Session(int sock, session_role role);
+    ~Session();
+
+    Session(const Session &) = delete;
+    Session &operator=(const Session &) = delete;
+
+    /*
+     * Takes ownership of the key agreed during the authentication, deriving
+     * from it the nonce salts of both directions. Both cipher contexts are
+     * keyed here, once: the key schedule is not computed again per message.
+     */
+    void set_key(unsigned char *key);
+
+    /*
+     * Writes into [iv] (AEAD_IV_LEN bytes) the nonce of the message numbered
+     * [seq] sent (received), for aead_seal (aead_open) to set it itself. The
+     * chunks of a transfer can be sealed in parallel, each thread with its
+     * own copy of the context: any number of threads may call these at once.
+     */
+    void send_nonce(seqnum seq, unsigned char *iv) const;
+    void recv_nonce(seqnum seq, unsigned char *iv) const;
+
+    /*
+     * Replaces the key of the session, wiping the one in use, and starts both
+     * counters over: nothing sealed with the old key may be in flight.
+     */
+    void replace_key(unsigned char *key);
+
+    /* Whether any of the counters is about to wrap around */
+    bool is_exhausted();
+
+    /* Whether any of the counters is far enough for the key to be replaced */
+    bool is_rekey_due();
+
+    /*
+     * Buffers holding a chunk, either as plaintext or as ciphertext (i.e.
+     * chunk_size + EVP_MAX_BLOCK_LENGTH bytes, aligned on BUFFER_ALIGN),
+     * kept from one transfer to the next. The chunk size must not change
+     * once any has been taken.
+     * They belong to the session: one that is not given back (e.g. on an
+     * error) is freed together with it.
+     */
+    unsigned char *take_buffer();
+    void give_back(unsigned char *buf);
+
+    /* Same as the above, for the compression streams of a chunk */
+    Codec *take_codec();
+    void give_back(Codec *codec);
+
+  private:
+    session_role role;
+
+    /*
+     * Salt of each direction. The nonce of a message is the salt followed by
+     * its sequence number, hence unique for as long as the key is in use. The
+     * IV is never sent, as both parties can compute it.
+     */
+    unsigned char send_salt[AEAD_IV_LEN - sizeof(seqnum)];
+    unsigned char recv_salt[AEAD_IV_LEN - sizeof(seqnum)];
+
+    std::vector<unsigned char *> buffers;
+    std::vector<unsigned char *> free_buffers;
+
+    std::vector<Codec *> codecs;
+    std::vector<Codec *> free_codecs;
+};
+
+#endif
@@ -0,0 +1,115 @@
+#include "types.h"
+#include <atomic>
+#include <stdint.h>
+
+#ifndef trace_h
+#define trace_h
+
+/*
+ * Trace of the messages of every connection, kept in memory at all times, so
+ * that what a session went through can be looked at after the fact, even in a
+ * release build.
+ *
+ * Each event is of a fixed size, written into the ring of the socket it
+ * happened on: the last TRACE_RING_LEN events of every connection are kept,
+ * the older ones overwritten. Recording one costs a timestamp and a few
+ * stores, with no lock, from whichever thread of the connection it happens
+ * on. The ring of a connection lives on once it is closed, until its socket
+ * is opened again.
+ *
+ * SIGUSR2 writes every ring of the process, as they are, to
+ * trace-<pid>.bin in the working directory (see install_trace_dump_handler).
+ *
+ * What is recorded is chosen at compile time, by TRACE_LEVEL:
+ *     0: nothing, the calls compile to nothing;
+ *     1: every message sent, every header and field received (default);
+ *     2: every read and write on the sockets as well.
+ */
+
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL 1
+#endif
+
+// Events kept per connection, a power of two
+#define TRACE_RING_LEN 1024
+// Sockets whose connections are traced, any higher one is not
+#define TRACE_MAX_SOCKETS 4096
+
+#define TRACE_MAGIC "FoCtrace"
+
+// Type of the events of a part of a message written (read) on its own, by
+// the unbuffered helpers of utils.h, which do not know it
+#define TRACE_NO_MTYPE 0xff
+
+enum trace_kind : uint8_t {
+    // A message written, or a part of one (len: its bytes on the wire, seq
+    // when it has one)
+    TraceSend,
+    // The type of a message read
+    TraceRecvType,
+    // The sequence number of the message being read
+    TraceRecvHeader,
+    // A field of the message being read (len: its bytes)
+    TraceRecvField,
+    // Level 2: bytes written to (read from) the socket at once, and the
+    // socket not being ready
+    TraceWrite,
+    TraceRead,
+    TraceWait
+};
+
+struct TraceEvent {
+    // Nanoseconds on the monotonic clock
+    uint64_t time;
+    seqnum seq;
+    uint32_t len;
+    uint8_t kind;
+    // Type of the message, with MTYPE_COMPRESSED when it is
+    uint8_t mtype;
+    uint8_t pad[6];
+};
+static_assert(sizeof(TraceEvent) == 24, "Events are dumped as they are");
+
+/*
+ * What the dump holds for each ring, followed by its TRACE_RING_LEN events:
+ * the ones before [head] are the last ones recorded, starting at
+ * head % TRACE_RING_LEN and going around. Events recorded while the dump was
+ * taken may be torn.
+ */
+struct TraceRingHeader {
+    char magic[8];
+    int32_t socket;
+    uint32_t len;
+    uint64_t head;
+    // Whether the socket was still open
+    uint8_t open;
+    uint8_t pad[7];
+};
+
+/* Records an event on the ring of [socket] */
+void trace(int socket, trace_kind kind, uint8_t mtype, seqnum seq,
+           uint32_t len);
+
+/*
+ * The connection on [socket] is over: its ring is kept as it is, and starts
+ * over with the next connection opened on the same socket
+ */
+void trace_close(int socket);
+
+/* Installs the handler of SIGUSR2, dumping every ring */
+void install_trace_dump_handler();
+
+#if TRACE_LEVEL >= 1
+#define TRACE_MESSAGE(socket, kind, mtype, seq, len)                           \
+    trace(socket, kind, mtype, seq, len)
+#else
+#define TRACE_MESSAGE(socket, kind, mtype, seq, len) ((void)0)
+#endif
+
+#if TRACE_LEVEL >= 2
+#define TRACE_IO(socket, kind, len) trace(socket, kind, 0, 0, len)
+#else
+#define TRACE_IO(socket, kind, len) ((void)0)
+#endif
+
+#endif
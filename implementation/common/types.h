@@ -8,19 +8,58 @@ typedef unsigned int uint;
 typedef char mtype;
 typedef uint seqnum;
 typedef ushort flen;
+// Length of the field of a chunk of a file, which may exceed FLEN_MAX
+typedef uint blen;
 
 #define SEQNUM_MAX ((1UL << 32) - 1)
 #define LOGOUT_THRESHOLD 5
 #define SEQ_MAX_THRESHOLD (SEQNUM_MAX - LOGOUT_THRESHOLD)
+// Past it, the client replaces the key of the session before its next
+// request. Far below SEQ_MAX_THRESHOLD, so that whatever was in flight (e.g.
+// a whole transfer, of FSIZE_MAX / MIN_CHUNK_SIZE chunks) is over first
+#define REKEY_THRESHOLD (SEQNUM_MAX / 2)
 
 #define FLEN_MAX ((1 << 16) - 1)
-#define FSIZE_MAX ((1UL << 32) - 1)
+// Sizes and offsets of files take 64 bits. Files are 32 TiB at most, so that
+// a single transfer of one never takes more than a quarter of the sequence
+// numbers: 2^30 chunks of MIN_CHUNK_SIZE bytes
+#define FSIZE_MAX ((1UL << 45) - 1)
 
 #define TAG_LEN 16
 #define FNAME_MAX_LEN 128
 
-// Size of a download/upload chunk
-#define CHUNK_SIZE 32768
+// Files of a batched delete (renames of a batched rename) at most
+#define BATCH_MAX_ITEMS 4096
+
+// Bytes of names in a page of a listing at most, each page being sent as soon
+// as it is full
+#define LIST_PAGE_LEN 16384
+
+// Size of the nonces exchanged when resuming a session
+#define NONCE_LEN 32
+
+// Size of the tag ending the answer of a login (get_hash_type())
+#define LOGIN_TAG_LEN 32
+
+// Size of the ID a client gives an upload, for it to be resumed later
+#define TRANSFER_ID_LEN 16
+
+// Size of the hash of a chunk, when uploads are deduplicated
+#define CHUNK_HASH_LEN 32
+
+// Size of the hash of the content of a file (get_hash_type()), e.g. of the
+// copy a client has cached
+#define FILE_HASH_LEN 32
+
+// Nodes of the Merkle tree of a file asked for at once at most, when
+// verifying it (see merkle.h)
+#define VERIFY_MAX_NODES 1024
+
+// Size of a download/upload chunk: the client proposes one at login, and the
+// server agrees on it as long as it is within its own limit
+#define MIN_CHUNK_SIZE 32768
+#define MAX_CHUNK_SIZE (4 * 1024 * 1024)
+#define DEFAULT_CHUNK_SIZE (1024 * 1024)
 
 enum mtypes {
     // Authentication
@@ -28,15 +67,25 @@ enum mtypes {
     AuthServerAns,
     AuthClientAns,
 
+    // Session resumption
+    AuthResume,
+    AuthResumeAns,
+    AuthTicket,
+
     // Upload
     UploadReq,
     UploadAns,
+    UploadHashReq,
+    UploadHashes,
+    UploadMissing,
     UploadChunk,
     UploadEnd,
     UploadRes,
 
     // Download
     DownloadReq,
+    DownloadAns,
+    DownloadUnchanged,
     DownloadChunk,
     DownloadEnd,
 
@@ -45,6 +94,8 @@ enum mtypes {
     DeleteConfirm,
     DeleteAns,
     DeleteRes,
+    DeleteBatchReq,
+    DeleteBatchRes,
 
     // List
     ListReq,
@@ -53,6 +104,36 @@ enum mtypes {
     // Rename
     RenameReq,
     RenameAns,
+    RenameBatchReq,
+    RenameBatchRes,
+
+    // Update
+    UpdateReq,
+    UpdateSigs,
+    UpdateChunk,
+    UpdateEnd,
+    UpdateRes,
+
+    // Info
+    InfoReq,
+    InfoAns,
+
+    // Verify
+    VerifyReq,
+    VerifyAns,
+
+    // Multiplexing (see mux.h)
+    MuxStart,
+    MuxStartAns,
+    MuxOpen,
+    MuxData,
+    MuxWindow,
+    MuxClose,
+    MuxEnd,
+
+    // Rekeying
+    RekeyReq,
+    RekeyAns,
 
     // Logout
     LogoutReq,
@@ -62,4 +143,8 @@ enum mtypes {
     Error
 };
 
+// Set in the type of a chunk whose content is compressed (see compress.h).
+// The type being authenticated, the flag cannot be changed on the way
+#define MTYPE_COMPRESSED 0x80
+
 #endif
@@ -1,10 +1,15 @@
 #include "utils.h"
+#include "cipher.h"
 #include "errors.h"
 #include "seq.h"
+#include "trace.h"
 #include "types.h"
+#include <algorithm>
 #include <errno.h>
 #include <iostream>
 #include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <poll.h>
 #include <stdio.h>
 #include <string.h>
 #include <tuple>
@@ -22,19 +27,103 @@ error "Missing the <filesystem> header."
 
 using namespace std;
 
+thread_local io_wait_hook_t io_wait_hook = nullptr;
+io_count_hook_t io_count_hook = nullptr;
+unsigned int io_idle_timeout = 0;
+
+/*
+ * Parks the caller until the socket is ready again. Blocking sockets never get
+ * here; non-blocking ones either go through the installed hook (event-driven
+ * server) or simply poll. Returns false if it was not ready in time.
+ */
+static bool wait_socket(int socket, bool for_write) {
+    TRACE_IO(socket, TraceWait, for_write);
+    if (io_wait_hook != nullptr) {
+        return io_wait_hook(socket, for_write);
+    }
+
+    struct pollfd pfd = {socket, (short)(for_write ? POLLOUT : POLLIN), 0};
+    int timeout = io_idle_timeout > 0 ? (int)io_idle_timeout * 1000 : -1;
+    int ready;
+    while ((ready = poll(&pfd, 1, timeout)) < 0 && errno == EINTR)
+        ;
+    return ready != 0;
+}
+
+/*
+ * Reads exactly len bytes from the socket. Returns false on EOF or on any
+ * error other than the socket not being ready.
+ */
+static bool read_exact(int socket, void *buf, size_t len) {
+    size_t received_len = 0;
+    while (received_len < len) {
+        ssize_t read_len = read(socket, (uchar *)buf + received_len,
+                                len - received_len);
+        if (read_len > 0) {
+            received_len += read_len;
+            TRACE_IO(socket, TraceRead, read_len);
+            if (io_count_hook != nullptr)
+                io_count_hook(read_len, false);
+        } else if (read_len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!wait_socket(socket, false))
+                return false;
+        } else if (read_len < 0 && errno == EINTR) {
+            continue;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+size_t read_some(int socket, void *buf, size_t len) {
+    for (;;) {
+        ssize_t read_len = read(socket, buf, len);
+        if (read_len >= 0) {
+            TRACE_IO(socket, TraceRead, read_len);
+            if (io_count_hook != nullptr)
+                io_count_hook(read_len, false);
+            return read_len;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            if (!wait_socket(socket, false))
+                return 0;
+        } else if (errno != EINTR) {
+            return 0;
+        }
+    }
+}
+
+/* Writes exactly len bytes to the socket, retrying on partial writes */
+bool write_exact(int socket, const void *buf, size_t len) {
+    size_t sent_len = 0;
+    while (sent_len < len) {
+        ssize_t write_len =
+            write(socket, (const uchar *)buf + sent_len, len - sent_len);
+        if (write_len >= 0) {
+            sent_len += write_len;
+            TRACE_IO(socket, TraceWrite, write_len);
+            if (io_count_hook != nullptr)
+                io_count_hook(write_len, true);
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            if (!wait_socket(socket, true))
+                return false;
+        } else if (errno != EINTR) {
+            return false;
+        }
+    }
+    return true;
+}
+
 void print_debug(unsigned char *x, int len) {
     for (int i = 0; i < len; i++)
         printf("%02x", (int)x[i]);
 }
 
-const EVP_CIPHER *get_symmetric_cipher() { return EVP_aes_256_gcm(); }
-int get_iv_len() { return EVP_CIPHER_iv_length(get_symmetric_cipher()); }
-int get_block_size() { return EVP_CIPHER_block_size(get_symmetric_cipher()); }
+int get_iv_len() { return AEAD_IV_LEN; }
+// Both are stream ciphers: a ciphertext is never longer than its plaintext
+int get_block_size() { return 1; }
 
-int get_symmetric_key_length() {
-    auto cipher = get_symmetric_cipher();
-    return EVP_CIPHER_key_length(cipher);
-}
+int get_symmetric_key_length() { return AEAD_KEY_LEN; }
 
 const EVP_MD *get_hash_type() { return EVP_sha256(); }
 int get_hash_type_length() { return EVP_MD_size(get_hash_type()); }
@@ -81,6 +170,110 @@ Maybe<unsigned char *> kdf(unsigned char *shared_secret, int shared_secret_len,
     return res;
 }
 
+Maybe<unsigned char *> derive_resumption_secret(unsigned char *key,
+                                                int key_len) {
+    static const char label[] = "resumption";
+
+    unsigned char *buf = new unsigned char[key_len + sizeof(label)];
+    memcpy(buf, key, key_len);
+    memcpy(buf + key_len, label, sizeof(label));
+    return kdf(buf, key_len + sizeof(label), key_len);
+}
+
+Maybe<unsigned char *> derive_nonce_salt(unsigned char *key, int key_len,
+                                         session_role sender, int salt_len) {
+    static const char client_label[] = "client nonce";
+    static const char server_label[] = "server nonce";
+    static_assert(sizeof(client_label) == sizeof(server_label));
+    const char *label = sender == RoleClient ? client_label : server_label;
+
+    unsigned char *buf = new unsigned char[key_len + sizeof(client_label)];
+    memcpy(buf, key, key_len);
+    memcpy(buf + key_len, label, sizeof(client_label));
+    return kdf(buf, key_len + sizeof(client_label), salt_len);
+}
+
+Maybe<unsigned char *> derive_resumed_key(unsigned char *resumption_secret,
+                                          int key_len,
+                                          unsigned char *client_nonce,
+                                          unsigned char *server_nonce) {
+    unsigned char *buf = new unsigned char[key_len + 2 * NONCE_LEN];
+    memcpy(buf, resumption_secret, key_len);
+    memcpy(buf + key_len, client_nonce, NONCE_LEN);
+    memcpy(buf + key_len + NONCE_LEN, server_nonce, NONCE_LEN);
+    return kdf(buf, key_len + 2 * NONCE_LEN, key_len);
+}
+
+Maybe<unsigned char *> derive_rekeyed_key(unsigned char *key, int key_len,
+                                          unsigned char *client_nonce,
+                                          unsigned char *server_nonce) {
+    static const char label[] = "rekey";
+
+    size_t len = key_len + sizeof(label) + 2 * NONCE_LEN;
+    unsigned char *buf = new unsigned char[len];
+    memcpy(buf, key, key_len);
+    memcpy(buf + key_len, label, sizeof(label));
+    memcpy(buf + key_len + sizeof(label), client_nonce, NONCE_LEN);
+    memcpy(buf + key_len + sizeof(label) + NONCE_LEN, server_nonce,
+           NONCE_LEN);
+    return kdf(buf, len, key_len);
+}
+
+Maybe<bool> login_tag(unsigned char *key, int key_len,
+                      const unsigned char *data, size_t len,
+                      unsigned char *tag) {
+    static const char label[] = "login";
+    Maybe<bool> res;
+
+    unsigned char *buf = new unsigned char[key_len + sizeof(label)];
+    memcpy(buf, key, key_len);
+    memcpy(buf + key_len, label, sizeof(label));
+    auto tag_key_res = kdf(buf, key_len + sizeof(label), key_len);
+    if (tag_key_res.is_error) {
+        res.set_error(tag_key_res.error);
+        return res;
+    }
+    unsigned int tag_len;
+    bool ok = HMAC(get_hash_type(), tag_key_res.result, key_len, data, len,
+                   tag, &tag_len) != nullptr &&
+              tag_len == LOGIN_TAG_LEN;
+    explicit_bzero(tag_key_res.result, key_len);
+    delete[] tag_key_res.result;
+    if (!ok) {
+        res.set_error("Could not compute the tag of the login");
+        return res;
+    }
+    res.set_result(true);
+    return res;
+}
+
+Maybe<unsigned char *> derive_stream_key(unsigned char *key, int key_len,
+                                         seqnum epoch, uint32_t stream) {
+    static const char label[] = "stream";
+
+    size_t len = key_len + sizeof(label) + sizeof(epoch) + sizeof(stream);
+    unsigned char *buf = new unsigned char[len];
+    memcpy(buf, key, key_len);
+    memcpy(buf + key_len, label, sizeof(label));
+    memcpy(buf + key_len + sizeof(label), &epoch, sizeof(epoch));
+    memcpy(buf + key_len + sizeof(label) + sizeof(epoch), &stream,
+           sizeof(stream));
+    return kdf(buf, len, key_len);
+}
+
+Maybe<unsigned char *> gen_nonce() {
+    Maybe<unsigned char *> res;
+
+    unsigned char *nonce = new unsigned char[NONCE_LEN];
+    if (RAND_bytes(nonce, NONCE_LEN) != 1) {
+        delete[] nonce;
+        res.set_error("Could not generate nonce");
+    } else {
+        res.set_result(nonce);
+    }
+    return res;
+}
+
 Maybe<unsigned char *> gen_iv() {
     Maybe<unsigned char *> res;
 
@@ -121,64 +314,28 @@ Maybe<unsigned char *> get_dummy() {
 Maybe<mtypes> get_mtype(int socket) {
     Maybe<mtypes> res;
 
-    if (read(socket, &res.result, sizeof(mtype)) != sizeof(mtype)) {
+    if (!read_exact(socket, &res.result, sizeof(mtype))) {
         res.set_error("Error when reading mtype");
+        return res;
     };
 
-#ifdef DEBUG
-    cout << endl
-         << GREEN << "Message type: " << mtypes_to_string(res.result) << RESET
-         << endl;
-#endif
+    TRACE_MESSAGE(socket, TraceRecvType, res.result, 0, sizeof(mtype));
     return res;
 }
 
 Maybe<bool> send_header(int socket, mtypes type) {
     Maybe<bool> res;
-    if (write(socket, &type, sizeof(mtype)) != sizeof(mtype)) {
+    if (!write_exact(socket, &type, sizeof(mtype))) {
         res.set_error("Error when writing mtype");
         return res;
     }
-#ifdef DEBUG
-    cout << endl
-         << BLUE << "Message type: " << mtypes_to_string(mtypes(type)) << RESET
-         << endl;
-#endif
+    TRACE_MESSAGE(socket, TraceSend, type, 0, sizeof(mtype));
     return res;
 }
 
-Maybe<bool> send_header(int socket, mtypes type, seqnum seq_num, uchar *iv,
-                        int iv_len) {
-    auto res = send_header(socket, type);
-    if (res.is_error) {
-        return res;
-    }
-
-    if (write(socket, &seq_num, sizeof(seq_num)) != sizeof(seq_num)) {
-        res.set_error("Error when writing sequence number");
-        return res;
-    }
-
-#ifdef DEBUG
-    cout << BLUE << "Sequence number: " << seq_num << RESET << endl;
-#endif
-
-    if (write(socket, iv, iv_len) != iv_len) {
-        res.set_error("Error when writing iv");
-        return res;
-    };
-
-#ifdef DEBUG
-    cout << BLUE << "IV: ";
-    print_debug(iv, iv_len);
-    cout << RESET << endl;
-#endif
-
-    return res;
-}
 Maybe<bool> send_tag(int socket, unsigned char *tag) {
     Maybe<bool> res;
-    if (write(socket, tag, TAG_LEN) != TAG_LEN) {
+    if (!write_exact(socket, tag, TAG_LEN)) {
         res.set_error("Error when writing tag");
         return res;
     }
@@ -188,126 +345,71 @@ Maybe<bool> send_tag(int socket, unsigned char *tag) {
 
 Maybe<bool> send_field(int socket, flen len, unsigned char *data) {
     Maybe<bool> res;
-    if (write(socket, &len, sizeof(flen)) != sizeof(flen)) {
+    if (!write_exact(socket, &len, sizeof(flen))) {
         res.set_error("Error when writing field length");
         return res;
     }
 
-#ifdef DEBUG
-    cout << BLUE << "Field length: " << len << RESET << endl;
-#endif
-    if (write(socket, data, len) != len) {
+    if (!write_exact(socket, data, len)) {
         res.set_error("Error when writing field data");
         return res;
     }
 
-#ifdef DEBUG
-    cout << BLUE << "Content (hex): ";
-    print_debug(data, len);
-    cout << RESET << endl;
-#endif
+    TRACE_MESSAGE(socket, TraceSend, TRACE_NO_MTYPE, 0, sizeof(flen) + len);
     return res;
 }
 
 Maybe<tuple<flen, unsigned char *>> read_field(int socket) {
     Maybe<tuple<flen, unsigned char *>> res;
 
-    ssize_t received_len = 0;
-    ssize_t read_len;
     flen len;
-    while ((unsigned long)received_len < sizeof(flen)) {
-        if ((read_len = read(socket, (uchar *)&len + received_len,
-                             sizeof(flen) - received_len)) <= 0) {
-            res.set_error("Error when reading field length");
-            return res;
-        }
-        received_len += read_len;
+    if (!read_exact(socket, &len, sizeof(flen))) {
+        res.set_error("Error when reading field length");
+        return res;
     }
 
-#ifdef DEBUG
-
-    cout << GREEN << "Field length: " << len << RESET << endl;
-#endif
     unsigned char *r = new unsigned char[len];
-
-    received_len = 0;
-    while (received_len < len) {
-        if ((read_len = read(socket, r + received_len, len - received_len)) <=
-            0) {
-            delete[] r;
-            res.set_error("Error when reading field");
-            return res;
-        }
-        received_len += read_len;
+    if (!read_exact(socket, r, len)) {
+        delete[] r;
+        res.set_error("Error when reading field");
+        return res;
     }
 
-#ifdef DEBUG
-    cout << GREEN << "Content (hex): ";
-    print_debug(reinterpret_cast<unsigned char *>(r), len);
-    cout << endl << RESET;
-#endif
+    TRACE_MESSAGE(socket, TraceRecvField, TRACE_NO_MTYPE, 0, len);
 
     res.set_result({len, r});
     return res;
 }
 
-unsigned char mtype_to_uc(mtypes m) { return (unsigned char)m; }
+Maybe<uint32_t> read_uint_field(int socket) {
+    Maybe<uint32_t> res;
 
-Maybe<tuple<seqnum, unsigned char *>> read_header(int socket) {
-    Maybe<tuple<seqnum, unsigned char *>> res;
-
-    ssize_t received_len = 0;
-    ssize_t read_len;
-    seqnum seq;
-    while ((unsigned long)received_len < sizeof(seqnum)) {
-        if ((read_len = read(socket, (uchar *)&seq + received_len,
-                             sizeof(seqnum) - received_len)) <= 0) {
-            res.set_error("Error when reading sequence number");
-            return res;
-        }
-        received_len += read_len;
+    auto field_res = read_field(socket);
+    if (field_res.is_error) {
+        res.set_error(field_res.error);
+        return res;
     }
+    auto [len, data] = field_res.result;
 
-#ifdef DEBUG
-    cout << GREEN << "Sequence number: " << seq << RESET << endl;
-#endif
-
-    received_len = 0;
-    unsigned char *iv = new unsigned char[get_iv_len()];
-    while (received_len < get_iv_len()) {
-        if ((read_len = read(socket, iv + received_len,
-                             get_iv_len() - received_len)) <= 0) {
-            delete[] iv;
-            res.set_error("Error when reading iv");
-            return res;
-        }
-
-        received_len += read_len;
+    if (len != sizeof(uint32_t)) {
+        res.set_error("Malformed integer field");
+    } else {
+        memcpy(&res.result, data, sizeof(uint32_t));
     }
-
-#ifdef DEBUG
-    cout << GREEN << "IV: ";
-    print_debug(iv, get_iv_len());
-    cout << RESET << endl;
-#endif
-
-    res.set_result({seq, iv});
+    delete[] data;
     return res;
 }
 
+unsigned char mtype_to_uc(mtypes m) { return (unsigned char)m; }
+
 Maybe<unsigned char *> read_tag(int socket) {
     Maybe<unsigned char *> res;
 
-    ssize_t received_len = 0;
-    ssize_t read_len;
     unsigned char *tag = new unsigned char[TAG_LEN];
-    while ((unsigned long)received_len < TAG_LEN) {
-        if ((read_len = read(socket, tag + received_len,
-                             TAG_LEN - received_len)) <= 0) {
-            res.set_error("Error when reading tag");
-            return res;
-        }
-        received_len += read_len;
+    if (!read_exact(socket, tag, TAG_LEN)) {
+        delete[] tag;
+        res.set_error("Error when reading tag");
+        return res;
     }
 
     res.set_result(tag);
@@ -320,44 +422,6 @@ unsigned char *string_to_uchar(const string &s) {
     return res;
 }
 
-fs::path get_user_storage_path(char *username) {
-    return fs::current_path() / "server" / "storage" / username;
-}
-
-bool is_path_valid(char *username, fs::path user_path) {
-    fs::path ok_path = get_user_storage_path(username);
-    string user_path_canonical_str;
-#if __has_include(<filesystem>)
-    fs::path user_path_canonical = fs::weakly_canonical(user_path);
-    user_path_canonical_str = user_path_canonical;
-#else
-    // realpath cannot be used on non-existing files, therefore we:
-    //   - check if the file already exists. If not, try to create the file, if
-    //   it fails it's invalid
-    //   - use realpath to get the canonical path
-    //   - remove the file, if we created it earlier
-    //   - check that the canonical path is a file in the user storage
-    bool already_exists;
-    if (!(already_exists = fs::exists(user_path))) {
-        FILE *f;
-        if ((f = fopen(user_path.native().c_str(), "w")) == nullptr) {
-            return false;
-        }
-        fclose(f);
-    }
-
-    char *user_path_canonical = realpath(user_path.native().c_str(), nullptr);
-    if (!already_exists)
-        fs::remove(user_path);
-
-    if (user_path_canonical == nullptr)
-        return false;
-
-    user_path_canonical_str = user_path_canonical;
-#endif
-    return user_path_canonical_str.rfind(ok_path.native(), 0) == 0;
-}
-
 const char *mtypes_to_string(mtypes m) {
     switch (m) {
     case AuthStart:
@@ -366,10 +430,22 @@ const char *mtypes_to_string(mtypes m) {
         return "AuthServerAns";
     case AuthClientAns:
         return "AuthClientAns";
+    case AuthResume:
+        return "AuthResume";
+    case AuthResumeAns:
+        return "AuthResumeAns";
+    case AuthTicket:
+        return "AuthTicket";
     case UploadReq:
         return "UploadReq";
     case UploadAns:
         return "UploadAns";
+    case UploadHashReq:
+        return "UploadHashReq";
+    case UploadHashes:
+        return "UploadHashes";
+    case UploadMissing:
+        return "UploadMissing";
     case UploadChunk:
         return "UploadChunk";
     case UploadEnd:
@@ -378,6 +454,10 @@ const char *mtypes_to_string(mtypes m) {
         return "UploadRes";
     case DownloadReq:
         return "DownloadReq";
+    case DownloadAns:
+        return "DownloadAns";
+    case DownloadUnchanged:
+        return "DownloadUnchanged";
     case DownloadChunk:
         return "DownloadChunk";
     case DownloadEnd:
@@ -390,6 +470,10 @@ const char *mtypes_to_string(mtypes m) {
         return "DeleteAns";
     case DeleteRes:
         return "DeleteRes";
+    case DeleteBatchReq:
+        return "DeleteBatchReq";
+    case DeleteBatchRes:
+        return "DeleteBatchRes";
     case ListReq:
         return "ListReq";
     case ListAns:
@@ -398,8 +482,48 @@ const char *mtypes_to_string(mtypes m) {
         return "RenameReq";
     case RenameAns:
         return "RenameAns";
+    case RenameBatchReq:
+        return "RenameBatchReq";
+    case RenameBatchRes:
+        return "RenameBatchRes";
+    case UpdateReq:
+        return "UpdateReq";
+    case UpdateSigs:
+        return "UpdateSigs";
+    case UpdateChunk:
+        return "UpdateChunk";
+    case UpdateEnd:
+        return "UpdateEnd";
+    case UpdateRes:
+        return "UpdateRes";
+    case InfoReq:
+        return "InfoReq";
+    case InfoAns:
+        return "InfoAns";
+    case VerifyReq:
+        return "VerifyReq";
+    case VerifyAns:
+        return "VerifyAns";
     case LogoutReq:
         return "LogoutReq";
+    case MuxStart:
+        return "MuxStart";
+    case MuxStartAns:
+        return "MuxStartAns";
+    case MuxOpen:
+        return "MuxOpen";
+    case MuxData:
+        return "MuxData";
+    case MuxWindow:
+        return "MuxWindow";
+    case MuxClose:
+        return "MuxClose";
+    case MuxEnd:
+        return "MuxEnd";
+    case RekeyReq:
+        return "RekeyReq";
+    case RekeyAns:
+        return "RekeyAns";
     case LogoutAns:
         return "LogoutAns";
     case Error:
@@ -409,95 +533,147 @@ const char *mtypes_to_string(mtypes m) {
     }
 }
 
-void send_error_response(int sock, unsigned char *key, const char *msg) {
-    // Generate iv for message
-    auto iv_res = gen_iv();
-    if (iv_res.is_error) {
-        handle_errors(iv_res.error);
+bool is_bulk(mtypes m) {
+    switch (m) {
+    case UploadHashes:
+    case UploadChunk:
+    case UploadEnd:
+    case DownloadChunk:
+    case DownloadEnd:
+    case UpdateSigs:
+    case UpdateChunk:
+    case UpdateEnd:
+    case DeleteBatchReq:
+    case DeleteBatchRes:
+    case RenameBatchReq:
+    case RenameBatchRes:
+    case MuxData:
+        return true;
+    default:
+        return false;
     }
-    auto iv = iv_res.result;
+}
 
-    // Send download request
-    auto send_packet_header_res =
-        send_header(sock, Error, seq_num, iv, get_iv_len());
-    if (send_packet_header_res.is_error) {
-        delete[] iv;
-        handle_errors(send_packet_header_res.error);
+void send_error_response(Session &session, const char *msg) {
+    session.errors_sent++;
+    send_message(session, Error, reinterpret_cast<const unsigned char *>(msg),
+                 strlen(msg) + 1);
+}
+
+void seal_message(Session &session, mtypes type, const unsigned char *pt,
+                  blen pt_len) {
+    session.out.header(type, session.send_seq);
+
+    // The ciphertext is as long as the plaintext, and sealed straight into
+    // the frame
+    unsigned char iv[AEAD_IV_LEN];
+    session.send_nonce(session.send_seq, iv);
+    auto space = session.out.field_space(pt_len);
+    if (space.is_error) {
+        handle_errors(space.error);
+    }
+    unsigned char *ct = space.result;
+    int ct_len = 0;
+    unsigned char tag[TAG_LEN];
+    bool sealed = with_suite(session.suite, [&](auto policy) {
+        return aead_seal<decltype(policy)>(
+            session.send_ctx, iv, mtype_to_uc(type), session.send_seq, pt,
+            pt_len, ct, ct_len, tag);
+    });
+    if (!sealed) {
+        handle_errors("Could not seal the message");
     }
+    session.out.tag(tag);
 
-    // Initialize encryption context
-    EVP_CIPHER_CTX *ctx;
-    int len = 0;
-    int ct_len;
-    if ((ctx = EVP_CIPHER_CTX_new()) == nullptr) {
-        delete[] iv;
-        handle_errors("Could not encrypt message (alloc)");
+    inc_seqnum(session.send_seq);
+}
+
+void send_message(Session &session, mtypes type, const unsigned char *pt,
+                  blen pt_len) {
+    seal_message(session, type, pt, pt_len);
+    auto send_res = session.out.flush(session.sock);
+    if (send_res.is_error) {
+        handle_errors(send_res.error);
     }
+}
 
-    if (EVP_EncryptInit(ctx, get_symmetric_cipher(), key, iv) != 1) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-    delete[] iv;
-
-    // Authenticated data
-    int err = 0;
-    unsigned char header = mtype_to_uc(Error);
-    err |=
-        EVP_EncryptUpdate(ctx, nullptr, &len, &header, sizeof(unsigned char));
-    err |=
-        EVP_EncryptUpdate(ctx, nullptr, &len, seqnum_to_uc(), sizeof(seqnum));
-    if (err != 1) {
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-
-    // Encryption of the filename
-    unsigned char *ct = new unsigned char[FNAME_MAX_LEN + get_block_size()];
-    if (EVP_EncryptUpdate(
-            ctx, ct, &len,
-            reinterpret_cast<unsigned char *>(const_cast<char *>(msg)),
-            strlen(msg) + 1) != 1) {
-        delete[] ct;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-    ct_len = len;
-
-    if (EVP_EncryptFinal(ctx, ct + ct_len, &len) != 1) {
-        delete[] ct;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-    ct_len += len;
+void send_message(Session &session, mtypes type, const string &msg) {
+    send_message(session, type,
+                 reinterpret_cast<const unsigned char *>(msg.c_str()),
+                 msg.length() + 1);
+}
 
-    unsigned char *tag = new unsigned char[TAG_LEN];
-    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, TAG_LEN, tag) != 1) {
-        delete[] ct;
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+bool receive_message(Session &session, mtypes type, vector<unsigned char> &pt,
+                     blen max_len) {
+    auto mtype_res = session.in.get_mtype(session.sock);
+    if (mtype_res.is_error ||
+        (mtype_res.result != type && mtype_res.result != Error)) {
+        handle_errors("Incorrect message type");
     }
-    EVP_CIPHER_CTX_free(ctx);
 
-    // Send ciphertext
-    auto ct_send_res = send_field(sock, (flen)ct_len, ct);
-    if (ct_send_res.is_error) {
-        delete[] ct;
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors(ct_send_res.error);
+    // An Error is no longer than a filename
+    if (mtype_res.result == Error) {
+        open_message(session, Error, pt, max(max_len, (blen)FNAME_MAX_LEN));
+        cout << message_string(pt) << endl;
+        return false;
     }
-    delete[] ct;
+    open_message(session, type, pt, max_len);
+    return true;
+}
 
-    auto tag_send_res = send_tag(sock, tag);
-    if (tag_send_res.is_error) {
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors(tag_send_res.error);
+bool split_results(const vector<unsigned char> &pt, size_t count,
+                   vector<string> &results) {
+    results.clear();
+    size_t start = 0;
+    for (size_t i = 0; i < pt.size(); i++) {
+        if (pt[i] != '\0')
+            continue;
+        results.emplace_back(reinterpret_cast<const char *>(pt.data()) + start,
+                             i - start);
+        start = i + 1;
+    }
+    return start == pt.size() && results.size() == count;
+}
+
+void open_message(Session &session, mtypes type, vector<unsigned char> &pt,
+                  blen max_len) {
+    auto seq_res = session.in.read_header(session.sock);
+    if (seq_res.is_error) {
+        handle_errors(seq_res.error);
     }
-    delete[] tag;
+    if (seq_res.result != session.recv_seq) {
+        handle_errors("Incorrect sequence number");
+    }
+
+    // The ciphertext is read into [pt], and opened there
+    pt.resize(max_len);
+    auto ct_res = session.in.read_field(session.sock, pt.data(), max_len);
+    if (ct_res.is_error) {
+        handle_errors(ct_res.error);
+    }
+    unsigned char tag[TAG_LEN];
+    auto tag_res = session.in.read_tag(session.sock, tag);
+    if (tag_res.is_error) {
+        handle_errors(tag_res.error);
+    }
+
+    unsigned char iv[AEAD_IV_LEN];
+    session.recv_nonce(session.recv_seq, iv);
+    int pt_len = 0;
+    bool opened = with_suite(session.suite, [&](auto policy) {
+        return aead_open<decltype(policy)>(
+            session.recv_ctx, iv, mtype_to_uc(type), session.recv_seq,
+            pt.data(), ct_res.result, pt.data(), pt_len, tag);
+    });
+    if (!opened) {
+        handle_errors("Could not open the message");
+    }
+    pt.resize(pt_len);
+
+    inc_seqnum(session.recv_seq);
+}
 
-    inc_seqnum();
+string message_string(const vector<unsigned char> &pt) {
+    const char *msg = reinterpret_cast<const char *>(pt.data());
+    return string(msg, strnlen(msg, pt.size()));
 }
@@ -1,11 +1,15 @@
 #include "maybe.h"
+#include "session.h"
 #include "types.h"
 #include <iostream>
 #include <openssl/bio.h>
 #include <openssl/evp.h>
 #include <openssl/rand.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string>
 #include <tuple>
+#include <vector>
 #include <unistd.h>
 
 #if __has_include(<filesystem>)
@@ -30,7 +34,49 @@ using namespace std;
 
 void print_debug(unsigned char *x, int len);
 
-const EVP_CIPHER *get_symmetric_cipher();
+/*
+ * Called by the socket helpers below whenever a non-blocking socket is not
+ * ready. The event-driven server installs one to park the current connection
+ * until epoll reports the socket ready again. When unset, the helpers poll.
+ *
+ * The hook belongs to the thread that installed it: other threads using the
+ * same socket (e.g. the stages of a transfer) poll instead. It may be called
+ * on any other file descriptor as well, for the connection to be parked until
+ * that one is ready: the socket is left alone meanwhile.
+ *
+ * Returns false if the socket was not ready within io_idle_timeout seconds:
+ * the helpers fail then, as if the peer went away.
+ */
+typedef bool (*io_wait_hook_t)(int socket, bool for_write);
+extern thread_local io_wait_hook_t io_wait_hook;
+
+/*
+ * Seconds a non-blocking socket may stay not ready before the helpers below
+ * give up on it, 0 for no limit (the default)
+ */
+extern unsigned int io_idle_timeout;
+
+/*
+ * Called by the socket helpers below with the bytes of every read (write),
+ * from whichever thread did it, e.g. for the server to count them. None when
+ * unset.
+ */
+typedef void (*io_count_hook_t)(size_t len, bool written);
+extern io_count_hook_t io_count_hook;
+
+/* Writes exactly len bytes to the socket. Returns false on failure */
+bool write_exact(int socket, const void *buf, size_t len);
+
+/*
+ * Reads at most len bytes from the socket, waiting for any to be available.
+ * Returns the number of bytes read, or zero on EOF or failure
+ */
+size_t read_some(int socket, void *buf, size_t len);
+
+/*
+ * Lengths of the keys, nonces and blocks of every cipher suite (see cipher.h),
+ * which share them
+ */
 int get_symmetric_key_length();
 int get_iv_len();
 int get_block_size();
@@ -49,8 +95,68 @@ Maybe<unsigned char *> kdf(unsigned char *shared_secret, int shared_secret_len,
                            unsigned int key_len);
 
 /*
- * The caller is responsible for the de-allocation of the returned pointer, if
- * any
+ * Secret kept by both parties after a login, from which the key of a resumed
+ * session is derived. The caller is responsible for the de-allocation of the
+ * returned pointer, if any
+ */
+Maybe<unsigned char *> derive_resumption_secret(unsigned char *key,
+                                                int key_len);
+
+/*
+ * Salt of the nonces of the messages sent by the given side of a session. The
+ * caller is responsible for the de-allocation of the returned pointer, if any
+ */
+Maybe<unsigned char *> derive_nonce_salt(unsigned char *key, int key_len,
+                                         session_role sender, int salt_len);
+
+/*
+ * Key of a resumed session: fresh as long as any of the two nonces is. The
+ * caller is responsible for the de-allocation of the returned pointer, if any
+ */
+Maybe<unsigned char *> derive_resumed_key(unsigned char *resumption_secret,
+                                          int key_len,
+                                          unsigned char *client_nonce,
+                                          unsigned char *server_nonce);
+
+/*
+ * Key replacing [key] when a session is rekeyed: fresh as long as any of the
+ * two nonces is. The caller is responsible for the de-allocation of the
+ * returned pointer, if any
+ */
+Maybe<unsigned char *> derive_rekeyed_key(unsigned char *key, int key_len,
+                                          unsigned char *client_nonce,
+                                          unsigned char *server_nonce);
+
+/*
+ * Key of the stream numbered [stream] of the multiplexing started by the
+ * message numbered [epoch] (see mux.h), distinct for every stream the key of a
+ * session is ever used for. The caller is responsible for the de-allocation of
+ * the returned pointer, if any
+ */
+Maybe<unsigned char *> derive_stream_key(unsigned char *key, int key_len,
+                                         seqnum epoch, uint32_t stream);
+
+/*
+ * Tag of the [len] bytes at [data] under a key derived from the key of a
+ * session, written into [tag] (LOGIN_TAG_LEN bytes): the server ends the
+ * answer of a login with the tag of what the client proposed followed by the
+ * answer, and the client checks it against what it proposed itself, so that
+ * neither can be changed on the way
+ */
+Maybe<bool> login_tag(unsigned char *key, int key_len,
+                      const unsigned char *data, size_t len,
+                      unsigned char *tag);
+
+/*
+ * Generates a random nonce of NONCE_LEN bytes. The caller is responsible for
+ * the de-allocation of the returned pointer, if any
+ */
+Maybe<unsigned char *> gen_nonce();
+
+/*
+ * Random IV, for what is not sealed with the key of a session (see
+ * Session::send_nonce). The caller is responsible for the de-allocation of the
+ * returned pointer, if any
  */
 Maybe<unsigned char *> gen_iv();
 
@@ -64,30 +170,77 @@ Maybe<unsigned char *> get_dummy();
 Maybe<mtypes> get_mtype(int socket);
 
 Maybe<bool> send_header(int socket, mtypes type);
-Maybe<bool> send_header(int socket, mtypes type, seqnum seq_num, uchar *iv,
-                        int iv_len);
 Maybe<bool> send_tag(int socket, unsigned char *tag);
 
 Maybe<bool> send_field(int socket, flen len, unsigned char *data);
 Maybe<tuple<flen, unsigned char *>> read_field(int socket);
 
+/* Reads a field holding a single 32-bit integer */
+Maybe<uint32_t> read_uint_field(int socket);
+
 unsigned char mtype_to_uc(mtypes m);
-Maybe<tuple<seqnum, unsigned char *>> read_header(int socket);
 Maybe<unsigned char *> read_tag(int socket);
 
 unsigned char *string_to_uchar(const string &my_string);
 
-/* Returns the path to the user storage */
-fs::path get_user_storage_path(char *username);
+// Files of a user storage named this way are uploads still in progress
+#define PARTIAL_PREFIX ".partial-"
+
+const char *mtypes_to_string(mtypes m);
 
 /*
- * Used to validate paths taken by the user.
- * Checks for path traversals
+ * Whether the field of the message is a chunk of a file (or the hashes of
+ * its chunks, its signature, or a batch of names), sized by a blen
  */
-bool is_path_valid(char *username, fs::path user_path);
+bool is_bulk(mtypes m);
 
-const char *mtypes_to_string(mtypes m);
+/*
+ * The codec of every message of a session, sealed (opened) with its next
+ * sequence number, the type byte and the sequence number being authenticated
+ * as well. Errors are thrown through handle_errors.
+ */
 
-void send_error_response(int sock, unsigned char *key, const char *msg);
+/*
+ * Assembles in session.out the [pt_len] bytes at [pt], sealed as a message of
+ * the given type, for the caller to flush
+ */
+void seal_message(Session &session, mtypes type, const unsigned char *pt,
+                  blen pt_len);
+
+/* Sends the [pt_len] bytes at [pt] as a message of the given type */
+void send_message(Session &session, mtypes type, const unsigned char *pt,
+                  blen pt_len);
+
+/* Same as the above, for a string, sent with its terminator */
+void send_message(Session &session, mtypes type, const string &msg);
+
+/* Sends [msg] as an Error */
+void send_error_response(Session &session, const char *msg);
+
+/*
+ * Receives a message of the given type into [pt], of at most [max_len] bytes.
+ * Returns false if the other party sent an Error instead, whose content is
+ * written on the standard output.
+ */
+bool receive_message(Session &session, mtypes type,
+                     vector<unsigned char> &pt, blen max_len);
+
+/*
+ * Same as the above, for a message whose type was already read: the rest of
+ * it, which must be of at most [max_len] bytes. It is opened in place, in
+ * [pt]: a buffer kept from one message to the next does not allocate.
+ */
+void open_message(Session &session, mtypes type, vector<unsigned char> &pt,
+                  blen max_len);
+
+/* The string a message opened into [pt] holds, up to its terminator if any */
+string message_string(const vector<unsigned char> &pt);
+
+/*
+ * Splits the answer [pt] to a batch of [count] items into the result of each,
+ * as strings one after the other. Returns false if it does not hold that many
+ */
+bool split_results(const vector<unsigned char> &pt, size_t count,
+                   vector<string> &results);
 
 #endif
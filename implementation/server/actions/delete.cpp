@@ -1,9 +1,16 @@
 #include "../../common/errors.h"
 #include "../../common/seq.h"
+#include "../../common/session.h"
 #include "../../common/types.h"
 #include "../../common/utils.h"
-#include <openssl/evp.h>
+#include "../chunkstore.h"
+#include "../metaindex.h"
+#include "../treestore.h"
+#include "../volumes.h"
+#include "delete.h"
+#include <stdint.h>
 #include <string.h>
+#include <vector>
 
 #if __has_include(<filesystem>)
 #include <filesystem>
@@ -17,6 +24,9 @@ error "Missing the <filesystem> header."
 
 using namespace std;
 
+// Length of the confirmation of the client
+#define CONF_LEN 3
+
 Maybe<fs::path> sanitize_path(char *username, unsigned char *f) {
     Maybe<fs::path> res;
 
@@ -41,9 +51,12 @@ Maybe<fs::path> sanitize_path(char *username, unsigned char *f) {
 
 string actual_delete(fs::path f_path) {
     error_code ec;
-    int retval = fs::remove(f_path, ec);
+    int retval = remove_stored_file(f_path, ec);
     if (!ec) { // Success
         if (retval) {
+            unindex_file(f_path.parent_path().filename().c_str(),
+                         f_path.filename().native());
+            drop_tree(f_path);
             return "Deletion performed correctly";
         } else {
             return "File does not exist, but it should";
@@ -54,403 +67,84 @@ string actual_delete(fs::path f_path) {
     return "Deletion canceled - something went wrong";
 }
 
-void delete_file(int sock, unsigned char *key, char *username) {
-
-    auto server_header_res = read_header(sock);
-    if (server_header_res.is_error) {
-        handle_errors();
-    }
-    auto [seq, iv] = server_header_res.result;
-
-    if (seq != seq_num) {
-        delete[] iv;
-        handle_errors("Incorrect sequence number");
-    }
-
-    // read ciphertext
-    auto ct_res = read_field(sock);
-    if (ct_res.is_error) {
-        delete[] iv;
-        handle_errors();
-    }
-    auto [ct_len, ct] = ct_res.result;
-
-    // read tag
-    auto tag_res = read_tag(sock);
-    if (tag_res.is_error) {
-        delete[] ct;
-        delete[] iv;
-        handle_errors();
-    }
-    auto tag = tag_res.result;
-
-    // Initialize decryption
-    EVP_CIPHER_CTX *ctx;
-    if ((ctx = EVP_CIPHER_CTX_new()) == nullptr) {
-        delete[] iv;
-        delete[] ct;
-        delete[] tag;
-        handle_errors("Could not decrypt message (alloc)");
-    }
-    int len;
-
-    if (EVP_DecryptInit(ctx, get_symmetric_cipher(), key, iv) != 1) {
-        delete[] iv;
-        delete[] ct;
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-
-    delete[] iv;
-
-    unsigned char header = mtype_to_uc(DeleteReq);
-
-    /* Specify authenticated data */
-    int err = 0;
-    err |= EVP_DecryptUpdate(ctx, nullptr, &len, &header, sizeof(mtype));
-    err |=
-        EVP_DecryptUpdate(ctx, nullptr, &len, seqnum_to_uc(), sizeof(seqnum));
-
-    if (err != 1) {
-        delete[] ct;
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-
-    auto *pt = new unsigned char[ct_len];
-    int pt_len;
-    // Decrypt Update
-    if (EVP_DecryptUpdate(ctx, pt, &len, ct, ct_len) != 1) {
-        delete[] ct;
-        delete[] tag;
-        delete[] pt;
-        EVP_CIPHER_CTX_free(ctx);
-    }
-
-    // GCM tag check
-    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, TAG_LEN, tag);
-
-    // Decrypt Final. Finalize the encryption and adds the padding
-    if (EVP_DecryptFinal(ctx, pt + len, &len) != 1) {
-        delete[] ct;
-        delete[] tag;
-        delete[] pt;
-        EVP_CIPHER_CTX_free(ctx);
+void delete_file(Session &session) {
+    // The name of the file
+    vector<unsigned char> filename;
+    open_message(session, DeleteReq, filename, FNAME_MAX_LEN);
+    if (filename.size() != FNAME_MAX_LEN) {
+        handle_errors("Malformed delete request");
     }
-
-    // free variables
-    delete[] ct;
-    delete[] tag;
-
-    // free context
-    EVP_CIPHER_CTX_reset(ctx);
-
-    inc_seqnum();
+    filename[FNAME_MAX_LEN - 1] = '\0';
 
 #ifdef DEBUG
-    cout << endl << "f to delete: " << pt << endl;
+    cout << endl << "f to delete: " << filename.data() << endl;
 #endif
 
-    // Plaintext stored in filename variable
-    unsigned char *filename = pt;
-
     // Sanitize path
-    auto sanitize_res = sanitize_path(username, filename);
+    auto sanitize_res = sanitize_path(session.username, filename.data());
     if (sanitize_res.is_error) {
-        EVP_CIPHER_CTX_free(ctx);
-        send_error_response(sock, key, sanitize_res.error);
-        delete[] filename;
+        send_error_response(session, sanitize_res.error);
         return;
     }
 
     //-----------------Respond to client---------------------
 
-    // Generate iv for message
-    auto iv_res = gen_iv();
-    if (iv_res.is_error) {
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors(iv_res.error);
-    }
-    iv = iv_res.result;
-
-    auto send_packet_header_res =
-        send_header(sock, DeleteConfirm, seq_num, iv, get_iv_len());
-    if (send_packet_header_res.is_error) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors(send_packet_header_res.error);
-    }
-
-    // Initialize encryption context
-    len = 0;
-    ct_len = 0;
-
-    if (EVP_EncryptInit(ctx, get_symmetric_cipher(), key, iv) != 1) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-
-    // Authenticate data
-    err = 0;
-    header = mtype_to_uc(DeleteConfirm);
-    err |= EVP_EncryptUpdate(ctx, nullptr, &len, &header, sizeof(mtype));
-    err |=
-        EVP_EncryptUpdate(ctx, nullptr, &len, seqnum_to_uc(), sizeof(seqnum));
-    if (err != 1) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-
-    unsigned char response[] = "Are you sure? (y/n)";
-    ct = new unsigned char[sizeof(response) + get_block_size()];
-    if (EVP_EncryptUpdate(ctx, ct, &len, response, sizeof(response)) != 1) {
-        delete[] iv;
-        delete[] ct;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-    ct_len = len;
-
-    if (EVP_EncryptFinal(ctx, ct + len, &len) != 1) {
-        delete[] iv;
-        delete[] ct;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-    ct_len += len;
-
-    tag = new unsigned char[TAG_LEN];
-    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, TAG_LEN, tag) != 1) {
-        delete[] iv;
-        delete[] ct;
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-    delete[] iv;
-    EVP_CIPHER_CTX_reset(ctx);
-
-    auto ct_send_res = send_field(sock, (flen)ct_len, ct);
-    if (ct_send_res.is_error) {
-        delete[] ct;
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors(ct_send_res.error);
-    }
-    delete[] ct;
-
-    auto tag_send_res = send_tag(sock, tag);
-    if (tag_send_res.is_error) {
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors(tag_send_res.error);
-    }
-    delete[] tag;
-
-    inc_seqnum();
+    send_message(session, DeleteConfirm, "Are you sure? (y/n)");
 
     //---------------Wait client confirmation---------------------
 
-    auto mtype_res = get_mtype(sock);
+    auto mtype_res = session.in.get_mtype(session.sock);
     if (mtype_res.is_error || mtype_res.result != DeleteRes) {
-        EVP_CIPHER_CTX_free(ctx);
         handle_errors("Incorrect message type");
     }
-
-    server_header_res = read_header(sock);
-    if (server_header_res.is_error) {
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-    seq = get<0>(server_header_res.result);
-    iv = get<1>(server_header_res.result);
-
-    if (seq != seq_num) {
-        EVP_CIPHER_CTX_free(ctx);
-        delete[] iv;
-        handle_errors("Incorrect sequence number");
-    }
-
-    // read ciphertext
-    ct_res = read_field(sock);
-    if (ct_res.is_error) {
-        EVP_CIPHER_CTX_free(ctx);
-        delete[] iv;
-        handle_errors();
-    }
-    ct_len = get<0>(ct_res.result);
-    ct = get<1>(ct_res.result);
-    pt = new unsigned char[ct_len];
-
-    // read tag
-    tag_res = read_tag(sock);
-    if (tag_res.is_error) {
-        EVP_CIPHER_CTX_free(ctx);
-        delete[] ct;
-        delete[] pt;
-        delete[] iv;
-        handle_errors();
-    }
-    tag = tag_res.result;
-
-    if (EVP_DecryptInit(ctx, get_symmetric_cipher(), key, iv) != 1) {
-        delete[] iv;
-        delete[] ct;
-        delete[] tag;
-        delete[] pt;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-
-    delete[] iv;
-
-    header = mtype_to_uc(DeleteRes);
-
-    /* Specify authenticated data */
-    err = 0;
-    err |= EVP_DecryptUpdate(ctx, nullptr, &len, &header, sizeof(mtype));
-    err |=
-        EVP_DecryptUpdate(ctx, nullptr, &len, seqnum_to_uc(), sizeof(seqnum));
-
-    if (err != 1) {
-        delete[] ct;
-        delete[] tag;
-        delete[] pt;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-
-    // Decrypt Update
-    if (EVP_DecryptUpdate(ctx, pt, &len, ct, ct_len) != 1) {
-        delete[] ct;
-        delete[] tag;
-        delete[] pt;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-
-    // GCM tag check
-    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, TAG_LEN, tag);
-
-    // Decrypt Final. Finalize the encryption and adds the padding
-    if (EVP_DecryptFinal(ctx, pt + len, &len) != 1) {
-        delete[] ct;
-        delete[] tag;
-        delete[] pt;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-
-    // free variables
-    delete[] ct;
-    delete[] tag;
-
-    // free context
-    EVP_CIPHER_CTX_reset(ctx);
-
-    inc_seqnum();
+    vector<unsigned char> confirm;
+    open_message(session, DeleteRes, confirm, CONF_LEN);
 
     // Perform actual deletion
     string delete_response;
-    if (strncmp(reinterpret_cast<char *>(pt), "y", 1) == 0) {
+    if (!confirm.empty() && confirm[0] == 'y') {
         delete_response = actual_delete(sanitize_res.result);
     } else {
         delete_response = "Deletion aborted - user did not confirm";
     }
-    delete[] pt;
-    delete[] filename;
 
     //-----------------Respond to client---------------------
 
-    // Generate iv for message
-    iv_res = gen_iv();
-    if (iv_res.is_error) {
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors(iv_res.error);
-    }
-    iv = iv_res.result;
-
-    send_packet_header_res =
-        send_header(sock, DeleteAns, seq_num, iv, get_iv_len());
-    if (send_packet_header_res.is_error) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors(send_packet_header_res.error);
-    }
-
-    // Initialize encryption context
-    len = 0;
-    ct_len = 0;
-
-    if (EVP_EncryptInit(ctx, get_symmetric_cipher(), key, iv) != 1) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-
-    // Authenticate data
-    err = 0;
-    header = mtype_to_uc(DeleteAns);
-    err |=
-        EVP_EncryptUpdate(ctx, nullptr, &len, &header, sizeof(unsigned char));
-    err |=
-        EVP_EncryptUpdate(ctx, nullptr, &len, seqnum_to_uc(), sizeof(seqnum));
-    if (err != 1) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-
-    pt_len = delete_response.length() + 1;
-    pt = string_to_uchar(delete_response);
-    ct = new unsigned char[pt_len];
-    if (EVP_EncryptUpdate(ctx, ct, &len, pt, pt_len) != 1) {
-        delete[] iv;
-        delete[] pt;
-        delete[] ct;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-    ct_len = len;
-    delete[] pt;
-
-    if (EVP_EncryptFinal(ctx, ct + len, &len) != 1) {
-        delete[] iv;
-        delete[] ct;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-    ct_len += len;
-
-    tag = new unsigned char[TAG_LEN];
-    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, TAG_LEN, tag) != 1) {
-        delete[] iv;
-        delete[] ct;
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-    delete[] iv;
-    EVP_CIPHER_CTX_free(ctx);
-
-    ct_send_res = send_field(sock, (flen)ct_len, ct);
-    if (ct_send_res.is_error) {
-        delete[] ct;
-        delete[] tag;
-        handle_errors(ct_send_res.error);
-    }
-    delete[] ct;
+    send_message(session, DeleteAns, delete_response);
+}
 
-    tag_send_res = send_tag(sock, tag);
-    if (tag_send_res.is_error) {
-        delete[] tag;
-        handle_errors(tag_send_res.error);
+void delete_files(Session &session) {
+    // The number of files, followed by their names
+    vector<unsigned char> pt;
+    open_message(session, DeleteBatchReq, pt,
+                 sizeof(uint32_t) + BATCH_MAX_ITEMS * FNAME_MAX_LEN);
+    uint32_t count = 0;
+    if (pt.size() >= sizeof(count)) {
+        memcpy(&count, pt.data(), sizeof(count));
+    }
+    if (pt.size() < sizeof(count) || count > BATCH_MAX_ITEMS ||
+        pt.size() != sizeof(count) + (size_t)count * FNAME_MAX_LEN) {
+        handle_errors("Malformed batch delete request");
+    }
+
+    // The client asked its user for confirmation once, for all of them.
+    // Each one is answered on its own, in order, as a string
+    vector<unsigned char> results;
+    for (uint32_t i = 0; i < count; i++) {
+        unsigned char *filename =
+            pt.data() + sizeof(count) + (size_t)i * FNAME_MAX_LEN;
+        filename[FNAME_MAX_LEN - 1] = '\0';
+
+        string result;
+        auto sanitize_res = sanitize_path(session.username, filename);
+        if (sanitize_res.is_error) {
+            result = sanitize_res.error;
+        } else {
+            result = actual_delete(sanitize_res.result);
+        }
+        results.insert(results.end(), result.begin(), result.end());
+        results.push_back('\0');
     }
-    delete[] tag;
 
-    inc_seqnum();
+    send_message(session, DeleteBatchRes, results.data(), results.size());
 }
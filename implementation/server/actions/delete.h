@@ -1,8 +1,32 @@
+#include "../../common/maybe.h"
+#include "../../common/session.h"
+#include <string>
+
+#if __has_include(<filesystem>)
+#include <filesystem>
+namespace fs = std::filesystem;
+#elif __has_include(<experimental/filesystem>)
+#include <experimental/filesystem>
+namespace fs = std::experimental::filesystem;
+#else
+error "Missing the <filesystem> header."
+#endif
+
 #ifndef delete_h
 #define delete_h
 
-void delete_file(int sock, unsigned char *key, char *username);
+void delete_file(Session &session);
+
+/*
+ * Deletes a batch of files in a single round trip: the client sends all of
+ * their names at once, once its user confirmed, and gets the result of each
+ */
+void delete_files(Session &session);
+
+/* Checks the name [f] of a file of [username], returning its path */
+Maybe<fs::path> sanitize_path(char *username, unsigned char *f);
 
-int sanitize_path(char *username, unsigned char *f);
+/* Deletes the file at [f_path], returning what happened */
+std::string actual_delete(fs::path f_path);
 
-#endif
\ No newline at end of file
+#endif
@@ -1,9 +1,17 @@
 #include "../../common/errors.h"
+#include "../../common/pipeline.h"
 #include "../../common/seq.h"
+#include "../../common/session.h"
 #include "../../common/types.h"
 #include "../../common/utils.h"
-#include <openssl/evp.h>
+#include "../chunkstore.h"
+#include "../metaindex.h"
+#include "../volumes.h"
+#include <memory>
+#include <stdint.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <vector>
 
 #if __has_include(<filesystem>)
 #include <filesystem>
@@ -39,253 +47,120 @@ Maybe<FILE *> validate_request(char *username, char *filename) {
     return res;
 }
 
-void download(int sock, unsigned char *key, char *username) {
-
-    // -----------receive client download request-----------
-    auto server_header_res = read_header(sock);
-    if (server_header_res.is_error) {
-        handle_errors();
-    }
-    auto [seq, iv] = server_header_res.result;
-
-    if (seq != seq_num) {
-        delete[] iv;
-        handle_errors("Incorrect sequence number");
-    }
-
-    // Read ciphertext
-    auto ct_res = read_field(sock);
-    if (ct_res.is_error) {
-        delete[] iv;
-        handle_errors();
-    }
-    auto [ct_len, ct] = ct_res.result;
-
-    // Read tag
-    auto tag_res = read_tag(sock);
-    if (tag_res.is_error) {
-        delete[] ct;
-        delete[] iv;
-        handle_errors();
-    }
-    auto tag = tag_res.result;
-
-    // Initialize decryption
-    EVP_CIPHER_CTX *ctx;
-    if ((ctx = EVP_CIPHER_CTX_new()) == nullptr) {
-        delete[] iv;
-        delete[] ct;
-        delete[] tag;
-        handle_errors("Could not decrypt message (alloc)");
-    }
-    int len;
-
-    if (EVP_DecryptInit(ctx, get_symmetric_cipher(), key, iv) != 1) {
-        delete[] iv;
-        delete[] ct;
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-
-    delete[] iv;
-
-    unsigned char header = mtype_to_uc(DownloadReq);
-
-    // Authenticated data
-    int err = 0;
-    err |= EVP_DecryptUpdate(ctx, nullptr, &len, &header, sizeof(mtype));
-    err |=
-        EVP_DecryptUpdate(ctx, nullptr, &len, seqnum_to_uc(), sizeof(seqnum));
-
-    if (err != 1) {
-        delete[] ct;
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
+/* Tells the client that the download starts, and the size of the whole file */
+void send_download_answer(Session &session, uint64_t file_size) {
+    send_message(session, DownloadAns,
+                 reinterpret_cast<unsigned char *>(&file_size),
+                 sizeof(file_size));
+}
 
-    auto *pt = new unsigned char[ct_len];
-    if (EVP_DecryptUpdate(ctx, pt, &len, ct, ct_len) != 1) {
-        delete[] ct;
-        delete[] tag;
-        delete[] pt;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+/*
+ * Tells the client that the file [filename] it has cached, whose content has
+ * the hash [cached], is what the server has, if the index says so. Returns
+ * whether it did.
+ */
+static bool is_unchanged(Session &session, const char *filename,
+                         const unsigned char *cached) {
+    FileMeta meta;
+    auto stat_res = stat_file(session.username, filename, meta);
+    if (stat_res.is_error || !stat_res.result || !meta.hashed ||
+        memcmp(meta.hash, cached, FILE_HASH_LEN) != 0) {
+        return false;
     }
+    send_message(session, DownloadUnchanged,
+                 reinterpret_cast<unsigned char *>(&meta.size),
+                 sizeof(meta.size));
+    return true;
+}
 
-    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, TAG_LEN, tag);
+void download(Session &session) {
 
-    if (EVP_DecryptFinal(ctx, pt + len, &len) != 1) {
-        delete[] ct;
-        delete[] tag;
-        delete[] pt;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+    // -----------receive client download request-----------
+    // The name of the file, followed by the range of it to send, then the
+    // hash of the copy the client has cached, if any
+    const size_t request_len = FNAME_MAX_LEN + 2 * sizeof(uint64_t);
+    vector<unsigned char> pt;
+    open_message(session, DownloadReq, pt, request_len + FILE_HASH_LEN);
+    if (pt.size() != request_len && pt.size() != request_len + FILE_HASH_LEN) {
+        handle_errors("Malformed download request");
     }
-
-    delete[] ct;
-    delete[] tag;
-
-    EVP_CIPHER_CTX_reset(ctx);
-
-    inc_seqnum();
+    pt[FNAME_MAX_LEN - 1] = '\0';
+    uint64_t offset, length;
+    memcpy(&offset, pt.data() + FNAME_MAX_LEN, sizeof(offset));
+    memcpy(&length, pt.data() + FNAME_MAX_LEN + sizeof(offset),
+           sizeof(length));
+    const unsigned char *cached =
+        pt.size() > request_len ? pt.data() + request_len : nullptr;
 
     // -----------validate client's request and answer-----------
-    auto validation_res =
-        validate_request(username, reinterpret_cast<char *>(pt));
-    delete[] pt;
+    char *filename = reinterpret_cast<char *>(pt.data());
+    auto validation_res = validate_request(session.username, filename);
     if (validation_res.is_error) {
-        EVP_CIPHER_CTX_free(ctx);
-        send_error_response(sock, key, validation_res.error);
+        send_error_response(session, validation_res.error);
         return;
     }
-
     FILE *file_fp = validation_res.result;
 
-    // Send the file a chunk at a time
-    unsigned char buffer[CHUNK_SIZE] = {0};
-    ct = new unsigned char[sizeof(buffer) + get_block_size()];
-    tag = new unsigned char[TAG_LEN];
-    mtypes msg_type = DownloadChunk;
-
-    for (;;) {
-        size_t read_len;
-        if ((read_len = fread(buffer, sizeof(*buffer), sizeof(buffer),
-                              file_fp)) != sizeof(buffer)) {
-
-            // When we read less than expected we could either have an error, or
-            // we could have reached eof
-            if (feof(file_fp) != 0) {
-                // Change message type, as this is the last chunk of data
-                msg_type = DownloadEnd;
-            } else if (ferror(file_fp) != 0) {
-                delete[] ct;
-                delete[] tag;
-                fclose(file_fp);
-                EVP_CIPHER_CTX_free(ctx);
-                send_error_response(sock, key, "Error - Could not read file");
-                return;
-            } else {
-                delete[] ct;
-                delete[] tag;
-                fclose(file_fp);
-                EVP_CIPHER_CTX_free(ctx);
-                send_error_response(sock, key, "Error - Cosmic rays uh?");
-                return;
-            }
-        }
-
-        // Generate iv for message
-        auto iv_res = gen_iv();
-        if (iv_res.is_error) {
-            delete[] ct;
-            delete[] tag;
-            fclose(file_fp);
-            EVP_CIPHER_CTX_free(ctx);
-            handle_errors(iv_res.error);
-        }
-        iv = iv_res.result;
-
-        // Send chunk header
-        auto send_packet_header_res =
-            send_header(sock, msg_type, seq_num, iv, get_iv_len());
-        if (send_packet_header_res.is_error) {
-            delete[] iv;
-            delete[] ct;
-            delete[] tag;
-            fclose(file_fp);
-            EVP_CIPHER_CTX_free(ctx);
-            handle_errors(send_packet_header_res.error);
-        }
-
-        if (EVP_EncryptInit(ctx, get_symmetric_cipher(), key, iv) != 1) {
-            delete[] iv;
-            delete[] ct;
-            delete[] tag;
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(file_fp);
-            handle_errors();
-        }
-        delete[] iv;
-
-        // Authenticated data
-        err = 0;
-        header = mtype_to_uc(msg_type);
-        err |= EVP_EncryptUpdate(ctx, nullptr, &len, &header,
-                                 sizeof(unsigned char));
-        err |= EVP_EncryptUpdate(ctx, nullptr, &len, seqnum_to_uc(),
-                                 sizeof(seqnum));
-        if (err != 1) {
-            delete[] ct;
-            delete[] tag;
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(file_fp);
-            handle_errors();
-        }
-
-        // Encrypt the chunk
-        if (EVP_EncryptUpdate(ctx, ct, &len, buffer, read_len) != 1) {
-            delete[] ct;
-            delete[] tag;
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(file_fp);
-            handle_errors();
-        }
-        ct_len = len;
-
-        // Finalize encryption
-        if (EVP_EncryptFinal(ctx, ct + ct_len, &len) != 1) {
-            delete[] ct;
-            delete[] tag;
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(file_fp);
-            handle_errors();
-        }
-        ct_len += len;
-
-        if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, TAG_LEN, tag) !=
-            1) {
-            delete[] ct;
-            delete[] tag;
-            EVP_CIPHER_CTX_free(ctx);
+    // A file the client has cached is not sent again if it did not change
+    try {
+        if (cached != nullptr && is_unchanged(session, filename, cached)) {
             fclose(file_fp);
-            handle_errors();
+            return;
         }
+    } catch (char const *) {
+        fclose(file_fp);
+        throw;
+    }
 
-        // Send ciphertext
-        auto ct_send_res = send_field(sock, (flen)ct_len, ct);
-        if (ct_send_res.is_error) {
-            delete[] ct;
-            delete[] tag;
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(file_fp);
-            handle_errors(ct_send_res.error);
-        }
+    // A file kept as its chunks is read from the store
+    Manifest manifest;
+    auto manifest_res = read_manifest(file_fp, manifest);
+    if (manifest_res.is_error) {
+        fclose(file_fp);
+        send_error_response(session, manifest_res.error);
+        return;
+    }
+    bool chunked = manifest_res.result;
 
-        auto tag_send_res = send_tag(sock, tag);
-        if (tag_send_res.is_error) {
-            delete[] tag;
-            delete[] ct;
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(file_fp);
-            handle_errors(tag_send_res.error);
-        }
+    struct stat st;
+    if (fstat(fileno(file_fp), &st) != 0 || st.st_size > (off_t)FSIZE_MAX) {
+        fclose(file_fp);
+        send_error_response(session, "Error - File is not readable");
+        return;
+    }
+    uint64_t file_size = chunked ? manifest.size : st.st_size;
+    if (offset > file_size) {
+        fclose(file_fp);
+        send_error_response(session, "Error - Invalid range");
+        return;
+    }
 
-        // At the end, reset the context and increase the sequence number
-        EVP_CIPHER_CTX_reset(ctx);
-        inc_seqnum();
+    try {
+        send_download_answer(session, file_size);
+    } catch (char const *) {
+        fclose(file_fp);
+        throw;
+    }
 
-        // We have reached EOF, thus the download has ended
-        // Note that we already sent the full file to the client, correctly
-        // ending with a DownloadEnd message
-        if (feof(file_fp) != 0) {
-            break;
-        }
+    // Send the range a chunk at a time, reading and encrypting the next
+    // chunks while the previous ones are sent
+    Maybe<bool> send_res;
+    if (chunked) {
+        fclose(file_fp);
+        unique_ptr<FileSource> source(
+            open_manifest_source(manifest, offset, length));
+        send_res = send_file(session, *source, DownloadChunk, DownloadEnd);
+    } else {
+        send_res = send_file(session, file_fp, offset, length, DownloadChunk,
+                             DownloadEnd);
+        fclose(file_fp);
+    }
+    if (send_res.is_error) {
+        handle_errors(send_res.error);
     }
 
-    delete[] tag;
-    delete[] ct;
-    EVP_CIPHER_CTX_free(ctx);
-    fclose(file_fp);
+    // Whatever was sent so far ends with the error
+    if (!send_res.result) {
+        send_error_response(session, "Error - Could not read file");
+    }
 }
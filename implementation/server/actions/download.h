@@ -1,6 +1,7 @@
+#include "../../common/session.h"
 #ifndef download_h
 #define download_h
 
-void download(int sock, unsigned char *key, char *username);
+void download(Session &session);
 
 #endif
@@ -0,0 +1,63 @@
+#include "../../common/errors.h"
+#include "../../common/session.h"
+#include "../../common/types.h"
+#include "../../common/utils.h"
+#include "../metaindex.h"
+#include "info.h"
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+void file_info(Session &session) {
+
+    // -----------receive client info request-----------
+    // The name of the file, empty for none
+    vector<unsigned char> pt;
+    open_message(session, InfoReq, pt, FNAME_MAX_LEN);
+    if (pt.size() != FNAME_MAX_LEN) {
+        handle_errors("Malformed info request");
+    }
+    pt[FNAME_MAX_LEN - 1] = '\0';
+    string name = reinterpret_cast<char *>(pt.data());
+
+    //-----------------Respond to client---------------------
+    // The bytes stored, the quota (0 for none) and the number of files,
+    // followed by the size, modification time and hash of the file if any
+    uint64_t bytes;
+    uint32_t files;
+    auto usage_res = get_usage(session.username, bytes, files);
+    if (usage_res.is_error) {
+        send_error_response(session, usage_res.error);
+        return;
+    }
+    uint64_t quota = get_user_quota();
+
+    vector<unsigned char> response(2 * sizeof(uint64_t) + sizeof(uint32_t));
+    memcpy(response.data(), &bytes, sizeof(bytes));
+    memcpy(response.data() + sizeof(bytes), &quota, sizeof(quota));
+    memcpy(response.data() + 2 * sizeof(uint64_t), &files, sizeof(files));
+
+    if (!name.empty()) {
+        FileMeta meta;
+        auto stat_res = stat_file(session.username, name, meta);
+        if (stat_res.is_error || !stat_res.result) {
+            send_error_response(session, stat_res.is_error
+                                             ? stat_res.error
+                                             : "Error - File not found");
+            return;
+        }
+        size_t off = response.size();
+        response.resize(off + sizeof(meta.size) + sizeof(meta.mtime) +
+                        INDEX_HASH_LEN);
+        memcpy(response.data() + off, &meta.size, sizeof(meta.size));
+        off += sizeof(meta.size);
+        memcpy(response.data() + off, &meta.mtime, sizeof(meta.mtime));
+        off += sizeof(meta.mtime);
+        memcpy(response.data() + off, meta.hash, INDEX_HASH_LEN);
+    }
+
+    send_message(session, InfoAns, response.data(), response.size());
+}
@@ -0,0 +1,12 @@
+#include "../../common/session.h"
+#ifndef info_h
+#define info_h
+
+/*
+ * Tells the client how much it stores, out of its quota, and when it names
+ * one of its files, the size, modification time and hash of that file. All
+ * of it comes from the index of its files (see metaindex.h).
+ */
+void file_info(Session &session);
+
+#endif
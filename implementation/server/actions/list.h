@@ -1,11 +1,8 @@
-#include <tuple>
-using namespace std;
+#include "../../common/session.h"
 
 #ifndef list_h
 #define list_h
 
-tuple<unsigned char *, unsigned int> get_file_list(char *username);
+void list_files(Session &session);
 
-void list_files(int sock, unsigned char *key, char *username);
-
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,38 @@
+#include "../../common/errors.h"
+#include "../../common/session.h"
+#include "../../common/types.h"
+#include "../../common/utils.h"
+#include "rekey.h"
+#include <vector>
+
+using namespace std;
+
+void rekey(Session &session) {
+
+    // -----------receive client rekey request-----------
+    vector<unsigned char> client_nonce;
+    open_message(session, RekeyReq, client_nonce, NONCE_LEN);
+    if (client_nonce.size() != NONCE_LEN) {
+        handle_errors("Malformed rekey request");
+    }
+
+    //-----------------Respond to client---------------------
+    auto nonce_res = gen_nonce();
+    if (nonce_res.is_error) {
+        handle_errors(nonce_res.error);
+    }
+    unsigned char *server_nonce = nonce_res.result;
+
+    auto key_res =
+        derive_rekeyed_key(session.key, get_symmetric_key_length(),
+                           client_nonce.data(), server_nonce);
+    if (key_res.is_error) {
+        delete[] server_nonce;
+        handle_errors(key_res.error);
+    }
+
+    // The answer is the last message sealed with the old key
+    send_message(session, RekeyAns, server_nonce, NONCE_LEN);
+    delete[] server_nonce;
+    session.replace_key(key_res.result);
+}
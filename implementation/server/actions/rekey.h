@@ -0,0 +1,12 @@
+#include "../../common/session.h"
+#ifndef rekey_h
+#define rekey_h
+
+/*
+ * Replaces the key of the session, once the client asked for it: the new one
+ * is derived from the one in use and a nonce of each party (see
+ * derive_rekeyed_key), and both counters start over.
+ */
+void rekey(Session &session);
+
+#endif
@@ -1,9 +1,15 @@
 #include "../../common/errors.h"
 #include "../../common/seq.h"
+#include "../../common/session.h"
 #include "../../common/types.h"
 #include "../../common/utils.h"
-#include <openssl/evp.h>
+#include "../metaindex.h"
+#include "../treestore.h"
+#include "../volumes.h"
+#include "rename.h"
+#include <stdint.h>
 #include <string.h>
+#include <vector>
 
 #if __has_include(<filesystem>)
 #include <filesystem>
@@ -51,209 +57,79 @@ Maybe<bool> handle_renaming(char *username, unsigned char *f_old,
     }
 
     // renaming
-    fs::rename(f_old_path, f_new_path);
+    error_code ec;
+    fs::rename(f_old_path, f_new_path, ec);
+    if (ec) {
+        res.set_error("Error - Could not rename the file");
+        return res;
+    }
+    reindex_file(username, f_old_path.filename().native(),
+                 f_new_path.filename().native());
+    move_tree(f_old_path, f_new_path);
 
     return res;
 }
 
-void rename(int sock, unsigned char *key, char *username) {
-
-    // -----------receive client list request-----------
-
-    auto server_header_res = read_header(sock);
-    if (server_header_res.is_error) {
-        handle_errors();
-    }
-    auto [seq, iv] = server_header_res.result;
-
-    if (seq != seq_num) {
-        delete[] iv;
-        handle_errors("Incorrect sequence number");
-    }
-
-    // read ciphertext
-    auto ct_res = read_field(sock);
-    if (ct_res.is_error) {
-        delete[] iv;
-        handle_errors();
-    }
-    auto [ct_len, ct] = ct_res.result;
-
-    // read tag
-    auto tag_res = read_tag(sock);
-    if (tag_res.is_error) {
-        delete[] ct;
-        delete[] iv;
-        handle_errors();
-    }
-    auto tag = tag_res.result;
-
-    // Initialize decryption
-    EVP_CIPHER_CTX *ctx;
-    if ((ctx = EVP_CIPHER_CTX_new()) == nullptr) {
-        delete[] iv;
-        delete[] ct;
-        delete[] tag;
-        handle_errors("Could not decrypt message (alloc)");
-    }
-    int len;
-
-    if (EVP_DecryptInit(ctx, get_symmetric_cipher(), key, iv) != 1) {
-        delete[] iv;
-        delete[] ct;
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-
-    delete[] iv;
-
-    unsigned char header = mtype_to_uc(RenameReq);
-
-    /* Specify authenticated data */
-    int err = 0;
-    err |= EVP_DecryptUpdate(ctx, nullptr, &len, &header, sizeof(mtype));
-    err |=
-        EVP_DecryptUpdate(ctx, nullptr, &len, seqnum_to_uc(), sizeof(seqnum));
-
-    if (err != 1) {
-        delete[] ct;
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-
-    auto *pt = new unsigned char[ct_len];
-    int pt_len;
-    // Encrypt Update: one call is enough because our mesage is very short.
-    if (EVP_DecryptUpdate(ctx, pt, &len, ct, ct_len) != 1) {
-        delete[] ct;
-        delete[] tag;
-        delete[] pt;
-        EVP_CIPHER_CTX_free(ctx);
-    }
-    pt_len = len;
-
-    // GCM tag check
-    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, TAG_LEN, tag);
+void rename(Session &session) {
 
-    // Encrypt Final. Finalize the encryption and adds the padding
-    if (EVP_DecryptFinal(ctx, pt + len, &len) != 1) {
-        delete[] ct;
-        delete[] tag;
-        delete[] pt;
-        EVP_CIPHER_CTX_free(ctx);
+    // -----------receive client rename request-----------
+    // The old name, followed by the new one
+    vector<unsigned char> pt;
+    open_message(session, RenameReq, pt, 2 * FNAME_MAX_LEN);
+    if (pt.size() != 2 * FNAME_MAX_LEN) {
+        handle_errors("Malformed rename request");
     }
-    pt_len += len;
-
-    // free variables
-    delete[] ct;
-    delete[] tag;
-
-    // free context
-    EVP_CIPHER_CTX_reset(ctx);
-
-    inc_seqnum();
+    unsigned char *f_old = pt.data();
+    unsigned char *f_new = f_old + FNAME_MAX_LEN;
+    f_old[FNAME_MAX_LEN - 1] = '\0';
+    f_new[FNAME_MAX_LEN - 1] = '\0';
 
 #ifdef DEBUG
-    cout << endl << "f_old || f_new: " << pt << endl;
+    cout << endl << "f_old || f_new: " << f_old << " " << f_new << endl;
 #endif
 
     // handle renaming
-    auto rename_res = handle_renaming(username, pt, pt + FNAME_MAX_LEN);
+    auto rename_res = handle_renaming(session.username, f_old, f_new);
     if (rename_res.is_error) {
-        delete[] pt;
-        EVP_CIPHER_CTX_free(ctx);
-        send_error_response(sock, key, rename_res.error);
+        send_error_response(session, rename_res.error);
         return;
     }
 
-    delete[] pt;
-
     //-----------------Respond to client---------------------
 
-    // Generate iv for message
-    auto iv_res = gen_iv();
-    if (iv_res.is_error) {
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors(iv_res.error);
-    }
-    iv = iv_res.result;
-
-    auto send_packet_header_res =
-        send_header(sock, RenameAns, seq_num, iv, get_iv_len());
-    if (send_packet_header_res.is_error) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors(send_packet_header_res.error);
-    }
-
-    // Initialize encryption context
-    len = 0;
-    ct_len = 0;
-
-    if (EVP_EncryptInit(ctx, get_symmetric_cipher(), key, iv) != 1) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-
-    // Authenticate data
-    err = 0;
-    header = mtype_to_uc(RenameAns);
-    err |=
-        EVP_EncryptUpdate(ctx, nullptr, &len, &header, sizeof(unsigned char));
-    err |=
-        EVP_EncryptUpdate(ctx, nullptr, &len, seqnum_to_uc(), sizeof(seqnum));
-    if (err != 1) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-
-    unsigned char response[] = "File renamed correctly";
-    ct = new unsigned char[pt_len];
-    if (EVP_EncryptUpdate(ctx, ct, &len, response, sizeof(response)) != 1) {
-        delete[] iv;
-        delete[] ct;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-    ct_len = len;
-
-    if (EVP_EncryptFinal(ctx, ct + len, &len) != 1) {
-        delete[] iv;
-        delete[] ct;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-    ct_len += len;
-
-    tag = new unsigned char[TAG_LEN];
-    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, TAG_LEN, tag) != 1) {
-        delete[] iv;
-        delete[] ct;
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-    delete[] iv;
-    EVP_CIPHER_CTX_free(ctx);
-
-    auto ct_send_res = send_field(sock, (flen)ct_len, ct);
-    if (ct_send_res.is_error) {
-        delete[] ct;
-        delete[] tag;
-        handle_errors(ct_send_res.error);
-    }
-    delete[] ct;
-
-    auto tag_send_res = send_tag(sock, tag);
-    if (tag_send_res.is_error) {
-        delete[] tag;
-        handle_errors(tag_send_res.error);
-    }
-    delete[] tag;
+    send_message(session, RenameAns, "File renamed correctly");
+}
 
-    inc_seqnum();
+void rename_files(Session &session) {
+    // The number of renames, followed by the old and the new name of each
+    vector<unsigned char> pt;
+    open_message(session, RenameBatchReq, pt,
+                 sizeof(uint32_t) + BATCH_MAX_ITEMS * 2 * FNAME_MAX_LEN);
+    uint32_t count = 0;
+    if (pt.size() >= sizeof(count)) {
+        memcpy(&count, pt.data(), sizeof(count));
+    }
+    if (pt.size() < sizeof(count) || count > BATCH_MAX_ITEMS ||
+        pt.size() != sizeof(count) + (size_t)count * 2 * FNAME_MAX_LEN) {
+        handle_errors("Malformed batch rename request");
+    }
+
+    // Renames run in order, so that one may free the name for the next.
+    // Each one is answered on its own, in order, as a string
+    vector<unsigned char> results;
+    for (uint32_t i = 0; i < count; i++) {
+        unsigned char *f_old =
+            pt.data() + sizeof(count) + (size_t)i * 2 * FNAME_MAX_LEN;
+        unsigned char *f_new = f_old + FNAME_MAX_LEN;
+        f_old[FNAME_MAX_LEN - 1] = '\0';
+        f_new[FNAME_MAX_LEN - 1] = '\0';
+
+        auto rename_res = handle_renaming(session.username, f_old, f_new);
+        string result =
+            rename_res.is_error ? rename_res.error : "File renamed correctly";
+        results.insert(results.end(), result.begin(), result.end());
+        results.push_back('\0');
+    }
+
+    send_message(session, RenameBatchRes, results.data(), results.size());
 }
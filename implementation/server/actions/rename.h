@@ -1,14 +1,22 @@
+#include "../../common/session.h"
 #include "../../common/maybe.h"
 #include <string>
 
 #ifndef rename_h
 #define rename_h
 
-void rename(int sock, unsigned char *key, char *username);
+void rename(Session &session);
 
-// TODO: better type?
-int handle_renaming(unsigned char *msg, int msg_len, char *username);
+/*
+ * Renames a batch of files in a single round trip: the client sends all of
+ * the pairs of names at once, and gets the result of each
+ */
+void rename_files(Session &session);
+
+/* Renames the file [f_old] of [username] to [f_new], if both are valid */
+Maybe<bool> handle_renaming(char *username, unsigned char *f_old,
+                            unsigned char *f_new);
 
 bool is_path_illegal(std::string path);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,238 @@
+#include "../../common/delta.h"
+#include "../../common/errors.h"
+#include "../../common/pipeline.h"
+#include "../../common/session.h"
+#include "../../common/types.h"
+#include "../../common/utils.h"
+#include "../chunkstore.h"
+#include "../metaindex.h"
+#include "../treestore.h"
+#include "../volumes.h"
+#include "update.h"
+#include "upload.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#if __has_include(<filesystem>)
+#include <filesystem>
+namespace fs = std::filesystem;
+#elif __has_include(<experimental/filesystem>)
+#include <experimental/filesystem>
+namespace fs = std::experimental::filesystem;
+#else
+error "Missing the <filesystem> header."
+#endif
+
+using namespace std;
+
+/*
+ * Opens the file of [username] to be updated by the one at [filename] on the
+ * client, found by its name alike uploads, setting [path] to where it is and
+ * [size] to its size
+ */
+static Maybe<FILE *> open_basis(char *username, char *filename,
+                                fs::path &path, uint32_t &size) {
+    Maybe<FILE *> res;
+
+    path = get_user_storage_path(username) / fs::path(filename).filename();
+    if (!is_path_valid(username, path)) {
+        res.set_error("Error - Illegal filename");
+        return res;
+    }
+
+    if (!fs::is_regular_file(path)) {
+        res.set_error("Error - File not found");
+        return res;
+    }
+
+    FILE *fp = fopen(path.native().c_str(), "r");
+    struct stat st;
+    if (fp == nullptr || fstat(fileno(fp), &st) != 0) {
+        if (fp != nullptr)
+            fclose(fp);
+        res.set_error("Error - File is not readable");
+        return res;
+    }
+    if ((unsigned long)st.st_size > DELTA_FSIZE_MAX) {
+        fclose(fp);
+        res.set_error("Error - File too big to be updated");
+        return res;
+    }
+
+    Manifest manifest;
+    auto manifest_res = read_manifest(fp, manifest);
+    if (manifest_res.is_error || manifest_res.result) {
+        fclose(fp);
+        res.set_error(manifest_res.is_error
+                          ? "Error - File is not readable"
+                          : "Error - Files kept as chunks cannot be updated");
+        return res;
+    }
+
+    size = st.st_size;
+    res.set_result(fp);
+    return res;
+}
+
+/*
+ * Opens a new file in [dir], named after [kind] under PARTIAL_PREFIX, so that
+ * it is neither listed nor left behind for long if the server stops. Its
+ * path is set in [path].
+ */
+static FILE *open_temp(const fs::path &dir, const char *kind, string &path) {
+    path = (dir / (string(PARTIAL_PREFIX) + kind + "-XXXXXX")).native();
+    int fd = mkstemp(&path[0]);
+    if (fd < 0)
+        return nullptr;
+    FILE *fp = fdopen(fd, "w+");
+    if (fp == nullptr) {
+        close(fd);
+        unlink(path.c_str());
+    }
+    return fp;
+}
+
+/*
+ * Gives the new version in [fp], at [tmp_path], the name of the file at
+ * [path] under the sync policy, then closes it. The new version is removed
+ * on failure.
+ */
+static Maybe<bool> replace_file(FILE *fp, const string &tmp_path,
+                                const fs::path &path) {
+    Maybe<bool> res;
+    sync_policy policy = get_upload_sync();
+    bool ok = fflush(fp) == 0;
+    if (ok && policy != SyncNone) {
+        ok = fsync(fileno(fp)) == 0;
+    }
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || rename(tmp_path.c_str(), path.native().c_str()) != 0) {
+        unlink(tmp_path.c_str());
+        res.set_error("Error - Could not save the file");
+        return res;
+    }
+
+    if (policy == SyncFull) {
+        int dir_fd =
+            open(path.parent_path().native().c_str(), O_RDONLY | O_DIRECTORY);
+        if (dir_fd < 0 || fsync(dir_fd) != 0) {
+            res.set_error("Error - Could not save the file");
+        }
+        if (dir_fd >= 0) {
+            close(dir_fd);
+        }
+    }
+    return res;
+}
+
+void update(Session &session) {
+
+    // -----------receive client update request-----------
+    // The name of the file, followed by the size of its new version
+    vector<unsigned char> pt;
+    open_message(session, UpdateReq, pt, FNAME_MAX_LEN + sizeof(uint32_t));
+    if (pt.size() != FNAME_MAX_LEN + sizeof(uint32_t)) {
+        handle_errors("Malformed update request");
+    }
+    pt[FNAME_MAX_LEN - 1] = '\0';
+    uint32_t new_size;
+    memcpy(&new_size, pt.data() + FNAME_MAX_LEN, sizeof(new_size));
+
+    fs::path path;
+    uint32_t size;
+    auto basis_res = open_basis(session.username,
+                                reinterpret_cast<char *>(pt.data()), path, size);
+    if (basis_res.is_error) {
+        send_error_response(session, basis_res.error);
+        return;
+    }
+    FILE *basis = basis_res.result;
+
+    auto quota_res = check_quota(session.username, new_size, size);
+    if (quota_res.is_error) {
+        fclose(basis);
+        send_error_response(session, quota_res.error);
+        return;
+    }
+
+    // The changes are kept next to the file, though never under a name
+    string delta_path;
+    FILE *delta = open_temp(path.parent_path(), "delta", delta_path);
+    if (delta == nullptr) {
+        fclose(basis);
+        send_error_response(session, "Error - Could not update the file");
+        return;
+    }
+    unlink(delta_path.c_str());
+
+    // -----------send the signature of the stored file-----------
+    vector<unsigned char> sigs;
+    if (!make_signature(fileno(basis), size, sigs)) {
+        fclose(delta);
+        fclose(basis);
+        send_error_response(session, "Error - File is not readable");
+        return;
+    }
+    try {
+        send_message(session, UpdateSigs, sigs.data(), sigs.size());
+    } catch (char const *) {
+        fclose(delta);
+        fclose(basis);
+        throw;
+    }
+
+    // -----------receive the changes-----------
+    auto receive_res = receive_file(session, delta, 0,
+                                    delta_max_len(new_size, size),
+                                    UpdateChunk, UpdateEnd);
+    if (receive_res.is_error || !receive_res.result) {
+        fclose(delta);
+        fclose(basis);
+        if (receive_res.is_error) {
+            handle_errors(receive_res.error);
+        }
+        return;
+    }
+
+    // -----------rebuild the new version-----------
+    string tmp_path;
+    FILE *out = open_temp(path.parent_path(), "update", tmp_path);
+    if (out == nullptr || fflush(delta) != 0) {
+        if (out != nullptr) {
+            fclose(out);
+            unlink(tmp_path.c_str());
+        }
+        fclose(delta);
+        fclose(basis);
+        send_error_response(session, "Error - Could not update the file");
+        return;
+    }
+    rewind(delta);
+    auto apply_res = apply_delta(delta, fileno(basis), size, new_size, out);
+    fclose(delta);
+    fclose(basis);
+    if (apply_res.is_error) {
+        fclose(out);
+        unlink(tmp_path.c_str());
+        send_error_response(session, apply_res.error);
+        return;
+    }
+
+    auto replace_res = replace_file(out, tmp_path, path);
+    if (replace_res.is_error) {
+        send_error_response(session, replace_res.error);
+        return;
+    }
+    index_file(session.username, path.filename().native());
+    drop_tree(path);
+
+    unsigned char response[] = "File updated correctly";
+    send_message(session, UpdateRes, response, sizeof(response));
+}
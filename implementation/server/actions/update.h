@@ -0,0 +1,14 @@
+#include "../../common/session.h"
+#ifndef update_h
+#define update_h
+
+/*
+ * Update of a stored file with a new version from the client, of which only
+ * the changes are sent (see delta.h). The new version is rebuilt next to the
+ * file, then takes its name at once, under the sync policy of the uploads:
+ * the file is never seen half-updated. Only files kept as they are can be
+ * updated, not those kept as their chunks.
+ */
+void update(Session &session);
+
+#endif
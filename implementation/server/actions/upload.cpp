@@ -1,10 +1,28 @@
 #include "../../common/errors.h"
+#include "../../common/pipeline.h"
 #include "../../common/seq.h"
+#include "../../common/session.h"
 #include "../../common/types.h"
 #include "../../common/utils.h"
-#include "download.h"
+#include "../chunkstore.h"
+#include "../metaindex.h"
+#include "../treestore.h"
+#include "../volumes.h"
+#include "upload.h"
+#include <errno.h>
+#include <fcntl.h>
 #include <openssl/evp.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <time.h>
+#include <string>
+#include <unistd.h>
+#include <unordered_set>
+#include <vector>
 
 #if __has_include(<filesystem>)
 #include <filesystem>
@@ -18,482 +36,562 @@ error "Missing the <filesystem> header."
 
 using namespace std;
 
-Maybe<fs::path> validate_path(char *username, char *f) {
-    Maybe<fs::path> res;
-    fs::path f_path = f;
-
-    // Validate path
-    fs::path dest_path = get_user_storage_path(username) / f_path.filename();
-    if (!is_path_valid(username, dest_path)) {
-        res.set_error("Error - Illegal path");
-        return res;
+static sync_policy upload_sync = SyncNone;
+
+Maybe<sync_policy> parse_sync_policy(const char *name) {
+    Maybe<sync_policy> res;
+    if (strcmp(name, "none") == 0) {
+        res.set_result(SyncNone);
+    } else if (strcmp(name, "file") == 0) {
+        res.set_result(SyncFile);
+    } else if (strcmp(name, "full") == 0) {
+        res.set_result(SyncFull);
+    } else {
+        res.set_error("Unknown sync policy");
     }
+    return res;
+}
 
-    // check if file already exists
-    if (fs::exists(dest_path)) {
-        res.set_error("Error - File already exist");
-        return res;
+void set_upload_sync(sync_policy policy) { upload_sync = policy; }
+sync_policy get_upload_sync() { return upload_sync; }
+
+void clean_partial_uploads() {
+    time_t now = time(nullptr);
+    error_code ec;
+    for (const auto &user : list_user_storages()) {
+        for (const auto &entry : fs::directory_iterator(user.second, ec)) {
+            struct stat st;
+            if (entry.path().filename().native().rfind(PARTIAL_PREFIX, 0) ==
+                    0 &&
+                stat(entry.path().native().c_str(), &st) == 0 &&
+                now - st.st_mtime > PARTIAL_LIFETIME) {
+                fs::remove(entry.path(), ec);
+            }
+        }
     }
+}
 
-    res.set_result(dest_path);
-    return res;
+/* Whether the file system of [fd] has [len] bytes left for its user */
+static bool has_room(int fd, uint64_t len) {
+    struct statvfs st;
+    return fstatvfs(fd, &st) != 0 || (uint64_t)st.f_bavail * st.f_frsize >= len;
 }
 
-void upload(int sock, unsigned char *key, char *username) {
+/* Path of the file receiving the upload [id] to [dest_path], next to it */
+static fs::path partial_name(const fs::path &dest_path,
+                             const unsigned char *id) {
+    char hex_id[2 * TRANSFER_ID_LEN + 1];
+    for (int i = 0; i < TRANSFER_ID_LEN; i++)
+        snprintf(hex_id + 2 * i, 3, "%02x", id[i]);
+    return dest_path.parent_path() / (string(PARTIAL_PREFIX) + hex_id);
+}
 
-    // -----------receive client upload request-----------
-    auto server_header_res = read_header(sock);
-    if (server_header_res.is_error) {
-        handle_errors();
+/*
+ * Bytes taken on disk by the uploads in progress next to [partial_path], but
+ * by its own. Each of them has the room for its whole file reserved.
+ */
+static uint64_t partial_bytes(const fs::path &partial_path) {
+    uint64_t bytes = 0;
+    error_code ec;
+    for (const auto &entry :
+         fs::directory_iterator(partial_path.parent_path(), ec)) {
+        struct stat st;
+        if (entry.path().filename().native().rfind(PARTIAL_PREFIX, 0) == 0 &&
+            entry.path() != partial_path &&
+            stat(entry.path().native().c_str(), &st) == 0) {
+            bytes += (uint64_t)st.st_blocks * 512;
+        }
     }
-    auto [seq, iv] = server_header_res.result;
+    return bytes;
+}
 
-    if (seq != seq_num) {
-        delete[] iv;
-        handle_errors("Incorrect sequence number");
+/*
+ * Opens the file receiving the upload [id] to [dest_path], next to it. A new
+ * one gets [size] bytes reserved on disk at once, rather than a few blocks at
+ * a time as it grows. One left by an earlier attempt is taken up where it
+ * ends, which [offset] is set to.
+ *
+ * The file stays locked while open, so that the session of an attempt that
+ * is not over yet on this side cannot write to it at the same time.
+ */
+Maybe<FILE *> open_partial(const fs::path &dest_path,
+                           const unsigned char *id, uint64_t size,
+                           fs::path &partial_path, uint64_t &offset) {
+    Maybe<FILE *> res;
+    partial_path = partial_name(dest_path, id);
+
+    int fd = open(partial_path.native().c_str(), O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        res.set_error("Error - Could not create the file");
+        return res;
     }
-
-    // Read ciphertext
-    auto ct_res = read_field(sock);
-    if (ct_res.is_error) {
-        delete[] iv;
-        handle_errors();
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        close(fd);
+        res.set_error("Error - The upload is already in progress");
+        return res;
     }
-    auto [ct_len, ct] = ct_res.result;
 
-    // Read tag
-    auto tag_res = read_tag(sock);
-    if (tag_res.is_error) {
-        delete[] ct;
-        delete[] iv;
-        handle_errors();
+    // What was written before is on disk, before it is counted
+    struct stat st;
+    if (fstat(fd, &st) != 0 || fsync(fd) != 0) {
+        close(fd);
+        res.set_error("Error - Could not create the file");
+        return res;
     }
-    auto tag = tag_res.result;
-
-    // Initialize decryption
-    EVP_CIPHER_CTX *ctx;
-    if ((ctx = EVP_CIPHER_CTX_new()) == nullptr) {
-        delete[] iv;
-        delete[] ct;
-        delete[] tag;
-        handle_errors("Could not decrypt message (alloc)");
+    offset = st.st_size;
+    if (offset > size) {
+        // Not an earlier attempt at this very file after all
+        offset = 0;
+        if (ftruncate(fd, 0) != 0) {
+            close(fd);
+            res.set_error("Error - Could not create the file");
+            return res;
+        }
     }
-    int len;
 
-    if (EVP_DecryptInit(ctx, get_symmetric_cipher(), key, iv) != 1) {
-        delete[] iv;
-        delete[] ct;
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+    // Only running out of space matters: a file system without fallocate
+    // gets its blocks allocated as the file grows, as long as it has room
+    // for them now
+    if (size > offset &&
+        fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, size - offset) != 0 &&
+        (errno == ENOSPC || !has_room(fd, size - offset))) {
+        close(fd);
+        if (offset == 0) {
+            fs::remove(partial_path);
+        }
+        res.set_error("Error - Not enough space for the file");
+        return res;
     }
 
-    delete[] iv;
-
-    unsigned char header = mtype_to_uc(UploadReq);
+    FILE *fp = fdopen(fd, "r+");
+    if (fp == nullptr) {
+        close(fd);
+        res.set_error("Error - Could not create the file");
+        return res;
+    }
+    res.set_result(fp);
+    return res;
+}
 
-    // Authenticated data
-    int err = 0;
-    err |= EVP_DecryptUpdate(ctx, nullptr, &len, &header, sizeof(mtype));
-    err |=
-        EVP_DecryptUpdate(ctx, nullptr, &len, seqnum_to_uc(), sizeof(seqnum));
+/*
+ * Gives the file of a complete upload, of [size] bytes as announced, its name
+ * under the sync policy, then closes it. The name is not taken over if
+ * another upload got it in the meantime. The file is removed on failure.
+ */
+Maybe<bool> finish_partial(FILE *fp, const fs::path &partial_path,
+                           const fs::path &dest_path, uint64_t size) {
+    Maybe<bool> res;
+    int fd = fileno(fp);
+    bool ok = fflush(fp) == 0;
+
+    // The client sent less than it announced: the blocks reserved past the
+    // end are given back
+    struct stat st;
+    if (ok && fstat(fd, &st) == 0 && st.st_size < (off_t)size) {
+        ok = ftruncate(fd, st.st_size) == 0;
+    }
+    if (ok && upload_sync != SyncNone) {
+        ok = fsync(fd) == 0;
+    }
+    if (!ok) {
+        fclose(fp);
+        fs::remove(partial_path);
+        res.set_error("Error when writing a chunk to file");
+        return res;
+    }
 
-    if (err != 1) {
-        delete[] ct;
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+    // Renamed while still locked: a new attempt at the same upload cannot
+    // take the file up in the meantime
+
+    const char *partial = partial_path.native().c_str();
+    const char *dest = dest_path.native().c_str();
+    int ret = renameat2(AT_FDCWD, partial, AT_FDCWD, dest, RENAME_NOREPLACE);
+    if (ret != 0 && (errno == EINVAL || errno == ENOSYS)) {
+        // No such rename on this file system, a link fails on existing names
+        // all the same
+        ret = link(partial, dest);
+        if (ret == 0) {
+            unlink(partial);
+        }
+    }
+    if (ret != 0) {
+        bool exists = errno == EEXIST;
+        fs::remove(partial_path);
+        fclose(fp);
+        res.set_error(exists ? "Error - File already exist"
+                             : "Error - Could not save the file");
+        return res;
     }
+    fclose(fp);
 
-    auto *pt = new unsigned char[ct_len];
-    if (EVP_DecryptUpdate(ctx, pt, &len, ct, ct_len) != 1) {
-        delete[] ct;
-        delete[] tag;
-        delete[] pt;
-        EVP_CIPHER_CTX_free(ctx);
+    if (upload_sync == SyncFull) {
+        int dir_fd = open(dest_path.parent_path().native().c_str(),
+                          O_RDONLY | O_DIRECTORY);
+        if (dir_fd < 0 || fsync(dir_fd) != 0) {
+            res.set_error("Error - Could not save the file");
+        }
+        if (dir_fd >= 0) {
+            close(dir_fd);
+        }
     }
+    return res;
+}
 
-    EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, TAG_LEN, tag);
+Maybe<fs::path> validate_path(char *username, char *f) {
+    Maybe<fs::path> res;
+    fs::path f_path = f;
 
-    if (EVP_DecryptFinal(ctx, pt + len, &len) != 1) {
-        delete[] ct;
-        delete[] tag;
-        delete[] pt;
-        EVP_CIPHER_CTX_free(ctx);
+    // Validate path
+    fs::path dest_path = get_user_storage_path(username) / f_path.filename();
+    if (!is_path_valid(username, dest_path)) {
+        res.set_error("Error - Illegal path");
+        return res;
     }
 
-    delete[] ct;
-    delete[] tag;
-
-    EVP_CIPHER_CTX_reset(ctx);
+    // check if file already exists
+    if (fs::exists(dest_path)) {
+        res.set_error("Error - File already exist");
+        return res;
+    }
 
-    inc_seqnum();
+    res.set_result(dest_path);
+    return res;
+}
 
-    // -----------validate client's request and answer-----------
-    auto validation_res = validate_path(username, reinterpret_cast<char *>(pt));
+/*
+ * Adds the first [len] bytes of [fp], written by an earlier attempt at the
+ * upload, to [builder], and sets [hash] to their hash (get_hash_type())
+ */
+static bool hash_received(FILE *fp, uint64_t len, TreeBuilder &builder,
+                          unsigned char *hash) {
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    bool ok = ctx != nullptr && EVP_DigestInit(ctx, get_hash_type()) == 1;
+    vector<unsigned char> buf(DEFAULT_CHUNK_SIZE);
+    for (uint64_t offset = 0; ok && offset < len;) {
+        size_t n = min((uint64_t)buf.size(), len - offset);
+        ok = pread(fileno(fp), buf.data(), n, offset) == (ssize_t)n &&
+             EVP_DigestUpdate(ctx, buf.data(), n) == 1;
+        builder.update(buf.data(), n);
+        offset += n;
+    }
+    ok = ok && EVP_DigestFinal(ctx, hash, nullptr) == 1;
+    EVP_MD_CTX_free(ctx);
+    return ok;
+}
 
-    delete[] pt;
+/* Tells the client that the file is saved */
+static void send_upload_result(Session &session) {
+    send_message(session, UploadRes, "File uploaded correctly");
+}
 
-    if (validation_res.is_error) {
-        EVP_CIPHER_CTX_free(ctx);
-        send_error_response(sock, key, validation_res.error);
-        return;
-    }
+/* Drops the references added to the first [count] chunks of [manifest] */
+static void unref_chunks(const Manifest &manifest, size_t count) {
+    for (size_t i = 0; i < count; i++)
+        unref_chunk(manifest.hash(i));
+}
 
-    // Generate iv for message
-    auto iv_res = gen_iv();
-    if (iv_res.is_error) {
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors(iv_res.error);
+/*
+ * Stores the chunks of the upload of [size] bytes to [dest_path] held in [fp],
+ * at [partial_path], then gives it its name as a manifest. Only the chunks
+ * asked for in [missing] were received: each of them is checked against its
+ * hash on the way in, so that no chunk ever holds anything but what its hash
+ * says. The file is closed, and removed on failure.
+ */
+static Maybe<bool> store_chunks(FILE *fp, const fs::path &partial_path,
+                                const fs::path &dest_path,
+                                Manifest &manifest,
+                                const vector<bool> &missing) {
+    Maybe<bool> res;
+    int fd = fileno(fp);
+    if (fflush(fp) != 0) {
+        fclose(fp);
+        fs::remove(partial_path);
+        res.set_error("Error - Could not save the file");
+        return res;
     }
-    iv = iv_res.result;
 
-    auto send_packet_header_res =
-        send_header(sock, UploadAns, seq_num, iv, get_iv_len());
-    if (send_packet_header_res.is_error) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors(send_packet_header_res.error);
+    vector<unsigned char> chunk(manifest.chunk_size);
+    for (size_t i = 0; i < manifest.chunks(); i++) {
+        off_t offset = (off_t)i * manifest.chunk_size;
+        blen len = min((off_t)manifest.chunk_size,
+                       (off_t)manifest.size - offset);
+
+        Maybe<bool> put_res;
+        if (missing[i]) {
+            unsigned char hash[EVP_MAX_MD_SIZE];
+            if (pread(fd, chunk.data(), len, offset) != (ssize_t)len ||
+                EVP_Digest(chunk.data(), len, hash, nullptr, get_hash_type(),
+                           nullptr) != 1 ||
+                memcmp(hash, manifest.hash(i), CHUNK_HASH_LEN) != 0) {
+                put_res.set_error("Error - A chunk does not match its hash");
+            } else {
+                put_res = put_chunk(manifest.hash(i), chunk.data(), len,
+                                    upload_sync != SyncNone);
+            }
+        } else {
+            put_res = ref_chunk(manifest.hash(i));
+            if (!put_res.is_error && !put_res.result) {
+                put_res.set_error("Error - A chunk is no longer stored");
+            }
+        }
+        if (put_res.is_error) {
+            unref_chunks(manifest, i);
+            fclose(fp);
+            fs::remove(partial_path);
+            res.set_error(put_res.error);
+            return res;
+        }
     }
 
-    // Initialize encryption context
-    len = 0;
-    ct_len = 0;
-
-    if (EVP_EncryptInit(ctx, get_symmetric_cipher(), key, iv) != 1) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+    // What was received gives way to the manifest
+    rewind(fp);
+    if (ftruncate(fd, 0) != 0 || !write_manifest(fp, manifest)) {
+        unref_chunks(manifest, manifest.chunks());
+        fclose(fp);
+        fs::remove(partial_path);
+        res.set_error("Error - Could not save the file");
+        return res;
     }
-
-    // Authenticate data
-    err = 0;
-    header = mtype_to_uc(UploadAns);
-    err |=
-        EVP_EncryptUpdate(ctx, nullptr, &len, &header, sizeof(unsigned char));
-    err |=
-        EVP_EncryptUpdate(ctx, nullptr, &len, seqnum_to_uc(), sizeof(seqnum));
-    if (err != 1) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+    long manifest_len = ftell(fp);
+    auto finish_res =
+        finish_partial(fp, partial_path, dest_path, manifest_len);
+    if (finish_res.is_error) {
+        unref_chunks(manifest, manifest.chunks());
     }
+    return finish_res;
+}
 
+/*
+ * Upload of a file kept as its chunks: the client sends the hashes of all
+ * the chunks of the file first, and then only the chunks the server does not
+ * have, as runs of consecutive ones. Returns false if the upload is over
+ * without the file, the client having been told why.
+ */
+static bool receive_chunks(Session &session, FILE *fp,
+                           const fs::path &partial_path,
+                           const fs::path &dest_path, uint64_t size) {
     unsigned char response[] = "The file can be uploaded";
-    ct = new unsigned char[sizeof(response)];
-    if (EVP_EncryptUpdate(ctx, ct, &len, response, sizeof(response)) != 1) {
-        delete[] iv;
-        delete[] ct;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+    try {
+        send_message(session, UploadHashReq, response, sizeof(response));
+    } catch (char const *) {
+        fclose(fp);
+        throw;
     }
-    ct_len = len;
 
-    if (EVP_EncryptFinal(ctx, ct + len, &len) != 1) {
-        delete[] iv;
-        delete[] ct;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+    Manifest manifest;
+    manifest.size = size;
+    manifest.chunk_size = session.chunk_size;
+    size_t chunks = manifest_chunks(size, session.chunk_size);
+    bool sent;
+    try {
+        sent = receive_message(session, UploadHashes, manifest.hashes,
+                               chunks * CHUNK_HASH_LEN);
+    } catch (char const *) {
+        fclose(fp);
+        fs::remove(partial_path);
+        throw;
+    }
+    if (!sent || manifest.hashes.size() != chunks * CHUNK_HASH_LEN) {
+        fclose(fp);
+        fs::remove(partial_path);
+        if (sent) {
+            handle_errors("Malformed chunk hashes");
+        }
+        return false;
     }
-    ct_len += len;
 
-    tag = new unsigned char[TAG_LEN];
-    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, TAG_LEN, tag) != 1) {
-        delete[] iv;
-        delete[] ct;
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
+    // Chunks found earlier in the same file are not asked for twice
+    vector<bool> missing(chunks);
+    unordered_set<string> asked;
+    vector<unsigned char> bitmap((chunks + 7) / 8);
+    for (size_t i = 0; i < chunks; i++) {
+        string hash(reinterpret_cast<const char *>(manifest.hash(i)),
+                    CHUNK_HASH_LEN);
+        if (asked.count(hash) == 0 && !has_chunk(manifest.hash(i))) {
+            missing[i] = true;
+            asked.insert(hash);
+            bitmap[i / 8] |= 1 << (i % 8);
+        }
+    }
+    try {
+        send_message(session, UploadMissing, bitmap.data(), bitmap.size());
+    } catch (char const *) {
+        fclose(fp);
+        fs::remove(partial_path);
+        throw;
     }
-    delete[] iv;
-    EVP_CIPHER_CTX_reset(ctx);
 
-    auto ct_send_res = send_field(sock, (flen)ct_len, ct);
-    if (ct_send_res.is_error) {
-        delete[] ct;
-        delete[] tag;
-        handle_errors(ct_send_res.error);
+    // Each run is written where it lies in the file
+    for (size_t i = 0; i < chunks;) {
+        if (!missing[i]) {
+            i++;
+            continue;
+        }
+        size_t run_end = i;
+        while (run_end < chunks && missing[run_end])
+            run_end++;
+        off_t offset = (off_t)i * session.chunk_size;
+        off_t end = min((off_t)run_end * session.chunk_size, (off_t)size);
+
+        auto receive_res = receive_file(session, fp, offset, end - offset,
+                                        UploadChunk, UploadEnd);
+        if (receive_res.is_error || !receive_res.result) {
+            fclose(fp);
+            fs::remove(partial_path);
+            if (receive_res.is_error) {
+                handle_errors(receive_res.error);
+            }
+            return false;
+        }
+        i = run_end;
     }
-    delete[] ct;
 
-    auto tag_send_res = send_tag(sock, tag);
-    if (tag_send_res.is_error) {
-        delete[] tag;
-        handle_errors(tag_send_res.error);
+    auto store_res =
+        store_chunks(fp, partial_path, dest_path, manifest, missing);
+    if (store_res.is_error) {
+        send_error_response(session, store_res.error);
+        return false;
     }
-    delete[] tag;
+    return true;
+}
+void upload(Session &session) {
 
-    inc_seqnum();
+    // -----------receive client upload request-----------
+    // The name of the file, followed by its size and the ID of the upload
+    vector<unsigned char> pt;
+    open_message(session, UploadReq, pt,
+                 FNAME_MAX_LEN + sizeof(uint64_t) + TRANSFER_ID_LEN);
+    if (pt.size() != FNAME_MAX_LEN + sizeof(uint64_t) + TRANSFER_ID_LEN) {
+        handle_errors("Malformed upload request");
+    }
+    pt[FNAME_MAX_LEN - 1] = '\0';
+    uint64_t file_size;
+    memcpy(&file_size, pt.data() + FNAME_MAX_LEN, sizeof(file_size));
+    unsigned char transfer_id[TRANSFER_ID_LEN];
+    memcpy(transfer_id, pt.data() + FNAME_MAX_LEN + sizeof(file_size),
+           TRANSFER_ID_LEN);
 
-    //------------------Client's response------------------
+    // -----------validate client's request and answer-----------
+    auto validation_res = validate_path(session.username,
+                                        reinterpret_cast<char *>(pt.data()));
 
-    pt = new unsigned char[CHUNK_SIZE + get_block_size()];
-    fs::path output_file_path = validation_res.result;
-    FILE *output_file_fp = fopen(output_file_path.native().c_str(), "w");
-    unsigned long received_size = 0;
-    for (;;) {
-        auto server_response_header_res = get_mtype(sock);
-        if (server_response_header_res.is_error) {
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(output_file_fp);
-            delete[] pt;
-            handle_errors(server_response_header_res.error);
-        }
-        auto server_response_header = server_response_header_res.result;
-
-        // Read IV and sequence number
-        server_header_res = read_header(sock);
-        if (server_header_res.is_error) {
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(output_file_fp);
-            delete[] pt;
-            handle_errors(server_header_res.error);
-        }
-        auto [in_seq, in_iv] = server_header_res.result;
-        seq = in_seq;
-        iv = in_iv;
-
-        // Check correctness of the sequence number
-        if (seq != seq_num) {
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(output_file_fp);
-            delete[] pt;
-            delete[] iv;
-            handle_errors("Incorrect sequence number");
-        }
+    if (validation_res.is_error) {
+        send_error_response(session, validation_res.error);
+        return;
+    }
 
-        // Read ciphertext
-        ct_res = read_field(sock);
-        if (ct_res.is_error) {
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(output_file_fp);
-            delete[] pt;
-            delete[] iv;
-            handle_errors(ct_res.error);
-        }
-        auto ct_tuple = ct_res.result;
-        ct_len = get<0>(ct_tuple);
-        ct = get<1>(ct_tuple);
+    if (file_size > FSIZE_MAX) {
+        send_error_response(session, "Error - File too big");
+        return;
+    }
 
-        if (ct_len > CHUNK_SIZE + get_block_size()) {
-            handle_errors("Ciphertext longer than expected");
+    // The file is received under the name of the upload, so that nobody sees
+    // it before it is complete, and so that a later attempt at it goes on
+    // from where this one stopped
+    fs::path output_file_path = validation_res.result;
+    fs::path partial_path = partial_name(output_file_path, transfer_id);
+
+    // The other uploads still in progress count against the quota as well,
+    // as they hold the room for their files already
+    uint64_t in_progress =
+        get_user_quota() != 0 ? partial_bytes(partial_path) : 0;
+    auto quota_res =
+        check_quota(session.username, file_size + in_progress, 0);
+    if (quota_res.is_error) {
+        send_error_response(session, quota_res.error);
+        return;
+    }
+    // Nothing is reserved for a file kept as its chunks, of which only some
+    // may be sent: nor is it resumed, as those received are already stored
+    bool chunked = get_storage_backend() == StorageChunks &&
+                   manifest_chunks(file_size, session.chunk_size) <=
+                       MANIFEST_MAX_CHUNKS;
+    uint64_t offset;
+    auto partial_res =
+        open_partial(output_file_path, transfer_id, chunked ? 0 : file_size,
+                     partial_path, offset);
+    if (partial_res.is_error) {
+        send_error_response(session, partial_res.error);
+        return;
+    }
+    FILE *output_file_fp = partial_res.result;
+
+    if (chunked) {
+        if (receive_chunks(session, output_file_fp, partial_path,
+                           output_file_path, file_size)) {
+            index_file(session.username,
+                       output_file_path.filename().native());
+            send_upload_result(session);
         }
+        return;
+    }
 
-        // Read tag
-        tag_res = read_tag(sock);
-        if (tag_res.is_error) {
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(output_file_fp);
-            delete[] pt;
-            delete[] ct;
-            delete[] iv;
-            handle_errors(tag_res.error);
-        }
-        tag = tag_res.result;
-
-        // Initialize decryption
-        if (EVP_DecryptInit(ctx, get_symmetric_cipher(), key, iv) != 1) {
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(output_file_fp);
-            delete[] pt;
-            delete[] tag;
-            delete[] ct;
-            delete[] iv;
-            handle_errors();
-        }
-        delete[] iv;
-
-        header = mtype_to_uc(server_response_header);
-
-        // Authenticated data
-        err = 0;
-        err |= EVP_DecryptUpdate(ctx, nullptr, &len, &header, sizeof(mtype));
-        err |= EVP_DecryptUpdate(ctx, nullptr, &len, seqnum_to_uc(),
-                                 sizeof(seqnum));
-
-        if (err != 1) {
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(output_file_fp);
-            delete[] pt;
-            delete[] tag;
-            delete[] ct;
-            handle_errors();
-        }
+    // The tree of the file is built as it is received, from what an earlier
+    // attempt wrote on
+    TreeBuilder tree_builder(output_file_path.parent_path());
+    unsigned char received_hash[FILE_HASH_LEN];
+    if (!hash_received(output_file_fp, offset, tree_builder, received_hash)) {
+        fclose(output_file_fp);
+        send_error_response(session, "Error - Could not read the file");
+        return;
+    }
 
-        int pt_len;
-        if (EVP_DecryptUpdate(ctx, pt, &len, ct, ct_len) != 1) {
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(output_file_fp);
-            delete[] pt;
-            delete[] tag;
-            delete[] ct;
-            handle_errors();
-        }
-        pt_len = len;
-
-        // GCM tag check
-        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, TAG_LEN, tag);
-
-        if (EVP_DecryptFinal(ctx, pt + len, &len) != 1) {
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(output_file_fp);
-            delete[] pt;
-            delete[] tag;
-            delete[] ct;
-            handle_errors();
-        }
-        pt_len += len;
-
-        delete[] ct;
-        delete[] tag;
-
-        // Reset the context and increment the sequence number
-        EVP_CIPHER_CTX_reset(ctx);
-        inc_seqnum();
-
-        received_size += pt_len;
-        if (received_size > FSIZE_MAX) {
-            EVP_CIPHER_CTX_free(ctx);
-            fclose(output_file_fp);
-            delete[] pt;
-            if (fs::exists(output_file_path)) {
-                fs::remove(output_file_path);
-            }
-            handle_errors("Error - File too big");
-        }
+    // Where the upload goes on from and the hash of what is there before it,
+    // for the client to check against its file, then a message for the user
+    unsigned char response[] = "The file can be uploaded";
+    unsigned char
+        answer[sizeof(offset) + sizeof(received_hash) + sizeof(response)];
+    memcpy(answer, &offset, sizeof(offset));
+    memcpy(answer + sizeof(offset), received_hash, sizeof(received_hash));
+    memcpy(answer + sizeof(offset) + sizeof(received_hash), response,
+           sizeof(response));
+    try {
+        send_message(session, UploadAns, answer, sizeof(answer));
+    } catch (char const *) {
+        fclose(output_file_fp);
+        throw;
+    }
 
-        // Finally, handle the message
-        switch (server_response_header) {
-        case UploadChunk:
-        case UploadEnd:
-            if (fwrite(pt, sizeof(*pt), pt_len, output_file_fp) !=
-                (unsigned int)pt_len) {
-                EVP_CIPHER_CTX_free(ctx);
-                fclose(output_file_fp);
-                delete[] pt;
-                if (fs::exists(output_file_path)) {
-                    fs::remove(output_file_path);
-                }
-                handle_errors("Error when writing uploaded chunk to file");
-            }
-            break;
-        case Error:
-        default:
-            // There was an error, either prior to the upload or during it
-            // Handle it by:
-            //   - printing the error to the user
-            //   - freeing memory
-            //   - removing the (partial) uploaded file
-
-            cout << pt << endl;
-
-            fclose(output_file_fp);
-            EVP_CIPHER_CTX_free(ctx);
-            delete[] pt;
-
-            if (fs::exists(output_file_path)) {
-                fs::remove(output_file_path);
-            }
+    //------------------Client's response------------------
 
-            return;
+    // Receive the file a chunk at a time, decrypting and writing the previous
+    // chunks while the next ones arrive
+    auto receive_res = receive_file(
+        session, output_file_fp, offset, file_size - offset, UploadChunk,
+        UploadEnd, [&](const unsigned char *data, blen len) {
+            tree_builder.update(data, len);
+            return true;
+        });
+
+    // The client aborted the upload, were it only for what is here not being
+    // the start of its file, or the file could not be written: the partial
+    // file is removed. After any other error, the connection is
+    // likely lost, and the file is kept for the client to go on with later.
+    if (receive_res.is_error || !receive_res.result) {
+        fclose(output_file_fp);
+        if (!receive_res.is_error ||
+            strcmp(receive_res.error, WRITE_ERROR) == 0) {
+            fs::remove(partial_path);
         }
-
-        if (server_response_header == UploadEnd) {
-            break;
+        if (receive_res.is_error) {
+            handle_errors(receive_res.error);
         }
+        return;
     }
 
-    EVP_CIPHER_CTX_reset(ctx);
-    fclose(output_file_fp);
-    delete[] pt;
+    auto finish_res = finish_partial(output_file_fp, partial_path,
+                                     output_file_path, file_size);
+    if (finish_res.is_error) {
+        send_error_response(session, finish_res.error);
+        return;
+    }
 
 #ifdef DEBUG
     cout << "File saved locally as '" << output_file_path << "' correctly!"
          << endl;
 #endif
 
-    //---------------Send response----------------
-
-    // Generate iv for message
-    iv_res = gen_iv();
-    if (iv_res.is_error) {
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors(iv_res.error);
-    }
-    iv = iv_res.result;
-    // Send upload request
-    send_packet_header_res =
-        send_header(sock, UploadRes, seq_num, iv, get_iv_len());
-    if (send_packet_header_res.is_error) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors(send_packet_header_res.error);
-    }
-
-    if (EVP_EncryptInit(ctx, get_symmetric_cipher(), key, iv) != 1) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-
-    // Authenticated data
-    err = 0;
-    header = mtype_to_uc(UploadRes);
-    err |=
-        EVP_EncryptUpdate(ctx, nullptr, &len, &header, sizeof(unsigned char));
-    err |=
-        EVP_EncryptUpdate(ctx, nullptr, &len, seqnum_to_uc(), sizeof(seqnum));
-    if (err != 1) {
-        delete[] iv;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-
-    // Encryption of the filename
-    unsigned char response2[] = "File uploaded correctly";
-    ct = new unsigned char[sizeof(response2) + get_block_size()];
-    if (EVP_EncryptUpdate(ctx, ct, &len, response2, sizeof(response2)) != 1) {
-        delete[] iv;
-        delete[] ct;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-    ct_len = len;
-
-    if (EVP_EncryptFinal(ctx, ct + ct_len, &len) != 1) {
-        delete[] iv;
-        delete[] ct;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-    ct_len += len;
-
-    tag = new unsigned char[TAG_LEN];
-    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, TAG_LEN, tag) != 1) {
-        delete[] iv;
-        delete[] ct;
-        delete[] tag;
-        EVP_CIPHER_CTX_free(ctx);
-        handle_errors();
-    }
-    delete[] iv;
-    EVP_CIPHER_CTX_free(ctx);
-
-    // Send ciphertext
-    ct_send_res = send_field(sock, (flen)ct_len, ct);
-    if (ct_send_res.is_error) {
-        delete[] ct;
-        delete[] tag;
-        handle_errors(ct_send_res.error);
-    }
-    delete[] ct;
-
-    tag_send_res = send_tag(sock, tag);
-    if (tag_send_res.is_error) {
-        delete[] tag;
-        handle_errors(tag_send_res.error);
-    }
-    delete[] tag;
-
-    inc_seqnum();
+    index_file(session.username, output_file_path.filename().native());
+    tree_builder.store(output_file_path);
+    send_upload_result(session);
 }
@@ -1,7 +1,35 @@
-
+#include "../../common/maybe.h"
+#include "../../common/session.h"
 #ifndef upload_h
 #define upload_h
 
-void upload(int sock, unsigned char *key, char *username);
+/*
+ * What an upload waits for before it is reported as done. The file is
+ * received under a temporary name, then renamed once complete, so a file
+ * never shows up half-written; the policy only says how much of that
+ * survives a crash:
+ *     - SyncNone: nothing, the kernel writes the file back when it sees fit
+ *                 (default)
+ *     - SyncFile: the content of the file is on disk before it gets its name
+ *     - SyncFull: the new name is on disk as well
+ */
+enum sync_policy { SyncNone, SyncFile, SyncFull };
+
+/* Parses the name of a policy: "none", "file" or "full" */
+Maybe<sync_policy> parse_sync_policy(const char *name);
+
+void set_upload_sync(sync_policy policy);
+sync_policy get_upload_sync();
+
+// Seconds an upload left in progress is kept for, for its client to resume it
+#define PARTIAL_LIFETIME (2 * 24 * 60 * 60)
+
+/*
+ * Removes the files of the uploads left in progress for longer than
+ * PARTIAL_LIFETIME, from the storage of every user
+ */
+void clean_partial_uploads();
+
+void upload(Session &session);
 
 #endif
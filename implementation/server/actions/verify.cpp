@@ -0,0 +1,76 @@
+#include "../../common/errors.h"
+#include "../../common/merkle.h"
+#include "../../common/session.h"
+#include "../../common/types.h"
+#include "../../common/utils.h"
+#include "../treestore.h"
+#include "../volumes.h"
+#include "verify.h"
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+using namespace std;
+
+#define VERIFY_REQ_LEN (FNAME_MAX_LEN + 2 * sizeof(uint32_t))
+#define VERIFY_ANS_LEN (sizeof(uint64_t) + sizeof(uint32_t) + MERKLE_HASH_LEN)
+
+void verify(Session &session) {
+
+    // -----------receive client verify request-----------
+    // The name of the file, followed by a level of its tree and the number
+    // of nodes asked for at it, then their indices
+    vector<unsigned char> pt;
+    open_message(session, VerifyReq, pt,
+                 VERIFY_REQ_LEN + VERIFY_MAX_NODES * sizeof(uint32_t));
+    uint32_t level, count;
+    if (pt.size() < VERIFY_REQ_LEN) {
+        handle_errors("Malformed verify request");
+    }
+    memcpy(&level, pt.data() + FNAME_MAX_LEN, sizeof(level));
+    memcpy(&count, pt.data() + FNAME_MAX_LEN + sizeof(level), sizeof(count));
+    if (count > VERIFY_MAX_NODES ||
+        pt.size() != VERIFY_REQ_LEN + count * sizeof(uint32_t)) {
+        handle_errors("Malformed verify request");
+    }
+    pt[FNAME_MAX_LEN - 1] = '\0';
+    char *filename = reinterpret_cast<char *>(pt.data());
+
+    // -----------open the tree of the file-----------
+    fs::path path = get_user_storage_path(session.username) / filename;
+    if (!is_path_valid(session.username, path)) {
+        send_error_response(session, "Error - Illegal filename");
+        return;
+    }
+    StoredTree tree;
+    auto tree_res = open_tree(path, tree);
+    if (tree_res.is_error || !tree_res.result) {
+        send_error_response(session, tree_res.is_error
+                                         ? tree_res.error
+                                         : "Error - File not found");
+        return;
+    }
+
+    //-----------------Respond to client---------------------
+    // The size of the file, the levels of its tree and its root, followed by
+    // the nodes asked for
+    vector<unsigned char> response(VERIFY_ANS_LEN + count * MERKLE_HASH_LEN);
+    memcpy(response.data(), &tree.size, sizeof(tree.size));
+    memcpy(response.data() + sizeof(tree.size), &tree.levels,
+           sizeof(tree.levels));
+    bool ok = tree.node(tree.levels - 1, 0,
+                        response.data() + sizeof(uint64_t) + sizeof(uint32_t));
+    for (uint32_t i = 0; ok && i < count; i++) {
+        uint32_t node;
+        memcpy(&node, pt.data() + VERIFY_REQ_LEN + i * sizeof(node),
+               sizeof(node));
+        ok = tree.node(level, node,
+                       response.data() + VERIFY_ANS_LEN + i * MERKLE_HASH_LEN);
+    }
+    if (!ok) {
+        send_error_response(session, "Error - No such node of the tree");
+        return;
+    }
+
+    send_message(session, VerifyAns, response.data(), response.size());
+}
@@ -0,0 +1,13 @@
+#include "../../common/session.h"
+#ifndef verify_h
+#define verify_h
+
+/*
+ * Sends the client the size of one of its files and the root of its Merkle
+ * tree, along with the nodes it asks for at one of the levels of the tree,
+ * for it to tell which ranges of its copy differ (see merkle.h). Only the
+ * stored tree is read, not the file.
+ */
+void verify(Session &session);
+
+#endif
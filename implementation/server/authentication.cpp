@@ -1,7 +1,12 @@
 #include "authentication.h"
 #include "../common/dhparams.h"
 #include "../common/errors.h"
+#include "../common/frame.h"
+#include "../common/keypool.h"
 #include "../common/utils.h"
+#include "keystore.h"
+#include "tickets.h"
+#include <algorithm>
 #include <iostream>
 #include <map>
 #include <new>
@@ -9,9 +14,12 @@
 #include <openssl/bio.h>
 #include <openssl/evp.h>
 #include <openssl/pem.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <tuple>
+#include <vector>
 
 #if __has_include(<filesystem>)
 #include <filesystem>
@@ -25,90 +33,46 @@ error "Missing the <filesystem> header."
 
 using namespace std;
 
-void free_user_keys(map<string, EVP_PKEY *> keys) {
-    for (auto it = keys.begin(); it != keys.end(); it++) {
-        EVP_PKEY_free(it->second);
-    }
-    keys.clear();
-}
-
-// Possible users of the server
-string users[2] = {"alice", "bob"};
 unsigned char server_name[] = "server";
 
-/* Reads all the public keys of the registered users */
-static map<string, EVP_PKEY *> setup_keys() {
-    auto user_map = map<string, EVP_PKEY *>();
-    FILE *public_key_fp;
-    EVP_PKEY *pubkey;
-
-    for (string user : users) {
-
-        // Get the user public key path
-        auto user_key_path =
-            (fs::canonical(".") / "certificates" / (user + ".pub")).string();
-
-        // Open the public key file
-        if ((public_key_fp = fopen(user_key_path.c_str(), "r")) == nullptr) {
-            user_map.clear();
-            handle_errors();
-        }
-
-        // ... and read it as a public key
-        if ((pubkey = PEM_read_PUBKEY(public_key_fp, nullptr, 0, nullptr)) ==
-            nullptr) {
-            fclose(public_key_fp);
-            free_user_keys(user_map);
-            handle_errors();
-        }
-
-        fclose(public_key_fp);
-
-        // ... and save it into the list of users
-        user_map.insert({user, pubkey});
-
-#ifdef DEBUG
-        cout << "Loaded public key for " << user << endl
-             << "Path: " << user_key_path << endl
-             << endl;
-#endif
+/*
+ * Terminates the [username] of [len] bytes read from a field, the last one
+ * being its terminator. Refuses one empty, or longer than any name of a
+ * file: it is read before the client is authenticated.
+ */
+static void terminate_username(flen len, unsigned char *username) {
+    if (len == 0 || len > FNAME_MAX_LEN) {
+        delete[] username;
+        handle_errors("Malformed username");
     }
-
-    return user_map;
+    username[len - 1] = '\0';
 }
 
 /*
- * Runs the key agreement protocol with the client.
- * Returns a tuple containing the username of the client and the agreed key.
- * The caller of this function has to free the memory allocated for the key when
- * done with it.
+ * Runs the full key agreement protocol with the client, whose AuthStart
+ * header has already been received.
+ * Returns a tuple containing the username of the client and the agreed key,
+ * the chunk size, the compression and the cipher suite proposed by the client
+ * are stored into [proposal], [compression] and [suite].
  */
-tuple<char *, unsigned char *> authenticate(int socket, int key_len) {
-    // Setup simple associations of usernames and public keys
-    auto user_keys = setup_keys();
+static tuple<char *, unsigned char *> run_handshake(int socket, int key_len,
+                                                    uint32_t &proposal,
+                                                    uint32_t &compression,
+                                                    uint32_t &suite) {
+    // Keep a reference to the keys, a reload must not free them under us
+    auto key_store = get_key_store();
 
     // ---------------------------------------------------------------------- //
     // ----------------- Client's opening message to Server ----------------- //
     // ---------------------------------------------------------------------- //
 
-    // Receive first client message
-    auto client_header_result = get_mtype(socket);
-
-    // Check the correctness of the message type
-    if (client_header_result.is_error ||
-        client_header_result.result != AuthStart) {
-        free_user_keys(user_keys);
-        handle_errors("Incorrect message type");
-    }
-
     // Read the username of the client
     auto username_result = read_field(socket);
     if (username_result.is_error) {
-        free_user_keys(user_keys);
         handle_errors(username_result.error);
     }
     auto [username_len, username] = username_result.result;
-    username[username_len - 1] = '\0';
+    terminate_username(username_len, username);
 
 #ifdef DEBUG
     cout << endl << "Username length: " << username_len << endl;
@@ -116,12 +80,9 @@ tuple<char *, unsigned char *> authenticate(int socket, int key_len) {
 #endif
 
     // Check that it is registered on the server
-    auto finder = user_keys.find(reinterpret_cast<char *>(username));
-    EVP_PKEY *client_pubkey = nullptr;
-    if (finder != user_keys.end()) {
-        client_pubkey = finder->second;
-    } else {
-        free_user_keys(user_keys);
+    EVP_PKEY *client_pubkey =
+        key_store->find_user(reinterpret_cast<char *>(username));
+    if (client_pubkey == nullptr) {
         delete[] username;
         handle_errors("User not registered!");
     }
@@ -129,7 +90,6 @@ tuple<char *, unsigned char *> authenticate(int socket, int key_len) {
     // Load the client's half key
     BIO *tmp_bio;
     if ((tmp_bio = BIO_new(BIO_s_mem())) == nullptr) {
-        free_user_keys(user_keys);
         delete[] username;
         handle_errors("Could not allocate memory bio");
     }
@@ -137,7 +97,6 @@ tuple<char *, unsigned char *> authenticate(int socket, int key_len) {
     // Read client half key in PEM format
     auto half_key_result = read_field(socket);
     if (half_key_result.is_error) {
-        free_user_keys(user_keys);
         delete[] username;
         BIO_free(tmp_bio);
         handle_errors(half_key_result.error);
@@ -147,7 +106,6 @@ tuple<char *, unsigned char *> authenticate(int socket, int key_len) {
     // Write it to memory bio
     if (BIO_write(tmp_bio, client_half_key_pem, client_half_key_len) !=
         client_half_key_len) {
-        free_user_keys(user_keys);
         delete[] username;
         delete[] client_half_key_pem;
         BIO_free(tmp_bio);
@@ -157,7 +115,6 @@ tuple<char *, unsigned char *> authenticate(int socket, int key_len) {
     // ... and extract it as the client half key
     auto client_half_key = PEM_read_bio_PUBKEY(tmp_bio, nullptr, 0, nullptr);
     if (client_half_key == nullptr) {
-        free_user_keys(user_keys);
         delete[] username;
         delete[] client_half_key_pem;
         BIO_free(tmp_bio);
@@ -171,38 +128,33 @@ tuple<char *, unsigned char *> authenticate(int socket, int key_len) {
     cout << endl;
 #endif
 
-    // ---------------------------------------------------------------------- //
-    // --------------------- Server's response to client -------------------- //
-    // ---------------------------------------------------------------------- //
-
-    // Send header
-    auto send_header_result = send_header(socket, AuthServerAns);
-    if (send_header_result.is_error) {
-        free_user_keys(user_keys);
+    // The server answers in the key exchange group chosen by the client
+    auto kex_res = get_kex_group(client_half_key);
+    if (kex_res.is_error) {
         delete[] username;
         delete[] client_half_key_pem;
+        BIO_free(tmp_bio);
         EVP_PKEY_free(client_half_key);
-        handle_errors(send_header_result.error);
+        handle_errors(kex_res.error);
     }
 
+    // ---------------------------------------------------------------------- //
+    // --------------------- Server's response to client -------------------- //
+    // ---------------------------------------------------------------------- //
+
+    // Send header. The answer is written at once, after being signed
+    FrameWriter out;
+    out.header(AuthServerAns);
+
     // Send server name ("server")
-    auto send_server_name_res =
-        send_field(socket, sizeof(server_name), server_name);
-    if (send_server_name_res.is_error) {
-        free_user_keys(user_keys);
-        delete[] username;
-        delete[] client_half_key_pem;
-        EVP_PKEY_free(client_half_key);
-        handle_errors(send_server_name_res.error);
-    }
+    out.field(sizeof(server_name), server_name);
 
     // Send server's half key
 
     // Generate the keypair for the server and write it the public key to the
     // memory bio to extract it as PEM
-    auto keypair = gen_keypair();
+    auto keypair = get_keypair(kex_res.result);
     if (PEM_write_bio_PUBKEY(tmp_bio, keypair) != 1) {
-        free_user_keys(user_keys);
         delete[] username;
         delete[] client_half_key_pem;
         BIO_free(tmp_bio);
@@ -215,7 +167,6 @@ tuple<char *, unsigned char *> authenticate(int socket, int key_len) {
     unsigned char *server_half_key_ptr;
     if ((server_half_key_len =
              BIO_get_mem_data(tmp_bio, &server_half_key_ptr)) <= 0) {
-        free_user_keys(user_keys);
         delete[] username;
         delete[] client_half_key_pem;
         BIO_free(tmp_bio);
@@ -233,7 +184,6 @@ tuple<char *, unsigned char *> authenticate(int socket, int key_len) {
     // Check if the size of the public key is less than the maximum size of a
     // packet field
     if (server_half_key_len > FLEN_MAX) {
-        free_user_keys(user_keys);
         delete[] username;
         delete[] client_half_key_pem;
         BIO_free(tmp_bio);
@@ -248,89 +198,16 @@ tuple<char *, unsigned char *> authenticate(int socket, int key_len) {
     memcpy(server_half_key_pem, server_half_key_ptr, server_half_key_len);
 
     // Actually send the half key
-    auto send_server_half_key_result =
-        send_field(socket, (flen)server_half_key_len, server_half_key_ptr);
-
-    // and check the result
-    if (send_server_half_key_result.is_error) {
-        free_user_keys(user_keys);
-        delete[] username;
-        delete[] client_half_key_pem;
-        delete[] server_half_key_pem;
-        BIO_free(tmp_bio);
-        EVP_PKEY_free(client_half_key);
-        EVP_PKEY_free(keypair);
-        handle_errors(send_server_half_key_result.error);
-    }
+    out.field((flen)server_half_key_len, server_half_key_ptr);
     BIO_reset(tmp_bio);
 
     // Send server's certificate
-
-    // Open the certificate file
-    FILE *server_certificate_fp;
-    if ((server_certificate_fp = fopen("certificates/server.crt", "r")) ==
-        nullptr) {
-        free_user_keys(user_keys);
-        delete[] username;
-        delete[] client_half_key_pem;
-        delete[] server_half_key_pem;
-        BIO_free(tmp_bio);
-        EVP_PKEY_free(client_half_key);
-        EVP_PKEY_free(keypair);
-        handle_errors("Could not open server's certificate file");
-    }
-
-    // Read the certificate into an X509 struct
-    X509 *server_certificate;
-    if ((server_certificate = PEM_read_X509(server_certificate_fp, nullptr, 0,
-                                            nullptr)) == nullptr) {
-        free_user_keys(user_keys);
-        delete[] username;
-        delete[] client_half_key_pem;
-        delete[] server_half_key_pem;
-        BIO_free(tmp_bio);
-        EVP_PKEY_free(client_half_key);
-        fclose(server_certificate_fp);
-        EVP_PKEY_free(keypair);
-        handle_errors("Could not read X509 certificate from file");
-    }
-
-    fclose(server_certificate_fp);
-
-    // Save the X509 certificate as PEM and writes it to the memory bio
-    if (PEM_write_bio_X509(tmp_bio, server_certificate) != 1) {
-        free_user_keys(user_keys);
-        delete[] username;
-        delete[] client_half_key_pem;
-        delete[] server_half_key_pem;
-        BIO_free(tmp_bio);
-        EVP_PKEY_free(client_half_key);
-        EVP_PKEY_free(keypair);
-        X509_free(server_certificate);
-        handle_errors("Could not write to memory bio");
-    }
-
-    X509_free(server_certificate);
-
-    // Get the length and a pointer to the bio's memory data
-    long server_certificate_len;
-    unsigned char *server_certificate_ptr;
-    if ((server_certificate_len =
-             BIO_get_mem_data(tmp_bio, &server_certificate_ptr)) <= 0) {
-        free_user_keys(user_keys);
-        delete[] username;
-        delete[] client_half_key_pem;
-        delete[] server_half_key_pem;
-        BIO_free(tmp_bio);
-        EVP_PKEY_free(client_half_key);
-        EVP_PKEY_free(keypair);
-        handle_errors("Could not read from memory bio");
-    }
+    long server_certificate_len = key_store->certificate_len;
+    unsigned char *server_certificate_ptr = key_store->certificate_pem;
 
     // Check if the size of the certificate is less than the maximum size of a
     // packet field
     if (server_certificate_len > FLEN_MAX) {
-        free_user_keys(user_keys);
         delete[] username;
         delete[] client_half_key_pem;
         delete[] server_half_key_pem;
@@ -342,20 +219,7 @@ tuple<char *, unsigned char *> authenticate(int socket, int key_len) {
     }
 
     // Actually send the certificate
-    auto send_server_certificate_result = send_field(
-        socket, (flen)server_certificate_len, server_certificate_ptr);
-
-    // and check the result
-    if (send_server_certificate_result.is_error) {
-        free_user_keys(user_keys);
-        delete[] username;
-        delete[] client_half_key_pem;
-        delete[] server_half_key_pem;
-        BIO_free(tmp_bio);
-        EVP_PKEY_free(client_half_key);
-        EVP_PKEY_free(keypair);
-        handle_errors(send_server_certificate_result.error);
-    }
+    out.field((flen)server_certificate_len, server_certificate_ptr);
     BIO_free(tmp_bio);
 
     // Sign {g^x, g^y, C} with server's private key and send it
@@ -363,7 +227,6 @@ tuple<char *, unsigned char *> authenticate(int socket, int key_len) {
     // Init the signing context
     EVP_MD_CTX *server_signature_ctx;
     if ((server_signature_ctx = EVP_MD_CTX_new()) == nullptr) {
-        free_user_keys(user_keys);
         delete[] username;
         delete[] client_half_key_pem;
         EVP_PKEY_free(client_half_key);
@@ -381,7 +244,6 @@ tuple<char *, unsigned char *> authenticate(int socket, int key_len) {
     err |= EVP_SignUpdate(server_signature_ctx, username, username_len);
 
     if (err != 1) {
-        free_user_keys(user_keys);
         delete[] username;
         delete[] client_half_key_pem;
         delete[] server_half_key_pem;
@@ -391,35 +253,7 @@ tuple<char *, unsigned char *> authenticate(int socket, int key_len) {
         handle_errors("Could not sign correctly (update)");
     }
 
-    // Open the server's private key file
-    FILE *server_private_key_fp;
-    if ((server_private_key_fp = fopen("certificates/server.key", "r")) ==
-        nullptr) {
-        free_user_keys(user_keys);
-        delete[] username;
-        delete[] client_half_key_pem;
-        delete[] server_half_key_pem;
-        EVP_PKEY_free(client_half_key);
-        EVP_MD_CTX_free(server_signature_ctx);
-        EVP_PKEY_free(keypair);
-        handle_errors("Could not open server's private key");
-    }
-
-    // And read the key from it
-    EVP_PKEY *server_private_key;
-    if ((server_private_key = PEM_read_PrivateKey(
-             server_private_key_fp, nullptr, 0, nullptr)) == nullptr) {
-        free_user_keys(user_keys);
-        delete[] username;
-        delete[] client_half_key_pem;
-        delete[] server_half_key_pem;
-        EVP_PKEY_free(client_half_key);
-        EVP_MD_CTX_free(server_signature_ctx);
-        fclose(server_private_key_fp);
-        EVP_PKEY_free(keypair);
-        handle_errors("Could not read server's private key");
-    }
-    fclose(server_private_key_fp);
+    EVP_PKEY *server_private_key = key_store->private_key;
 
     unsigned char *server_signature =
         new unsigned char[get_signature_max_length(server_private_key)];
@@ -427,7 +261,6 @@ tuple<char *, unsigned char *> authenticate(int socket, int key_len) {
 
     if (EVP_SignFinal(server_signature_ctx, server_signature,
                       &server_signature_len, server_private_key) != 1) {
-        free_user_keys(user_keys);
         delete[] username;
         delete[] client_half_key_pem;
         delete[] server_half_key_pem;
@@ -435,15 +268,12 @@ tuple<char *, unsigned char *> authenticate(int socket, int key_len) {
         EVP_PKEY_free(client_half_key);
         EVP_MD_CTX_free(server_signature_ctx);
         EVP_PKEY_free(keypair);
-        EVP_PKEY_free(server_private_key);
         handle_errors("Could not sign correctly (final)");
     }
 
-    EVP_PKEY_free(server_private_key);
     EVP_MD_CTX_free(server_signature_ctx);
 
     if (server_signature_len > FLEN_MAX) {
-        free_user_keys(user_keys);
         delete[] username;
         delete[] client_half_key_pem;
         delete[] server_half_key_pem;
@@ -455,9 +285,8 @@ tuple<char *, unsigned char *> authenticate(int socket, int key_len) {
     }
 
     auto send_server_signature_result =
-        send_field(socket, (flen)server_signature_len, server_signature);
+        out.field((flen)server_signature_len, server_signature).flush(socket);
     if (send_server_signature_result.is_error) {
-        free_user_keys(user_keys);
         delete[] username;
         delete[] client_half_key_pem;
         delete[] server_half_key_pem;
@@ -477,7 +306,6 @@ tuple<char *, unsigned char *> authenticate(int socket, int key_len) {
     auto client_header_res = get_mtype(socket);
     if (client_header_res.is_error ||
         client_header_res.result != AuthClientAns) {
-        free_user_keys(user_keys);
         delete[] username;
         delete[] client_half_key_pem;
         delete[] server_half_key_pem;
@@ -489,7 +317,6 @@ tuple<char *, unsigned char *> authenticate(int socket, int key_len) {
     // Receive client signature and check it
     auto client_signature_res = read_field(socket);
     if (client_signature_res.is_error) {
-        free_user_keys(user_keys);
         delete[] username;
         delete[] client_half_key_pem;
         delete[] server_half_key_pem;
@@ -503,7 +330,6 @@ tuple<char *, unsigned char *> authenticate(int socket, int key_len) {
     // Create and initialize the verification context
     EVP_MD_CTX *client_signature_ctx;
     if ((client_signature_ctx = EVP_MD_CTX_new()) == nullptr) {
-        free_user_keys(user_keys);
         delete[] username;
         delete[] client_signature;
         delete[] client_half_key_pem;
@@ -524,7 +350,6 @@ tuple<char *, unsigned char *> authenticate(int socket, int key_len) {
                             sizeof(server_name));
 
     if (err != 1) {
-        free_user_keys(user_keys);
         delete[] username;
         delete[] client_signature;
         delete[] client_half_key_pem;
@@ -538,7 +363,6 @@ tuple<char *, unsigned char *> authenticate(int socket, int key_len) {
     // Verify that the signature is correct
     if (EVP_VerifyFinal(client_signature_ctx, client_signature,
                         client_signature_len, client_pubkey) != 1) {
-        free_user_keys(user_keys);
         delete[] username;
         delete[] client_signature;
         EVP_PKEY_free(client_half_key);
@@ -555,7 +379,6 @@ tuple<char *, unsigned char *> authenticate(int socket, int key_len) {
     // Computes shared secret
     EVP_PKEY_CTX *shared_secret_ctx;
     if ((shared_secret_ctx = EVP_PKEY_CTX_new(keypair, nullptr)) == nullptr) {
-        free_user_keys(user_keys);
         delete[] username;
         EVP_PKEY_free(client_half_key);
         handle_errors("Shared secret creation failed (alloc)");
@@ -575,14 +398,12 @@ tuple<char *, unsigned char *> authenticate(int socket, int key_len) {
         EVP_PKEY_derive(shared_secret_ctx, shared_secret, &shared_secret_len);
 
     if (err != 1) {
-        free_user_keys(user_keys);
         delete[] username;
         EVP_PKEY_free(client_half_key);
         EVP_PKEY_CTX_free(shared_secret_ctx);
         handle_errors("Shared secret creation failed");
     }
 
-    free_user_keys(user_keys);
     EVP_PKEY_free(keypair);
     EVP_PKEY_free(client_half_key);
     EVP_PKEY_CTX_free(shared_secret_ctx);
@@ -590,12 +411,273 @@ tuple<char *, unsigned char *> authenticate(int socket, int key_len) {
     // Finally, derive the symmetric key from the shared secret
     auto key_res = kdf(shared_secret, shared_secret_len, key_len);
     if (key_res.is_error) {
-        free_user_keys(user_keys);
         delete[] username;
         handle_errors("Shared secret creation failed");
     }
 
     auto key = key_res.result;
 
+    // The chunk size, the compression and the cipher suite proposed by the
+    // client end its answer
+    auto proposal_res = read_uint_field(socket);
+    auto compression_res = proposal_res.is_error ? proposal_res
+                                                 : read_uint_field(socket);
+    auto suite_res = compression_res.is_error ? compression_res
+                                              : read_uint_field(socket);
+    if (suite_res.is_error) {
+        delete[] username;
+        explicit_bzero(key, key_len);
+        delete[] key;
+        handle_errors(suite_res.error);
+    }
+    proposal = proposal_res.result;
+    compression = compression_res.result;
+    suite = suite_res.result;
+
     return {reinterpret_cast<char *>(username), key};
 }
+
+/*
+ * Resumes a session of the client from a ticket, whose AuthResume header has
+ * already been received. The client proves to own the ticket by using the new
+ * key, which depends on a fresh nonce of the server as well: a replayed
+ * AuthResume cannot be followed by a valid request.
+ *
+ * Returns the username and the key of the session, or {nullptr, nullptr} if
+ * the ticket was refused (the client then runs the full handshake). The chunk
+ * size, the compression and the cipher suite proposed by the client are
+ * stored into [proposal], [compression] and [suite], and the time of the full
+ * handshake the ticket comes from into [handshake_time].
+ */
+static tuple<char *, unsigned char *>
+resume_session(int socket, int key_len, uint32_t &proposal,
+               uint32_t &compression, uint32_t &suite,
+               int64_t &handshake_time) {
+    // Read the username, the ticket, the nonce, the chunk size, the
+    // compression and the cipher suite of the client
+    auto username_res = read_field(socket);
+    if (username_res.is_error) {
+        handle_errors(username_res.error);
+    }
+    auto [username_len, username] = username_res.result;
+    terminate_username(username_len, username);
+
+    auto ticket_res = read_field(socket);
+    if (ticket_res.is_error) {
+        delete[] username;
+        handle_errors(ticket_res.error);
+    }
+    auto [ticket_len, ticket] = ticket_res.result;
+
+    auto client_nonce_res = read_field(socket);
+    if (client_nonce_res.is_error) {
+        delete[] username;
+        delete[] ticket;
+        handle_errors(client_nonce_res.error);
+    }
+    auto [client_nonce_len, client_nonce] = client_nonce_res.result;
+
+    auto proposal_res = read_uint_field(socket);
+    auto compression_res = proposal_res.is_error ? proposal_res
+                                                 : read_uint_field(socket);
+    auto suite_res = compression_res.is_error ? compression_res
+                                              : read_uint_field(socket);
+    if (suite_res.is_error) {
+        delete[] username;
+        delete[] ticket;
+        delete[] client_nonce;
+        handle_errors(suite_res.error);
+    }
+    proposal = proposal_res.result;
+    compression = compression_res.result;
+    suite = suite_res.result;
+
+    // A ticket of a user that is no longer registered is refused as well
+    auto secret_res =
+        open_ticket(reinterpret_cast<char *>(username), ticket, ticket_len,
+                    key_len, handshake_time);
+    delete[] ticket;
+    bool refused = secret_res.is_error || client_nonce_len != NONCE_LEN ||
+                   get_key_store()->find_user(
+                       reinterpret_cast<char *>(username)) == nullptr;
+
+    if (refused) {
+#ifdef DEBUG
+        cout << "Refusing ticket: "
+             << (secret_res.is_error ? secret_res.error : "bad request")
+             << endl;
+#endif
+        if (!secret_res.is_error) {
+            explicit_bzero(secret_res.result, key_len);
+            delete[] secret_res.result;
+        }
+        delete[] username;
+        delete[] client_nonce;
+
+        // An empty nonce tells the client to fall back to the full handshake
+        FrameWriter out;
+        auto send_res =
+            out.header(AuthResumeAns).field(0, nullptr).flush(socket);
+        if (send_res.is_error) {
+            handle_errors("Could not refuse the ticket");
+        }
+        return {nullptr, nullptr};
+    }
+    auto resumption_secret = secret_res.result;
+
+    auto server_nonce_res = gen_nonce();
+    if (server_nonce_res.is_error) {
+        explicit_bzero(resumption_secret, key_len);
+        delete[] resumption_secret;
+        delete[] username;
+        delete[] client_nonce;
+        handle_errors(server_nonce_res.error);
+    }
+    auto server_nonce = server_nonce_res.result;
+
+    auto key_res = derive_resumed_key(resumption_secret, key_len, client_nonce,
+                                      server_nonce);
+    explicit_bzero(resumption_secret, key_len);
+    delete[] resumption_secret;
+    delete[] client_nonce;
+    if (key_res.is_error) {
+        delete[] username;
+        delete[] server_nonce;
+        handle_errors(key_res.error);
+    }
+
+    FrameWriter out;
+    auto send_res =
+        out.header(AuthResumeAns).field(NONCE_LEN, server_nonce).flush(socket);
+    delete[] server_nonce;
+    if (send_res.is_error) {
+        delete[] username;
+        explicit_bzero(key_res.result, key_len);
+        delete[] key_res.result;
+        handle_errors("Could not accept the ticket");
+    }
+
+    return {reinterpret_cast<char *>(username), key_res.result};
+}
+
+/*
+ * Sends a new ticket to the client, to resume the session later on, along
+ * with the agreed chunk size, compression and cipher suite. The session comes
+ * from a full handshake at [handshake_time]. The answer ends with its tag
+ * (login_tag), which covers the [proposals] of the client as well: neither
+ * its signature nor the ticket covers them.
+ */
+static void issue_ticket(int socket, char *username, unsigned char *key,
+                         int key_len, const uint32_t proposals[3],
+                         uint32_t chunk_size, uint32_t compression,
+                         uint32_t suite, int64_t handshake_time) {
+    auto secret_res = derive_resumption_secret(key, key_len);
+    if (secret_res.is_error) {
+        handle_errors(secret_res.error);
+    }
+
+    uint32_t lifetime;
+    auto ticket_res = seal_ticket(username, secret_res.result, key_len,
+                                  handshake_time, lifetime);
+    explicit_bzero(secret_res.result, key_len);
+    delete[] secret_res.result;
+    if (ticket_res.is_error) {
+        handle_errors(ticket_res.error);
+    }
+    auto [ticket_len, ticket] = ticket_res.result;
+
+    // Tagged: the proposals, then the answer as it is sent
+    uint32_t answer[] = {proposals[0], proposals[1], proposals[2], lifetime,
+                         chunk_size,   compression,  suite};
+    vector<unsigned char> tagged(sizeof(answer) + ticket_len);
+    memcpy(tagged.data(), answer, sizeof(answer));
+    memcpy(tagged.data() + sizeof(answer), ticket, ticket_len);
+    unsigned char tag[LOGIN_TAG_LEN];
+    auto tag_res =
+        login_tag(key, key_len, tagged.data(), tagged.size(), tag);
+    if (tag_res.is_error) {
+        delete[] ticket;
+        handle_errors(tag_res.error);
+    }
+
+    FrameWriter out;
+    auto send_res = out.header(AuthTicket)
+                        .field(ticket_len, ticket)
+                        .field(sizeof(lifetime),
+                               reinterpret_cast<unsigned char *>(&lifetime))
+                        .field(sizeof(chunk_size),
+                               reinterpret_cast<unsigned char *>(&chunk_size))
+                        .field(sizeof(compression),
+                               reinterpret_cast<unsigned char *>(&compression))
+                        .field(sizeof(suite),
+                               reinterpret_cast<unsigned char *>(&suite))
+                        .field(sizeof(tag), tag)
+                        .flush(socket);
+    delete[] ticket;
+    if (send_res.is_error) {
+        handle_errors("Could not send the ticket");
+    }
+}
+
+tuple<char *, unsigned char *> authenticate(int socket, int key_len,
+                                            unsigned int &chunk_size,
+                                            compression_algo &compression,
+                                            cipher_suite &suite) {
+    auto header_res = get_mtype(socket);
+    if (header_res.is_error) {
+        handle_errors(header_res.error);
+    }
+
+    tuple<char *, unsigned char *> res = {nullptr, nullptr};
+    uint32_t proposal = 0;
+    uint32_t compression_proposal = CompressNone;
+    uint32_t suite_proposal = SuiteAesGcm;
+    int64_t handshake_time = 0;
+    if (header_res.result == AuthResume) {
+        res = resume_session(socket, key_len, proposal, compression_proposal,
+                             suite_proposal, handshake_time);
+
+        // Refused ticket: the full handshake follows
+        if (get<0>(res) == nullptr) {
+            header_res = get_mtype(socket);
+            if (header_res.is_error) {
+                handle_errors(header_res.error);
+            }
+        }
+    }
+
+    if (get<0>(res) == nullptr) {
+        // Check the correctness of the message type
+        if (header_res.result != AuthStart) {
+            handle_errors("Incorrect message type");
+        }
+        res = run_handshake(socket, key_len, proposal, compression_proposal,
+                            suite_proposal);
+        handshake_time = time(nullptr);
+    }
+
+    // The chunk size of the client wins, as long as it is within our limit
+    chunk_size =
+        max<uint32_t>(MIN_CHUNK_SIZE, min<uint32_t>(proposal, chunk_size));
+    // So does its compression, unless we do not allow it (or do not know it)
+    if (compression_proposal != (uint32_t)compression) {
+        compression = CompressNone;
+    }
+    // And so does its cipher suite, which we know or fall back from
+    suite = suite_proposal == SuiteChaCha20 ? SuiteChaCha20 : SuiteAesGcm;
+
+    // Any error in here is a failure of the session: the username and the
+    // key have to be freed
+    uint32_t proposals[] = {proposal, compression_proposal, suite_proposal};
+    try {
+        issue_ticket(socket, get<0>(res), get<1>(res), key_len, proposals,
+                     chunk_size, compression, suite, handshake_time);
+    } catch (char const *) {
+        delete[] get<0>(res);
+        explicit_bzero(get<1>(res), key_len);
+        delete[] get<1>(res);
+        throw;
+    }
+
+    return res;
+}
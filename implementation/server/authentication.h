@@ -1,3 +1,5 @@
+#include "../common/cipher.h"
+#include "../common/compress.h"
 #include <openssl/bio.h>
 #include <tuple>
 
@@ -9,8 +11,21 @@ using namespace std;
  * Runs the authentication protocol with the entity on the other side of the
  * passed socket.
  *
- * Returns the key shared with the other party of len [key_len], if the run was
- * successful. If the run failed, it aborts the program execution.
+ * The client either runs the full protocol or presents a ticket issued by an
+ * earlier session; in both cases it gets a new ticket at the end.
+ *
+ * [chunk_size] holds the largest chunk size we accept, and is set to the one
+ * agreed with the client. [compression] holds the compression we allow, and
+ * is set to the one agreed with the client: that one, or none. [suite] is set
+ * to the cipher suite agreed with the client: the one it proposed, or
+ * AES-256-GCM if we do not know that one.
+ *
+ * Returns the username of the client and the key shared with it of len
+ * [key_len], if the run was successful. If the run failed, it aborts the
+ * program execution.
  */
-tuple<char *, unsigned char *> authenticate(int socket, int key_len);
+tuple<char *, unsigned char *> authenticate(int socket, int key_len,
+                                            unsigned int &chunk_size,
+                                            compression_algo &compression,
+                                            cipher_suite &suite);
 #endif
@@ -0,0 +1,457 @@
+#include "chunkstore.h"
+#include "../common/utils.h"
+#include "volumes.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <openssl/rand.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+
+using namespace std;
+
+// Chunks start with the number of files they are in
+typedef uint32_t refcount;
+
+// Manifests start with this, then with the ID of the store they refer to:
+// nobody but the server can write a file as it is that reads as a manifest.
+// Then come the size of the file and the size of its chunks.
+#define MANIFEST_MAGIC "FoCchnk2"
+#define MANIFEST_MAGIC_LEN 8
+#define STORE_ID_LEN 16
+#define MANIFEST_HEADER_LEN                                                    \
+    (MANIFEST_MAGIC_LEN + STORE_ID_LEN + sizeof(uint64_t) + sizeof(uint32_t))
+// Manifests written before sizes took 64 bits, which are still read
+#define MANIFEST_V1_MAGIC "FoCchnks"
+#define MANIFEST_V1_HEADER_LEN                                                 \
+    (MANIFEST_MAGIC_LEN + STORE_ID_LEN + 2 * sizeof(uint32_t))
+
+static storage_backend backend = StorageFiles;
+
+// Whether there is a store at all: without one, no file is a manifest
+static bool store_open = false;
+static unsigned char store_id[STORE_ID_LEN];
+
+Maybe<storage_backend> parse_storage_backend(const char *name) {
+    Maybe<storage_backend> res;
+    if (strcmp(name, "files") == 0) {
+        res.set_result(StorageFiles);
+    } else if (strcmp(name, "chunks") == 0) {
+        res.set_result(StorageChunks);
+    } else {
+        res.set_error("Unknown storage backend");
+    }
+    return res;
+}
+
+void set_storage_backend(storage_backend b) { backend = b; }
+
+storage_backend get_storage_backend() { return backend; }
+
+static fs::path store_path() {
+    return primary_volume() / ".chunks";
+}
+
+static string to_hex(const uchar *hash) {
+    static const char digits[] = "0123456789abcdef";
+    string hex(2 * CHUNK_HASH_LEN, '0');
+    for (int i = 0; i < CHUNK_HASH_LEN; i++) {
+        hex[2 * i] = digits[hash[i] >> 4];
+        hex[2 * i + 1] = digits[hash[i] & 0xf];
+    }
+    return hex;
+}
+
+static bool from_hex(const string &hex, uchar *hash) {
+    if (hex.size() != 2 * CHUNK_HASH_LEN)
+        return false;
+    for (int i = 0; i < CHUNK_HASH_LEN; i++) {
+        char byte[3] = {hex[2 * i], hex[2 * i + 1], '\0'};
+        char *end;
+        hash[i] = strtoul(byte, &end, 16);
+        if (*end != '\0')
+            return false;
+    }
+    return true;
+}
+
+/* Chunks are spread over directories named after the start of their hash */
+static fs::path chunk_path(const uchar *hash) {
+    string hex = to_hex(hash);
+    return store_path() / hex.substr(0, 2) / hex;
+}
+
+static bool write_all(int fd, const void *data, size_t len, off_t offset) {
+    auto *p = static_cast<const uchar *>(data);
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            return false;
+        }
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return true;
+}
+
+static bool fsync_dir(const fs::path &dir) {
+    int fd = open(dir.native().c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+        return false;
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+/* Adds all the references of the manifests of every user to [refs] */
+static void count_references(unordered_map<string, refcount> &refs) {
+    error_code ec;
+    for (const auto &user : list_user_storages()) {
+        for (const auto &entry : fs::directory_iterator(user.second, ec)) {
+            if (entry.path().filename().native().rfind(PARTIAL_PREFIX, 0) ==
+                    0 ||
+                !fs::is_regular_file(entry.path()))
+                continue;
+            FILE *fp = fopen(entry.path().native().c_str(), "r");
+            if (fp == nullptr)
+                continue;
+            Manifest manifest;
+            auto manifest_res = read_manifest(fp, manifest);
+            fclose(fp);
+            if (manifest_res.is_error || !manifest_res.result)
+                continue;
+            for (size_t i = 0; i < manifest.chunks(); i++)
+                refs[to_hex(manifest.hash(i))]++;
+        }
+    }
+}
+
+void init_chunk_store() {
+    fs::path store = store_path();
+    fs::path id_path = store / "id";
+    error_code ec;
+    if (!fs::exists(id_path, ec)) {
+        // Nothing to read from a store that was never created
+        if (backend != StorageChunks)
+            return;
+        fs::create_directories(store, ec);
+        if (ec || RAND_bytes(store_id, STORE_ID_LEN) != 1) {
+            perror("Could not create the chunk store");
+            exit(EXIT_FAILURE);
+        }
+        FILE *fp = fopen(id_path.native().c_str(), "w");
+        if (fp == nullptr || fwrite(store_id, STORE_ID_LEN, 1, fp) != 1 ||
+            fclose(fp) != 0) {
+            perror("Could not create the chunk store");
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        FILE *fp = fopen(id_path.native().c_str(), "r");
+        if (fp == nullptr || fread(store_id, STORE_ID_LEN, 1, fp) != 1) {
+            perror("Could not open the chunk store");
+            exit(EXIT_FAILURE);
+        }
+        fclose(fp);
+    }
+    store_open = true;
+
+    // No session runs yet: the counts cannot change meanwhile
+    unordered_map<string, refcount> refs;
+    count_references(refs);
+    for (const auto &dir : fs::directory_iterator(store, ec)) {
+        if (!fs::is_directory(dir.path()))
+            continue;
+        for (const auto &entry : fs::directory_iterator(dir.path(), ec)) {
+            string name = entry.path().filename().native();
+            uchar hash[CHUNK_HASH_LEN];
+            auto count = refs.find(name);
+            if (!from_hex(name, hash) || count == refs.end()) {
+                // Chunks of nothing, or one that was never given its name
+                fs::remove(entry.path(), ec);
+                continue;
+            }
+            int fd = open(entry.path().native().c_str(), O_RDWR);
+            if (fd < 0)
+                continue;
+            write_all(fd, &count->second, sizeof(refcount), 0);
+            close(fd);
+        }
+    }
+}
+
+bool has_chunk(const uchar *hash) {
+    return access(chunk_path(hash).native().c_str(), F_OK) == 0;
+}
+
+/*
+ * Opens the chunk of [hash] for an update of its count, locked. Returns -1 if
+ * it is not stored, which it is not anymore once its last reference dropped:
+ * it may have been removed between the open and the lock.
+ */
+static int lock_chunk(const uchar *hash) {
+    int fd = open(chunk_path(hash).native().c_str(), O_RDWR);
+    if (fd < 0)
+        return -1;
+    struct stat st;
+    if (flock(fd, LOCK_EX) != 0 || fstat(fd, &st) != 0 || st.st_nlink == 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+Maybe<bool> ref_chunk(const uchar *hash) {
+    Maybe<bool> res;
+    int fd = lock_chunk(hash);
+    if (fd < 0) {
+        res.set_result(false);
+        return res;
+    }
+    refcount refs;
+    if (pread(fd, &refs, sizeof(refs), 0) != sizeof(refs)) {
+        close(fd);
+        res.set_error("Error - Could not read a chunk");
+        return res;
+    }
+    refs++;
+    bool ok = write_all(fd, &refs, sizeof(refs), 0);
+    close(fd);
+    if (!ok) {
+        res.set_error("Error - Could not save the file");
+        return res;
+    }
+    res.set_result(true);
+    return res;
+}
+
+Maybe<bool> put_chunk(const uchar *hash, const uchar *data, blen len,
+                      bool sync) {
+    Maybe<bool> res;
+    fs::path path = chunk_path(hash);
+    error_code ec;
+    fs::create_directory(path.parent_path(), ec);
+
+    // The chunk is written in full under a name of its own, then linked to
+    // its own name: those looking for it either see it whole, or not at all
+    for (;;) {
+        auto ref_res = ref_chunk(hash);
+        if (ref_res.is_error || ref_res.result) {
+            return ref_res;
+        }
+
+        string tmp = (path.parent_path() / "tmp-XXXXXX").native();
+        int fd = mkstemp(&tmp[0]);
+        if (fd < 0) {
+            res.set_error("Error - Could not save the file");
+            return res;
+        }
+        refcount refs = 1;
+        bool ok = write_all(fd, &refs, sizeof(refs), 0) &&
+                  write_all(fd, data, len, sizeof(refs)) &&
+                  (!sync || fsync(fd) == 0);
+        close(fd);
+        if (!ok) {
+            unlink(tmp.c_str());
+            res.set_error("Error - Could not save the file");
+            return res;
+        }
+
+        int ret = link(tmp.c_str(), path.native().c_str());
+        int link_errno = errno;
+        unlink(tmp.c_str());
+        if (ret == 0) {
+            if (sync && !fsync_dir(path.parent_path())) {
+                res.set_error("Error - Could not save the file");
+                return res;
+            }
+            res.set_result(true);
+            return res;
+        }
+        // Stored by another upload in the meantime: referenced instead
+        if (link_errno != EEXIST) {
+            res.set_error("Error - Could not save the file");
+            return res;
+        }
+    }
+}
+
+void unref_chunk(const uchar *hash) {
+    int fd = lock_chunk(hash);
+    if (fd < 0)
+        return;
+    refcount refs;
+    if (pread(fd, &refs, sizeof(refs), 0) == sizeof(refs)) {
+        if (refs <= 1) {
+            // Still locked: whoever waits for the lock sees it removed
+            unlink(chunk_path(hash).native().c_str());
+        } else {
+            refs--;
+            write_all(fd, &refs, sizeof(refs), 0);
+        }
+    }
+    close(fd);
+}
+
+uint64_t manifest_chunks(uint64_t size, uint32_t chunk_size) {
+    return (size + chunk_size - 1) / chunk_size;
+}
+
+Maybe<bool> read_manifest(FILE *fp, Manifest &manifest) {
+    Maybe<bool> res;
+    if (!store_open) {
+        return res;
+    }
+
+    int fd = fileno(fp);
+    struct stat st;
+    uchar header[MANIFEST_HEADER_LEN];
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+        st.st_size < (off_t)MANIFEST_V1_HEADER_LEN) {
+        return res;
+    }
+    size_t header_len = min((off_t)MANIFEST_HEADER_LEN, st.st_size);
+    if (pread(fd, header, header_len, 0) != (ssize_t)header_len ||
+        memcmp(header + MANIFEST_MAGIC_LEN, store_id, STORE_ID_LEN) != 0) {
+        return res;
+    }
+
+    const uchar *fields = header + MANIFEST_MAGIC_LEN + STORE_ID_LEN;
+    uint64_t size;
+    uint32_t chunk_size;
+    if (memcmp(header, MANIFEST_MAGIC, MANIFEST_MAGIC_LEN) == 0 &&
+        header_len == MANIFEST_HEADER_LEN) {
+        memcpy(&size, fields, sizeof(size));
+        memcpy(&chunk_size, fields + sizeof(size), sizeof(chunk_size));
+    } else if (memcmp(header, MANIFEST_V1_MAGIC, MANIFEST_MAGIC_LEN) == 0) {
+        uint32_t v1_size;
+        memcpy(&v1_size, fields, sizeof(v1_size));
+        memcpy(&chunk_size, fields + sizeof(v1_size), sizeof(chunk_size));
+        size = v1_size;
+        header_len = MANIFEST_V1_HEADER_LEN;
+    } else {
+        return res;
+    }
+    uint64_t chunks = chunk_size == 0 ? 0 : manifest_chunks(size, chunk_size);
+    if (chunk_size < MIN_CHUNK_SIZE || size > FSIZE_MAX ||
+        st.st_size != (off_t)(header_len + chunks * CHUNK_HASH_LEN)) {
+        res.set_error("Error - File is not readable");
+        return res;
+    }
+
+    vector<uchar> hashes(chunks * CHUNK_HASH_LEN);
+    if (pread(fd, hashes.data(), hashes.size(), header_len) !=
+        (ssize_t)hashes.size()) {
+        res.set_error("Error - File is not readable");
+        return res;
+    }
+    manifest.size = size;
+    manifest.chunk_size = chunk_size;
+    manifest.hashes.swap(hashes);
+    res.set_result(true);
+    return res;
+}
+
+bool write_manifest(FILE *fp, const Manifest &manifest) {
+    uchar header[MANIFEST_HEADER_LEN];
+    memcpy(header, MANIFEST_MAGIC, MANIFEST_MAGIC_LEN);
+    memcpy(header + MANIFEST_MAGIC_LEN, store_id, STORE_ID_LEN);
+    uchar *fields = header + MANIFEST_MAGIC_LEN + STORE_ID_LEN;
+    memcpy(fields, &manifest.size, sizeof(manifest.size));
+    memcpy(fields + sizeof(manifest.size), &manifest.chunk_size,
+           sizeof(manifest.chunk_size));
+    return fwrite(header, MANIFEST_HEADER_LEN, 1, fp) == 1 &&
+           fwrite(manifest.hashes.data(), 1, manifest.hashes.size(), fp) ==
+               manifest.hashes.size();
+}
+
+/* Reads the chunks of a manifest in order, each from its own file */
+class ManifestSource : public FileSource {
+  public:
+    ManifestSource(const Manifest &manifest, off_t offset, off_t end)
+        : manifest(manifest), offset(offset), end(end), fd(-1), index(0) {}
+    ~ManifestSource() {
+        if (fd >= 0)
+            close(fd);
+    }
+
+    Maybe<const uchar *> next(uchar *buf, blen max_len, blen &len) override {
+        Maybe<const uchar *> res;
+        len = 0;
+
+        // A chunk of the transfer may span many chunks of the store, as the
+        // file may have been stored with another chunk size
+        while (len < max_len && offset < end) {
+            size_t i = offset / manifest.chunk_size;
+            if (fd < 0 || i != index) {
+                if (fd >= 0)
+                    close(fd);
+                fd = open(chunk_path(manifest.hash(i)).native().c_str(),
+                          O_RDONLY);
+                index = i;
+                if (fd < 0) {
+                    res.set_error("Error - Could not read a chunk");
+                    return res;
+                }
+            }
+
+            off_t chunk_start = (off_t)i * manifest.chunk_size;
+            off_t chunk_end = min(end, chunk_start + manifest.chunk_size);
+            size_t n = min((off_t)(max_len - len), chunk_end - offset);
+            ssize_t r = pread(fd, buf + len, n,
+                              sizeof(refcount) + offset - chunk_start);
+            if (r <= 0) {
+                res.set_error("Error - Could not read a chunk");
+                return res;
+            }
+            len += r;
+            offset += r;
+        }
+
+        res.set_result(buf);
+        return res;
+    }
+
+    bool at_end() override { return offset == end; }
+
+  private:
+    const Manifest manifest;
+    off_t offset;
+    off_t end;
+    // Chunk being read
+    int fd;
+    size_t index;
+};
+
+FileSource *open_manifest_source(const Manifest &manifest, off_t offset,
+                                 off_t length) {
+    off_t size = manifest.size;
+    offset = min(offset, size);
+    off_t end = length < 0 || length > size - offset ? size : offset + length;
+    return new ManifestSource(manifest, offset, end);
+}
+
+bool remove_stored_file(const fs::path &path, error_code &ec) {
+    Manifest manifest;
+    bool is_manifest = false;
+    FILE *fp = fopen(path.native().c_str(), "r");
+    if (fp != nullptr) {
+        auto manifest_res = read_manifest(fp, manifest);
+        is_manifest = !manifest_res.is_error && manifest_res.result;
+        fclose(fp);
+    }
+
+    // The file goes first: a chunk is never missing from a file still there
+    bool removed = fs::remove(path, ec);
+    if (removed && is_manifest) {
+        for (size_t i = 0; i < manifest.chunks(); i++)
+            unref_chunk(manifest.hash(i));
+    }
+    return removed;
+}
@@ -0,0 +1,118 @@
+#include "../common/filesource.h"
+#include "../common/maybe.h"
+#include "../common/types.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <vector>
+
+#if __has_include(<filesystem>)
+#include <filesystem>
+namespace fs = std::filesystem;
+#elif __has_include(<experimental/filesystem>)
+#include <experimental/filesystem>
+namespace fs = std::experimental::filesystem;
+#else
+error "Missing the <filesystem> header."
+#endif
+
+#ifndef chunkstore_h
+#define chunkstore_h
+
+/*
+ * How the uploaded files are kept:
+ *     - StorageFiles:  each one as it is, in the storage of its user
+ *                      (default)
+ *     - StorageChunks: each one as a manifest in the storage of its user,
+ *                      listing the hashes of its chunks. The chunks are kept
+ *                      once, in a store shared by every user, along with the
+ *                      number of files they are in: a chunk the server
+ *                      already has is neither sent again nor stored twice.
+ * Files of both kinds are read and removed whatever the choice, so that it
+ * can change between runs of the server.
+ *
+ * The store lies next to the storage of the users, and only the server
+ * processes get to it. A client learns whether a chunk is there, and may
+ * reference it, from its hash alone: which is the whole point, but which
+ * also means that the chunks of a user are not kept secret from one who can
+ * tell their hashes.
+ */
+enum storage_backend { StorageFiles, StorageChunks };
+
+/* Parses the name of a backend: "files" or "chunks" */
+Maybe<storage_backend> parse_storage_backend(const char *name);
+
+void set_storage_backend(storage_backend backend);
+storage_backend get_storage_backend();
+
+/*
+ * Opens the chunk store, creating it with the chunks backend, then counts
+ * the references to every chunk again from the manifests: chunks of uploads
+ * cut short, or of files whose removal was, are dropped. To be called before
+ * any session starts. Aborts the program on failure.
+ */
+void init_chunk_store();
+
+/* Whether the chunk of [hash] (CHUNK_HASH_LEN bytes) is in the store */
+bool has_chunk(const uchar *hash);
+
+/*
+ * Adds a reference to the chunk of [hash], storing its [len] bytes at [data]
+ * first if it is not there yet. The chunk is on disk before it is counted as
+ * stored if [sync] is set.
+ */
+Maybe<bool> put_chunk(const uchar *hash, const uchar *data, blen len,
+                      bool sync);
+
+/* Adds a reference to the chunk of [hash]. Returns false if it is not stored */
+Maybe<bool> ref_chunk(const uchar *hash);
+
+/* Drops a reference to the chunk of [hash], which is removed with the last */
+void unref_chunk(const uchar *hash);
+
+/*
+ * Chunks of a file kept as its chunks at most: the hashes of all of them are
+ * held at once, and sent in a single message. A larger file is kept as it
+ * is, whatever the backend.
+ */
+#define MANIFEST_MAX_CHUNKS (2 * 1024 * 1024)
+
+/* Number of chunks of [chunk_size] bytes of a file of [size] bytes */
+uint64_t manifest_chunks(uint64_t size, uint32_t chunk_size);
+
+/* File kept as its chunks */
+struct Manifest {
+    uint64_t size;
+    uint32_t chunk_size;
+    // Hash of every chunk of the file, in order
+    std::vector<uchar> hashes;
+
+    size_t chunks() const { return hashes.size() / CHUNK_HASH_LEN; }
+    const uchar *hash(size_t i) const {
+        return hashes.data() + i * CHUNK_HASH_LEN;
+    }
+};
+
+/*
+ * Reads [fp] as a manifest. Returns false, leaving [manifest] as it is, if
+ * it is a file as it is instead. The position in [fp] is left as it is.
+ */
+Maybe<bool> read_manifest(FILE *fp, Manifest &manifest);
+
+/* Writes [manifest] at the current position of [fp] */
+bool write_manifest(FILE *fp, const Manifest &manifest);
+
+/*
+ * Opens a source reading the [length] bytes of the file of [manifest]
+ * starting at [offset], or all of them past it if [length] is negative
+ */
+FileSource *open_manifest_source(const Manifest &manifest, off_t offset,
+                                 off_t length);
+
+/*
+ * Removes the file at [path], along with its references to the chunks it is
+ * made of if it is a manifest
+ */
+bool remove_stored_file(const fs::path &path, std::error_code &ec);
+
+#endif
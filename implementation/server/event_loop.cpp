@@ -0,0 +1,354 @@
+#include "event_loop.h"
+#include "../common/errors.h"
+#include "../common/keypool.h"
+#include "../common/utils.h"
+#include "keystore.h"
+#include "server.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <iostream>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <unordered_set>
+#include <vector>
+#include <wait.h>
+
+// Stack of a single connection. Handlers keep a whole chunk on the stack, and
+// OpenSSL needs some room as well during the handshake.
+#define CONNECTION_STACK_SIZE (512 * 1024)
+#define MAX_EVENTS 64
+
+using namespace std;
+
+// Connections giving up on their socket (io_idle_timeout) are looked for
+// this often at least
+#define IDLE_CHECK_MS 1000
+
+enum connection_state { ConnRunning, ConnWaitRead, ConnWaitWrite, ConnDone };
+
+struct connection {
+    int fd;
+    connection_state state;
+    ucontext_t ctx;
+    void *stack;
+    // While parked on its socket: when it gives up on it, if ever, and
+    // whether it did
+    time_t deadline;
+    bool timed_out;
+};
+
+static int epoll_fd = -1;
+static ucontext_t loop_ctx;
+static connection *current = nullptr;
+static unordered_set<connection *> connections;
+static volatile sig_atomic_t draining = 0;
+
+static void drain_handler(int signum) {
+    (void)signum;
+    draining = 1;
+}
+
+/*
+ * I/O wait hook: registers interest in the socket and gives control back to
+ * the loop. Runs on the stack of the connection, which is resumed right here.
+ *
+ * Any other file descriptor, e.g. the one telling that the threads of a
+ * transfer are done, takes the place of the socket in epoll until it is
+ * ready: the socket is in the hands of those threads meanwhile, nor may a
+ * hangup of it resume the connection ahead of time. Only the socket is ever
+ * given up on, after io_idle_timeout seconds: the threads of a transfer do so
+ * on their own.
+ */
+static bool park_connection(int fd, bool for_write) {
+    connection *conn = current;
+    if (conn == nullptr) {
+        handle_errors("Parking outside of a connection");
+    }
+
+    struct epoll_event ev;
+    ev.events = for_write ? EPOLLOUT : EPOLLIN;
+    ev.data.ptr = conn;
+    bool own = fd == conn->fd;
+    if (own) {
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) < 0) {
+            handle_errors("Could not register connection to epoll");
+        }
+    } else if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        handle_errors("Could not register connection to epoll");
+    } else if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, nullptr) < 0) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+        handle_errors("Could not register connection to epoll");
+    }
+    conn->state = for_write ? ConnWaitWrite : ConnWaitRead;
+    conn->deadline = own && io_idle_timeout > 0
+                         ? time(nullptr) + io_idle_timeout
+                         : 0;
+    conn->timed_out = false;
+
+    swapcontext(&conn->ctx, &loop_ctx);
+
+    conn->state = ConnRunning;
+    conn->deadline = 0;
+    if (!own) {
+        // Back to the socket, without any interest until parked on it again
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+        ev.events = 0;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev) < 0) {
+            handle_errors("Could not register connection to epoll");
+        }
+    }
+    return !conn->timed_out;
+}
+
+/* Entry point of every connection, runs on its own stack */
+static void connection_main() {
+    connection *conn = current;
+
+    try {
+        serve_session(conn->fd);
+    } catch (char const *ex) {
+        cerr << "Something went wrong! :(" << endl;
+#ifdef DEBUG
+        cerr << "Error: " << ex << endl;
+#endif
+        cerr << "Closing connection..." << endl;
+    }
+
+    conn->state = ConnDone;
+    // Returning switches back to the loop through uc_link
+}
+
+/* The socket itself has already been closed by its session */
+static void close_connection(connection *conn) {
+    connections.erase(conn);
+    munmap(conn->stack, CONNECTION_STACK_SIZE);
+    delete conn;
+}
+
+/* Runs the connection until it either blocks or terminates */
+static void resume_connection(connection *conn) {
+    current = conn;
+    swapcontext(&loop_ctx, &conn->ctx);
+    current = nullptr;
+
+    if (conn->state == ConnDone)
+        close_connection(conn);
+}
+
+static void start_connection(int fd) {
+    auto conn = new connection;
+    conn->fd = fd;
+    conn->state = ConnRunning;
+    conn->deadline = 0;
+    conn->timed_out = false;
+
+    // Allocate the stack of the connection, with a guard page at its bottom
+    conn->stack = mmap(nullptr, CONNECTION_STACK_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (conn->stack == MAP_FAILED) {
+        perror("Could not allocate connection stack");
+        close(fd);
+        delete conn;
+        return;
+    }
+    mprotect(conn->stack, getpagesize(), PROT_NONE);
+
+    // Register the socket without any interest: the connection declares what
+    // it is waiting for when it gets parked
+    struct epoll_event ev;
+    ev.events = 0;
+    ev.data.ptr = conn;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("Could not register connection to epoll");
+        munmap(conn->stack, CONNECTION_STACK_SIZE);
+        close(fd);
+        delete conn;
+        return;
+    }
+
+    getcontext(&conn->ctx);
+    conn->ctx.uc_stack.ss_sp = conn->stack;
+    conn->ctx.uc_stack.ss_size = CONNECTION_STACK_SIZE;
+    conn->ctx.uc_link = &loop_ctx;
+    makecontext(&conn->ctx, connection_main, 0);
+
+    connections.insert(conn);
+    resume_connection(conn);
+}
+
+/* Resumes every connection parked on its socket past its deadline */
+static void expire_connections() {
+    time_t now = time(nullptr);
+    vector<connection *> expired;
+    for (connection *conn : connections) {
+        if (conn->deadline != 0 && conn->deadline <= now)
+            expired.push_back(conn);
+    }
+    for (connection *conn : expired) {
+        conn->timed_out = true;
+        resume_connection(conn);
+    }
+}
+
+/* Accepts every pending connection on the listening socket */
+static void accept_connections(int listen_sock) {
+    for (;;) {
+        struct sockaddr_in address;
+        socklen_t addr_len = sizeof(address);
+        int fd = accept4(listen_sock, (struct sockaddr *)&address, &addr_len,
+                         SOCK_NONBLOCK);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                perror("Accept failed");
+            return;
+        }
+        start_connection(fd);
+    }
+}
+
+/* Loop of a single worker. Returns once drained (SIGINT) */
+static void worker_loop(int listen_sock, int key_pool_size) {
+    signal(SIGINT, drain_handler);
+    // Every connection of the worker shares the process: a client going away
+    // in the middle of a write must only terminate its own session
+    signal(SIGPIPE, SIG_IGN);
+    start_key_pool(key_pool_size, kex_groups);
+
+    if ((epoll_fd = epoll_create1(0)) < 0) {
+        perror("Could not create epoll instance");
+        exit(EXIT_FAILURE);
+    }
+
+    // Every worker waits on the same listening socket: EPOLLEXCLUSIVE avoids
+    // waking all of them up for a single connection
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = nullptr;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_sock, &ev) < 0) {
+        perror("Could not register listening socket to epoll");
+        exit(EXIT_FAILURE);
+    }
+    bool listening = true;
+
+    io_wait_hook = park_connection;
+
+    struct epoll_event events[MAX_EVENTS];
+    while (!draining || !connections.empty()) {
+        if (draining && listening) {
+            // Stop accepting, but let every open session terminate
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, listen_sock, nullptr);
+            listening = false;
+        }
+
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS,
+                           io_idle_timeout > 0 ? IDLE_CHECK_MS : -1);
+        refresh_key_store();
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait failed");
+            exit(EXIT_FAILURE);
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == nullptr) {
+                accept_connections(listen_sock);
+            } else {
+                resume_connection(
+                    reinterpret_cast<connection *>(events[i].data.ptr));
+            }
+        }
+        if (io_idle_timeout > 0)
+            expire_connections();
+    }
+
+    io_wait_hook = nullptr;
+    close(epoll_fd);
+    print_key_pool_stats();
+}
+
+// Pids of the workers, indexed by slot. Only ever written in place, so that
+// the signal handler can walk it.
+static vector<pid_t> worker_pids;
+static volatile sig_atomic_t shutting_down = 0;
+
+/*
+ * Handler for SIGINT and SIGHUP in the supervisor: forwards them to every
+ * worker, letting them drain or reload their keys
+ */
+static void supervisor_handler(int signum) {
+    if (signum == SIGINT)
+        shutting_down = 1;
+    for (pid_t pid : worker_pids) {
+        if (pid > 0)
+            kill(pid, signum);
+    }
+}
+
+static pid_t spawn_worker(int listen_sock, int key_pool_size) {
+    pid_t res;
+    if ((res = fork()) == -1) {
+        perror("Fork failed");
+    } else if (res == 0) {
+        install_reload_handler();
+        worker_loop(listen_sock, key_pool_size);
+        exit(EXIT_SUCCESS);
+    }
+    return res;
+}
+
+void run_event_workers(int listen_sock, int workers, int key_pool_size) {
+    if (fcntl(listen_sock, F_SETFL, fcntl(listen_sock, F_GETFL) | O_NONBLOCK) <
+        0) {
+        perror("Could not set listening socket as non-blocking");
+        exit(EXIT_FAILURE);
+    }
+
+#ifdef DEBUG
+    // When in debug mode, run the loop in the main process. Should make
+    // debugging easier.
+    (void)workers;
+    (void)spawn_worker;
+    (void)supervisor_handler;
+    worker_loop(listen_sock, key_pool_size);
+#else
+    worker_pids.assign(workers, -1);
+    signal(SIGINT, supervisor_handler);
+    signal(SIGHUP, supervisor_handler);
+
+    for (int i = 0; i < workers; i++) {
+        if ((worker_pids[i] = spawn_worker(listen_sock, key_pool_size)) == -1)
+            exit(EXIT_FAILURE);
+    }
+
+    // The parent only supervises: a worker that died is replaced, until
+    // SIGINT asks every worker to drain and exit
+    int status;
+    pid_t dead;
+    while ((dead = wait(&status)) > 0 || errno == EINTR) {
+        if (dead <= 0)
+            continue;
+
+        for (auto &pid : worker_pids) {
+            if (pid != dead)
+                continue;
+
+            pid = -1;
+            if (!shutting_down &&
+                !(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS)) {
+                cerr << "Worker " << dead << " died, restarting it" << endl;
+                pid = spawn_worker(listen_sock, key_pool_size);
+            }
+        }
+    }
+    cout << "Bye!" << endl;
+#endif
+}
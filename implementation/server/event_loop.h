@@ -0,0 +1,22 @@
+#ifndef event_loop_h
+#define event_loop_h
+
+/*
+ * Event-driven connection engine. Spawns [workers] processes (none in debug
+ * builds, where the calling process runs the loop itself), each running an
+ * epoll loop over the non-blocking listening socket and its own connections.
+ *
+ * Every connection runs the usual blocking session code (authentication and
+ * the request loop) on its own stack: whenever its socket is not ready the
+ * connection is parked, and it is resumed right where it stopped once epoll
+ * reports the socket ready again. The position in the session is therefore the
+ * state of the connection, for every flow of the protocol.
+ *
+ * Every worker keeps its own pool of [key_pool_size] ephemeral key pairs per
+ * group.
+ *
+ * Returns once every worker has terminated.
+ */
+void run_event_workers(int listen_sock, int workers, int key_pool_size);
+
+#endif
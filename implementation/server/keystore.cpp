@@ -0,0 +1,186 @@
+#include "keystore.h"
+#include "../common/errors.h"
+#include <iostream>
+#include <openssl/bio.h>
+#include <openssl/pem.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+
+#if __has_include(<filesystem>)
+#include <filesystem>
+namespace fs = std::filesystem;
+#elif __has_include(<experimental/filesystem>)
+#include <experimental/filesystem>
+namespace fs = std::experimental::filesystem;
+#else
+error "Missing the <filesystem> header."
+#endif
+
+using namespace std;
+
+#define CERTIFICATES_DIR "certificates"
+#define SERVER_CERTIFICATE "server.crt"
+#define SERVER_PRIVATE_KEY "server.key"
+
+static shared_ptr<const KeyStore> current_store;
+static volatile sig_atomic_t reload_requested = 0;
+
+KeyStore::KeyStore()
+    : private_key(nullptr), certificate_pem(nullptr), certificate_len(0) {}
+
+KeyStore::~KeyStore() {
+    for (auto it = users.begin(); it != users.end(); it++) {
+        EVP_PKEY_free(it->second);
+    }
+    EVP_PKEY_free(private_key);
+    delete[] certificate_pem;
+}
+
+EVP_PKEY *KeyStore::find_user(const char *username) const {
+    auto finder = users.find(username);
+    return finder != users.end() ? finder->second : nullptr;
+}
+
+/* Reads a PEM public key from file. Returns nullptr on failure */
+static EVP_PKEY *read_public_key(const fs::path &path) {
+    FILE *fp;
+    if ((fp = fopen(path.c_str(), "r")) == nullptr)
+        return nullptr;
+
+    auto pubkey = PEM_read_PUBKEY(fp, nullptr, 0, nullptr);
+    fclose(fp);
+    return pubkey;
+}
+
+/* Reads the certificate of the server and stores it as PEM */
+static bool read_certificate(KeyStore *store, const fs::path &path) {
+    FILE *fp;
+    if ((fp = fopen(path.c_str(), "r")) == nullptr)
+        return false;
+
+    X509 *certificate = PEM_read_X509(fp, nullptr, 0, nullptr);
+    fclose(fp);
+    if (certificate == nullptr)
+        return false;
+
+    BIO *bio;
+    if ((bio = BIO_new(BIO_s_mem())) == nullptr) {
+        X509_free(certificate);
+        return false;
+    }
+    if (PEM_write_bio_X509(bio, certificate) != 1) {
+        X509_free(certificate);
+        BIO_free(bio);
+        return false;
+    }
+    X509_free(certificate);
+
+    unsigned char *pem;
+    long pem_len;
+    if ((pem_len = BIO_get_mem_data(bio, &pem)) <= 0) {
+        BIO_free(bio);
+        return false;
+    }
+
+    store->certificate_pem = new unsigned char[pem_len];
+    memcpy(store->certificate_pem, pem, pem_len);
+    store->certificate_len = pem_len;
+    BIO_free(bio);
+    return true;
+}
+
+/* Builds a new store from the certificates directory. nullptr on failure */
+static KeyStore *read_key_store() {
+    auto store = new KeyStore();
+    auto dir = fs::path(CERTIFICATES_DIR);
+
+    if (!read_certificate(store, dir / SERVER_CERTIFICATE)) {
+        cerr << "Could not read server's certificate" << endl;
+        delete store;
+        return nullptr;
+    }
+
+    FILE *fp;
+    if ((fp = fopen((dir / SERVER_PRIVATE_KEY).c_str(), "r")) == nullptr) {
+        cerr << "Could not open server's private key" << endl;
+        delete store;
+        return nullptr;
+    }
+    store->private_key = PEM_read_PrivateKey(fp, nullptr, 0, nullptr);
+    fclose(fp);
+    if (store->private_key == nullptr) {
+        cerr << "Could not read server's private key" << endl;
+        delete store;
+        return nullptr;
+    }
+
+    // Every public key in the directory belongs to a registered user
+    error_code ec;
+    for (auto &entry : fs::directory_iterator(dir, ec)) {
+        if (!fs::is_regular_file(entry.path()) ||
+            entry.path().extension() != ".pub")
+            continue;
+
+        auto user = entry.path().stem().string();
+        EVP_PKEY *pubkey;
+        if ((pubkey = read_public_key(entry.path())) == nullptr) {
+            cerr << "Could not read public key of " << user << endl;
+            delete store;
+            return nullptr;
+        }
+        store->users.insert({user, pubkey});
+
+#ifdef DEBUG
+        cout << "Loaded public key for " << user << endl
+             << "Path: " << entry.path().string() << endl
+             << endl;
+#endif
+    }
+    if (ec) {
+        cerr << "Could not list the certificates directory" << endl;
+        delete store;
+        return nullptr;
+    }
+
+    return store;
+}
+
+void load_key_store() {
+    KeyStore *store;
+    if ((store = read_key_store()) == nullptr) {
+        exit(EXIT_FAILURE);
+    }
+    atomic_store(&current_store, shared_ptr<const KeyStore>(store));
+}
+
+shared_ptr<const KeyStore> get_key_store() {
+    return atomic_load(&current_store);
+}
+
+static void reload_handler(int signum) {
+    (void)signum;
+    reload_requested = 1;
+}
+
+void install_reload_handler() {
+    struct sigaction sa = {};
+    sa.sa_handler = reload_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGHUP, &sa, nullptr);
+}
+
+void refresh_key_store() {
+    if (!reload_requested)
+        return;
+    reload_requested = 0;
+
+    KeyStore *store;
+    if ((store = read_key_store()) == nullptr) {
+        cerr << "Reload failed, keeping the current keys" << endl;
+        return;
+    }
+    atomic_store(&current_store, shared_ptr<const KeyStore>(store));
+    cout << "Keys reloaded, " << store->users.size() << " users registered"
+         << endl;
+}
@@ -0,0 +1,55 @@
+#include <map>
+#include <memory>
+#include <openssl/evp.h>
+#include <string>
+
+#ifndef keystore_h
+#define keystore_h
+
+/*
+ * Every credential the server needs during the authentication: the public
+ * keys of the registered users, its own private key and its certificate
+ * (kept as PEM, ready to be sent). Never modified once loaded, so it can be
+ * shared by any number of sessions.
+ */
+class KeyStore {
+  public:
+    // Registered users, by username
+    std::map<std::string, EVP_PKEY *> users;
+    EVP_PKEY *private_key;
+    unsigned char *certificate_pem;
+    long certificate_len;
+
+    KeyStore();
+    ~KeyStore();
+
+    KeyStore(const KeyStore &) = delete;
+    KeyStore &operator=(const KeyStore &) = delete;
+
+    /* Returns the public key of the user, nullptr if not registered */
+    EVP_PKEY *find_user(const char *username) const;
+};
+
+/*
+ * Loads the key store from the certificates directory: every <user>.pub file
+ * registers a user. Aborts the program if the store cannot be loaded.
+ */
+void load_key_store();
+
+/* Returns the current key store. The store lives as long as the reference */
+std::shared_ptr<const KeyStore> get_key_store();
+
+/*
+ * Installs the SIGHUP handler that asks for the key store to be reloaded.
+ * Interrupts blocking system calls, so that the reload is not delayed.
+ */
+void install_reload_handler();
+
+/*
+ * Reloads the key store if it was asked to. Sessions that are running keep
+ * the store they started with; if the new store cannot be loaded, the current
+ * one is kept.
+ */
+void refresh_key_store();
+
+#endif
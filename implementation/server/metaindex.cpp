@@ -0,0 +1,668 @@
+#include "metaindex.h"
+#include "../common/filesource.h"
+#include "../common/utils.h"
+#include "chunkstore.h"
+#include "treestore.h"
+#include "volumes.h"
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <openssl/evp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+// An index starts with this, then with the number of its slots, of files and
+// of bytes in them. The slots follow, each empty or holding an entry, then
+// the order of the entries: the numbers of their slots, sorted by name.
+#define INDEX_MAGIC "FoCindx2"
+#define INDEX_MAGIC_LEN 8
+// Slots of an index at least, which has at least twice as many as entries
+#define INDEX_MIN_SLOTS 64
+// Times an index is opened again, as it was replaced or removed meanwhile
+#define INDEX_OPEN_TRIES 8
+
+struct IndexHeader {
+    char magic[INDEX_MAGIC_LEN];
+    uint32_t slots;
+    uint32_t files;
+    uint64_t bytes;
+};
+
+struct IndexEntry {
+    uint8_t used;
+    uint8_t hashed;
+    uint8_t pad[6];
+    uint64_t size;
+    int64_t mtime;
+    uchar hash[INDEX_HASH_LEN];
+    char name[FNAME_MAX_LEN];
+};
+
+static uint64_t user_quota = 0;
+
+void set_user_quota(uint64_t quota) { user_quota = quota; }
+
+uint64_t get_user_quota() { return user_quota; }
+
+static fs::path index_dir() {
+    return primary_volume() / ".index";
+}
+
+static fs::path index_path(const char *username) {
+    return index_dir() / username;
+}
+
+static size_t index_len(uint32_t slots) {
+    return sizeof(IndexHeader) +
+           (size_t)slots * (sizeof(IndexEntry) + sizeof(uint32_t));
+}
+
+static uint32_t *entry_order(IndexHeader *header, IndexEntry *table) {
+    return reinterpret_cast<uint32_t *>(table + header->slots);
+}
+
+/*
+ * Position in the order of the first entry whose name is not before [name]
+ * or, if [past], after it
+ */
+static uint32_t order_pos(IndexHeader *header, IndexEntry *table,
+                          const char *name, bool past = false) {
+    uint32_t *order = entry_order(header, table);
+    uint32_t *end = order + header->files;
+    if (past) {
+        return upper_bound(order, end, name,
+                           [table](const char *n, uint32_t slot) {
+                               return strcmp(n, table[slot].name) < 0;
+                           }) -
+               order;
+    }
+    return lower_bound(order, end, name,
+                       [table](uint32_t slot, const char *n) {
+                           return strcmp(table[slot].name, n) < 0;
+                       }) -
+           order;
+}
+
+/* FNV-1a hash of a name, which gives the slot the entry of the file goes in */
+static uint64_t name_hash(const char *name) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *name != '\0'; name++) {
+        hash ^= (uchar)*name;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/*
+ * Slot holding the entry of [name] in a table of [slots] slots (a power of
+ * 2), or the empty one it would go in
+ */
+static uint32_t find_slot(const IndexEntry *table, uint32_t slots,
+                          const char *name) {
+    uint32_t i = name_hash(name) & (slots - 1);
+    while (table[i].used && strcmp(table[i].name, name) != 0)
+        i = (i + 1) & (slots - 1);
+    return i;
+}
+
+/* Adds [entry] to the table, replacing the one of the same name if any */
+static void put_entry(IndexHeader *header, IndexEntry *table,
+                      const IndexEntry &entry) {
+    uint32_t i = find_slot(table, header->slots, entry.name);
+    IndexEntry &slot = table[i];
+    if (slot.used) {
+        header->bytes -= slot.size;
+    } else {
+        uint32_t *order = entry_order(header, table);
+        uint32_t pos = order_pos(header, table, entry.name);
+        memmove(order + pos + 1, order + pos,
+                (header->files - pos) * sizeof(uint32_t));
+        order[pos] = i;
+        header->files++;
+    }
+    slot = entry;
+    slot.used = 1;
+    header->bytes += slot.size;
+}
+
+/*
+ * Empties the slot [i]. The entries that come after it in the same run are
+ * moved back into the hole whenever it is on their way, so that no lookup
+ * ever stops short of them.
+ */
+static void erase_slot(IndexHeader *header, IndexEntry *table, uint32_t i) {
+    uint32_t mask = header->slots - 1;
+    uint32_t *order = entry_order(header, table);
+    uint32_t pos = order_pos(header, table, table[i].name);
+    header->files--;
+    memmove(order + pos, order + pos + 1,
+            (header->files - pos) * sizeof(uint32_t));
+    header->bytes -= table[i].size;
+    uint32_t hole = i;
+    for (uint32_t j = (i + 1) & mask; table[j].used; j = (j + 1) & mask) {
+        uint32_t home = name_hash(table[j].name) & mask;
+        // Whether [home] lies cyclically in (hole, j]: if so, it stays
+        bool stays = hole <= j ? (hole < home && home <= j)
+                               : (hole < home || home <= j);
+        if (!stays) {
+            order[order_pos(header, table, table[j].name)] = hole;
+            table[hole] = table[j];
+            hole = j;
+        }
+    }
+    memset(&table[hole], 0, sizeof(IndexEntry));
+}
+
+/*
+ * Sets [entry] to what the file [name] of [username] is now. Returns false
+ * if it is not a file to be indexed.
+ */
+static bool read_entry(const char *username, const string &name,
+                       IndexEntry &entry) {
+    if (name.length() >= FNAME_MAX_LEN || name.rfind(PARTIAL_PREFIX, 0) == 0 ||
+        name.rfind(TREE_PREFIX, 0) == 0 || name == ".gitignore" ||
+        name == ".gitkeep") {
+        return false;
+    }
+
+    fs::path path = get_user_storage_path(const_cast<char *>(username)) / name;
+    FILE *fp = fopen(path.native().c_str(), "r");
+    if (fp == nullptr)
+        return false;
+    struct stat st;
+    if (fstat(fileno(fp), &st) != 0 || !S_ISREG(st.st_mode)) {
+        fclose(fp);
+        return false;
+    }
+    Manifest manifest;
+    auto manifest_res = read_manifest(fp, manifest);
+    fclose(fp);
+    if (manifest_res.is_error)
+        return false;
+
+    memset(&entry, 0, sizeof(entry));
+    entry.used = 1;
+    entry.size = manifest_res.result ? manifest.size : st.st_size;
+    entry.mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    strcpy(entry.name, name.c_str());
+    return true;
+}
+
+/*
+ * Maps the index in [fd], of [st_size] bytes. Returns nullptr if it is not
+ * an index.
+ */
+static IndexHeader *map_index(int fd, off_t st_size, int prot) {
+    if (st_size < (off_t)sizeof(IndexHeader))
+        return nullptr;
+    void *map = mmap(nullptr, st_size, prot, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        return nullptr;
+    auto *header = static_cast<IndexHeader *>(map);
+    if (memcmp(header->magic, INDEX_MAGIC, INDEX_MAGIC_LEN) != 0 ||
+        header->slots < INDEX_MIN_SLOTS ||
+        (header->slots & (header->slots - 1)) != 0 ||
+        (off_t)index_len(header->slots) != st_size) {
+        munmap(map, st_size);
+        return nullptr;
+    }
+    return header;
+}
+
+/*
+ * Writes an index of [entries] at [path], in full under a name of its own
+ * first. An index already there is replaced if [replace] is set, and kept
+ * otherwise: it was built by another session in the meantime.
+ */
+static bool write_index(const fs::path &path,
+                        const vector<IndexEntry> &entries, bool replace) {
+    uint32_t slots = INDEX_MIN_SLOTS;
+    while (slots < 2 * entries.size())
+        slots *= 2;
+    vector<uchar> buf(index_len(slots), 0);
+    auto *header = reinterpret_cast<IndexHeader *>(buf.data());
+    auto *table = reinterpret_cast<IndexEntry *>(buf.data() + sizeof(*header));
+    memcpy(header->magic, INDEX_MAGIC, INDEX_MAGIC_LEN);
+    header->slots = slots;
+    // In the order of their names, each one goes at the end of the order
+    vector<const IndexEntry *> sorted;
+    for (const auto &entry : entries)
+        sorted.push_back(&entry);
+    sort(sorted.begin(), sorted.end(),
+         [](const IndexEntry *a, const IndexEntry *b) {
+             return strcmp(a->name, b->name) < 0;
+         });
+    for (const auto *entry : sorted)
+        put_entry(header, table, *entry);
+
+    string tmp = (path.parent_path() / "tmp-XXXXXX").native();
+    int fd = mkstemp(&tmp[0]);
+    if (fd < 0)
+        return false;
+    size_t done = 0;
+    while (done < buf.size()) {
+        ssize_t n = write(fd, buf.data() + done, buf.size() - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    bool ok = close(fd) == 0 && done == buf.size();
+    if (ok && replace) {
+        ok = rename(tmp.c_str(), path.native().c_str()) == 0;
+    } else if (ok) {
+        ok = link(tmp.c_str(), path.native().c_str()) == 0 || errno == EEXIST;
+    }
+    unlink(tmp.c_str());
+    return ok;
+}
+
+/*
+ * Walks the storage of [username] for the entries of its index. The hash of
+ * an entry of [old] whose file did not change is kept.
+ */
+static void scan_storage(const char *username, const IndexHeader *old,
+                         vector<IndexEntry> &entries) {
+    const auto *old_table = reinterpret_cast<const IndexEntry *>(old + 1);
+    error_code ec;
+    fs::path storage = get_user_storage_path(const_cast<char *>(username));
+    for (const auto &file : fs::directory_iterator(storage, ec)) {
+        IndexEntry entry;
+        if (!read_entry(username, file.path().filename().native(), entry))
+            continue;
+        if (old != nullptr) {
+            const IndexEntry &known =
+                old_table[find_slot(old_table, old->slots, entry.name)];
+            if (known.used && known.hashed && known.size == entry.size &&
+                known.mtime == entry.mtime) {
+                entry.hashed = 1;
+                memcpy(entry.hash, known.hash, INDEX_HASH_LEN);
+            }
+        }
+        entries.push_back(entry);
+    }
+}
+
+/* Whether [entries] are exactly those of the index [header] */
+static bool same_entries(const IndexHeader *header,
+                         const vector<IndexEntry> &entries) {
+    const auto *table = reinterpret_cast<const IndexEntry *>(header + 1);
+    if (header->files != entries.size())
+        return false;
+    for (const auto &entry : entries) {
+        const IndexEntry &known =
+            table[find_slot(table, header->slots, entry.name)];
+        if (!known.used || known.size != entry.size ||
+            known.mtime != entry.mtime)
+            return false;
+    }
+    return true;
+}
+
+void init_meta_index() {
+    error_code ec;
+    fs::create_directories(index_dir(), ec);
+    if (ec) {
+        perror("Could not create the index of the files");
+        exit(EXIT_FAILURE);
+    }
+
+    // No session runs yet: the storage cannot change meanwhile
+    for (const auto &user : list_user_storages()) {
+        const char *username = user.first.c_str();
+        IndexHeader *old = nullptr;
+        struct stat st;
+        int fd = open(index_path(username).native().c_str(), O_RDONLY);
+        if (fd >= 0 && fstat(fd, &st) == 0) {
+            old = map_index(fd, st.st_size, PROT_READ);
+        }
+        vector<IndexEntry> entries;
+        scan_storage(username, old, entries);
+        bool stale = old == nullptr || !same_entries(old, entries);
+        if (old != nullptr)
+            munmap(old, st.st_size);
+        if (fd >= 0)
+            close(fd);
+
+        if (stale && !write_index(index_path(username), entries, true)) {
+            perror("Could not write the index of the files");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/* The index of a user, mapped and locked for as long as it is open */
+class UserIndex {
+  public:
+    UserIndex(const char *username) : username(username), fd(-1) {}
+    ~UserIndex() { release(); }
+
+    /* Opens the index with the lock [lock] of flock(), building it first if
+     * it is missing */
+    bool open(int lock);
+
+    /* Adds [entry], making room for it first if need be */
+    bool put(const IndexEntry &entry);
+
+    /* Entry of [name], or nullptr if there is none */
+    IndexEntry *find(const char *name) {
+        IndexEntry &entry = table()[find_slot(table(), header->slots, name)];
+        return entry.used ? &entry : nullptr;
+    }
+
+    void erase(IndexEntry *entry) {
+        erase_slot(header, table(), entry - table());
+    }
+
+    /* Removes the index altogether, for it to be built again */
+    void drop() {
+        unlink(index_path(username).native().c_str());
+        release();
+    }
+
+    IndexEntry *table() { return reinterpret_cast<IndexEntry *>(header + 1); }
+
+    IndexHeader *header;
+
+  private:
+    void release() {
+        if (fd >= 0) {
+            munmap(header, index_len(header->slots));
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    const char *username;
+    int fd;
+};
+
+bool UserIndex::open(int lock) {
+    fs::path path = index_path(username);
+    for (int i = 0; i < INDEX_OPEN_TRIES; i++) {
+        fd = ::open(path.native().c_str(), O_RDWR);
+        if (fd < 0) {
+            vector<IndexEntry> entries;
+            if (errno != ENOENT)
+                return false;
+            scan_storage(username, nullptr, entries);
+            if (!write_index(path, entries, false))
+                return false;
+            continue;
+        }
+
+        // A file replaced (or dropped) between the open and the lock is not
+        // the index anymore
+        struct stat st;
+        if (flock(fd, lock) != 0 || fstat(fd, &st) != 0) {
+            close(fd);
+            fd = -1;
+            return false;
+        }
+        if (st.st_nlink == 0) {
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        header = map_index(fd, st.st_size, PROT_READ | PROT_WRITE);
+        if (header == nullptr) {
+            unlink(path.native().c_str());
+            close(fd);
+            fd = -1;
+            continue;
+        }
+        return true;
+    }
+    fd = -1;
+    return false;
+}
+
+bool UserIndex::put(const IndexEntry &entry) {
+    if (find(entry.name) != nullptr || 2 * (header->files + 1) <= header->slots) {
+        put_entry(header, table(), entry);
+        return true;
+    }
+
+    // The table doubles in a new file, which takes the place of this one
+    // while both are locked: those waiting for this one then see it replaced
+    fs::path path = index_path(username);
+    uint32_t slots = 2 * header->slots;
+    string tmp = (path.parent_path() / "tmp-XXXXXX").native();
+    int new_fd = mkstemp(&tmp[0]);
+    if (new_fd < 0)
+        return false;
+    void *map = MAP_FAILED;
+    if (flock(new_fd, LOCK_EX) == 0 &&
+        ftruncate(new_fd, index_len(slots)) == 0) {
+        map = mmap(nullptr, index_len(slots), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, new_fd, 0);
+    }
+    if (map == MAP_FAILED) {
+        close(new_fd);
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    auto *new_header = static_cast<IndexHeader *>(map);
+    auto *new_table = reinterpret_cast<IndexEntry *>(new_header + 1);
+    memcpy(new_header->magic, INDEX_MAGIC, INDEX_MAGIC_LEN);
+    new_header->slots = slots;
+    uint32_t *order = entry_order(header, table());
+    for (uint32_t i = 0; i < header->files; i++)
+        put_entry(new_header, new_table, table()[order[i]]);
+    put_entry(new_header, new_table, entry);
+
+    if (rename(tmp.c_str(), path.native().c_str()) != 0) {
+        munmap(map, index_len(slots));
+        close(new_fd);
+        unlink(tmp.c_str());
+        return false;
+    }
+    release();
+    fd = new_fd;
+    header = new_header;
+    return true;
+}
+
+void index_file(const char *username, const string &name) {
+    IndexEntry entry;
+    bool exists = read_entry(username, name, entry);
+    UserIndex index(username);
+    if (!index.open(LOCK_EX))
+        return;
+    if (!exists) {
+        IndexEntry *known = index.find(name.c_str());
+        if (known != nullptr)
+            index.erase(known);
+    } else if (!index.put(entry)) {
+        index.drop();
+    }
+}
+
+void unindex_file(const char *username, const string &name) {
+    UserIndex index(username);
+    if (!index.open(LOCK_EX))
+        return;
+    IndexEntry *entry = index.find(name.c_str());
+    if (entry != nullptr)
+        index.erase(entry);
+}
+
+void reindex_file(const char *username, const string &from,
+                  const string &to) {
+    IndexEntry entry;
+    bool exists = read_entry(username, to, entry);
+    UserIndex index(username);
+    if (!index.open(LOCK_EX))
+        return;
+
+    // A rename keeps the content, and its hash along with it
+    IndexEntry *known = index.find(from.c_str());
+    if (known != nullptr) {
+        if (exists && known->hashed && known->size == entry.size) {
+            entry.hashed = 1;
+            memcpy(entry.hash, known->hash, INDEX_HASH_LEN);
+        }
+        index.erase(known);
+    }
+    if (exists && !index.put(entry)) {
+        index.drop();
+    }
+}
+
+/* Computes the hash of the content of the file at [path] */
+static bool hash_file(const fs::path &path, uchar *hash) {
+    FILE *fp = fopen(path.native().c_str(), "r");
+    if (fp == nullptr)
+        return false;
+    Manifest manifest;
+    auto manifest_res = read_manifest(fp, manifest);
+    if (manifest_res.is_error) {
+        fclose(fp);
+        return false;
+    }
+    FileSource *source = manifest_res.result
+                             ? open_manifest_source(manifest, 0, -1)
+                             : open_source(fp, SourceStdio);
+
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    bool ok = ctx != nullptr && EVP_DigestInit(ctx, get_hash_type()) == 1;
+    vector<uchar> buf(DEFAULT_CHUNK_SIZE);
+    while (ok && !source->at_end()) {
+        blen len;
+        auto next_res = source->next(buf.data(), buf.size(), len);
+        ok = !next_res.is_error &&
+             EVP_DigestUpdate(ctx, next_res.result, len) == 1;
+    }
+    ok = ok && EVP_DigestFinal(ctx, hash, nullptr) == 1;
+    EVP_MD_CTX_free(ctx);
+    delete source;
+    fclose(fp);
+    return ok;
+}
+
+Maybe<bool> stat_file(const char *username, const string &name,
+                      FileMeta &meta) {
+    Maybe<bool> res;
+    IndexEntry entry;
+    {
+        UserIndex index(username);
+        if (!index.open(LOCK_SH)) {
+            res.set_error("Error - Could not read the index of your files");
+            return res;
+        }
+        IndexEntry *known = index.find(name.c_str());
+        if (known == nullptr) {
+            res.set_result(false);
+            return res;
+        }
+        entry = *known;
+    }
+
+    // The file is read without the index locked: its hash is only kept if
+    // it did not change in the meantime
+    if (!entry.hashed) {
+        fs::path path =
+            get_user_storage_path(const_cast<char *>(username)) / name;
+        if (!hash_file(path, entry.hash)) {
+            res.set_error("Error - File is not readable");
+            return res;
+        }
+        entry.hashed = 1;
+        IndexEntry now;
+        UserIndex index(username);
+        if (read_entry(username, name, now) && now.size == entry.size &&
+            now.mtime == entry.mtime && index.open(LOCK_EX)) {
+            IndexEntry *known = index.find(name.c_str());
+            if (known != nullptr && known->size == entry.size &&
+                known->mtime == entry.mtime) {
+                known->hashed = 1;
+                memcpy(known->hash, entry.hash, INDEX_HASH_LEN);
+            }
+        }
+    }
+
+    meta.size = entry.size;
+    meta.mtime = entry.mtime;
+    meta.hashed = entry.hashed;
+    memcpy(meta.hash, entry.hash, INDEX_HASH_LEN);
+    res.set_result(true);
+    return res;
+}
+
+Maybe<bool> get_usage(const char *username, uint64_t &bytes,
+                      uint32_t &files) {
+    Maybe<bool> res;
+    UserIndex index(username);
+    if (!index.open(LOCK_SH)) {
+        res.set_error("Error - Could not read the index of your files");
+        return res;
+    }
+    bytes = index.header->bytes;
+    files = index.header->files;
+    res.set_result(true);
+    return res;
+}
+
+Maybe<bool> check_quota(const char *username, uint64_t adding,
+                        uint64_t removing) {
+    Maybe<bool> res;
+    if (user_quota == 0) {
+        res.set_result(true);
+        return res;
+    }
+    uint64_t bytes;
+    uint32_t files;
+    auto usage_res = get_usage(username, bytes, files);
+    if (usage_res.is_error) {
+        return usage_res;
+    }
+    if (bytes - min(bytes, removing) + adding > user_quota) {
+        res.set_error("Error - Not enough space left for the file");
+        return res;
+    }
+    res.set_result(true);
+    return res;
+}
+
+Maybe<bool> list_index(const char *username, string &after,
+                       bool (*match)(const char *name, const char *arg),
+                       const char *arg, vector<uchar> &names,
+                       size_t max_len) {
+    Maybe<bool> res;
+    UserIndex index(username);
+    if (!index.open(LOCK_SH)) {
+        res.set_error("Error - Could not list your files");
+        return res;
+    }
+
+    // From the first name past [after] on, in the order of the index
+    IndexEntry *table = index.table();
+    uint32_t *order = entry_order(index.header, table);
+    size_t len = 0;
+    for (uint32_t i = order_pos(index.header, table, after.c_str(), true);
+         i < index.header->files; i++) {
+        const char *name = table[order[i]].name;
+        if (!match(name, arg))
+            continue;
+        size_t name_len = strnlen(name, FNAME_MAX_LEN - 1);
+        if (len + name_len + 1 > max_len) {
+            res.set_result(true);
+            return res;
+        }
+        names.insert(names.end(), name, name + name_len);
+        names.push_back('\0');
+        len += name_len + 1;
+        after.assign(name, name_len);
+    }
+    res.set_result(false);
+    return res;
+}
@@ -0,0 +1,100 @@
+#include "../common/maybe.h"
+#include "../common/types.h"
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#ifndef metaindex_h
+#define metaindex_h
+
+/*
+ * Index of the files of each user: the name, size, modification time and
+ * hash of every one of them, so that listing them, telling their size or how
+ * much a user stores takes no walk of the storage.
+ *
+ * The index of a user is a hash table in a file of its own, next to the
+ * storage of the users, along with the order of the names of its entries: a
+ * page of a listing starts right where the previous one stopped. It is
+ * mapped in memory by whoever reads or changes it, under a lock of the file:
+ * it is shared by the processes and threads of all the sessions alike.
+ * Actions changing a file of the user change its entry once done. The index
+ * is checked against the storage when the server starts, and built again
+ * wherever it does not match: the files may have changed while the server
+ * was not running, or while it failed to keep up.
+ * One that is missing is built again as soon as it is needed.
+ *
+ * Files whose name does not fit an upload (FNAME_MAX_LEN) are not indexed,
+ * nor are the uploads in progress, nor the trees of the files.
+ */
+
+// Size of the hash of a file (get_hash_type())
+#define INDEX_HASH_LEN FILE_HASH_LEN
+
+/* What the index knows of a file */
+struct FileMeta {
+    // Size of the content of the file, whether it is kept as it is or as
+    // its chunks
+    uint64_t size;
+    // Time of the last change, in nanoseconds since the epoch
+    int64_t mtime;
+    // The hash of the content, when known: it is only computed when asked
+    // for, then kept for as long as the file does not change
+    bool hashed;
+    uchar hash[INDEX_HASH_LEN];
+};
+
+/* Bytes each user may store at most, 0 for no limit (the default) */
+void set_user_quota(uint64_t quota);
+uint64_t get_user_quota();
+
+/*
+ * Checks the index of every user against its storage, building it again if
+ * anything changed. To be called before any session starts, after the chunk
+ * store is opened. Aborts the program on failure.
+ */
+void init_meta_index();
+
+/*
+ * Sets the entry of the file [name] of [username] to what the file is now,
+ * adding it if there was none. Called once the file is stored (or replaced).
+ */
+void index_file(const char *username, const std::string &name);
+
+/* Removes the entry of the file [name] of [username], once it is removed */
+void unindex_file(const char *username, const std::string &name);
+
+/* Moves the entry of [from] to [to], once the file is renamed */
+void reindex_file(const char *username, const std::string &from,
+                  const std::string &to);
+
+/*
+ * Sets [meta] to the entry of the file [name] of [username], computing its
+ * hash first if it is not known yet. Returns false if there is no such file.
+ */
+Maybe<bool> stat_file(const char *username, const std::string &name,
+                      FileMeta &meta);
+
+/* Bytes stored by [username], and the number of files they are in */
+Maybe<bool> get_usage(const char *username, uint64_t &bytes, uint32_t &files);
+
+/*
+ * Fails if [username] cannot store [adding] bytes more once [removing] bytes
+ * of the files it stores are gone, given the quota
+ */
+Maybe<bool> check_quota(const char *username, uint64_t adding,
+                        uint64_t removing);
+
+/*
+ * Appends to [names] the names of the files of [username] matched by
+ * [match], each followed by a 0, in the order of their bytes from the first
+ * one past [after] on, as long as they fit in [max_len] bytes. Sets [after]
+ * to the last one appended, and returns whether any is left. As they go by
+ * name, the pages of a listing neither skip nor repeat a file that is there
+ * all along, however the others change in between.
+ */
+Maybe<bool> list_index(const char *username, std::string &after,
+                       bool (*match)(const char *name, const char *arg),
+                       const char *arg, std::vector<uchar> &names,
+                       size_t max_len);
+
+#endif
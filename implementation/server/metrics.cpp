@@ -0,0 +1,338 @@
+#include "metrics.h"
+#include "../common/utils.h"
+#include <arpa/inet.h>
+#include <atomic>
+#include <errno.h>
+#include <fcntl.h>
+#include <iomanip>
+#include <iostream>
+#include <netinet/in.h>
+#include <new>
+#include <poll.h>
+#include <signal.h>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+using namespace std;
+
+static_assert(atomic<uint64_t>::is_always_lock_free,
+              "The counters are shared between processes");
+
+// Upper bounds of the buckets of the latency histograms, in nanoseconds. One
+// more bucket holds anything slower.
+static const uint64_t bucket_bounds[] = {
+    100000,     250000,     500000,     1000000,     2500000,    5000000,
+    10000000,   25000000,   50000000,   100000000,   250000000,  500000000,
+    1000000000, 2500000000, 5000000000, 10000000000, 30000000000};
+#define BUCKETS (sizeof(bucket_bounds) / sizeof(bucket_bounds[0]) + 1)
+
+/* Requests, named as in the metrics */
+static const struct {
+    mtypes type;
+    const char *name;
+} request_names[] = {{UploadReq, "upload"},
+                {DownloadReq, "download"},
+                {DeleteReq, "delete"},
+                {DeleteBatchReq, "delete_batch"},
+                {ListReq, "list"},
+                {InfoReq, "info"},
+                {VerifyReq, "verify"},
+                {RenameReq, "rename"},
+                {RenameBatchReq, "rename_batch"},
+                {UpdateReq, "update"},
+                {MuxStart, "mux"},
+                {RekeyReq, "rekey"},
+                {LogoutReq, "logout"}};
+#define REQUESTS (sizeof(request_names) / sizeof(request_names[0]))
+
+struct Histogram {
+    atomic<uint64_t> buckets[BUCKETS];
+    atomic<uint64_t> sum;
+    atomic<uint64_t> count;
+
+    void record(uint64_t ns) {
+        size_t i = 0;
+        while (i < BUCKETS - 1 && ns > bucket_bounds[i])
+            i++;
+        buckets[i].fetch_add(1, memory_order_relaxed);
+        sum.fetch_add(ns, memory_order_relaxed);
+        count.fetch_add(1, memory_order_relaxed);
+    }
+};
+
+struct RequestMetrics {
+    Histogram latency;
+    // Requests answered with an Error
+    atomic<uint64_t> errors;
+    // Nanoseconds spent by the stages of the transfers
+    atomic<uint64_t> disk;
+    atomic<uint64_t> cipher;
+    atomic<uint64_t> socket;
+    atomic<uint64_t> chunks;
+};
+
+struct Metrics {
+    atomic<int64_t> sessions_active;
+    atomic<uint64_t> sessions;
+    atomic<uint64_t> sessions_failed;
+    Histogram handshakes;
+    atomic<uint64_t> handshakes_failed;
+    atomic<uint64_t> bytes_received;
+    atomic<uint64_t> bytes_sent;
+    RequestMetrics requests[REQUESTS];
+};
+
+static Metrics *metrics = nullptr;
+
+// Written by the handler of SIGUSR1, read by the thread dumping the metrics
+static int dump_pipe[2] = {-1, -1};
+
+static void count_bytes(size_t len, bool written) {
+    (written ? metrics->bytes_sent : metrics->bytes_received)
+        .fetch_add(len, memory_order_relaxed);
+}
+
+void init_metrics() {
+    // Shared with every process forked from now on
+    void *map = mmap(nullptr, sizeof(Metrics), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        perror("Could not map the metrics");
+        exit(EXIT_FAILURE);
+    }
+    // The mapping is zeroed, as are the counters
+    metrics = new (map) Metrics();
+    io_count_hook = count_bytes;
+}
+
+void session_started() {
+    metrics->sessions_active.fetch_add(1, memory_order_relaxed);
+    metrics->sessions.fetch_add(1, memory_order_relaxed);
+}
+
+void session_ended(bool failed) {
+    metrics->sessions_active.fetch_sub(1, memory_order_relaxed);
+    if (failed)
+        metrics->sessions_failed.fetch_add(1, memory_order_relaxed);
+}
+
+void record_handshake(uint64_t ns, bool failed) {
+    metrics->handshakes.record(ns);
+    if (failed)
+        metrics->handshakes_failed.fetch_add(1, memory_order_relaxed);
+}
+
+void record_request(mtypes type, uint64_t ns, Session &session) {
+    size_t i = 0;
+    while (i < REQUESTS && request_names[i].type != type)
+        i++;
+    if (i == REQUESTS)
+        return;
+
+    RequestMetrics &request = metrics->requests[i];
+    request.latency.record(ns);
+    if (session.errors_sent > 0)
+        request.errors.fetch_add(1, memory_order_relaxed);
+    request.disk.fetch_add(session.times.disk.exchange(0),
+                           memory_order_relaxed);
+    request.cipher.fetch_add(session.times.cipher.exchange(0),
+                             memory_order_relaxed);
+    request.socket.fetch_add(session.times.socket.exchange(0),
+                             memory_order_relaxed);
+    request.chunks.fetch_add(session.times.chunks.exchange(0),
+                             memory_order_relaxed);
+    session.errors_sent = 0;
+}
+
+static void print_header(ostream &out, const char *name, const char *type,
+                         const char *help) {
+    out << "# HELP " << name << " " << help << "\n"
+        << "# TYPE " << name << " " << type << "\n";
+}
+
+static void print_histogram(ostream &out, const char *name,
+                            const string &labels, const Histogram &h) {
+    string sep = labels.empty() ? "" : ",";
+    uint64_t count = 0;
+    for (size_t i = 0; i < BUCKETS; i++) {
+        count += h.buckets[i].load(memory_order_relaxed);
+        out << name << "_bucket{" << labels << sep << "le=\"";
+        if (i < BUCKETS - 1)
+            out << bucket_bounds[i] / 1e9;
+        else
+            out << "+Inf";
+        out << "\"} " << count << "\n";
+    }
+    string braces = labels.empty() ? "" : "{" + labels + "}";
+    out << name << "_sum" << braces << " "
+        << h.sum.load(memory_order_relaxed) / 1e9 << "\n"
+        << name << "_count" << braces << " "
+        << h.count.load(memory_order_relaxed) << "\n";
+}
+
+void print_metrics(ostream &out) {
+    out << setprecision(9);
+
+    print_header(out, "foc_sessions_active", "gauge", "Sessions being served");
+    out << "foc_sessions_active " << metrics->sessions_active << "\n";
+    print_header(out, "foc_sessions_total", "counter", "Sessions started");
+    out << "foc_sessions_total " << metrics->sessions << "\n";
+    print_header(out, "foc_sessions_failed_total", "counter",
+                 "Sessions ended by an error rather than a logout");
+    out << "foc_sessions_failed_total " << metrics->sessions_failed << "\n";
+
+    print_header(out, "foc_handshake_duration_seconds", "histogram",
+                 "Time taken by the handshakes, failed ones included");
+    print_histogram(out, "foc_handshake_duration_seconds", "",
+                    metrics->handshakes);
+    print_header(out, "foc_handshakes_failed_total", "counter",
+                 "Handshakes that failed");
+    out << "foc_handshakes_failed_total " << metrics->handshakes_failed
+        << "\n";
+
+    print_header(out, "foc_received_bytes_total", "counter",
+                 "Bytes read from the sockets of the sessions");
+    out << "foc_received_bytes_total " << metrics->bytes_received << "\n";
+    print_header(out, "foc_sent_bytes_total", "counter",
+                 "Bytes written to the sockets of the sessions");
+    out << "foc_sent_bytes_total " << metrics->bytes_sent << "\n";
+
+    print_header(out, "foc_request_duration_seconds", "histogram",
+                 "Time taken by the requests");
+    for (size_t i = 0; i < REQUESTS; i++) {
+        print_histogram(out, "foc_request_duration_seconds",
+                        string("op=\"") + request_names[i].name + "\"",
+                        metrics->requests[i].latency);
+    }
+    print_header(out, "foc_request_errors_total", "counter",
+                 "Requests answered with an error");
+    for (size_t i = 0; i < REQUESTS; i++) {
+        out << "foc_request_errors_total{op=\"" << request_names[i].name << "\"} "
+            << metrics->requests[i].errors << "\n";
+    }
+    print_header(out, "foc_transfer_stage_seconds_total", "counter",
+                 "Time spent by the stages of the transfers of the requests");
+    for (size_t i = 0; i < REQUESTS; i++) {
+        const RequestMetrics &request = metrics->requests[i];
+        const pair<const char *, const atomic<uint64_t> &> stages[] = {
+            {"disk", request.disk},
+            {"cipher", request.cipher},
+            {"socket", request.socket}};
+        for (const auto &stage : stages) {
+            out << "foc_transfer_stage_seconds_total{op=\"" << request_names[i].name
+                << "\",stage=\"" << stage.first << "\"} "
+                << stage.second.load(memory_order_relaxed) / 1e9 << "\n";
+        }
+    }
+    print_header(out, "foc_transfer_chunks_total", "counter",
+                 "Chunks transferred by the requests");
+    for (size_t i = 0; i < REQUESTS; i++) {
+        out << "foc_transfer_chunks_total{op=\"" << request_names[i].name << "\"} "
+            << metrics->requests[i].chunks << "\n";
+    }
+}
+
+static void dump_handler(int signum) {
+    (void)signum;
+    int saved_errno = errno;
+    char c = 0;
+    // Nothing to do if a dump is pending already
+    if (write(dump_pipe[1], &c, 1) < 0) {
+    }
+    errno = saved_errno;
+}
+
+/* Answers a single HTTP request on [client] with the metrics, then closes it */
+static void serve_scrape(int client) {
+    // Whatever is asked, the answer is the same: the request is only read so
+    // that the client does not see its connection reset
+    char request[4096];
+    struct pollfd pfd = {client, POLLIN, 0};
+    if (poll(&pfd, 1, 1000) > 0 && read(client, request, sizeof(request))) {
+    }
+
+    ostringstream body;
+    print_metrics(body);
+    string content = body.str();
+    string response = "HTTP/1.0 200 OK\r\n"
+                      "Content-Type: text/plain; version=0.0.4\r\n"
+                      "Content-Length: " +
+                      to_string(content.length()) + "\r\n\r\n" + content;
+    for (size_t sent = 0; sent < response.length();) {
+        ssize_t len = send(client, response.data() + sent,
+                           response.length() - sent, MSG_NOSIGNAL);
+        if (len <= 0 && errno != EINTR)
+            break;
+        if (len > 0)
+            sent += len;
+    }
+    close(client);
+}
+
+static void metrics_main(int listen_sock) {
+    struct pollfd pfds[2] = {{dump_pipe[0], POLLIN, 0},
+                             {listen_sock, POLLIN, 0}};
+    for (;;) {
+        if (poll(pfds, listen_sock >= 0 ? 2 : 1, -1) < 0)
+            continue;
+
+        if (pfds[0].revents & POLLIN) {
+            char buf[64];
+            while (read(dump_pipe[0], buf, sizeof(buf)) > 0)
+                ;
+            print_metrics(cout);
+            cout << flush;
+        }
+        if (listen_sock >= 0 && (pfds[1].revents & POLLIN)) {
+            int client = accept(listen_sock, nullptr, nullptr);
+            if (client >= 0)
+                serve_scrape(client);
+        }
+    }
+}
+
+void start_metrics(int port) {
+    if (pipe(dump_pipe) != 0 || fcntl(dump_pipe[0], F_SETFL, O_NONBLOCK) != 0 ||
+        fcntl(dump_pipe[1], F_SETFL, O_NONBLOCK) != 0) {
+        perror("Could not create the pipe of the metrics");
+        exit(EXIT_FAILURE);
+    }
+
+    int listen_sock = -1;
+    if (port > 0) {
+        struct sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(port);
+        int enable_sockopt = 1;
+        if ((listen_sock = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+            setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &enable_sockopt,
+                       sizeof(enable_sockopt)) < 0 ||
+            bind(listen_sock, (struct sockaddr *)&address, sizeof(address)) <
+                0 ||
+            listen(listen_sock, SOMAXCONN) < 0) {
+            perror("Could not listen on the port of the metrics");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    struct sigaction sa = {};
+    sa.sa_handler = dump_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, nullptr);
+
+    // No signal may be delivered to the thread, whose blocking calls are
+    // never meant to be interrupted: the engines rely on getting them
+    sigset_t mask, old_mask;
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+    thread(metrics_main, listen_sock).detach();
+    pthread_sigmask(SIG_SETMASK, &old_mask, nullptr);
+}
@@ -0,0 +1,53 @@
+#include "../common/session.h"
+#include "../common/types.h"
+#include <ostream>
+#include <stdint.h>
+
+#ifndef metrics_h
+#define metrics_h
+
+/*
+ * Counters and latency histograms of the server: the sessions, the
+ * handshakes, the bytes on the sockets and, for every kind of request, how
+ * many were served, how long they took and how much of it went into the disk,
+ * the cipher and the socket stages of their transfers.
+ *
+ * They live in memory shared by every process and thread of the server alike,
+ * whatever the engine, mapped before any worker is forked: each of them adds
+ * to the very same counters, with no collecting afterwards.
+ *
+ * They are written in the Prometheus text format, on SIGUSR1 to the standard
+ * output, or to whoever asks the local port they are served on, if any.
+ */
+
+/*
+ * Maps the counters and starts counting the bytes on the sockets. To be called
+ * before any session starts or worker is forked. Aborts the program on
+ * failure.
+ */
+void init_metrics();
+
+/*
+ * Starts the thread dumping the metrics on SIGUSR1, and serving them over HTTP
+ * on 127.0.0.1:[port] unless it is 0. Aborts the program on failure.
+ */
+void start_metrics(int port);
+
+/* A session started (ended, [failed] if it did not end with a logout) */
+void session_started();
+void session_ended(bool failed);
+
+/* A handshake took [ns] nanoseconds to complete, or to fail */
+void record_handshake(uint64_t ns, bool failed);
+
+/*
+ * The request that started with a message of [type] took [ns] nanoseconds.
+ * Takes the times of its transfers and its errors from [session], which are
+ * back to zero afterwards.
+ */
+void record_request(mtypes type, uint64_t ns, Session &session);
+
+/* Writes every metric in the Prometheus text format */
+void print_metrics(std::ostream &out);
+
+#endif
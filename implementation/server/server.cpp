@@ -1,17 +1,38 @@
 #include "../common/errors.h"
-#include "../common/seq.h"
+#include "../common/keypool.h"
+#include "../common/mux.h"
+#include "../common/session.h"
+#include "../common/trace.h"
 #include "../common/types.h"
 #include "../common/utils.h"
 #include "actions/delete.h"
 #include "actions/download.h"
+#include "actions/info.h"
 #include "actions/list.h"
 #include "actions/logout.h"
+#include "actions/rekey.h"
 #include "actions/rename.h"
+#include "actions/update.h"
 #include "actions/upload.h"
+#include "actions/verify.h"
 #include "authentication.h"
+#include "chunkstore.h"
+#include "event_loop.h"
+#include "keystore.h"
+#include "metaindex.h"
+#include "metrics.h"
+#include "tickets.h"
+#include "treestore.h"
+#include "server.h"
+#include "volumes.h"
+#include "worker_pool.h"
+#include <chrono>
 #include <csignal>
+#include <errno.h>
 #include <iostream>
+#include <memory>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <openssl/bio.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -21,127 +42,510 @@
 #include <wait.h>
 
 #define PORT 8080
+// Clients waiting for a worker in pool mode
+#define DEFAULT_QUEUE_CAP 64
+// Ephemeral key pairs kept ready for each key exchange group
+#define DEFAULT_KEY_POOL_SIZE 16
+// Seconds after which a resumption ticket expires
+#define DEFAULT_TICKET_LIFETIME 3600
+// Seconds an event-driven connection may wait on its client
+#define DEFAULT_IDLE_TIMEOUT 300
 
 using namespace std;
+using namespace std::chrono;
+
+enum engine { EngineFork, EngineEvent, EnginePool };
 
 pid_t server = -1;
-int client_sock;
-unsigned char *shared_key;
-char *username;
+
+// Largest chunk size accepted from the clients
+unsigned int max_chunk_size = DEFAULT_CHUNK_SIZE;
+// Threads encrypting (decrypting) the chunks of each transfer
+int cipher_threads = 1;
+// How the files downloaded by the clients are read
+source_backend read_backend = SourceStdio;
+// Disk operations of each transfer in flight at once, 0 for none
+int disk_depth = 0;
+// Compression of the chunks allowed to the clients
+compression_algo compression = CompressZlib;
+
+void print_key_pool_stats() {
+    auto stats = get_key_pool_stats();
+    cout << "Key pool: " << stats.hits << " hits, " << stats.misses
+         << " misses" << endl;
+}
 
 /* Handler for SIGINT. Gracefully shuts down the server by:
  *     - waiting for every child to terminate (we assume that child processes
  *       will eventually terminate)
  */
 void signal_handler(int signum) {
+    (void)signum;
 #ifdef NDEBUG
     if (server == getpid()) {
         cout << "Waiting for every child process to terminate... " << endl;
 
         while (wait(NULL) > 0)
             ;
+        print_key_pool_stats();
         cout << "Bye!" << endl;
 
         exit(EXIT_SUCCESS);
     }
 #endif
+}
 
-    if (signum == SIGUSR1) {
-        // Check whether we are exiting from a user-requested exit, or
-        // due to a wraparound happening during some other action.
-        // In the latter case, we need to receive the header of the logout
-        if (seq_num > SEQ_MAX_THRESHOLD) {
-            auto header_res = get_mtype(client_sock);
-            if (header_res.is_error || header_res.result != LogoutReq) {
-                handle_errors();
-            }
-        }
-
-        logout(client_sock, shared_key);
-        delete[] username;
-        explicit_bzero(shared_key, get_symmetric_key_length());
-        delete[] shared_key;
-        close(client_sock);
-        exit(EXIT_SUCCESS);
-    }
+static uint64_t elapsed_ns(steady_clock::time_point start) {
+    return duration_cast<nanoseconds>(steady_clock::now() - start).count();
 }
 
-/* Server loop for the client to send requests to the server */
-void serve_client() {
+static void serve_requests(Session &session, bool &logged_out,
+                           bool stream = false);
+
+/*
+ * Runs a whole session with the client on sock: the authentication protocol
+ * first, then the request loop. Returns once the client has logged out or the
+ * connection dropped, errors are thrown through handle_errors. The socket is
+ * closed in any case.
+ */
+void serve_session(int sock) {
+    Session session(sock, RoleServer);
     int key_len;
 
     key_len = get_symmetric_key_length();
 
+    session.chunk_size = max_chunk_size;
+    session.cipher_threads = cipher_threads;
+    session.read_backend = read_backend;
+    session.disk_depth = disk_depth;
+    session.compression = compression;
+    session_started();
+    auto start = steady_clock::now();
     tuple<char *, unsigned char *> auth_res;
     try {
-        auth_res = authenticate(client_sock, key_len);
+        auth_res = authenticate(session.sock, key_len, session.chunk_size,
+                                session.compression, session.suite);
+    } catch (char const *) {
+        record_handshake(elapsed_ns(start), true);
+        session_ended(true);
+        throw;
+    }
+    record_handshake(elapsed_ns(start), false);
 
-        username = get<0>(auth_res);
-        shared_key = get<1>(auth_res);
+    session.username = get<0>(auth_res);
+    session.set_key(get<1>(auth_res));
 
 #ifdef DEBUG
-        cout << "Shared key: ";
-        print_debug(shared_key, key_len);
-        cout << endl;
+    cout << "Shared key: ";
+    print_debug(session.key, key_len);
+    cout << endl;
 #endif
 
-        // Server loop
-        for (;;) {
-            auto header_res = get_mtype(client_sock);
-            if (header_res.is_error)
-                continue;
+    // Server loop
+    bool logged_out = false;
+    try {
+        serve_requests(session, logged_out);
+    } catch (char const *) {
+        session_ended(true);
+        throw;
+    }
+    session_ended(!logged_out);
+}
+
+/*
+ * Serves the streams the client opens on [session] (see mux.h), its MuxStart
+ * read, until it ends the multiplexing.
+ */
+static void multiplex(Session &session) {
+    seqnum epoch = session.recv_seq;
+    vector<unsigned char> pt;
+    open_message(session, MuxStart, pt, 0);
+
+    // The streams are served by threads blocking on their sockets, which
+    // would stall every other connection of an event-driven worker
+    if (io_wait_hook != nullptr) {
+        send_error_response(session,
+                            "Multiplexing is not available on this server");
+        return;
+    }
 
-            switch (header_res.result) {
-            case UploadReq:
-                upload(client_sock, shared_key, username);
-                break;
-            case DownloadReq:
-                download(client_sock, shared_key, username);
-                break;
-            case DeleteReq:
-                delete_file(client_sock, shared_key, username);
-                break;
-            case ListReq:
-                list_files(client_sock, shared_key, username);
-                break;
-            case RenameReq:
-                rename(client_sock, shared_key, username);
-                break;
-            case LogoutReq:
-                kill(getpid(), SIGUSR1);
-                break;
-            default:
+    Mux mux(session, RoleServer);
+    mux.serve(epoch, [](Session *stream) {
+        unique_ptr<Session> owned(stream);
+        bool logged_out = false;
+        try {
+            serve_requests(*stream, logged_out, true);
+        } catch (char const *ex) {
+            // Only the stream is over, the rest of the session goes on
 #ifdef DEBUG
-                cout << "Invalid header was received from client" << endl;
+            cerr << "Error on a stream: " << ex << endl;
+#else
+            (void)ex;
 #endif
-                break;
+        }
+    });
+}
+
+/*
+ * Request loop of [session], setting [logged_out] once the client has logged
+ * out. Returns once it did, or once the connection dropped.
+ * The session of a [stream] is not logged out of, nor multiplexed: both are
+ * made on the session carrying it.
+ */
+static void serve_requests(Session &session, bool &logged_out, bool stream) {
+    while (!logged_out) {
+        auto header_res = session.in.get_mtype(session.sock);
+        if (header_res.is_error) {
+            // The client went away without logging out
+            break;
+        }
+
+        // Once a counter is about to wrap around, the only requests left to
+        // the client are the rekeying and the logout
+        if (session.is_exhausted() && header_res.result != RekeyReq &&
+            header_res.result != LogoutReq) {
+            handle_errors("Sequence number is about to wrap around");
+        }
+
+        auto start = steady_clock::now();
+        switch (header_res.result) {
+        case UploadReq:
+            upload(session);
+            break;
+        case DownloadReq:
+            download(session);
+            break;
+        case DeleteReq:
+            delete_file(session);
+            break;
+        case ListReq:
+            list_files(session);
+            break;
+        case InfoReq:
+            file_info(session);
+            break;
+        case VerifyReq:
+            verify(session);
+            break;
+        case RenameReq:
+            rename(session);
+            break;
+        case DeleteBatchReq:
+            delete_files(session);
+            break;
+        case RenameBatchReq:
+            rename_files(session);
+            break;
+        case UpdateReq:
+            update(session);
+            break;
+        case RekeyReq:
+            rekey(session);
+            break;
+        case MuxStart:
+            if (stream) {
+                handle_errors("Multiplexing requested on a stream");
             }
+            multiplex(session);
+            break;
+        case LogoutReq:
+            if (stream) {
+                handle_errors("Logout requested on a stream");
+            }
+            logout(session);
+            logged_out = true;
+            break;
+        default:
+#ifdef DEBUG
+            cout << "Invalid header was received from client" << endl;
+#endif
+            break;
         }
+        record_request(header_res.result, elapsed_ns(start), session);
+    }
+}
+
+/* Serves the client of a forked child, never returns */
+void serve_client(int sock) {
+    try {
+        serve_session(sock);
     } catch (char const *ex) {
         cerr << "Something went wrong! :(" << endl;
 #ifdef DEBUG
         cerr << "Error: " << ex << endl;
 #endif
         cerr << "Exiting..." << endl;
-        close(client_sock);
         exit(EXIT_FAILURE);
     }
+
+    exit(EXIT_SUCCESS);
+}
+
+void print_usage(const char *name) {
+    cerr << "Usage: " << name
+         << " [-m fork|event|pool] [-w workers] [-q queue] [-b backlog]"
+            " [-p keys] [-t seconds] [-c bytes] [-j threads]"
+            " [-r stdio|mmap|direct] [-d depth] [-s none|file|full]"
+            " [-u files|chunks] [-z none|zlib] [-l bytes] [-e port]"
+            " [-V volumes] [-i seconds]"
+         << endl
+         << "    -m  connection engine: a process per client (fork, default),"
+         << endl
+         << "        an epoll loop per worker process (event) or a pool of"
+         << endl
+         << "        worker threads picking clients off a queue (pool)" << endl
+         << "    -w  number of workers in event and pool mode (default: one "
+            "per core)"
+         << endl
+         << "    -q  clients waiting for a worker in pool mode, any further one"
+         << endl
+         << "        is rejected (default: " << DEFAULT_QUEUE_CAP << ")"
+         << endl
+         << "    -b  listen backlog (default: " << SOMAXCONN << ")" << endl
+         << "    -p  ephemeral key pairs kept ready for each group, 0 disables"
+         << endl
+         << "        the pool (default: " << DEFAULT_KEY_POOL_SIZE << ")"
+         << endl
+         << "    -t  lifetime of the resumption tickets (default: "
+         << DEFAULT_TICKET_LIFETIME << ")" << endl
+         << "    -c  largest chunk size accepted from the clients, between "
+         << MIN_CHUNK_SIZE << endl
+         << "        and " << MAX_CHUNK_SIZE
+         << " bytes (default: " << DEFAULT_CHUNK_SIZE << ")" << endl
+         << "    -j  threads encrypting (decrypting) the chunks of each"
+         << endl
+         << "        transfer in parallel (default: 1)" << endl
+         << "    -r  how the files downloaded are read: buffered (stdio,"
+         << endl
+         << "        default), mapped in memory (mmap) or bypassing the page"
+         << endl
+         << "        cache (direct)" << endl
+         << "    -d  disk reads (writes) of each transfer queued at once on"
+         << endl
+         << "        io_uring, or on threads without it, 0 runs them one at a"
+         << endl
+         << "        time (default: 0)" << endl
+         << "    -s  what an upload waits for before it is done: nothing"
+         << endl
+         << "        (none, default), its content on disk (file) or its name"
+         << endl
+         << "        on disk as well (full)" << endl
+         << "    -u  how the files uploaded are kept: as they are (files,"
+         << endl
+         << "        default), or as their chunks, stored once for all users"
+         << endl
+         << "        and only sent when the server does not have them (chunks)"
+         << endl
+         << "    -z  compression of the chunks allowed to the clients that ask"
+         << endl
+         << "        for it: none, or deflate (zlib, default)" << endl
+         << "    -l  bytes each user may store at most, 0 for no limit"
+         << endl
+         << "        (default: 0)" << endl
+         << "    -e  local port the metrics are served on, in the Prometheus"
+         << endl
+         << "        text format, 0 for none: SIGUSR1 dumps them in any case"
+         << endl
+         << "        (default: 0)" << endl
+         << "    -V  directories the storages of the users are spread over,"
+         << endl
+         << "        separated by commas, the first one also holding the"
+         << endl
+         << "        index and the chunks (default: server/storage)" << endl
+         << "    -i  seconds a client may leave a connection waiting on it in"
+         << endl
+         << "        event mode before it is closed, 0 for no limit (default: "
+         << DEFAULT_IDLE_TIMEOUT << ")" << endl;
 }
 
-int main() {
+int main(int argc, char **argv) {
     int sock, new_client;
     struct sockaddr_in address;
     socklen_t addr_len = sizeof(address);
     pid_t res;
+    engine mode = EngineFork;
+    int workers = sysconf(_SC_NPROCESSORS_ONLN);
+    int queue_cap = DEFAULT_QUEUE_CAP;
+    int backlog = SOMAXCONN;
+    int key_pool_size = DEFAULT_KEY_POOL_SIZE;
+    int ticket_lifetime = DEFAULT_TICKET_LIFETIME;
+    int metrics_port = 0;
+    vector<string> volumes;
+    int idle_timeout = DEFAULT_IDLE_TIMEOUT;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "m:w:q:b:p:t:c:j:r:d:s:u:z:l:e:V:i:")) !=
+           -1) {
+        switch (opt) {
+        case 'm':
+            if (strcmp(optarg, "fork") == 0) {
+                mode = EngineFork;
+            } else if (strcmp(optarg, "event") == 0) {
+                mode = EngineEvent;
+            } else if (strcmp(optarg, "pool") == 0) {
+                mode = EnginePool;
+            } else {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'w':
+            if ((workers = atoi(optarg)) <= 0) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'q':
+            if ((queue_cap = atoi(optarg)) <= 0) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'b':
+            if ((backlog = atoi(optarg)) <= 0) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'p':
+            if ((key_pool_size = atoi(optarg)) < 0) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'i':
+            if ((idle_timeout = atoi(optarg)) < 0) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 't':
+            if ((ticket_lifetime = atoi(optarg)) <= 0) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'c':
+            max_chunk_size = strtoul(optarg, nullptr, 10);
+            if (max_chunk_size < MIN_CHUNK_SIZE ||
+                max_chunk_size > MAX_CHUNK_SIZE) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'j':
+            if ((cipher_threads = atoi(optarg)) <= 0) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'r': {
+            auto backend_res = parse_source_backend(optarg);
+            if (backend_res.is_error) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            read_backend = backend_res.result;
+            break;
+        }
+        case 'd':
+            if ((disk_depth = atoi(optarg)) < 0) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 's': {
+            auto policy_res = parse_sync_policy(optarg);
+            if (policy_res.is_error) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            set_upload_sync(policy_res.result);
+            break;
+        }
+        case 'u': {
+            auto storage_res = parse_storage_backend(optarg);
+            if (storage_res.is_error) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            set_storage_backend(storage_res.result);
+            break;
+        }
+        case 'z': {
+            auto compression_res = parse_compression(optarg);
+            if (compression_res.is_error) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            compression = compression_res.result;
+            break;
+        }
+        case 'l': {
+            char *end;
+            uint64_t quota = strtoull(optarg, &end, 10);
+            if (*end != '\0' || optarg[0] == '-') {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            set_user_quota(quota);
+            break;
+        }
+        case 'e':
+            metrics_port = atoi(optarg);
+            if (metrics_port < 0 || metrics_port > 65535) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'V':
+            volumes = parse_volumes(optarg);
+            if (volumes.empty()) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        default:
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (workers <= 0)
+        workers = 1;
 
     server = getpid();
 
     // Register signal handler to gracefully close on SIGINT
     signal(SIGINT, signal_handler);
 
-    // Register signal handler to gracefully close on SIGUSR1 (before sequence
-    // number wraps)
-    signal(SIGUSR1, signal_handler);
+    // SIGUSR2 dumps the trace of the connections of each process it reaches
+    install_trace_dump_handler();
+
+    // Parse every credential once, SIGHUP reloads them
+    load_key_store();
+    install_reload_handler();
+
+    // Every worker shares the key of the tickets
+    init_tickets(ticket_lifetime);
+
+    // The storages of the users are looked up on every volume
+    init_volumes(volumes);
+
+    // Uploads left in progress for too long are not resumed anymore
+    clean_partial_uploads();
+
+    // Nor are the trees of the files removed meanwhile kept
+    clean_trees();
+
+    // Files kept as chunks are read whatever the storage of new uploads
+    init_chunk_store();
+
+    // Files may have changed while the server was not running
+    init_meta_index();
+
+    // Every worker adds to the same metrics
+    init_metrics();
+    start_metrics(metrics_port);
 
     // Create socket file descriptor
     if ((sock = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
@@ -161,6 +565,16 @@ int main() {
     }
 #endif
 
+    // Every message is written at once already. A small one must not wait
+    // for the acknowledgment of the one before, e.g. the answers to requests
+    // pipelined by a client. Inherited by every connection accepted.
+    int nodelay = 1;
+    if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) <
+        0) {
+        perror("Setting socket options failed");
+        exit(EXIT_FAILURE);
+    }
+
     // Set socket address and port
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = INADDR_ANY;
@@ -172,22 +586,37 @@ int main() {
         exit(EXIT_FAILURE);
     }
 
-    // Start listening on it
-    if (listen(sock, 0) < 0) {
+    // Start listening on it. The backlog absorbs bursts of connections while
+    // the accept loop is busy (forking, or rejecting clients in pool mode)
+    if (listen(sock, backlog) < 0) {
         perror("Socket listen failed");
         exit(EXIT_FAILURE);
     }
 
+    if (mode == EngineEvent) {
+        // A connection waiting on its client holds a stack of its own: one
+        // that waits too long is closed
+        io_idle_timeout = idle_timeout;
+        // Every worker fills its own pool of key pairs
+        run_event_workers(sock, workers, key_pool_size);
+        exit(EXIT_SUCCESS);
+    }
+
+    // Generate the ephemeral key pairs ahead of the handshakes. Forked
+    // children get one key pair per group each.
+    start_key_pool(key_pool_size, kex_groups);
+
+    if (mode == EnginePool) {
+        run_worker_pool(sock, workers, queue_cap);
+        exit(EXIT_SUCCESS);
+    }
+
 #ifdef DEBUG
     // When in debug mode, don't spawn child processes. Instead, use the main
     // process to serve the client request. Should make debugging easier.
     if ((new_client = accept(sock, (struct sockaddr *)&address, &addr_len)) >=
         0) {
-        client_sock = new_client;
-        serve_client();
-        // Close the file descriptor after we are done with it
-        close(new_client);
-        exit(EXIT_SUCCESS);
+        serve_client(new_client);
     } else {
         perror("Accept failed");
         exit(EXIT_FAILURE);
@@ -195,17 +624,24 @@ int main() {
 #else
     // Accept loop: each time a new client connects start a new process for that
     // client. The child process will handle all interactions with the client.
-    while ((new_client =
-                accept(sock, (struct sockaddr *)&address, &addr_len)) >= 0) {
+    for (;;) {
+        new_client = accept(sock, (struct sockaddr *)&address, &addr_len);
+
+        // Children are forked with the keys of the parent: pick up any reload
+        // before the next one
+        refresh_key_store();
+
+        if (new_client < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
         if ((res = fork()) == -1) {
             perror("Fork failed");
             exit(EXIT_FAILURE);
         } else if (res == 0) {
-            client_sock = new_client;
-            serve_client();
-            // Close the file descriptor after we are done with it
-            close(new_client);
-            exit(EXIT_SUCCESS);
+            serve_client(new_client);
         };
 
         // The parent closes the fd immediately
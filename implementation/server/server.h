@@ -0,0 +1,14 @@
+#ifndef server_h
+#define server_h
+
+/*
+ * Runs a whole session with the client on sock (authentication and request
+ * loop). Owns, and eventually closes, the socket. Errors are thrown through
+ * handle_errors.
+ */
+void serve_session(int sock);
+
+/* Prints the counters of the ephemeral key pool */
+void print_key_pool_stats();
+
+#endif
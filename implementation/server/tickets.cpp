@@ -0,0 +1,151 @@
+#include "tickets.h"
+#include "../common/utils.h"
+#include <algorithm>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+using namespace std;
+
+using expiration = int64_t;
+
+static unsigned char *ticket_key = nullptr;
+static unsigned int ticket_lifetime;
+
+void init_tickets(unsigned int lifetime) {
+    ticket_key = new unsigned char[get_symmetric_key_length()];
+    if (RAND_bytes(ticket_key, get_symmetric_key_length()) != 1) {
+        perror("Could not generate the key of the tickets");
+        exit(EXIT_FAILURE);
+    }
+    ticket_lifetime = lifetime;
+}
+
+unsigned int get_ticket_lifetime() { return ticket_lifetime; }
+
+Maybe<tuple<flen, unsigned char *>>
+seal_ticket(const char *username, unsigned char *resumption_secret,
+            int secret_len, int64_t handshake_time, uint32_t &lifetime) {
+    Maybe<tuple<flen, unsigned char *>> res;
+
+    // Plaintext: expiration time || handshake time || resumption secret
+    int pt_len = 2 * sizeof(expiration) + secret_len;
+    unsigned char *pt = new unsigned char[pt_len];
+    expiration now = time(nullptr);
+    expiration expires_at = min<expiration>(now + ticket_lifetime,
+                                            handshake_time + TICKET_MAX_AGE);
+    lifetime = expires_at > now ? expires_at - now : 0;
+    memcpy(pt, &expires_at, sizeof(expiration));
+    memcpy(pt + sizeof(expiration), &handshake_time, sizeof(expiration));
+    memcpy(pt + 2 * sizeof(expiration), resumption_secret, secret_len);
+
+    auto iv_res = gen_iv();
+    if (iv_res.is_error) {
+        explicit_bzero(pt, pt_len);
+        delete[] pt;
+        res.set_error(iv_res.error);
+        return res;
+    }
+    auto iv = iv_res.result;
+
+    // Ticket: iv || ciphertext || tag
+    int iv_len = get_iv_len();
+    flen ticket_len = iv_len + pt_len + TAG_LEN;
+    unsigned char *ticket = new unsigned char[ticket_len];
+    memcpy(ticket, iv, iv_len);
+    delete[] iv;
+
+    EVP_CIPHER_CTX *ctx;
+    if ((ctx = EVP_CIPHER_CTX_new()) == nullptr) {
+        explicit_bzero(pt, pt_len);
+        delete[] pt;
+        delete[] ticket;
+        res.set_error("Could not seal ticket (alloc)");
+        return res;
+    }
+
+    // Each call is checked on its own: any of them failing fails the seal
+    int len;
+    bool ok =
+        EVP_EncryptInit(ctx, AesGcm::cipher(), ticket_key, ticket) == 1 &&
+        EVP_EncryptUpdate(ctx, nullptr, &len,
+                          reinterpret_cast<const unsigned char *>(username),
+                          strlen(username) + 1) == 1 &&
+        EVP_EncryptUpdate(ctx, ticket + iv_len, &len, pt, pt_len) == 1 &&
+        EVP_EncryptFinal(ctx, ticket + iv_len + len, &len) == 1 &&
+        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, TAG_LEN,
+                            ticket + iv_len + pt_len) == 1;
+    EVP_CIPHER_CTX_free(ctx);
+    explicit_bzero(pt, pt_len);
+    delete[] pt;
+
+    if (!ok) {
+        delete[] ticket;
+        res.set_error("Could not seal ticket");
+        return res;
+    }
+
+    res.set_result({ticket_len, ticket});
+    return res;
+}
+
+Maybe<unsigned char *> open_ticket(const char *username, unsigned char *ticket,
+                                   flen ticket_len, int secret_len,
+                                   int64_t &handshake_time) {
+    Maybe<unsigned char *> res;
+
+    int iv_len = get_iv_len();
+    int pt_len = 2 * sizeof(expiration) + secret_len;
+    if (ticket_len != iv_len + pt_len + TAG_LEN) {
+        res.set_error("Malformed ticket");
+        return res;
+    }
+
+    EVP_CIPHER_CTX *ctx;
+    if ((ctx = EVP_CIPHER_CTX_new()) == nullptr) {
+        res.set_error("Could not open ticket (alloc)");
+        return res;
+    }
+
+    unsigned char *pt = new unsigned char[pt_len];
+    int len;
+    bool ok =
+        EVP_DecryptInit(ctx, AesGcm::cipher(), ticket_key, ticket) == 1 &&
+        EVP_DecryptUpdate(ctx, nullptr, &len,
+                          reinterpret_cast<const unsigned char *>(username),
+                          strlen(username) + 1) == 1 &&
+        EVP_DecryptUpdate(ctx, pt, &len, ticket + iv_len, pt_len) == 1 &&
+        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, TAG_LEN,
+                            ticket + iv_len + pt_len) == 1 &&
+        EVP_DecryptFinal(ctx, pt + len, &len) == 1;
+    if (!ok) {
+        EVP_CIPHER_CTX_free(ctx);
+        explicit_bzero(pt, pt_len);
+        delete[] pt;
+        res.set_error("Invalid ticket");
+        return res;
+    }
+    EVP_CIPHER_CTX_free(ctx);
+
+    // Past the end of its chain a ticket is refused too, whatever it says of
+    // its own expiration
+    expiration expires_at, now = time(nullptr);
+    memcpy(&expires_at, pt, sizeof(expiration));
+    memcpy(&handshake_time, pt + sizeof(expiration), sizeof(expiration));
+    if (expires_at < now || handshake_time + TICKET_MAX_AGE < now) {
+        explicit_bzero(pt, pt_len);
+        delete[] pt;
+        res.set_error("Expired ticket");
+        return res;
+    }
+
+    unsigned char *secret = new unsigned char[secret_len];
+    memcpy(secret, pt + 2 * sizeof(expiration), secret_len);
+    explicit_bzero(pt, pt_len);
+    delete[] pt;
+
+    res.set_result(secret);
+    return res;
+}
@@ -0,0 +1,51 @@
+#include "../common/maybe.h"
+#include "../common/types.h"
+#include <stdint.h>
+#include <tuple>
+
+#ifndef tickets_h
+#define tickets_h
+
+/*
+ * Resumption tickets. A ticket is the resumption secret of a session, its
+ * expiration time and the time of the full handshake the session comes from,
+ * encrypted and authenticated with AES-256-GCM, whatever the suite of the
+ * sessions, under a key known only to the server (generated at startup, so a
+ * restart invalidates every ticket). The username is authenticated as well,
+ * so that a ticket only resumes sessions of the user it was issued to.
+ *
+ * A resumed session gets a new ticket in turn, but none of them outlives the
+ * full handshake by more than TICKET_MAX_AGE: a chain of resumptions ends
+ * with a full handshake all the same.
+ */
+
+// Seconds after a full handshake past which no ticket resumes its sessions
+#define TICKET_MAX_AGE (7 * 24 * 60 * 60)
+
+/* Generates the key of the tickets. Aborts the program on failure */
+void init_tickets(unsigned int lifetime);
+
+/* Seconds after which a ticket expires */
+unsigned int get_ticket_lifetime();
+
+/*
+ * Seals a new ticket for the user, whose session comes from a full handshake
+ * at [handshake_time]. Sets [lifetime] to the seconds it lasts, up to
+ * get_ticket_lifetime(). The caller is responsible for the de-allocation of
+ * the returned ticket, if any
+ */
+Maybe<std::tuple<flen, unsigned char *>>
+seal_ticket(const char *username, unsigned char *resumption_secret,
+            int secret_len, int64_t handshake_time, uint32_t &lifetime);
+
+/*
+ * Opens a ticket presented by the user, returning its resumption secret and
+ * setting [handshake_time] to the one it was sealed with. Fails if the ticket
+ * was forged, issued to someone else or if it expired.
+ * The caller is responsible for the de-allocation of the secret, if any
+ */
+Maybe<unsigned char *> open_ticket(const char *username, unsigned char *ticket,
+                                   flen ticket_len, int secret_len,
+                                   int64_t &handshake_time);
+
+#endif
@@ -0,0 +1,221 @@
+#include "treestore.h"
+#include "../common/filesource.h"
+#include "../common/utils.h"
+#include "chunkstore.h"
+#include "volumes.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+// A tree starts with this, then with what its file was when it was built,
+// and the size of the content of the file. The nodes follow.
+#define TREE_MAGIC "FoCtree1"
+#define TREE_MAGIC_LEN 8
+
+struct TreeHeader {
+    char magic[TREE_MAGIC_LEN];
+    uint64_t ino;
+    uint64_t file_len;
+    int64_t mtime;
+    uint64_t size;
+};
+
+static fs::path tree_path(const fs::path &path) {
+    return path.parent_path() / (TREE_PREFIX + path.filename().native());
+}
+
+/* What the file of [st] is, as a tree header tells it */
+static void stamp(const struct stat &st, TreeHeader &header) {
+    memcpy(header.magic, TREE_MAGIC, TREE_MAGIC_LEN);
+    header.ino = st.st_ino;
+    header.file_len = st.st_size;
+    header.mtime =
+        (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+static bool same_stamp(const TreeHeader &a, const TreeHeader &b) {
+    return memcmp(a.magic, b.magic, TREE_MAGIC_LEN) == 0 && a.ino == b.ino &&
+           a.file_len == b.file_len && a.mtime == b.mtime;
+}
+
+/*
+ * Creates a file for a tree in the storage [dir], named [tmp] until it is
+ * stored. Returns it open, or -1 on failure.
+ */
+static int create_tree(const fs::path &dir, string &tmp) {
+    tmp = (dir / PARTIAL_PREFIX).native() + "tree-XXXXXX";
+    int fd = mkstemp(&tmp[0]);
+    if (fd < 0)
+        tmp.clear();
+    return fd;
+}
+
+/*
+ * Completes the tree built in [fd], named [tmp], with [header]: the tree of
+ * the file at [path] as the header tells it. Stored as its tree if [named],
+ * and left open under no name otherwise. The file [tmp] is gone either way.
+ */
+static bool seal_tree(int fd, const string &tmp, const TreeHeader &header,
+                      const fs::path &path, bool named) {
+    bool ok = pwrite(fd, &header, sizeof(header), 0) == sizeof(header);
+    if (!ok || !named ||
+        rename(tmp.c_str(), tree_path(path).native().c_str()) != 0) {
+        unlink(tmp.c_str());
+    }
+    return ok;
+}
+
+/* Adds the content of the file at [path] to [builder] */
+static bool read_content(const fs::path &path, MerkleBuilder &builder) {
+    FILE *fp = fopen(path.native().c_str(), "r");
+    if (fp == nullptr)
+        return false;
+    Manifest manifest;
+    auto manifest_res = read_manifest(fp, manifest);
+    if (manifest_res.is_error) {
+        fclose(fp);
+        return false;
+    }
+    FileSource *source = manifest_res.result
+                             ? open_manifest_source(manifest, 0, -1)
+                             : open_source(fp, SourceStdio);
+    bool ok = merkle_source(*source, builder);
+    delete source;
+    fclose(fp);
+    return ok;
+}
+
+TreeBuilder::TreeBuilder(const fs::path &dir)
+    : fd(create_tree(dir, tmp)), builder(fd, sizeof(TreeHeader)) {}
+
+TreeBuilder::~TreeBuilder() { give_up(); }
+
+void TreeBuilder::give_up() {
+    if (fd >= 0) {
+        close(fd);
+        unlink(tmp.c_str());
+        fd = -1;
+    }
+}
+
+void TreeBuilder::update(const uchar *data, size_t len) {
+    if (fd >= 0 && !builder.update(data, len))
+        give_up();
+}
+
+bool TreeBuilder::store(const fs::path &path) {
+    struct stat st;
+    if (fd < 0 || !builder.finish() ||
+        stat(path.native().c_str(), &st) != 0) {
+        give_up();
+        return false;
+    }
+    TreeHeader header;
+    stamp(st, header);
+    header.size = builder.length();
+    bool ok = seal_tree(fd, tmp, header, path, true);
+    close(fd);
+    fd = -1;
+    return ok;
+}
+
+StoredTree::~StoredTree() {
+    if (fd >= 0)
+        close(fd);
+}
+
+bool StoredTree::node(uint32_t level, uint64_t i, uchar *hash) const {
+    if (level >= levels || i >= merkle_nodes(size, level))
+        return false;
+    off_t offset = sizeof(TreeHeader);
+    for (uint32_t l = 0; l < level; l++)
+        offset += merkle_nodes(size, l) * MERKLE_HASH_LEN;
+    offset += i * MERKLE_HASH_LEN;
+    return pread(fd, hash, MERKLE_HASH_LEN, offset) == MERKLE_HASH_LEN;
+}
+
+Maybe<bool> open_tree(const fs::path &path, StoredTree &tree) {
+    Maybe<bool> res;
+    struct stat st;
+    if (stat(path.native().c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+        res.set_result(false);
+        return res;
+    }
+    TreeHeader now, stored;
+    stamp(st, now);
+
+    int fd = open(tree_path(path).native().c_str(), O_RDONLY);
+    if (fd >= 0 && pread(fd, &stored, sizeof(stored), 0) == sizeof(stored) &&
+        same_stamp(stored, now)) {
+        tree.fd = fd;
+        tree.size = stored.size;
+        tree.levels = merkle_levels(stored.size);
+        res.set_result(true);
+        return res;
+    }
+    if (fd >= 0)
+        close(fd);
+
+    // Missing, or built for what the file was before: built again, and only
+    // stored if the file did not change in the meantime either
+    string tmp;
+    fd = create_tree(path.parent_path(), tmp);
+    if (fd < 0) {
+        res.set_error("Error - Could not hash the file");
+        return res;
+    }
+    MerkleBuilder builder(fd, sizeof(TreeHeader));
+    if (!read_content(path, builder) || !builder.finish()) {
+        close(fd);
+        unlink(tmp.c_str());
+        res.set_error("Error - File is not readable");
+        return res;
+    }
+    now.size = builder.length();
+    TreeHeader after = now;
+    bool unchanged = stat(path.native().c_str(), &st) == 0;
+    if (unchanged) {
+        stamp(st, after);
+        unchanged = same_stamp(after, now);
+    }
+    if (!seal_tree(fd, tmp, now, path, unchanged)) {
+        close(fd);
+        res.set_error("Error - Could not hash the file");
+        return res;
+    }
+    tree.fd = fd;
+    tree.size = now.size;
+    tree.levels = merkle_levels(now.size);
+    res.set_result(true);
+    return res;
+}
+
+void move_tree(const fs::path &from, const fs::path &to) {
+    error_code ec;
+    fs::rename(tree_path(from), tree_path(to), ec);
+}
+
+void drop_tree(const fs::path &path) {
+    error_code ec;
+    fs::remove(tree_path(path), ec);
+}
+
+void clean_trees() {
+    error_code ec;
+    size_t prefix_len = strlen(TREE_PREFIX);
+    for (const auto &user : list_user_storages()) {
+        for (const auto &entry : fs::directory_iterator(user.second, ec)) {
+            string name = entry.path().filename().native();
+            if (name.rfind(TREE_PREFIX, 0) == 0 &&
+                !fs::exists(user.second / name.substr(prefix_len))) {
+                fs::remove(entry.path(), ec);
+            }
+        }
+    }
+}
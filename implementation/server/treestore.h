@@ -0,0 +1,108 @@
+#include "../common/maybe.h"
+#include "../common/merkle.h"
+#include "../common/types.h"
+#include <stdint.h>
+#include <string>
+
+#if __has_include(<filesystem>)
+#include <filesystem>
+namespace fs = std::filesystem;
+#elif __has_include(<experimental/filesystem>)
+#include <experimental/filesystem>
+namespace fs = std::experimental::filesystem;
+#else
+error "Missing the <filesystem> header."
+#endif
+
+#ifndef treestore_h
+#define treestore_h
+
+/*
+ * Merkle trees of the files of the users (see merkle.h), each kept next to
+ * its file under TREE_PREFIX: every node of it, level after level from the
+ * leaves up, after a header telling which file it was built from. Seen
+ * through the inode, size and modification time of the file, so that a tree
+ * whose file changed since is never taken for its tree.
+ *
+ * The tree of an upload is built as its chunks are received, straight into
+ * a file, and stored once the file is; renaming or removing the file does
+ * the same to its tree. Any other tree that is missing or stale, e.g. of a
+ * file kept as its chunks, or of one updated, is built again from the file
+ * when it is first asked for. Either way, only a block of nodes at a time is
+ * held in memory, so that the 32 B of a leaf every MERKLE_LEAF_LEN bytes of
+ * a file of up to FSIZE_MAX bytes never weigh on the server.
+ */
+
+// Files of a user storage named this way are the trees of the others
+#define TREE_PREFIX ".merkle-"
+
+/* A stored tree, opened for its nodes to be read */
+struct StoredTree {
+    int fd = -1;
+    // Size of the file
+    uint64_t size;
+    uint32_t levels;
+
+    StoredTree() {}
+    ~StoredTree();
+    StoredTree(const StoredTree &) = delete;
+    StoredTree &operator=(const StoredTree &) = delete;
+
+    /*
+     * Reads node [i] of [level] into [hash] (MERKLE_HASH_LEN bytes). Returns
+     * false if there is no such node, or if it could not be read.
+     */
+    bool node(uint32_t level, uint64_t i, uchar *hash) const;
+};
+
+/*
+ * Builds the tree of a file as its content goes by, into a file of its own
+ * next to it (see MerkleBuilder), then stores it as the tree of the file
+ * once the file is written. A tree that cannot be written is given up on,
+ * and built again once asked for; one never stored is removed.
+ */
+class TreeBuilder {
+  public:
+    /* Builds the tree of a file of the storage [dir] */
+    TreeBuilder(const fs::path &dir);
+    ~TreeBuilder();
+
+    TreeBuilder(const TreeBuilder &) = delete;
+    TreeBuilder &operator=(const TreeBuilder &) = delete;
+
+    /* Adds the next [len] bytes of the file */
+    void update(const uchar *data, size_t len);
+
+    /*
+     * Stores the tree as that of the file at [path], just written. Returns
+     * false if it could not be.
+     */
+    bool store(const fs::path &path);
+
+  private:
+    std::string tmp;
+    int fd;
+    MerkleBuilder builder;
+
+    void give_up();
+};
+
+/*
+ * Opens the tree of the file at [path] into [tree], building it first if
+ * need be. Returns false if there is no such file.
+ */
+Maybe<bool> open_tree(const fs::path &path, StoredTree &tree);
+
+/* Gives the tree of the file at [from] over to the file at [to] */
+void move_tree(const fs::path &from, const fs::path &to);
+
+/* Removes the tree of the file at [path] */
+void drop_tree(const fs::path &path);
+
+/*
+ * Removes the trees of the files that are gone, e.g. removed while the
+ * server was not running. To be called before any session starts.
+ */
+void clean_trees();
+
+#endif
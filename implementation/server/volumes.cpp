@@ -0,0 +1,153 @@
+#include "volumes.h"
+#include "../common/utils.h"
+#include "treestore.h"
+#include <algorithm>
+#include <openssl/evp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unordered_map>
+
+using namespace std;
+
+// Canonical paths of the volumes, the primary one first
+static vector<fs::path> volume_paths;
+// Points of the volumes on the ring, sorted, each with its volume
+static vector<pair<uint64_t, size_t>> ring;
+// Volume of every storage found when the server started
+static unordered_map<string, size_t> placed;
+
+/* The first 64 bits of the hash of [s] */
+static uint64_t ring_hash(const string &s) {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    uint64_t point;
+    if (EVP_Digest(s.c_str(), s.length(), digest, nullptr, EVP_sha256(),
+                   nullptr) != 1) {
+        fprintf(stderr, "Could not hash the volumes\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(&point, digest, sizeof(point));
+    return point;
+}
+
+vector<string> parse_volumes(const char *list) {
+    vector<string> volumes;
+    string all = list;
+    size_t start = 0;
+    for (size_t end; (end = all.find(',', start)) != string::npos;
+         start = end + 1) {
+        if (end > start)
+            volumes.push_back(all.substr(start, end - start));
+    }
+    if (start < all.length())
+        volumes.push_back(all.substr(start));
+    return volumes;
+}
+
+void init_volumes(const vector<string> &volumes) {
+    vector<fs::path> paths;
+    for (auto &volume : volumes)
+        paths.push_back(volume);
+    if (paths.empty())
+        paths.push_back(fs::current_path() / "server" / "storage");
+
+    // The paths of the users are checked against those of their volumes,
+    // which must be canonical then
+    error_code ec;
+    for (auto &path : paths) {
+        fs::create_directories(path, ec);
+        fs::path canonical = ec ? path : fs::canonical(path, ec);
+        if (ec) {
+            fprintf(stderr, "Could not open the volume %s: %s\n",
+                    path.native().c_str(), ec.message().c_str());
+            exit(EXIT_FAILURE);
+        }
+        if (find(volume_paths.begin(), volume_paths.end(), canonical) ==
+            volume_paths.end())
+            volume_paths.push_back(canonical);
+    }
+
+    for (size_t i = 0; i < volume_paths.size(); i++) {
+        for (int j = 0; j < VOLUME_RING_POINTS; j++) {
+            ring.emplace_back(
+                ring_hash(volume_paths[i].native() + "#" + to_string(j)), i);
+        }
+    }
+    sort(ring.begin(), ring.end());
+
+    for (size_t i = 0; i < volume_paths.size(); i++) {
+        for (const auto &user : fs::directory_iterator(volume_paths[i], ec)) {
+            string username = user.path().filename().native();
+            if (username[0] == '.' || !fs::is_directory(user.path()))
+                continue;
+            if (!placed.emplace(username, i).second) {
+                fprintf(stderr,
+                        "The storage of %s is on more than one volume, only "
+                        "the one in %s is served\n",
+                        username.c_str(),
+                        volume_paths[placed[username]].native().c_str());
+            }
+        }
+    }
+}
+
+fs::path primary_volume() { return volume_paths[0]; }
+
+vector<pair<string, fs::path>> list_user_storages() {
+    vector<pair<string, fs::path>> storages;
+    for (auto &[username, volume] : placed)
+        storages.emplace_back(username, volume_paths[volume] / username);
+    return storages;
+}
+
+fs::path get_user_storage_path(char *username) {
+    auto it = placed.find(username);
+    if (it != placed.end())
+        return volume_paths[it->second] / username;
+
+    // The first point at or past that of the user, around the ring
+    auto point = lower_bound(ring.begin(), ring.end(),
+                             make_pair(ring_hash(username), (size_t)0));
+    if (point == ring.end())
+        point = ring.begin();
+    return volume_paths[point->second] / username;
+}
+
+bool is_path_valid(char *username, fs::path user_path) {
+    string name = user_path.filename().native();
+    if (name.rfind(PARTIAL_PREFIX, 0) == 0 || name.rfind(TREE_PREFIX, 0) == 0)
+        return false;
+
+    fs::path ok_path = get_user_storage_path(username);
+    string user_path_canonical_str;
+#if __has_include(<filesystem>)
+    fs::path user_path_canonical = fs::weakly_canonical(user_path);
+    user_path_canonical_str = user_path_canonical;
+#else
+    // realpath cannot be used on non-existing files, therefore we:
+    //   - check if the file already exists. If not, try to create the file, if
+    //   it fails it's invalid
+    //   - use realpath to get the canonical path
+    //   - remove the file, if we created it earlier
+    //   - check that the canonical path is a file in the user storage
+    bool already_exists;
+    if (!(already_exists = fs::exists(user_path))) {
+        FILE *f;
+        if ((f = fopen(user_path.native().c_str(), "w")) == nullptr) {
+            return false;
+        }
+        fclose(f);
+    }
+
+    char *user_path_canonical = realpath(user_path.native().c_str(), nullptr);
+    if (!already_exists)
+        fs::remove(user_path);
+
+    if (user_path_canonical == nullptr)
+        return false;
+
+    user_path_canonical_str = user_path_canonical;
+#endif
+    return user_path_canonical_str.rfind(ok_path.native(), 0) == 0;
+}
@@ -0,0 +1,72 @@
+#include <string>
+#include <utility>
+#include <vector>
+
+#if __has_include(<filesystem>)
+#include <filesystem>
+namespace fs = std::filesystem;
+#elif __has_include(<experimental/filesystem>)
+#include <experimental/filesystem>
+namespace fs = std::experimental::filesystem;
+#else
+error "Missing the <filesystem> header."
+#endif
+
+#ifndef volumes_h
+#define volumes_h
+
+/*
+ * Volumes of the storage: directories, each on a disk (or a mount of a node)
+ * of its own, that the storages of the users are spread over. By default
+ * there is a single one, server/storage.
+ *
+ * A user is placed by consistent hashing: every volume takes
+ * VOLUME_RING_POINTS points on a ring of 64-bit hashes, at the hashes of its
+ * path numbered, and a user belongs to the first volume past the hash of its
+ * name. Adding a volume to n others takes about one user in n + 1 over to
+ * it, from every other volume alike, and moves nobody else.
+ *
+ * Nor does it move anybody at once: a user whose storage is on some volume
+ * already is served there, wherever the ring would place it, until it is
+ * moved while the server is not running. The ring only places the storages
+ * that are on no volume, which is where they are to be created. The volumes
+ * are walked for the storages once, when the server starts.
+ *
+ * The index of the files and the chunk store lie in the first volume, the
+ * primary one.
+ */
+
+// Points of each volume on the ring: the more, the more even the spread
+#define VOLUME_RING_POINTS 128
+
+/*
+ * Sets the volumes of the storage, the first being the primary one, and
+ * walks them for the storages of the users. Created if missing. To be called
+ * before any session starts, even with no volumes: the default is taken
+ * then. Aborts the program on failure.
+ */
+void init_volumes(const std::vector<std::string> &volumes);
+
+/* Parses a list of volumes, separated by commas */
+std::vector<std::string> parse_volumes(const char *list);
+
+/* Returns the primary volume */
+fs::path primary_volume();
+
+/*
+ * Returns the storage of every user, as its name and its path, on whichever
+ * volume it is
+ */
+std::vector<std::pair<std::string, fs::path>> list_user_storages();
+
+/* Returns the path to the user storage */
+fs::path get_user_storage_path(char *username);
+
+/*
+ * Used to validate paths taken by the user.
+ * Checks for path traversals, for the files of uploads in progress and for
+ * the trees of the files
+ */
+bool is_path_valid(char *username, fs::path user_path);
+
+#endif
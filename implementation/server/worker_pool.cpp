@@ -0,0 +1,142 @@
+#include "worker_pool.h"
+#include "keystore.h"
+#include "server.h"
+#include <condition_variable>
+#include <deque>
+#include <errno.h>
+#include <iostream>
+#include <mutex>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+// Accepted sockets waiting for a worker
+static deque<int> pending;
+static mutex pending_mutex;
+static condition_variable pending_cv;
+static bool closed = false;
+
+static volatile sig_atomic_t draining = 0;
+
+// Pause of the accept loop when out of descriptors or memory, in microseconds
+#define ACCEPT_PAUSE_US 100000
+
+static void drain_handler(int signum) {
+    (void)signum;
+    draining = 1;
+}
+
+/* Takes the next socket off the queue. Returns -1 once drained */
+static int next_client() {
+    unique_lock<mutex> lock(pending_mutex);
+    pending_cv.wait(lock, [] { return !pending.empty() || closed; });
+    if (pending.empty())
+        return -1;
+
+    int sock = pending.front();
+    pending.pop_front();
+    return sock;
+}
+
+static void worker_main() {
+    int sock;
+    while ((sock = next_client()) >= 0) {
+        try {
+            serve_session(sock);
+        } catch (char const *ex) {
+            cerr << "Something went wrong! :(" << endl;
+#ifdef DEBUG
+            cerr << "Error: " << ex << endl;
+#endif
+            cerr << "Closing connection..." << endl;
+        }
+    }
+}
+
+/* Queues the socket for the pool. Returns false if the queue is full */
+static bool admit_client(int sock, size_t queue_cap) {
+    {
+        lock_guard<mutex> lock(pending_mutex);
+        if (pending.size() >= queue_cap)
+            return false;
+        pending.push_back(sock);
+    }
+    pending_cv.notify_one();
+    return true;
+}
+
+void run_worker_pool(int listen_sock, int workers, int queue_cap) {
+    // SIGINT and SIGHUP must interrupt accept, and must only ever be delivered
+    // to this thread: block them while spawning the workers, which inherit the
+    // mask
+    struct sigaction sa = {};
+    sa.sa_handler = drain_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, nullptr);
+
+    // Every session shares the process: a client going away in the middle of
+    // a write must only terminate its own session
+    signal(SIGPIPE, SIG_IGN);
+
+    sigset_t mask, old_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+
+    vector<thread> pool;
+    for (int i = 0; i < workers; i++)
+        pool.emplace_back(worker_main);
+
+    pthread_sigmask(SIG_SETMASK, &old_mask, nullptr);
+
+    // Whether accepting last failed for lack of descriptors or memory
+    bool exhausted = false;
+    while (!draining) {
+        struct sockaddr_in address;
+        socklen_t addr_len = sizeof(address);
+        int client =
+            accept(listen_sock, (struct sockaddr *)&address, &addr_len);
+        refresh_key_store();
+        if (client < 0) {
+            if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS ||
+                errno == ENOMEM) {
+                // The connection stays pending: retrying at once would only
+                // fail again. Give the sessions some time to close theirs.
+                if (!exhausted)
+                    perror("Accept failed, pausing");
+                exhausted = true;
+                usleep(ACCEPT_PAUSE_US);
+            } else if (errno != EINTR) {
+                perror("Accept failed");
+            }
+            continue;
+        }
+        exhausted = false;
+
+        if (!admit_client(client, queue_cap)) {
+#ifdef DEBUG
+            cout << "Server is overloaded, rejecting connection" << endl;
+#endif
+            close(client);
+        }
+    }
+
+    // Stop accepting, but serve every session that was already admitted
+    cout << "Waiting for every session to terminate... " << endl;
+    {
+        lock_guard<mutex> lock(pending_mutex);
+        closed = true;
+    }
+    pending_cv.notify_all();
+    for (auto &worker : pool)
+        worker.join();
+    print_key_pool_stats();
+    cout << "Bye!" << endl;
+}
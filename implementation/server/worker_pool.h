@@ -0,0 +1,16 @@
+#ifndef worker_pool_h
+#define worker_pool_h
+
+/*
+ * Thread pool connection engine. Spawns [workers] threads up front, then
+ * accepts connections on the calling thread and hands them over to the pool
+ * through a queue holding at most [queue_cap] sockets. When every worker is
+ * busy and the queue is full, new connections are closed right away instead
+ * of piling up.
+ *
+ * Returns once SIGINT has been received and every admitted session has
+ * terminated.
+ */
+void run_worker_pool(int listen_sock, int workers, int queue_cap);
+
+#endif
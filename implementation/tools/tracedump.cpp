@@ -0,0 +1,97 @@
+#include "../common/trace.h"
+#include "../common/types.h"
+#include "../common/utils.h"
+#include <iomanip>
+#include <iostream>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+/*
+ * Prints the traces dumped by a server or client on SIGUSR2 (see
+ * common/trace.h), one event per line, oldest first, for each connection.
+ */
+
+using namespace std;
+
+static const char *kind_names[] = {"send",  "recv-type", "recv-header",
+                                   "recv-field", "write", "read", "wait"};
+
+static void print_event(const TraceEvent &event, uint64_t start) {
+    cout << setw(14) << fixed << setprecision(3)
+         << (event.time - start) / 1e3 << " us  ";
+    if (event.kind >= sizeof(kind_names) / sizeof(kind_names[0])) {
+        cout << "unknown event " << (int)event.kind << endl;
+        return;
+    }
+    cout << left << setw(12) << kind_names[event.kind] << right;
+    if (event.kind == TraceWait) {
+        cout << (event.len ? "for writing" : "for reading") << endl;
+        return;
+    }
+    if (event.kind == TraceSend || event.kind == TraceRecvType ||
+        event.kind == TraceRecvHeader || event.kind == TraceRecvField) {
+        // Parts of a message read (written) on their own have no type
+        if (event.mtype != TRACE_NO_MTYPE) {
+            mtypes type = (mtypes)(event.mtype & ~MTYPE_COMPRESSED);
+            cout << mtypes_to_string(type);
+            if (event.mtype & MTYPE_COMPRESSED)
+                cout << " (compressed)";
+            cout << "  ";
+        }
+        if (event.kind == TraceRecvHeader || event.seq != 0)
+            cout << "seq " << event.seq << "  ";
+    }
+    cout << "len " << event.len << endl;
+}
+
+static bool print_dump(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (fp == nullptr) {
+        perror(path);
+        return false;
+    }
+
+    TraceRingHeader header;
+    vector<TraceEvent> events;
+    while (fread(&header, sizeof(header), 1, fp) == 1) {
+        if (memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+            header.len == 0) {
+            cerr << path << ": not a trace dump" << endl;
+            fclose(fp);
+            return false;
+        }
+        events.resize(header.len);
+        if (fread(events.data(), sizeof(TraceEvent), header.len, fp) !=
+            header.len) {
+            cerr << path << ": truncated" << endl;
+            fclose(fp);
+            return false;
+        }
+
+        uint64_t first = header.head > header.len ? header.head - header.len
+                                                  : 0;
+        cout << "socket " << header.socket << " ("
+             << (header.open ? "open" : "closed") << "), "
+             << header.head - first << " events of " << header.head << endl;
+        uint64_t start = events[first % header.len].time;
+        for (uint64_t i = first; i < header.head; i++)
+            print_event(events[i % header.len], start);
+        cout << endl;
+    }
+
+    fclose(fp);
+    return true;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        cerr << "Usage: " << argv[0] << " trace-<pid>.bin..." << endl;
+        return EXIT_FAILURE;
+    }
+
+    bool ok = true;
+    for (int i = 1; i < argc; i++)
+        ok = print_dump(argv[i]) && ok;
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}